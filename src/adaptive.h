@@ -0,0 +1,42 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <math.h>
+
+#include "gpulib.h"
+
+/*
+ * Adaptive sampling stops the pixels whose mean has converged, which matches kernels/path-trace.cl. Each pixel keeps
+ * the sum of the squared luminance of its samples, and the number of samples in that sum, from which the standard
+ * error of its mean is estimated. A pixel stops once that error, relative to its mean, is below the threshold.
+ */
+
+// the number of samples in the luminance moments before the error of a pixel is trusted, since with fewer, the pixels
+// lit by rare paths underestimate their variance, and stop darker than they are
+#define ADAPTIVE_MIN_SAMPLES 64
+// added to the mean luminance, so that the error of dark pixels is relative to this rather than to almost nothing
+#define ADAPTIVE_MIN_LUMINANCE 0.01f
+
+static inline float get_luminance(const float r, const float g, const float b)
+{
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+/**
+ * @brief Estimates the standard error of the mean luminance of a pixel, relative to that mean.
+ *
+ * @param pixel the sample sum of the pixel, with the sample count in w.
+ * @param moments the sum of the squared luminance of the samples since the moments were cleared, with their count in y.
+ * @return float the relative error, which is infinite until there are enough samples to estimate it.
+ */
+static inline float get_pixel_error(const cl_float4 pixel, const cl_float2 moments)
+{
+    if (moments.y < ADAPTIVE_MIN_SAMPLES)
+        return INFINITY;
+
+    float mean = get_luminance(pixel.x, pixel.y, pixel.z) / pixel.w;
+    float variance = fmaxf(moments.x / moments.y - mean * mean, 0.0f) * moments.y / (moments.y - 1);
+    return sqrtf(variance / pixel.w) / (mean + ADAPTIVE_MIN_LUMINANCE);
+}
+
+#endif
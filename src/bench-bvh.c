@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gpulib.h"
+#include "scene.h"
+#include "bvh.h"
+#include "vector.h"
+
+// the number of sphere tests per linear measurement, which bounds the time of each scene size
+#define LINEAR_TESTS (1 << 24)
+#define MAX_RANDOM_SPHERES (1 << 16)
+
+static double elapsed_seconds(const struct timespec start, const struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static float random_unit(cl_uint *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return (*state >> 8) / 16777216.0f;
+}
+
+/**
+ * @brief Measures the closest-hit throughput of the linear loop and the bvh over Cornell boxes with a growing number
+ * of random spheres, to find the scene size from which the bvh should be used.
+ */
+int main(void)
+{
+    printf("%10s %10s %16s %16s\n", "spheres", "nodes", "linear Mrays/s", "bvh Mrays/s");
+
+    size_t crossover = 0;
+    for (size_t num_random = 0; num_random <= MAX_RANDOM_SPHERES; num_random = num_random == 0 ? 1 : num_random * 2)
+    {
+        struct sphere *spheres;
+        size_t num_spheres;
+        if (create_cornell_box(&spheres, &num_spheres) != CL_SUCCESS || add_random_spheres(&spheres, &num_spheres, num_random, 1) != CL_SUCCESS)
+            return 1;
+
+        struct sphere *leaf_spheres = malloc(num_spheres * sizeof(struct sphere));
+        memcpy(leaf_spheres, spheres, num_spheres * sizeof(struct sphere));
+
+        struct bvh bvh;
+        if (build_sphere_bvh(leaf_spheres, num_spheres, &bvh) != CL_SUCCESS)
+            return 1;
+
+        // rays from random points inside the box, in random directions
+        size_t num_rays = LINEAR_TESTS / num_spheres;
+        num_rays = num_rays < 4096 ? 4096 : num_rays;
+
+        cl_float3 *origins = malloc(num_rays * sizeof(cl_float3));
+        cl_float3 *directions = malloc(num_rays * sizeof(cl_float3));
+        cl_uint state = 7;
+        for (size_t i = 0; i < num_rays; i++)
+        {
+            origins[i] = (cl_float3){10 + 150 * random_unit(&state), 5 + 90 * random_unit(&state), 5 + 70 * random_unit(&state)};
+            directions[i] = normalize_float3((cl_float3){random_unit(&state) - 0.5f, random_unit(&state) - 0.5f, random_unit(&state) - 0.5f});
+        }
+
+        struct timespec start, end;
+        size_t linear_hits = 0;
+        size_t bvh_hits = 0;
+        float t;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < num_rays; i++)
+        {
+            int hit_index = -1;
+            linear_hits += intersect_spheres(spheres, num_spheres, origins[i], directions[i], &hit_index, &t);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double linear_rate = num_rays / elapsed_seconds(start, end) * 1e-6;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < num_rays; i++)
+        {
+            int hit_index = -1;
+            bvh_hits += intersect_sphere_bvh(&bvh, leaf_spheres, origins[i], directions[i], &hit_index, &t);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double bvh_rate = num_rays / elapsed_seconds(start, end) * 1e-6;
+
+        if (linear_hits != bvh_hits)
+            fprintf(stderr, "Mismatched hits for %zu spheres: %zu linear, %zu bvh.\n", num_spheres, linear_hits, bvh_hits);
+
+        if (crossover == 0 && bvh_rate > linear_rate)
+            crossover = num_spheres;
+
+        printf("%10zu %10u %16.2f %16.2f\n", num_spheres, bvh.num_nodes, linear_rate, bvh_rate);
+
+        free(directions);
+        free(origins);
+        release_bvh(&bvh);
+        free(leaf_spheres);
+        free(spheres);
+    }
+
+    printf("The bvh outperforms the linear loop from %zu spheres.\n", crossover);
+
+    return 0;
+}
@@ -0,0 +1,534 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "gpulib.h"
+#include "geometry.h"
+#include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "session.h"
+#include "cpu.h"
+#include "profile.h"
+
+// samples per kernel launch, as in firefly
+#define CHUNK_SAMPLES 4
+#define MAX_NAME 64
+
+// a benchmark scene, which is the Cornell box with a number of random spheres, at a resolution and number of samples
+struct bench_scene
+{
+    const char *name;
+    size_t num_random_spheres;
+    cl_uint width;
+    cl_uint height;
+    cl_uint num_samples;
+};
+
+// the scenes, whose names must stay the same so that results can be compared with older baselines
+static const struct bench_scene bench_scenes[] = {
+    {"cornell-640x360-64spp", 0, 640, 360, 64},
+    {"cornell-1280x720-16spp", 0, 1280, 720, 16},
+    {"spheres-1k-640x360-16spp", 1024, 640, 360, 16},
+    {"spheres-16k-640x360-16spp", 16384, 640, 360, 16},
+};
+
+struct bench_result
+{
+    const struct bench_scene *scene;
+    size_t num_spheres;
+    // the time spent in the render kernel, and the rest, such as setting up the scene and reading the image back
+    double kernel_seconds;
+    double host_seconds;
+    cl_ulong num_rays;
+};
+
+static struct camera camera = {{160, 50, 52}, {CL_M_PI_2, -CL_M_PI_2, 0}, 1.25f};
+
+static int use_cpu = 0;
+static cl_uint num_threads = 0;
+// whether to render with the render kernel specialized for each scene, to compare with a baseline of the generic one
+static int is_specialized = 0;
+// whether to render with the persistent render kernel, to compare with a baseline of the one with a work item per pixel
+static int use_persistent = 0;
+static const char *output_path = NULL;
+static const char *baseline_path = NULL;
+// the fraction by which samples/s may fall below the baseline before a run is a regression
+static double tolerance = 0.1;
+
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue command_queue;
+
+static double elapsed_seconds(const struct timespec start, const struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static double get_samples_per_second(const struct bench_result *result)
+{
+    return (double) result->scene->width * result->scene->height * result->scene->num_samples / result->kernel_seconds;
+}
+
+/**
+ * @brief Renders a scene with an OpenCL session.
+ *
+ * @param result the result, whose scene is set, and whose times and ray count are written.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param bvh the sphere bvh.
+ * @param image the accumulator, which is read back.
+ * @return cl_int the return code.
+ */
+static cl_int bench_cl(struct bench_result *result, const struct sphere *spheres, const struct bvh *bvh, cl_float4 *image)
+{
+    cl_int ret;
+
+    const struct bench_scene *scene = result->scene;
+    struct mesh mesh = {NULL, 0, NULL, 0};
+    struct bvh mesh_bvh = {NULL, 0, NULL};
+    struct material material = {{0.75f, 0.75f, 0.75f}, {0, 0, 0}};
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct profile profile = {NULL, 0, 0, {0}};
+    struct session session;
+    ret = create_session(context, device, command_queue, scene->width, scene->height, 0, &session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = set_session_profile(&session, &profile);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    ret = set_session_camera(&session, &camera);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    ret = set_session_scene(&session, spheres, result->num_spheres, bvh, &mesh, &mesh_bvh, &material, 1);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    // the specialized kernel is built once the scene is set, which the host time includes unless it was cached
+    ret = set_session_specialized(&session, is_specialized);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    ret = set_session_persistent(&session, use_persistent);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    ret = clFinish(command_queue);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->host_seconds = elapsed_seconds(start, end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (cl_uint sample_offset = 0; sample_offset < scene->num_samples; sample_offset += CHUNK_SAMPLES)
+    {
+        cl_uint samples = scene->num_samples - sample_offset < CHUNK_SAMPLES ? scene->num_samples - sample_offset : CHUNK_SAMPLES;
+        ret = render_session_samples(&session, samples, &result->num_rays);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+    }
+
+    ret = read_session_accumulator(&session, image);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // the kernel time is measured on the device, and the rest of the render counts as host time
+    cl_ulong kernel_time;
+    ret = get_profile_stage_time(&profile, "render", &kernel_time);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    result->kernel_seconds = kernel_time * 1e-9;
+    result->host_seconds += elapsed_seconds(start, end) - result->kernel_seconds;
+
+cleanup:
+    release_session(&session);
+    release_profile(&profile);
+    return ret;
+}
+
+/**
+ * @brief Renders a scene on the CPU backend.
+ *
+ * @param result the result, whose scene is set, and whose times and ray count are written.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param bvh the sphere bvh.
+ * @param image the accumulator.
+ * @return cl_int the return code.
+ */
+static cl_int bench_cpu(struct bench_result *result, const struct sphere *spheres, const struct bvh *bvh, cl_float4 *image)
+{
+    cl_int ret;
+
+    const struct bench_scene *scene = result->scene;
+    struct mesh mesh = {NULL, 0, NULL, 0};
+    struct bvh mesh_bvh = {NULL, 0, NULL};
+    struct material material = {{0.75f, 0.75f, 0.75f}, {0, 0, 0}};
+    struct timespec start, end;
+
+    cl_float4 camera_quat;
+    cl_float z_distance;
+    get_camera_projection(&camera, scene->height, &camera_quat, &z_distance);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct cpu_scene cpu_scene;
+    ret = create_cpu_scene(spheres, result->num_spheres, bvh, &mesh, &mesh_bvh, &material, &cpu_scene);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->host_seconds = elapsed_seconds(start, end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (cl_uint sample_offset = 0; sample_offset < scene->num_samples; sample_offset += CHUNK_SAMPLES)
+    {
+        cl_uint samples = scene->num_samples - sample_offset < CHUNK_SAMPLES ? scene->num_samples - sample_offset : CHUNK_SAMPLES;
+        cl_uint num_active_pixels;
+        ret = render_cpu_samples(&cpu_scene, image, NULL, NULL, NULL, NULL, camera_quat, z_distance, camera.position, scene->height, scene->width, sample_offset, samples, 0, num_threads, &result->num_rays, &num_active_pixels);
+        if (ret != CL_SUCCESS)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->kernel_seconds = elapsed_seconds(start, end);
+
+    release_cpu_scene(&cpu_scene);
+    return ret;
+}
+
+/**
+ * @brief Builds a benchmark scene, and renders it.
+ *
+ * The random spheres are always drawn from the same seed, so that every run renders the same scene. Building the
+ * bvh counts towards the host time.
+ *
+ * @param scene the scene.
+ * @param result the result.
+ * @return cl_int the return code.
+ */
+static cl_int run_bench(const struct bench_scene *scene, struct bench_result *result)
+{
+    cl_int ret;
+
+    memset(result, 0, sizeof(struct bench_result));
+    result->scene = scene;
+
+    struct sphere *spheres;
+    size_t num_spheres;
+    ret = create_cornell_box(&spheres, &num_spheres);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = add_random_spheres(&spheres, &num_spheres, scene->num_random_spheres, 1);
+    if (ret != CL_SUCCESS)
+        goto cleanup_spheres;
+
+    result->num_spheres = num_spheres;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the bvh permutes the spheres into leaf order
+    struct bvh bvh = {NULL, 0, NULL};
+    if (num_spheres >= BVH_MIN_PRIMITIVES)
+    {
+        ret = build_sphere_bvh(spheres, num_spheres, &bvh);
+        if (ret != CL_SUCCESS)
+            goto cleanup_spheres;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double bvh_seconds = elapsed_seconds(start, end);
+
+    cl_float4 *image = calloc((size_t) scene->width * scene->height, sizeof(cl_float4));
+    if (image == NULL)
+    {
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto cleanup_bvh;
+    }
+
+    if (use_cpu)
+        ret = bench_cpu(result, spheres, &bvh, image);
+    else
+        ret = bench_cl(result, spheres, &bvh, image);
+
+    result->host_seconds += bvh_seconds;
+
+    free(image);
+cleanup_bvh:
+    release_bvh(&bvh);
+cleanup_spheres:
+    free(spheres);
+    return ret;
+}
+
+/**
+ * @brief Writes the results as JSON.
+ *
+ * @param fp the file.
+ * @param results the results.
+ * @param num_results the number of results.
+ */
+static void write_results(FILE *fp, const struct bench_result *results, const size_t num_results)
+{
+    char device_name[256] = "cpu";
+    if (!use_cpu && clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL) != CL_SUCCESS)
+        strcpy(device_name, "unknown");
+
+    // the device name is only reported, so quotes and backslashes are dropped rather than escaped
+    for (char *c = device_name; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            *c = ' ';
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"backend\": \"%s\",\n", use_cpu ? "cpu" : "opencl");
+    fprintf(fp, "  \"device\": \"%s\",\n", device_name);
+    if (use_cpu)
+        fprintf(fp, "  \"threads\": %u,\n", num_threads);
+    else
+    {
+        fprintf(fp, "  \"specialized\": %s,\n", is_specialized ? "true" : "false");
+        fprintf(fp, "  \"persistent\": %s,\n", use_persistent ? "true" : "false");
+    }
+
+    fprintf(fp, "  \"runs\": [\n");
+    for (size_t i = 0; i < num_results; i++)
+    {
+        const struct bench_result *result = &results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"spheres\": %zu, \"width\": %u, \"height\": %u, \"samples\": %u, ", result->scene->name, result->num_spheres, result->scene->width, result->scene->height, result->scene->num_samples);
+        fprintf(fp, "\"kernel_seconds\": %.6f, \"host_seconds\": %.6f, \"samples_per_second\": %.1f, \"rays_per_second\": %.1f}%s\n",
+                result->kernel_seconds, result->host_seconds, get_samples_per_second(result), result->num_rays / result->kernel_seconds, i + 1 < num_results ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+}
+
+/**
+ * @brief Finds the samples/s of a run in a baseline written by write_results.
+ *
+ * @param baseline the baseline JSON.
+ * @param name the run name.
+ * @param samples_per_second a pointer to the samples/s of the run.
+ * @return int whether the baseline has the run.
+ */
+static int find_baseline_run(const char *baseline, const char *name, double *samples_per_second)
+{
+    char key[MAX_NAME + 16];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+    const char *run = strstr(baseline, key);
+    if (run == NULL)
+        return 0;
+
+    // each run is on one line
+    const char *end = strchr(run, '\n');
+    const char *value = strstr(run, "\"samples_per_second\":");
+    if (value == NULL || (end != NULL && value > end))
+        return 0;
+
+    *samples_per_second = strtod(value + strlen("\"samples_per_second\":"), NULL);
+    return *samples_per_second > 0;
+}
+
+/**
+ * @brief Compares the results with a baseline, and reports each run.
+ *
+ * @param results the results.
+ * @param num_results the number of results.
+ * @return cl_int CL_SUCCESS, or CL_INVALID_VALUE if any run is slower than the baseline by more than the tolerance.
+ */
+static cl_int compare_baseline(const struct bench_result *results, const size_t num_results)
+{
+    FILE *fp = fopen(baseline_path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Failed to open baseline '%s'.\n", baseline_path);
+        return 1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *baseline = malloc(size + 1);
+    if (baseline == NULL || fread(baseline, 1, size, fp) != (size_t) size)
+    {
+        fprintf(stderr, "Failed to read baseline '%s'.\n", baseline_path);
+        free(baseline);
+        fclose(fp);
+        return 1;
+    }
+
+    baseline[size] = '\0';
+    fclose(fp);
+
+    cl_int ret = CL_SUCCESS;
+    fprintf(stderr, "%-28s %14s %14s %8s\n", "run", "baseline Ms/s", "Msamples/s", "ratio");
+    for (size_t i = 0; i < num_results; i++)
+    {
+        double samples_per_second = get_samples_per_second(&results[i]);
+        double baseline_samples_per_second;
+        if (!find_baseline_run(baseline, results[i].scene->name, &baseline_samples_per_second))
+        {
+            fprintf(stderr, "%-28s %14s %14.2f %8s\n", results[i].scene->name, "-", samples_per_second * 1e-6, "new");
+            continue;
+        }
+
+        double ratio = samples_per_second / baseline_samples_per_second;
+        int is_regression = ratio < 1 - tolerance;
+        fprintf(stderr, "%-28s %14.2f %14.2f %8.3f%s\n", results[i].scene->name, baseline_samples_per_second * 1e-6, samples_per_second * 1e-6, ratio, is_regression ? " REGRESSION" : "");
+        if (is_regression)
+            ret = CL_INVALID_VALUE;
+    }
+
+    free(baseline);
+    return ret;
+}
+
+/**
+ * @brief Renders a fixed set of scenes, and reports the kernel and host time, samples/s and rays/s of each as JSON.
+ *
+ * With a baseline written by an earlier run, each run is compared with it, and the exit code is non-zero if any is
+ * slower by more than the tolerance. Runs may be chosen by name.
+ */
+int main(int argc, char **argv)
+{
+    cl_int ret;
+
+    static const struct option long_options[] = {
+        {"cpu", no_argument, NULL, 'C'},
+        {"threads", required_argument, NULL, 't'},
+        {"output", required_argument, NULL, 'o'},
+        {"baseline", required_argument, NULL, 'B'},
+        {"tolerance", required_argument, NULL, 'T'},
+        {"specialize", no_argument, NULL, 'S'},
+        {"persistent", no_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "Ct:o:B:T:SP", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'C':
+            use_cpu = 1;
+            break;
+        case 't':
+            num_threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'B':
+            baseline_path = optarg;
+            break;
+        case 'T':
+            tolerance = strtod(optarg, NULL);
+            break;
+        case 'S':
+            is_specialized = 1;
+            break;
+        case 'P':
+            use_persistent = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--cpu] [--threads count] [--output path] [--baseline path] [--tolerance fraction] [--specialize] [--persistent] [run...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    size_t num_scenes = sizeof(bench_scenes) / sizeof(bench_scenes[0]);
+    for (int i = optind; i < argc; i++)
+    {
+        size_t j = 0;
+        while (j < num_scenes && strcmp(argv[i], bench_scenes[j].name) != 0)
+            j++;
+
+        if (j == num_scenes)
+        {
+            fprintf(stderr, "There is no run named '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (num_threads == 0)
+        num_threads = get_cpu_count();
+
+    if (!use_cpu && setup_cl(CL_QUEUE_PROFILING_ENABLE, &device, &context, &command_queue) != CL_SUCCESS)
+    {
+        fprintf(stderr, "Failed to set up OpenCL, so benchmarking the CPU backend.\n");
+        use_cpu = 1;
+    }
+
+    if (use_cpu && is_specialized)
+    {
+        fprintf(stderr, "The CPU backend is compiled ahead of time, so only the OpenCL render kernel is specialized.\n");
+        is_specialized = 0;
+    }
+
+    if (use_cpu && use_persistent)
+    {
+        fprintf(stderr, "The CPU backend already steals tiles between threads, so only the OpenCL render kernel is persistent.\n");
+        use_persistent = 0;
+    }
+
+    struct bench_result results[sizeof(bench_scenes) / sizeof(bench_scenes[0])];
+    size_t num_results = 0;
+    ret = CL_SUCCESS;
+    for (size_t i = 0; i < num_scenes && ret == CL_SUCCESS; i++)
+    {
+        int is_chosen = optind == argc;
+        for (int j = optind; j < argc; j++)
+            is_chosen |= strcmp(argv[j], bench_scenes[i].name) == 0;
+
+        if (!is_chosen)
+            continue;
+
+        fprintf(stderr, "Running %s.\n", bench_scenes[i].name);
+        ret = run_bench(&bench_scenes[i], &results[num_results]);
+        if (ret != CL_SUCCESS)
+            fprintf(stderr, "Failed to run %s with code '%d'.\n", bench_scenes[i].name, ret);
+        else
+            num_results++;
+    }
+
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    FILE *fp = output_path != NULL ? fopen(output_path, "w") : stdout;
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Failed to open '%s'.\n", output_path);
+        ret = 1;
+        goto cleanup;
+    }
+
+    write_results(fp, results, num_results);
+    if (fp != stdout)
+        fclose(fp);
+
+    if (baseline_path != NULL)
+        ret = compare_baseline(results, num_results);
+
+cleanup:
+    if (!use_cpu)
+    {
+        clReleaseCommandQueue(command_queue);
+        clReleaseContext(context);
+    }
+
+    return ret != CL_SUCCESS;
+}
@@ -0,0 +1,459 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bvh.h"
+#include "vector.h"
+
+// the number of bins along each axis, for which split costs are evaluated
+#define BVH_BINS 16
+// matches the self-intersection epsilon of the kernel
+#define INTERSECTION_EPSILON 1e-2f
+
+struct bvh_bin
+{
+    struct aabb bounds;
+    cl_uint count;
+};
+
+struct bvh_builder
+{
+    const struct aabb *bounds;
+    cl_uint *indices;
+    struct bvh_node *nodes;
+    cl_uint num_nodes;
+};
+
+static inline struct aabb empty_aabb(void)
+{
+    struct aabb result;
+    result.min = (cl_float3){INFINITY, INFINITY, INFINITY};
+    result.max = (cl_float3){-INFINITY, -INFINITY, -INFINITY};
+
+    return result;
+}
+
+static inline struct aabb grow_aabb(const struct aabb lhs, const struct aabb rhs)
+{
+    struct aabb result;
+    result.min = min_float3(lhs.min, rhs.min);
+    result.max = max_float3(lhs.max, rhs.max);
+
+    return result;
+}
+
+static inline float aabb_area(const struct aabb bounds)
+{
+    cl_float3 extent = subtract_float3(bounds.max, bounds.min);
+    if (extent.x < 0 || extent.y < 0 || extent.z < 0)
+        return 0;
+
+    return 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+static inline float aabb_centroid(const struct aabb bounds, const int axis)
+{
+    return 0.5f * (bounds.min.s[axis] + bounds.max.s[axis]);
+}
+
+/**
+ * @brief Finds the binned surface area heuristic split with the lowest cost.
+ * 
+ * @param builder the builder.
+ * @param begin the first primitive.
+ * @param end one past the last primitive.
+ * @param centroid_bounds the bounds of the primitive centroids.
+ * @param split_axis a pointer to the axis of the best split, or -1 if no split separates the primitives.
+ * @param split_position a pointer to the centroid position of the best split.
+ */
+static void find_split(const struct bvh_builder *builder, const cl_uint begin, const cl_uint end, const struct aabb centroid_bounds, int *split_axis, float *split_position)
+{
+    float best_cost = INFINITY;
+    *split_axis = -1;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float axis_min = centroid_bounds.min.s[axis];
+        float extent = centroid_bounds.max.s[axis] - axis_min;
+        if (extent <= 0)
+            continue;
+
+        struct bvh_bin bins[BVH_BINS];
+        for (int b = 0; b < BVH_BINS; b++)
+        {
+            bins[b].bounds = empty_aabb();
+            bins[b].count = 0;
+        }
+
+        float bin_scale = BVH_BINS / extent;
+        for (cl_uint i = begin; i < end; i++)
+        {
+            struct aabb bounds = builder->bounds[builder->indices[i]];
+            int b = (int)((aabb_centroid(bounds, axis) - axis_min) * bin_scale);
+            b = b < BVH_BINS ? b : BVH_BINS - 1;
+
+            bins[b].bounds = grow_aabb(bins[b].bounds, bounds);
+            bins[b].count++;
+        }
+
+        // sweep from the left to find the left costs, then from the right to combine them
+        float left_area[BVH_BINS - 1];
+        cl_uint left_count[BVH_BINS - 1];
+        struct aabb accumulated = empty_aabb();
+        cl_uint count = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++)
+        {
+            accumulated = grow_aabb(accumulated, bins[b].bounds);
+            count += bins[b].count;
+            left_area[b] = aabb_area(accumulated);
+            left_count[b] = count;
+        }
+
+        accumulated = empty_aabb();
+        count = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--)
+        {
+            accumulated = grow_aabb(accumulated, bins[b].bounds);
+            count += bins[b].count;
+
+            if (count == 0 || left_count[b - 1] == 0)
+                continue;
+
+            float cost = left_count[b - 1] * left_area[b - 1] + count * aabb_area(accumulated);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                *split_axis = axis;
+                *split_position = axis_min + b / bin_scale;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Recursively builds the subtree over a range of primitives, appending the nodes in depth-first order.
+ * 
+ * @param builder the builder.
+ * @param begin the first primitive.
+ * @param end one past the last primitive.
+ */
+static void build_node(struct bvh_builder *builder, const cl_uint begin, const cl_uint end)
+{
+    cl_uint node_index = builder->num_nodes++;
+
+    struct aabb node_bounds = empty_aabb();
+    struct aabb centroid_bounds = empty_aabb();
+    for (cl_uint i = begin; i < end; i++)
+    {
+        struct aabb bounds = builder->bounds[builder->indices[i]];
+        node_bounds = grow_aabb(node_bounds, bounds);
+
+        cl_float3 centroid = scale_float3(add_float3(bounds.min, bounds.max), 0.5f);
+        centroid_bounds.min = min_float3(centroid_bounds.min, centroid);
+        centroid_bounds.max = max_float3(centroid_bounds.max, centroid);
+    }
+
+    struct bvh_node *node = &builder->nodes[node_index];
+    node->min = node_bounds.min;
+    node->max = node_bounds.max;
+    node->padding = 0;
+
+    cl_uint count = end - begin;
+    if (count <= BVH_MAX_LEAF_SIZE)
+    {
+        node->offset = begin;
+        node->count = count;
+        node->skip = node_index + 1;
+        return;
+    }
+
+    int split_axis;
+    float split_position;
+    find_split(builder, begin, end, centroid_bounds, &split_axis, &split_position);
+
+    cl_uint middle = begin + count / 2;
+    if (split_axis >= 0)
+    {
+        // partition the primitives about the split
+        cl_uint *left = builder->indices + begin;
+        cl_uint *right = builder->indices + end - 1;
+        while (left <= right)
+        {
+            if (aabb_centroid(builder->bounds[*left], split_axis) < split_position)
+            {
+                left++;
+            }
+            else
+            {
+                cl_uint swap = *left;
+                *left = *right;
+                *right-- = swap;
+            }
+        }
+
+        cl_uint partition = left - builder->indices;
+        if (partition > begin && partition < end)
+            middle = partition;
+    }
+
+    node->offset = 0;
+    node->count = 0;
+
+    build_node(builder, begin, middle);
+    build_node(builder, middle, end);
+
+    // the subtree is complete, so the next node appended is the first node after it
+    node->skip = builder->num_nodes;
+}
+
+/**
+ * @brief Builds a bvh over primitive bounds with the binned surface area heuristic.
+ * 
+ * @param bounds the bounds of each primitive.
+ * @param num_primitives the number of primitives.
+ * @param bvh a pointer to the bvh, which must be released with release_bvh.
+ * @return cl_int the return code.
+ */
+cl_int build_bvh(const struct aabb *bounds, const size_t num_primitives, struct bvh *bvh)
+{
+    bvh->nodes = NULL;
+    bvh->num_nodes = 0;
+    bvh->indices = NULL;
+
+    if (num_primitives == 0)
+        return CL_SUCCESS;
+
+    // a binary tree with at least one primitive per leaf has at most 2n - 1 nodes
+    struct bvh_builder builder;
+    builder.bounds = bounds;
+    builder.indices = malloc(num_primitives * sizeof(cl_uint));
+    builder.nodes = malloc((2 * num_primitives - 1) * sizeof(struct bvh_node));
+    builder.num_nodes = 0;
+
+    if (builder.indices == NULL || builder.nodes == NULL)
+    {
+        free(builder.indices);
+        free(builder.nodes);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for (cl_uint i = 0; i < num_primitives; i++)
+        builder.indices[i] = i;
+
+    build_node(&builder, 0, num_primitives);
+
+    struct bvh_node *nodes = realloc(builder.nodes, builder.num_nodes * sizeof(struct bvh_node));
+    bvh->nodes = nodes == NULL ? builder.nodes : nodes;
+    bvh->num_nodes = builder.num_nodes;
+    bvh->indices = builder.indices;
+
+    return CL_SUCCESS;
+}
+
+void release_bvh(struct bvh *bvh)
+{
+    free(bvh->nodes);
+    free(bvh->indices);
+
+    bvh->nodes = NULL;
+    bvh->num_nodes = 0;
+    bvh->indices = NULL;
+}
+
+static inline struct aabb get_sphere_bounds(const struct sphere *sphere)
+{
+    cl_float3 radius = (cl_float3){sphere->radius, sphere->radius, sphere->radius};
+
+    struct aabb result;
+    result.min = subtract_float3(sphere->position, radius);
+    result.max = add_float3(sphere->position, radius);
+
+    return result;
+}
+
+/**
+ * @brief Builds a bvh over spheres, and permutes the spheres into leaf order, so that each leaf is contiguous.
+ * 
+ * @param spheres the spheres, which are permuted.
+ * @param num_spheres the number of spheres.
+ * @param bvh a pointer to the bvh, which must be released with release_bvh.
+ * @return cl_int the return code.
+ */
+cl_int build_sphere_bvh(struct sphere *spheres, const size_t num_spheres, struct bvh *bvh)
+{
+    cl_int ret = CL_OUT_OF_HOST_MEMORY;
+
+    struct aabb *bounds = malloc(num_spheres * sizeof(struct aabb));
+    struct sphere *permuted = malloc(num_spheres * sizeof(struct sphere));
+    if (bounds == NULL || permuted == NULL)
+        goto cleanup;
+
+    for (size_t i = 0; i < num_spheres; i++)
+        bounds[i] = get_sphere_bounds(&spheres[i]);
+
+    ret = build_bvh(bounds, num_spheres, bvh);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    for (size_t i = 0; i < num_spheres; i++)
+        permuted[i] = spheres[bvh->indices[i]];
+
+    memcpy(spheres, permuted, num_spheres * sizeof(struct sphere));
+
+cleanup:
+    free(permuted);
+    free(bounds);
+    return ret;
+}
+
+/**
+ * @brief Recomputes the bounds of every node after spheres have moved, keeping the tree as it is.
+ * 
+ * A refit is much cheaper than a rebuild, but the tree degrades as spheres move further from where it was built.
+ * 
+ * @param bvh the bvh.
+ * @param spheres the spheres, in leaf order.
+ */
+void refit_sphere_bvh(struct bvh *bvh, const struct sphere *spheres)
+{
+    // children follow their parents in depth-first order, so a reverse pass visits the children first
+    for (cl_uint i = bvh->num_nodes; i-- > 0;)
+    {
+        struct bvh_node *node = &bvh->nodes[i];
+
+        struct aabb bounds = empty_aabb();
+        if (node->count > 0)
+        {
+            for (cl_uint j = node->offset; j < node->offset + node->count; j++)
+                bounds = grow_aabb(bounds, get_sphere_bounds(&spheres[j]));
+        }
+        else
+        {
+            // the left child is the next node, and the right child is the node after the left subtree
+            const struct bvh_node *left = &bvh->nodes[i + 1];
+            const struct bvh_node *right = &bvh->nodes[left->skip];
+            bounds = grow_aabb((struct aabb){left->min, left->max}, (struct aabb){right->min, right->max});
+        }
+
+        node->min = bounds.min;
+        node->max = bounds.max;
+    }
+}
+
+static inline int intersect_sphere(const struct sphere *s, const cl_float3 origin, const cl_float3 direction, float *t)
+{
+    cl_float3 centre_ray = subtract_float3(s->position, origin);
+
+    // solve the quadratic, where a = 1
+    float b = dot_float3(centre_ray, direction);
+    float c = dot_float3(centre_ray, centre_ray) - s->radius * s->radius;
+
+    float disc = b * b - c;
+
+    if (disc < 0.0f)
+        return 0;
+
+    float disc_root = sqrtf(disc);
+    if ((*t = b - disc_root) > INTERSECTION_EPSILON)
+        return 1;
+
+    if ((*t = b + disc_root) > INTERSECTION_EPSILON)
+        return 1;
+
+    return 0;
+}
+
+static inline int intersect_aabb(const cl_float3 box_min, const cl_float3 box_max, const cl_float3 origin, const cl_float3 inverse_direction, const float max_distance)
+{
+    cl_float3 t0 = multiply_float3(subtract_float3(box_min, origin), inverse_direction);
+    cl_float3 t1 = multiply_float3(subtract_float3(box_max, origin), inverse_direction);
+    cl_float3 near = min_float3(t0, t1);
+    cl_float3 far = max_float3(t0, t1);
+
+    float t_near = max_float(max_float(near.x, near.y), near.z);
+    float t_far = min_float(min_float(far.x, far.y), far.z);
+
+    return t_near <= t_far && t_far > 0 && t_near < max_distance;
+}
+
+/**
+ * @brief Finds the closest sphere hit by a ray by testing every sphere, as the kernel does without a bvh.
+ * 
+ * @param spheres the spheres.
+ * @param num_spheres the number of spheres.
+ * @param origin the ray origin.
+ * @param direction the normalised ray direction.
+ * @param hit_index a pointer to the index of the sphere to ignore, which is set to the closest hit.
+ * @param t a pointer to the distance of the closest hit.
+ * @return int whether a sphere was hit.
+ */
+int intersect_spheres(const struct sphere *spheres, const size_t num_spheres, const cl_float3 origin, const cl_float3 direction, int *hit_index, float *t)
+{
+    float min_distance = INFINITY;
+    // no sphere is excluded at -1, which converts to past the last index
+    size_t excluded_index = (size_t) *hit_index;
+
+    for (size_t i = 0; i < num_spheres; i++)
+    {
+        float hit_distance;
+
+        if (i != excluded_index && intersect_sphere(&spheres[i], origin, direction, &hit_distance) && hit_distance < min_distance)
+        {
+            min_distance = hit_distance;
+            *hit_index = i;
+        }
+    }
+
+    *t = min_distance;
+
+    return min_distance < INFINITY;
+}
+
+/**
+ * @brief Finds the closest sphere hit by a ray with the same stackless traversal as the kernel.
+ * 
+ * @param bvh the bvh.
+ * @param spheres the spheres, in leaf order.
+ * @param origin the ray origin.
+ * @param direction the normalised ray direction.
+ * @param hit_index a pointer to the index of the sphere to ignore, which is set to the closest hit.
+ * @param t a pointer to the distance of the closest hit.
+ * @return int whether a sphere was hit.
+ */
+int intersect_sphere_bvh(const struct bvh *bvh, const struct sphere *spheres, const cl_float3 origin, const cl_float3 direction, int *hit_index, float *t)
+{
+    float min_distance = INFINITY;
+    // no sphere is excluded at -1, which converts to past the last index
+    size_t excluded_index = (size_t) *hit_index;
+
+    cl_float3 inverse_direction = (cl_float3){1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z};
+
+    cl_uint node_index = 0;
+    while (node_index < bvh->num_nodes)
+    {
+        const struct bvh_node *node = &bvh->nodes[node_index];
+        if (!intersect_aabb(node->min, node->max, origin, inverse_direction, min_distance))
+        {
+            node_index = node->skip;
+            continue;
+        }
+
+        for (size_t i = node->offset; i < node->offset + node->count; i++)
+        {
+            float hit_distance;
+
+            if (i != excluded_index && intersect_sphere(&spheres[i], origin, direction, &hit_distance) && hit_distance < min_distance)
+            {
+                min_distance = hit_distance;
+                *hit_index = i;
+            }
+        }
+
+        // both the left child of an interior node, and the node after a leaf, follow in depth-first order
+        node_index++;
+    }
+
+    *t = min_distance;
+
+    return min_distance < INFINITY;
+}
@@ -0,0 +1,54 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "gpulib.h"
+#include "scene.h"
+
+// the maximum number of primitives in a leaf
+#define BVH_MAX_LEAF_SIZE 4
+// the number of primitives from which a bvh outperforms the linear loop, as firefly-bvh-bench reports it, which times
+// both traversals on the host, so it only approximates the crossover of the kernels. it is measured with spheres
+// only, and the mesh bvh uses the same count of triangles without a measurement of its own
+#define BVH_MIN_PRIMITIVES 265
+
+struct aabb
+{
+    cl_float3 min;
+    cl_float3 max;
+};
+
+/*
+ * A node of a flattened bvh, stored in depth-first order, so that an interior node is followed by its left child.
+ * When a ray misses the bounds of a node, traversal continues at skip, which is the node after its subtree. This
+ * allows stackless traversal, which ends once the index reaches the number of nodes.
+ */
+struct bvh_node
+{
+    cl_float3 min;
+    cl_float3 max;
+    // the first primitive of a leaf
+    cl_uint offset;
+    // the number of primitives in a leaf, or zero for interior nodes
+    cl_uint count;
+    cl_uint skip;
+    cl_uint padding;
+};
+
+_Static_assert(sizeof(struct bvh_node) == 48, "struct bvh_node must match the kernel");
+
+struct bvh
+{
+    struct bvh_node *nodes;
+    cl_uint num_nodes;
+    // the primitive order of the leaves, into which the primitives should be permuted
+    cl_uint *indices;
+};
+
+cl_int build_bvh(const struct aabb *bounds, const size_t num_primitives, struct bvh *bvh);
+void release_bvh(struct bvh *bvh);
+cl_int build_sphere_bvh(struct sphere *spheres, const size_t num_spheres, struct bvh *bvh);
+void refit_sphere_bvh(struct bvh *bvh, const struct sphere *spheres);
+int intersect_sphere_bvh(const struct bvh *bvh, const struct sphere *spheres, const cl_float3 origin, const cl_float3 direction, int *hit_index, float *t);
+int intersect_spheres(const struct sphere *spheres, const size_t num_spheres, const cl_float3 origin, const cl_float3 direction, int *hit_index, float *t);
+
+#endif
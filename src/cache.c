@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+// 64-bit FNV-1a
+#define HASH_OFFSET 0xcbf29ce484222325UL
+#define HASH_PRIME 0x100000001b3UL
+
+static cl_ulong hash_bytes(cl_ulong hash, const void *data, const size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= HASH_PRIME;
+    }
+
+    return hash;
+}
+
+static cl_ulong hash_device_info(cl_ulong hash, const cl_device_id device, const cl_device_info parameter, cl_int *ret)
+{
+    size_t parameter_size;
+    *ret = clGetDeviceInfo(device, parameter, 0, NULL, &parameter_size);
+    if (*ret != CL_SUCCESS)
+        return hash;
+
+    char *value = malloc(parameter_size);
+    if (value == NULL)
+    {
+        *ret = CL_OUT_OF_HOST_MEMORY;
+        return hash;
+    }
+
+    *ret = clGetDeviceInfo(device, parameter, parameter_size, value, NULL);
+    hash = hash_bytes(hash, value, parameter_size);
+    free(value);
+
+    return hash;
+}
+
+/**
+ * @brief Gets the cache directory, which is FIREFLY_CACHE_DIR, or else firefly under the XDG cache directory.
+ * 
+ * @return char* the cache directory, which must be freed, or NULL if caching is disabled by an empty FIREFLY_CACHE_DIR.
+ */
+static char *get_cache_directory(void)
+{
+    const char *directory = getenv("FIREFLY_CACHE_DIR");
+    if (directory != NULL)
+        return directory[0] == '\0' ? NULL : strdup(directory);
+
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *suffix = "/firefly";
+    if (base == NULL || base[0] == '\0')
+    {
+        base = getenv("HOME");
+        suffix = "/.cache/firefly";
+    }
+
+    if (base == NULL)
+        return NULL;
+
+    char *result = malloc(strlen(base) + strlen(suffix) + 1);
+    if (result != NULL)
+        sprintf(result, "%s%s", base, suffix);
+
+    return result;
+}
+
+/**
+ * @brief Gets the path of a cached program.
+ * 
+ * @param key the program key.
+ * @param create whether to create the cache directory, and its parents.
+ * @return char* the path, which must be freed, or NULL if there is no cache directory.
+ */
+static char *get_cache_path(const cl_ulong key, const int create)
+{
+    char *directory = get_cache_directory();
+    if (directory == NULL)
+        return NULL;
+
+    if (create)
+    {
+        // create each parent in turn, as mkdir does not create parents
+        for (char *separator = strchr(directory + 1, '/'); separator != NULL; separator = strchr(separator + 1, '/'))
+        {
+            *separator = '\0';
+            mkdir(directory, 0755);
+            *separator = '/';
+        }
+
+        if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+        {
+            free(directory);
+            return NULL;
+        }
+    }
+
+    char *path = malloc(strlen(directory) + sizeof("/0123456789abcdef.bin"));
+    if (path != NULL)
+        sprintf(path, "%s/%016lx.bin", directory, (unsigned long) key);
+
+    free(directory);
+    return path;
+}
+
+/**
+ * @brief Hashes the sources and build options of a program, which is the part of its cache key that is not the device.
+ * 
+ * @param sources the sources.
+ * @param source_sizes the source sizes.
+ * @param num_sources the number of sources.
+ * @param options the build options, or NULL.
+ * @return cl_ulong the hash.
+ */
+cl_ulong hash_program_sources(const char **sources, const size_t *source_sizes, const cl_uint num_sources, const char *options)
+{
+    cl_ulong hash = HASH_OFFSET;
+    for (cl_uint i = 0; i < num_sources; i++)
+    {
+        // hash the sizes too, so that moving code between sources changes the key
+        hash = hash_bytes(hash, &source_sizes[i], sizeof(size_t));
+        hash = hash_bytes(hash, sources[i], source_sizes[i]);
+    }
+
+    if (options != NULL)
+        hash = hash_bytes(hash, options, strlen(options) + 1);
+
+    return hash;
+}
+
+/**
+ * @brief Gets the cache key of a program, which changes with its sources, build options, device, and driver.
+ * 
+ * @param device the device.
+ * @param sources the sources.
+ * @param source_sizes the source sizes.
+ * @param num_sources the number of sources.
+ * @param options the build options, or NULL.
+ * @param key a pointer to the key.
+ * @return cl_int the return code.
+ */
+cl_int get_program_key(const cl_device_id device, const char **sources, const size_t *source_sizes, const cl_uint num_sources, const char *options, cl_ulong *key)
+{
+    cl_int ret;
+
+    cl_ulong hash = hash_program_sources(sources, source_sizes, num_sources, options);
+    hash = hash_device_info(hash, device, CL_DEVICE_NAME, &ret);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    hash = hash_device_info(hash, device, CL_DEVICE_VERSION, &ret);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    hash = hash_device_info(hash, device, CL_DRIVER_VERSION, &ret);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    *key = hash;
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Reads the cached binary of a key.
+ * 
+ * @param key the program key.
+ * @param binary a pointer to the binary, which must be freed.
+ * @param binary_size a pointer to the binary size.
+ * @return cl_int the return code, which is not CL_SUCCESS if there is no binary for the key.
+ */
+cl_int read_cached_binary(const cl_ulong key, unsigned char **binary, size_t *binary_size)
+{
+    cl_int ret = 1;
+
+    char *path = get_cache_path(key, 0);
+    if (path == NULL)
+        return ret;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        goto cleanup_path;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+
+    *binary = size > 0 ? malloc(size) : NULL;
+    if (*binary == NULL)
+        goto cleanup_file;
+
+    if (fread(*binary, 1, size, fp) != (size_t) size)
+    {
+        free(*binary);
+        goto cleanup_file;
+    }
+
+    *binary_size = size;
+    ret = CL_SUCCESS;
+
+cleanup_file:
+    fclose(fp);
+cleanup_path:
+    free(path);
+    return ret;
+}
+
+/**
+ * @brief Creates and builds a program from its cached binary.
+ * 
+ * @param context the context.
+ * @param device the device to build for.
+ * @param key the program key.
+ * @param options the build options, or NULL.
+ * @param program a pointer to the program.
+ * @return cl_int the return code, which is not CL_SUCCESS if there is no usable binary.
+ */
+cl_int load_cached_program(const cl_context context, const cl_device_id device, const cl_ulong key, const char *options, cl_program *program)
+{
+    cl_int ret;
+
+    unsigned char *binary;
+    size_t binary_size;
+    ret = read_cached_binary(key, &binary, &binary_size);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    cl_int binary_status;
+    *program = clCreateProgramWithBinary(context, 1, &device, &binary_size, (const unsigned char **) &binary, &binary_status, &ret);
+    if (ret == CL_SUCCESS && binary_status != CL_SUCCESS)
+    {
+        clReleaseProgram(*program);
+        ret = binary_status;
+    }
+
+    if (ret != CL_SUCCESS)
+        goto cleanup_binary;
+
+    // a binary still has to be built, which may fail if the driver rejects it
+    ret = clBuildProgram(*program, 1, &device, options, NULL, NULL);
+    if (ret != CL_SUCCESS)
+        clReleaseProgram(*program);
+
+cleanup_binary:
+    free(binary);
+    return ret;
+}
+
+/**
+ * @brief Writes the cached binary of a key.
+ * 
+ * The binary is first written to a temporary file, which is then renamed into place, so that runs never load a
+ * partially written binary.
+ * 
+ * @param key the program key.
+ * @param binary the binary.
+ * @param binary_size the binary size.
+ * @return cl_int the return code.
+ */
+cl_int write_cached_binary(const cl_ulong key, const unsigned char *binary, const size_t binary_size)
+{
+    cl_int ret = 1;
+
+    char *path = get_cache_path(key, 1);
+    if (path == NULL)
+        return ret;
+
+    // the temporary file is named after the process, so that concurrent runs do not write to the same file
+    char *temporary_path = malloc(strlen(path) + sizeof(".4294967295.tmp"));
+    if (temporary_path == NULL)
+        goto cleanup_path;
+
+    sprintf(temporary_path, "%s.%u.tmp", path, (unsigned int) getpid());
+
+    FILE *fp = fopen(temporary_path, "wb");
+    if (fp == NULL)
+        goto cleanup_temporary_path;
+
+    int failed = fwrite(binary, 1, binary_size, fp) != binary_size;
+    failed |= fclose(fp) != 0;
+
+    if (failed || rename(temporary_path, path) != 0)
+        remove(temporary_path);
+    else
+        ret = CL_SUCCESS;
+
+cleanup_temporary_path:
+    free(temporary_path);
+cleanup_path:
+    free(path);
+    return ret;
+}
+
+/**
+ * @brief Saves the binary of a program built for one device.
+ * 
+ * @param program the program.
+ * @param key the program key.
+ * @return cl_int the return code.
+ */
+cl_int save_cached_program(const cl_program program, const cl_ulong key)
+{
+    cl_int ret;
+
+    size_t binary_size;
+    ret = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    if (binary_size == 0)
+        return 1;
+
+    unsigned char *binary = malloc(binary_size);
+    if (binary == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    ret = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL);
+    if (ret == CL_SUCCESS)
+        ret = write_cached_binary(key, binary, binary_size);
+
+    free(binary);
+    return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "gpulib.h"
+
+cl_ulong hash_program_sources(const char **sources, const size_t *source_sizes, const cl_uint num_sources, const char *options);
+cl_int get_program_key(const cl_device_id device, const char **sources, const size_t *source_sizes, const cl_uint num_sources, const char *options, cl_ulong *key);
+cl_int read_cached_binary(const cl_ulong key, unsigned char **binary, size_t *binary_size);
+cl_int write_cached_binary(const cl_ulong key, const unsigned char *binary, const size_t binary_size);
+cl_int load_cached_program(const cl_context context, const cl_device_id device, const cl_ulong key, const char *options, cl_program *program);
+cl_int save_cached_program(const cl_program program, const cl_ulong key);
+
+#endif
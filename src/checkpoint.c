@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC "FFCK"
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header
+{
+    char magic[4];
+    cl_uint version;
+    cl_uint width;
+    cl_uint height;
+    cl_uint num_samples;
+    cl_uint reserved[3];
+};
+
+/**
+ * @brief Writes the accumulator to disk, so that a render may be resumed later.
+ * 
+ * The checkpoint is first written to a temporary file, which is then renamed over the destination, so that a
+ * preempted write never leaves a truncated checkpoint behind.
+ * 
+ * @param path the checkpoint path.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @param width the image width.
+ * @param height the image height.
+ * @param num_samples the number of samples accumulated so far.
+ * @return cl_int the return code.
+ */
+cl_int write_checkpoint(const char *path, const cl_float4 *accumulator, const cl_uint width, const cl_uint height, const cl_uint num_samples)
+{
+    cl_int ret = 1;
+
+    size_t path_length = strlen(path);
+    char *temporary_path = malloc((path_length + sizeof(".tmp")) * sizeof(char));
+    if (temporary_path == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    memcpy(temporary_path, path, path_length);
+    memcpy(temporary_path + path_length, ".tmp", sizeof(".tmp"));
+
+    FILE *fp = fopen(temporary_path, "wb");
+    if (fp == NULL)
+        goto cleanup_path;
+
+    struct checkpoint_header header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, width, height, num_samples, {0}};
+    size_t num_pixels = (size_t)width * height;
+
+    int failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+    failed |= fwrite(accumulator, sizeof(cl_float4), num_pixels, fp) != num_pixels;
+    failed |= fclose(fp) != 0;
+
+    if (failed)
+    {
+        remove(temporary_path);
+        goto cleanup_path;
+    }
+
+    if (rename(temporary_path, path) == 0)
+        ret = CL_SUCCESS;
+
+cleanup_path:
+    free(temporary_path);
+    return ret;
+}
+
+/**
+ * @brief Reads an accumulator checkpoint written by write_checkpoint.
+ * 
+ * @param path the checkpoint path.
+ * @param accumulator the accumulator to fill, with room for width * height pixels.
+ * @param width the expected image width.
+ * @param height the expected image height.
+ * @param num_samples a pointer to the number of samples accumulated in the checkpoint.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the checkpoint does not match the image.
+ */
+cl_int read_checkpoint(const char *path, cl_float4 *accumulator, const cl_uint width, const cl_uint height, cl_uint *num_samples)
+{
+    cl_int ret = 1;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return ret;
+
+    struct checkpoint_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1)
+        goto cleanup_file;
+
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION || header.width != width || header.height != height)
+    {
+        ret = CL_INVALID_VALUE;
+        goto cleanup_file;
+    }
+
+    size_t num_pixels = (size_t)width * height;
+    if (fread(accumulator, sizeof(cl_float4), num_pixels, fp) != num_pixels)
+        goto cleanup_file;
+
+    *num_samples = header.num_samples;
+    ret = CL_SUCCESS;
+
+cleanup_file:
+    fclose(fp);
+    return ret;
+}
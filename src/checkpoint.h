@@ -0,0 +1,9 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "gpulib.h"
+
+cl_int write_checkpoint(const char *path, const cl_float4 *accumulator, const cl_uint width, const cl_uint height, const cl_uint num_samples);
+cl_int read_checkpoint(const char *path, cl_float4 *accumulator, const cl_uint width, const cl_uint height, cl_uint *num_samples);
+
+#endif
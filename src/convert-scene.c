@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpulib.h"
+#include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "scene-file.h"
+
+#define MAX_LINE 4096
+
+struct scene_description
+{
+    struct sphere *spheres;
+    size_t num_spheres;
+    struct material *materials;
+    size_t num_materials;
+    struct mesh mesh;
+    // the bvh mode, which is auto unless set by a bvh line
+    int use_bvh;
+    int is_bvh_auto;
+};
+
+// grows an array by one element, doubling its capacity when it is full
+static int append(void **array, const size_t count, const size_t element_size)
+{
+    if (count & (count - 1))
+        return 1;
+
+    void *resized = realloc(*array, (count == 0 ? 1 : 2 * count) * element_size);
+    if (resized == NULL)
+        return 0;
+
+    *array = resized;
+    return 1;
+}
+
+/**
+ * @brief Loads an OBJ mesh, scales and translates it, and appends its vertices and triangles to the scene mesh.
+ *
+ * @param description the scene description.
+ * @param path the OBJ path.
+ * @param material the material index of every triangle of the mesh.
+ * @param scale the uniform scale.
+ * @param offset the translation.
+ * @return cl_int the return code.
+ */
+static cl_int append_mesh(struct scene_description *description, const char *path, const cl_uint material, const cl_float scale, const cl_float3 offset)
+{
+    cl_int ret;
+
+    struct mesh mesh;
+    ret = load_obj(path, material, &mesh);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    transform_mesh(&mesh, scale, offset);
+
+    struct mesh *scene_mesh = &description->mesh;
+    cl_float *vertices = realloc(scene_mesh->vertices, 3 * (scene_mesh->num_vertices + mesh.num_vertices) * sizeof(cl_float) + sizeof(cl_float));
+    if (vertices == NULL)
+    {
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto cleanup;
+    }
+
+    scene_mesh->vertices = vertices;
+
+    struct triangle *triangles = realloc(scene_mesh->triangles, (scene_mesh->num_triangles + mesh.num_triangles) * sizeof(struct triangle) + sizeof(struct triangle));
+    if (triangles == NULL)
+    {
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto cleanup;
+    }
+
+    scene_mesh->triangles = triangles;
+
+    memcpy(scene_mesh->vertices + 3 * scene_mesh->num_vertices, mesh.vertices, 3 * mesh.num_vertices * sizeof(cl_float));
+
+    // the triangles index the vertices of their own mesh
+    cl_uint first_vertex = scene_mesh->num_vertices;
+    for (size_t i = 0; i < mesh.num_triangles; i++)
+    {
+        struct triangle triangle = mesh.triangles[i];
+        triangle.v0 += first_vertex;
+        triangle.v1 += first_vertex;
+        triangle.v2 += first_vertex;
+        scene_mesh->triangles[scene_mesh->num_triangles + i] = triangle;
+    }
+
+    scene_mesh->num_vertices += mesh.num_vertices;
+    scene_mesh->num_triangles += mesh.num_triangles;
+
+cleanup:
+    release_mesh(&mesh);
+    return ret;
+}
+
+/**
+ * @brief Parses one line of a scene description.
+ *
+ * @param description the scene description.
+ * @param line the line.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the line is malformed.
+ */
+static cl_int parse_line(struct scene_description *description, const char *line)
+{
+    char keyword[16];
+    int length;
+    if (sscanf(line, " %15s%n", keyword, &length) != 1 || keyword[0] == '#')
+        return CL_SUCCESS;
+
+    const char *arguments = line + length;
+    if (strcmp(keyword, "sphere") == 0)
+    {
+        struct sphere sphere = {0};
+        if (sscanf(arguments, "%f %f %f %f %f %f %f %f %f %f", &sphere.position.x, &sphere.position.y, &sphere.position.z, &sphere.radius,
+                   &sphere.colour.x, &sphere.colour.y, &sphere.colour.z, &sphere.emission.x, &sphere.emission.y, &sphere.emission.z) != 10)
+            return CL_INVALID_VALUE;
+
+        if (!append((void **)&description->spheres, description->num_spheres, sizeof(struct sphere)))
+            return CL_OUT_OF_HOST_MEMORY;
+
+        description->spheres[description->num_spheres++] = sphere;
+    }
+    else if (strcmp(keyword, "material") == 0)
+    {
+        struct material material = {0};
+        if (sscanf(arguments, "%f %f %f %f %f %f", &material.colour.x, &material.colour.y, &material.colour.z, &material.emission.x, &material.emission.y, &material.emission.z) != 6)
+            return CL_INVALID_VALUE;
+
+        if (!append((void **)&description->materials, description->num_materials, sizeof(struct material)))
+            return CL_OUT_OF_HOST_MEMORY;
+
+        description->materials[description->num_materials++] = material;
+    }
+    else if (strcmp(keyword, "mesh") == 0)
+    {
+        char path[MAX_LINE];
+        cl_uint material;
+        cl_float scale = 1;
+        cl_float3 offset = {0, 0, 0};
+        int count = sscanf(arguments, "%s %u %f %f %f %f", path, &material, &scale, &offset.x, &offset.y, &offset.z);
+        if (count < 2 || count == 4 || count == 5 || material >= description->num_materials)
+            return CL_INVALID_VALUE;
+
+        cl_int ret = append_mesh(description, path, material, scale, offset);
+        if (ret != CL_SUCCESS)
+            fprintf(stderr, "Failed to load mesh '%s'.\n", path);
+
+        return ret;
+    }
+    else if (strcmp(keyword, "bvh") == 0)
+    {
+        char mode[8];
+        if (sscanf(arguments, "%7s", mode) != 1)
+            return CL_INVALID_VALUE;
+
+        description->is_bvh_auto = strcmp(mode, "auto") == 0;
+        description->use_bvh = strcmp(mode, "on") == 0;
+        if (!description->is_bvh_auto && !description->use_bvh && strcmp(mode, "off") != 0)
+            return CL_INVALID_VALUE;
+    }
+    else
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Converts a text scene description into a scene file, which firefly maps and uploads without parsing.
+ *
+ * Each line of the description is one of:
+ *   sphere x y z radius r g b emission_r emission_g emission_b
+ *   material r g b emission_r emission_g emission_b
+ *   mesh path material [scale [x y z]]
+ *   bvh auto|on|off
+ * where a mesh is an OBJ file whose triangles use the material of that index, and lines starting with # are comments.
+ * The bvhs are built here, so that loading the scene does no work.
+ */
+int main(int argc, char **argv)
+{
+    cl_int ret = 1;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s description.txt scene.ffs\n", argv[0]);
+        return ret;
+    }
+
+    FILE *fp = fopen(argv[1], "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Failed to open '%s'.\n", argv[1]);
+        return ret;
+    }
+
+    struct scene_description description = {NULL, 0, NULL, 0, {NULL, 0, NULL, 0}, 0, 1};
+
+    char line[MAX_LINE];
+    for (size_t line_number = 1; fgets(line, sizeof(line), fp) != NULL; line_number++)
+    {
+        ret = parse_line(&description, line);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to parse line %zu of '%s'.\n", line_number, argv[1]);
+            goto cleanup_description;
+        }
+    }
+
+    ret = 1;
+    if (description.num_spheres == 0)
+    {
+        fprintf(stderr, "The scene must have at least one sphere.\n");
+        goto cleanup_description;
+    }
+
+    // the bvhs permute the spheres and triangles into leaf order
+    struct bvh sphere_bvh = {NULL, 0, NULL};
+    struct bvh mesh_bvh = {NULL, 0, NULL};
+    if (description.use_bvh || (description.is_bvh_auto && description.num_spheres >= BVH_MIN_PRIMITIVES))
+    {
+        ret = build_sphere_bvh(description.spheres, description.num_spheres, &sphere_bvh);
+        if (ret != CL_SUCCESS)
+            goto cleanup_bvhs;
+    }
+
+    // a scene without a mesh has no mesh bvh, even if bvhs are forced on
+    if (description.mesh.num_triangles > 0 && (description.use_bvh || (description.is_bvh_auto && description.mesh.num_triangles >= BVH_MIN_PRIMITIVES)))
+    {
+        ret = build_mesh_bvh(&description.mesh, &mesh_bvh);
+        if (ret != CL_SUCCESS)
+            goto cleanup_bvhs;
+    }
+
+    ret = write_scene_file(argv[2], description.spheres, description.num_spheres, &sphere_bvh, &description.mesh, &mesh_bvh, description.materials, description.num_materials);
+    if (ret != CL_SUCCESS)
+    {
+        fprintf(stderr, "Failed to write '%s'.\n", argv[2]);
+        goto cleanup_bvhs;
+    }
+
+    printf("Wrote %zu spheres with %u bvh nodes, and %zu triangles with %u bvh nodes, to '%s'.\n", description.num_spheres, sphere_bvh.num_nodes, description.mesh.num_triangles, mesh_bvh.num_nodes, argv[2]);
+
+cleanup_bvhs:
+    release_bvh(&mesh_bvh);
+    release_bvh(&sphere_bvh);
+cleanup_description:
+    release_mesh(&description.mesh);
+    free(description.materials);
+    free(description.spheres);
+    fclose(fp);
+    return ret;
+}
@@ -0,0 +1,734 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "geometry.h"
+#include "vector.h"
+#include "sampler.h"
+#include "adaptive.h"
+#include "partial.h"
+
+// matches the self-intersection epsilon of the kernel
+#define EPSILON 1e-2f
+#define MAX_BOUNCES 16
+// the bounce after which paths are terminated with Russian roulette
+#define ROULETTE_BOUNCE 5
+
+/*
+ * The sphere test runs on as many spheres as the widest vector extension the compiler targets, which is SSE2 on any
+ * x86-64 build, and AVX with -mavx or -march=native.
+ */
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+typedef __m256 simd_float;
+#define simd_set _mm256_set1_ps
+#define simd_load _mm256_loadu_ps
+#define simd_store _mm256_storeu_ps
+#define simd_add _mm256_add_ps
+#define simd_subtract _mm256_sub_ps
+#define simd_multiply _mm256_mul_ps
+#define simd_max _mm256_max_ps
+#define simd_sqrt _mm256_sqrt_ps
+#define simd_and _mm256_and_ps
+#define simd_greater(lhs, rhs) _mm256_cmp_ps(lhs, rhs, _CMP_GT_OQ)
+#define simd_less(lhs, rhs) _mm256_cmp_ps(lhs, rhs, _CMP_LT_OQ)
+#define simd_greater_equal(lhs, rhs) _mm256_cmp_ps(lhs, rhs, _CMP_GE_OQ)
+#define simd_select(mask, lhs, rhs) _mm256_blendv_ps(rhs, lhs, mask)
+#define simd_mask _mm256_movemask_ps
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+typedef __m128 simd_float;
+#define simd_set _mm_set1_ps
+#define simd_load _mm_loadu_ps
+#define simd_store _mm_storeu_ps
+#define simd_add _mm_add_ps
+#define simd_subtract _mm_sub_ps
+#define simd_multiply _mm_mul_ps
+#define simd_max _mm_max_ps
+#define simd_sqrt _mm_sqrt_ps
+#define simd_and _mm_and_ps
+#define simd_greater _mm_cmpgt_ps
+#define simd_less _mm_cmplt_ps
+#define simd_greater_equal _mm_cmpge_ps
+#define simd_select(mask, lhs, rhs) _mm_or_ps(_mm_and_ps(mask, lhs), _mm_andnot_ps(mask, rhs))
+#define simd_mask _mm_movemask_ps
+#else
+#define SIMD_WIDTH 1
+#endif
+
+_Static_assert(SIMD_WIDTH <= SPHERE_LANES, "the sphere components must be padded by a whole vector");
+
+// a range of tiles, which its thread takes from, and which other threads steal from once their own range is empty
+struct tile_range
+{
+    // aligned to a cache line, so that threads taking from neighbouring ranges do not contend
+    _Alignas(64) atomic_uint next;
+    cl_uint end;
+};
+
+struct cpu_job
+{
+    const struct cpu_scene *scene;
+    cl_float4 *accumulator;
+    cl_float2 *luminance_moments;
+    cl_float4 *albedo;
+    cl_float4 *normal_depth;
+    cl_ulong4 *exact_sums;
+    // the conjugate of the camera rotation, by which the kernels rotate the screen coordinates
+    cl_float4 reverse_quat;
+    cl_float z_distance;
+    cl_float3 camera_position;
+    cl_uint height;
+    cl_uint width;
+    cl_uint sample_offset;
+    cl_uint num_samples;
+    cl_float error_threshold;
+    cl_uint num_tiles_x;
+    struct tile_range *ranges;
+    cl_uint num_threads;
+    atomic_ulong num_rays;
+    atomic_uint num_active_pixels;
+};
+
+struct cpu_worker
+{
+    struct cpu_job *job;
+    cl_uint index;
+};
+
+/**
+ * @brief Copies the scene, and the sphere components into padded arrays, for the CPU backend.
+ *
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param sphere_bvh the sphere bvh, which is empty to test every sphere.
+ * @param mesh the mesh, which may have no triangles.
+ * @param mesh_bvh the mesh bvh, which is empty to test every triangle.
+ * @param materials the materials of the triangles.
+ * @param scene a pointer to the scene, which must be released with release_cpu_scene.
+ * @return cl_int the return code.
+ */
+cl_int create_cpu_scene(const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const struct material *materials, struct cpu_scene *scene)
+{
+    scene->spheres = spheres;
+    scene->num_spheres = num_spheres;
+    scene->sphere_bvh = sphere_bvh;
+    scene->mesh = mesh;
+    scene->mesh_bvh = mesh_bvh;
+    scene->materials = materials;
+    scene->lights = NULL;
+    scene->num_lights = 0;
+    scene->sphere_x = NULL;
+
+    // the arrays are padded by SPHERE_LANES, which is at least SIMD_WIDTH, as the kernels read them
+    float *components;
+    size_t size;
+    cl_int ret = build_sphere_components(spheres, num_spheres, &components, &size);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    size_t stride = num_spheres + SPHERE_LANES;
+    scene->sphere_x = components;
+    scene->sphere_y = components + stride;
+    scene->sphere_z = components + 2 * stride;
+    scene->sphere_radius2 = components + 3 * stride;
+
+    size_t num_lights;
+    ret = build_light_table(spheres, num_spheres, &scene->lights, &num_lights);
+    if (ret != CL_SUCCESS)
+    {
+        release_cpu_scene(scene);
+        return ret;
+    }
+
+    scene->num_lights = num_lights;
+
+    return CL_SUCCESS;
+}
+
+void release_cpu_scene(struct cpu_scene *scene)
+{
+    // the components are one allocation, which starts with the x array
+    free(scene->sphere_x);
+    free(scene->lights);
+
+    scene->lights = NULL;
+    scene->num_lights = 0;
+    scene->sphere_x = NULL;
+    scene->sphere_y = NULL;
+    scene->sphere_z = NULL;
+    scene->sphere_radius2 = NULL;
+}
+
+/**
+ * @brief Computes the direction of a camera ray through a point on the screen, as get_camera_direction of
+ * kernels/camera.cl does.
+ *
+ * @param job the job.
+ * @param x the horizontal screen coordinate, in pixels from the left.
+ * @param y the vertical screen coordinate, in pixels from the top.
+ * @return cl_float3 the direction.
+ */
+static inline cl_float3 get_camera_direction(const struct cpu_job *job, const float x, const float y)
+{
+    cl_float4 screen_coordinates = (cl_float4){x - job->width / 2.0f, y - job->height / 2.0f, job->z_distance, 0};
+    cl_float4 direction = rotate_quat(job->reverse_quat, screen_coordinates);
+    return normalize_float3((cl_float3){direction.x, direction.y, direction.z});
+}
+
+/**
+ * @brief Tests a ray against a range of spheres, several at a time.
+ *
+ * @param scene the scene.
+ * @param begin the first sphere.
+ * @param end the sphere after the last.
+ * @param origin the ray origin.
+ * @param direction the normalised ray direction.
+ * @param excluded_index the index of the primitive the ray starts from, which is ignored.
+ * @param min_distance a pointer to the distance of the closest hit so far.
+ * @param hit_index a pointer to the index of the closest hit so far.
+ */
+static inline void test_spheres(const struct cpu_scene *scene, const cl_uint begin, const cl_uint end, const cl_float3 origin, const cl_float3 direction, const int excluded_index, float *min_distance, int *hit_index)
+{
+#if SIMD_WIDTH > 1
+    simd_float origin_x = simd_set(origin.x);
+    simd_float origin_y = simd_set(origin.y);
+    simd_float origin_z = simd_set(origin.z);
+    simd_float direction_x = simd_set(direction.x);
+    simd_float direction_y = simd_set(direction.y);
+    simd_float direction_z = simd_set(direction.z);
+    simd_float epsilon = simd_set(EPSILON);
+    simd_float zero = simd_set(0);
+
+    for (cl_uint i = begin; i < end; i += SIMD_WIDTH)
+    {
+        simd_float centre_x = simd_subtract(simd_load(&scene->sphere_x[i]), origin_x);
+        simd_float centre_y = simd_subtract(simd_load(&scene->sphere_y[i]), origin_y);
+        simd_float centre_z = simd_subtract(simd_load(&scene->sphere_z[i]), origin_z);
+
+        // solve the quadratic, where a = 1
+        simd_float b = simd_add(simd_add(simd_multiply(centre_x, direction_x), simd_multiply(centre_y, direction_y)), simd_multiply(centre_z, direction_z));
+        simd_float c = simd_add(simd_add(simd_multiply(centre_x, centre_x), simd_multiply(centre_y, centre_y)), simd_multiply(centre_z, centre_z));
+        c = simd_subtract(c, simd_load(&scene->sphere_radius2[i]));
+
+        simd_float disc = simd_subtract(simd_multiply(b, b), c);
+        simd_float disc_root = simd_sqrt(simd_max(disc, zero));
+
+        // the near root, unless it is behind the ray, in which case the far root
+        simd_float near = simd_subtract(b, disc_root);
+        simd_float t = simd_select(simd_greater(near, epsilon), near, simd_add(b, disc_root));
+
+        simd_float hit = simd_and(simd_greater_equal(disc, zero), simd_greater(t, epsilon));
+        int mask = simd_mask(simd_and(hit, simd_less(t, simd_set(*min_distance))));
+        if (mask == 0)
+            continue;
+
+        float distances[SIMD_WIDTH];
+        simd_store(distances, t);
+        for (cl_uint lane = 0; lane < SIMD_WIDTH && i + lane < end; lane++)
+        {
+            int index = i + lane;
+            if ((mask & (1 << lane)) && index != excluded_index && distances[lane] < *min_distance)
+            {
+                *min_distance = distances[lane];
+                *hit_index = index;
+            }
+        }
+    }
+#else
+    for (cl_uint i = begin; i < end; i++)
+    {
+        cl_float3 centre_ray = (cl_float3){scene->sphere_x[i] - origin.x, scene->sphere_y[i] - origin.y, scene->sphere_z[i] - origin.z};
+
+        float b = dot_float3(centre_ray, direction);
+        float c = dot_float3(centre_ray, centre_ray) - scene->sphere_radius2[i];
+        float disc = b * b - c;
+        if (disc < 0.0f)
+            continue;
+
+        float disc_root = sqrtf(disc);
+        float t = b - disc_root > EPSILON ? b - disc_root : b + disc_root;
+        if (t > EPSILON && t < *min_distance && (int) i != excluded_index)
+        {
+            *min_distance = t;
+            *hit_index = i;
+        }
+    }
+#endif
+}
+
+static inline cl_float3 load_vertex(const struct mesh *mesh, const cl_uint index)
+{
+    return (cl_float3){mesh->vertices[3 * index], mesh->vertices[3 * index + 1], mesh->vertices[3 * index + 2]};
+}
+
+static inline int intersect_triangle(const cl_float3 v0, const cl_float3 v1, const cl_float3 v2, const cl_float3 origin, const cl_float3 direction, float *t)
+{
+    // Moller-Trumbore, which solves for the distance and barycentric coordinates with Cramer's rule
+    cl_float3 edge1 = subtract_float3(v1, v0);
+    cl_float3 edge2 = subtract_float3(v2, v0);
+
+    cl_float3 p = cross_float3(direction, edge2);
+    float determinant = dot_float3(edge1, p);
+
+    // the ray is parallel to the triangle
+    if (determinant == 0.0f)
+        return 0;
+
+    float inverse_determinant = 1.0f / determinant;
+
+    cl_float3 s = subtract_float3(origin, v0);
+    float u = dot_float3(s, p) * inverse_determinant;
+    if (u < 0.0f || u > 1.0f)
+        return 0;
+
+    cl_float3 q = cross_float3(s, edge1);
+    float v = dot_float3(direction, q) * inverse_determinant;
+    if (v < 0.0f || u + v > 1.0f)
+        return 0;
+
+    *t = dot_float3(edge2, q) * inverse_determinant;
+
+    return *t > EPSILON;
+}
+
+static inline void test_triangles(const struct cpu_scene *scene, const cl_uint begin, const cl_uint end, const cl_float3 origin, const cl_float3 direction, const int excluded_index, float *min_distance, int *hit_index)
+{
+    const struct mesh *mesh = scene->mesh;
+    for (cl_uint i = begin; i < end; i++)
+    {
+        // triangles are indexed after the spheres
+        int index = scene->num_spheres + i;
+
+        const struct triangle *triangle = &mesh->triangles[i];
+        float hit_distance;
+        if (intersect_triangle(load_vertex(mesh, triangle->v0), load_vertex(mesh, triangle->v1), load_vertex(mesh, triangle->v2), origin, direction, &hit_distance) && hit_distance < *min_distance && index != excluded_index)
+        {
+            *min_distance = hit_distance;
+            *hit_index = index;
+        }
+    }
+}
+
+static inline int intersect_aabb(const cl_float3 box_min, const cl_float3 box_max, const cl_float3 origin, const cl_float3 inverse_direction, const float max_distance)
+{
+    cl_float3 t0 = multiply_float3(subtract_float3(box_min, origin), inverse_direction);
+    cl_float3 t1 = multiply_float3(subtract_float3(box_max, origin), inverse_direction);
+    cl_float3 near = min_float3(t0, t1);
+    cl_float3 far = max_float3(t0, t1);
+
+    float t_near = max_float(max_float(near.x, near.y), near.z);
+    float t_far = min_float(min_float(far.x, far.y), far.z);
+
+    return t_near <= t_far && t_far > 0 && t_near < max_distance;
+}
+
+static inline void intersect_primitives(const struct cpu_scene *scene, const int triangles, const cl_float3 origin, const cl_float3 direction, const int excluded_index, float *min_distance, int *hit_index)
+{
+    const struct bvh *bvh = triangles ? scene->mesh_bvh : scene->sphere_bvh;
+
+    if (bvh->num_nodes == 0)
+    {
+        if (triangles)
+            test_triangles(scene, 0, scene->mesh->num_triangles, origin, direction, excluded_index, min_distance, hit_index);
+        else
+            test_spheres(scene, 0, scene->num_spheres, origin, direction, excluded_index, min_distance, hit_index);
+
+        return;
+    }
+
+    cl_float3 inverse_direction = (cl_float3){1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z};
+
+    // stackless traversal, as both the left child of a hit interior node and the node after a leaf come next
+    cl_uint node_index = 0;
+    while (node_index < bvh->num_nodes)
+    {
+        const struct bvh_node *node = &bvh->nodes[node_index];
+        if (!intersect_aabb(node->min, node->max, origin, inverse_direction, *min_distance))
+        {
+            node_index = node->skip;
+            continue;
+        }
+
+        if (triangles)
+            test_triangles(scene, node->offset, node->offset + node->count, origin, direction, excluded_index, min_distance, hit_index);
+        else
+            test_spheres(scene, node->offset, node->offset + node->count, origin, direction, excluded_index, min_distance, hit_index);
+
+        node_index++;
+    }
+}
+
+static inline int intersect_scene(const struct cpu_scene *scene, const cl_float3 origin, const cl_float3 direction, int *hit_index, float *t)
+{
+    float min_distance = INFINITY;
+    // ignore the primitive the ray starts from
+    int excluded_index = *hit_index;
+
+    intersect_primitives(scene, 0, origin, direction, excluded_index, &min_distance, hit_index);
+    intersect_primitives(scene, 1, origin, direction, excluded_index, &min_distance, hit_index);
+
+    *t = min_distance;
+
+    return min_distance < INFINITY;
+}
+
+static inline void get_surface(const struct cpu_scene *scene, const int hit_index, const cl_float3 hit_point, cl_float3 *normal, cl_float3 *colour, cl_float3 *emission)
+{
+    if ((cl_uint) hit_index < scene->num_spheres)
+    {
+        const struct sphere *sphere = &scene->spheres[hit_index];
+        // a ray from the centre of a sphere, to the point on the surface will have the direction of the normal
+        *normal = normalize_float3(subtract_float3(hit_point, sphere->position));
+        *colour = sphere->colour;
+        *emission = sphere->emission;
+    }
+    else
+    {
+        const struct triangle *triangle = &scene->mesh->triangles[hit_index - scene->num_spheres];
+        cl_float3 v0 = load_vertex(scene->mesh, triangle->v0);
+        cl_float3 v1 = load_vertex(scene->mesh, triangle->v1);
+        cl_float3 v2 = load_vertex(scene->mesh, triangle->v2);
+        *normal = normalize_float3(cross_float3(subtract_float3(v1, v0), subtract_float3(v2, v0)));
+
+        const struct material *material = &scene->materials[triangle->material];
+        *colour = material->colour;
+        *emission = material->emission;
+    }
+}
+
+// returns the smallest axis of a vector, about which orthonormal axes are created
+static inline cl_float3 get_smallest_axis(const cl_float3 w)
+{
+    if (fabsf(w.x) < fabsf(w.y) && fabsf(w.x) < fabsf(w.z))
+        return (cl_float3){1, 0, 0};
+
+    return fabsf(w.y) < fabsf(w.z) ? (cl_float3){0, 1, 0} : (cl_float3){0, 0, 1};
+}
+
+// samples a cosine-weighted direction in the hemisphere about the oriented normal
+static inline cl_float3 sample_hemisphere(const cl_float3 oriented_normal, struct sampler *sampler)
+{
+    // create axes about the normal
+    cl_float3 w = oriented_normal;
+    cl_float3 u = normalize_float3(cross_float3(get_smallest_axis(w), w));
+    cl_float3 v = cross_float3(w, u);
+
+    // cosine hemisphere sampling
+    float random_angle, random_number;
+    sample_2d(sampler, &random_angle, &random_number);
+    random_angle *= 2 * (float) M_PI;
+    float random_distance = sqrtf(random_number);
+
+    cl_float3 direction = scale_float3(u, cosf(random_angle) * random_distance);
+    direction = add_float3(direction, scale_float3(v, sinf(random_angle) * random_distance));
+    direction = add_float3(direction, scale_float3(w, sqrtf(1 - random_number)));
+
+    return normalize_float3(direction);
+}
+
+// picks an emitting sphere from the light alias table, traces a shadow ray towards it, and returns the direct light
+// reflected by a diffuse surface, divided by the probability of the pick
+static inline cl_float3 sample_lights(const struct cpu_scene *scene, const cl_float3 bounce_start, const cl_float3 oriented_normal, const cl_float3 colour, const int hit_index, struct sampler *sampler, cl_uint *num_rays)
+{
+    // translated from smallpt, as in sample_lights of kernels/scene.cl
+    // smallpt is by Kevin Beason, released under the MIT licence, a copy of which is in kernels/scene.cl
+    cl_float3 e = (cl_float3){0, 0, 0};
+    if (scene->num_lights == 0)
+        return e;
+
+    // pick an entry uniformly, then its own sphere or its alias by the fraction left over
+    float pick = sample_1d(sampler) * scene->num_lights;
+    cl_uint entry = (cl_uint) pick < scene->num_lights - 1 ? (cl_uint) pick : scene->num_lights - 1;
+    const struct light *light = &scene->lights[entry];
+    if (pick - entry >= light->threshold)
+        light = &scene->lights[light->alias];
+
+    int j = light->sphere;
+    const struct sphere *sphere = &scene->spheres[j];
+    cl_float3 light_w = subtract_float3(sphere->position, bounce_start);
+    cl_float3 light_u = normalize_float3(cross_float3(get_smallest_axis(light_w), light_w));
+    cl_float3 light_v = cross_float3(light_w, light_u);
+    float cos_a_max = sqrtf(1 - sphere->radius * sphere->radius / dot_float3(light_w, light_w));
+    float eps1, eps2;
+    sample_2d(sampler, &eps1, &eps2);
+    float cos_a = 1 - eps1 + eps1 * cos_a_max;
+    float sin_a = sqrtf(1 - cos_a * cos_a);
+    float phi = 2 * (float) M_PI * eps2;
+
+    cl_float3 l = scale_float3(light_u, cosf(phi) * sin_a);
+    l = add_float3(l, scale_float3(light_v, sinf(phi) * sin_a));
+    l = normalize_float3(add_float3(l, scale_float3(light_w, cos_a)));
+
+    int hit_light = -1;
+    float t_light;
+    (*num_rays)++;
+    if (intersect_scene(scene, bounce_start, l, &hit_light, &t_light) && hit_light == j && hit_light != hit_index)
+    {
+        float omega = 2 * (float) M_PI * (1 - cos_a_max);
+        e = scale_float3(multiply_float3(colour, sphere->emission), dot_float3(l, oriented_normal) * omega * (float) M_1_PI / light->probability);
+    }
+
+    return e;
+}
+
+/**
+ * @brief Traces the samples of a pixel, as the render kernel of kernels/path-trace.cl does.
+ *
+ * @param job the job.
+ * @param i the pixel index.
+ * @param num_active_pixels a pointer to the number of pixels which took samples, which is incremented.
+ * @return cl_uint the number of rays traced.
+ */
+static cl_uint render_pixel(const struct cpu_job *job, const size_t i, cl_uint *num_active_pixels)
+{
+    const struct cpu_scene *scene = job->scene;
+
+    // adaptive sampling skips the pixels which have converged, so that the samples go to the noisy ones
+    if (job->luminance_moments != NULL && job->error_threshold > 0 && get_pixel_error(job->accumulator[i], job->luminance_moments[i]) < job->error_threshold)
+        return 0;
+
+    (*num_active_pixels)++;
+
+    cl_uint num_rays = 0;
+    cl_float3 sample_sum = (cl_float3){0, 0, 0};
+    float square_sum = 0;
+    cl_float3 albedo_sum = (cl_float3){0, 0, 0};
+    cl_float3 normal_sum = (cl_float3){0, 0, 0};
+    float depth_sum = 0;
+    cl_ulong exact_sum[3] = {0, 0, 0};
+    for (cl_uint s = 0; s < job->num_samples; s++)
+    {
+        float light_weight = 1;
+        cl_float3 accumulated_colour = (cl_float3){0, 0, 0};
+        cl_float3 mask = (cl_float3){1, 1, 1};
+        cl_float3 origin = job->camera_position;
+        // index the samples from those already taken, so that each chunk of samples continues the sequence
+        struct sampler sampler = create_sampler(i, job->sample_offset + s);
+        // jitter each sample within the pixel, for anti-aliasing
+        float jitter_x, jitter_y;
+        sample_2d(&sampler, &jitter_x, &jitter_y);
+        cl_float3 direction = get_camera_direction(job, i % job->width + jitter_x, i / job->width + jitter_y);
+        int hit_index = -1;
+        for (cl_uint bounce = 0; bounce < MAX_BOUNCES; bounce++)
+        {
+            float t;
+            num_rays++;
+            if (!intersect_scene(scene, origin, direction, &hit_index, &t))
+                break;
+
+            cl_float3 hit_point = add_float3(origin, scale_float3(direction, t));
+            cl_float3 normal, colour, emission;
+            get_surface(scene, hit_index, hit_point, &normal, &colour, &emission);
+
+            accumulated_colour = add_float3(accumulated_colour, scale_float3(multiply_float3(mask, emission), light_weight));
+
+            float p = max_float(mask.x, max_float(mask.y, mask.z));
+            if (bounce > ROULETTE_BOUNCE)
+            {
+                if (sample_1d(&sampler) > p)
+                    break;
+
+                mask = scale_float3(mask, 1.0f / p);
+            }
+
+            // normal flipping technique
+            cl_float3 oriented_normal = dot_float3(normal, direction) < 0.0f ? normal : scale_float3(normal, -1.0f);
+
+            if (bounce == 0)
+            {
+                albedo_sum = add_float3(albedo_sum, colour);
+                normal_sum = add_float3(normal_sum, oriented_normal);
+                depth_sum += t;
+            }
+
+            cl_float3 bounce_direction = sample_hemisphere(oriented_normal, &sampler);
+            cl_float3 bounce_start = add_float3(hit_point, scale_float3(oriented_normal, EPSILON));
+
+            origin = bounce_start;
+            direction = bounce_direction;
+
+            cl_float3 direct_light = sample_lights(scene, bounce_start, oriented_normal, colour, hit_index, &sampler, &num_rays);
+            accumulated_colour = add_float3(accumulated_colour, multiply_float3(mask, direct_light));
+            mask = multiply_float3(mask, colour);
+
+            light_weight = 0;
+        }
+
+        sample_sum = add_float3(sample_sum, accumulated_colour);
+        exact_sum[0] += get_exact_sample(accumulated_colour.x);
+        exact_sum[1] += get_exact_sample(accumulated_colour.y);
+        exact_sum[2] += get_exact_sample(accumulated_colour.z);
+        float luminance = get_luminance(accumulated_colour.x, accumulated_colour.y, accumulated_colour.z);
+        square_sum += luminance * luminance;
+    }
+
+    // each pixel belongs to one tile, so it is only written by one thread
+    cl_float4 *pixel = &job->accumulator[i];
+    pixel->x += sample_sum.x;
+    pixel->y += sample_sum.y;
+    pixel->z += sample_sum.z;
+    pixel->w += job->num_samples;
+
+    if (job->albedo != NULL)
+    {
+        job->albedo[i].x += albedo_sum.x;
+        job->albedo[i].y += albedo_sum.y;
+        job->albedo[i].z += albedo_sum.z;
+        job->albedo[i].w += job->num_samples;
+        job->normal_depth[i].x += normal_sum.x;
+        job->normal_depth[i].y += normal_sum.y;
+        job->normal_depth[i].z += normal_sum.z;
+        job->normal_depth[i].w += depth_sum;
+    }
+
+    if (job->exact_sums != NULL)
+    {
+        job->exact_sums[i].x += exact_sum[0];
+        job->exact_sums[i].y += exact_sum[1];
+        job->exact_sums[i].z += exact_sum[2];
+        job->exact_sums[i].w += job->num_samples;
+    }
+
+    if (job->luminance_moments != NULL)
+    {
+        job->luminance_moments[i].x += square_sum;
+        job->luminance_moments[i].y += job->num_samples;
+    }
+
+    return num_rays;
+}
+
+static cl_uint render_tile(const struct cpu_job *job, const cl_uint tile, cl_uint *num_active_pixels)
+{
+    cl_uint x_begin = (tile % job->num_tiles_x) * CPU_TILE_SIZE;
+    cl_uint y_begin = (tile / job->num_tiles_x) * CPU_TILE_SIZE;
+    cl_uint x_end = x_begin + CPU_TILE_SIZE < job->width ? x_begin + CPU_TILE_SIZE : job->width;
+    cl_uint y_end = y_begin + CPU_TILE_SIZE < job->height ? y_begin + CPU_TILE_SIZE : job->height;
+
+    cl_uint num_rays = 0;
+    for (cl_uint y = y_begin; y < y_end; y++)
+    {
+        for (cl_uint x = x_begin; x < x_end; x++)
+            num_rays += render_pixel(job, x + (size_t) job->width * y, num_active_pixels);
+    }
+
+    return num_rays;
+}
+
+static void *render_tiles(void *arg)
+{
+    struct cpu_worker *worker = arg;
+    struct cpu_job *job = worker->job;
+
+    cl_ulong num_rays = 0;
+    cl_uint num_active_pixels = 0;
+
+    // take tiles from the range of this thread first, then steal from the ranges of the following threads
+    for (cl_uint i = 0; i < job->num_threads; i++)
+    {
+        struct tile_range *range = &job->ranges[(worker->index + i) % job->num_threads];
+
+        cl_uint tile;
+        while ((tile = atomic_fetch_add(&range->next, 1)) < range->end)
+            num_rays += render_tile(job, tile, &num_active_pixels);
+    }
+
+    atomic_fetch_add(&job->num_rays, num_rays);
+    atomic_fetch_add(&job->num_active_pixels, num_active_pixels);
+
+    return NULL;
+}
+
+/**
+ * @brief Renders samples on a pool of threads, and adds them to the accumulator.
+ *
+ * The image is split into tiles, which are divided evenly between the threads. Threads which finish their own tiles
+ * steal the remaining tiles of the others, so that tiles which are slow to trace do not hold back the whole image.
+ *
+ * @param scene the scene.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @param luminance_moments the per-pixel sums of squared sample luminance, with their count in y, or NULL to render
+ * every sample without estimating the error of the pixels.
+ * @param albedo the per-pixel sums of the first-hit albedo, with the sample count in w, or NULL to skip the
+ * auxiliary outputs.
+ * @param normal_depth the per-pixel sums of the first-hit normal, facing the camera, with the sum of the first-hit
+ * depth in w, or NULL with albedo.
+ * @param exact_sums the per-pixel fixed point sums of the samples, as in partial.h, with the sample count in w, or
+ * NULL to only sum them in floating point.
+ * @param camera_quat the camera rotation.
+ * @param z_distance the distance of the screen from the camera, in pixels.
+ * @param camera_position the camera position.
+ * @param height the image height.
+ * @param width the image width.
+ * @param sample_offset the index of the first sample.
+ * @param num_samples the number of samples.
+ * @param error_threshold the relative error at which pixels stop taking samples, as in adaptive.h, or zero to render
+ * every sample of every pixel.
+ * @param num_threads the number of threads.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @param num_active_pixels a pointer to the number of pixels which took samples, which is zero once every pixel has
+ * converged.
+ * @return cl_int the return code.
+ */
+cl_int render_cpu_samples(const struct cpu_scene *scene, cl_float4 *accumulator, cl_float2 *luminance_moments, cl_float4 *albedo, cl_float4 *normal_depth, cl_ulong4 *exact_sums, const cl_float4 camera_quat, const cl_float z_distance, const cl_float3 camera_position, const cl_uint height, const cl_uint width, const cl_uint sample_offset, const cl_uint num_samples, const cl_float error_threshold, const cl_uint num_threads, cl_ulong *num_rays, cl_uint *num_active_pixels)
+{
+    cl_int ret = CL_SUCCESS;
+
+    cl_uint num_tiles_x = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    cl_uint num_tiles = num_tiles_x * ((height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE);
+
+    struct tile_range *ranges = aligned_alloc(_Alignof(struct tile_range), num_threads * sizeof(struct tile_range));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    struct cpu_worker *workers = malloc(num_threads * sizeof(struct cpu_worker));
+    if (ranges == NULL || threads == NULL || workers == NULL)
+    {
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto cleanup;
+    }
+
+    struct cpu_job job = {scene, accumulator, luminance_moments, albedo, normal_depth, exact_sums, conjugate_quat(camera_quat), z_distance, camera_position, height, width, sample_offset, num_samples, error_threshold, num_tiles_x, ranges, num_threads, 0, 0};
+
+    for (cl_uint i = 0; i < num_threads; i++)
+    {
+        atomic_init(&ranges[i].next, (cl_ulong) num_tiles * i / num_threads);
+        ranges[i].end = (cl_ulong) num_tiles * (i + 1) / num_threads;
+    }
+
+    // the calling thread renders as the first worker
+    cl_uint num_started = 1;
+    for (; num_started < num_threads; num_started++)
+    {
+        workers[num_started] = (struct cpu_worker){&job, num_started};
+        if (pthread_create(&threads[num_started], NULL, render_tiles, &workers[num_started]) != 0)
+            break;
+    }
+
+    // threads which failed to start leave their tiles to be stolen
+    workers[0] = (struct cpu_worker){&job, 0};
+    render_tiles(&workers[0]);
+
+    for (cl_uint i = 1; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+
+    *num_rays += atomic_load(&job.num_rays);
+    *num_active_pixels = atomic_load(&job.num_active_pixels);
+
+cleanup:
+    free(workers);
+    free(threads);
+    free(ranges);
+    return ret;
+}
+
+cl_uint get_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
@@ -0,0 +1,40 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "gpulib.h"
+#include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
+
+// the side of the square tiles which the render threads take
+#define CPU_TILE_SIZE 16
+
+/*
+ * The scene as the CPU backend traces it. The spheres are also copied into padded arrays of each component, so that
+ * several spheres are tested against a ray at once.
+ */
+struct cpu_scene
+{
+    const struct sphere *spheres;
+    cl_uint num_spheres;
+    const struct bvh *sphere_bvh;
+    const struct mesh *mesh;
+    const struct bvh *mesh_bvh;
+    const struct material *materials;
+    // the light alias table, which build_light_table builds from the spheres
+    struct light *lights;
+    cl_uint num_lights;
+
+    // the sphere components, from build_sphere_components
+    float *sphere_x;
+    float *sphere_y;
+    float *sphere_z;
+    float *sphere_radius2;
+};
+
+cl_int create_cpu_scene(const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const struct material *materials, struct cpu_scene *scene);
+void release_cpu_scene(struct cpu_scene *scene);
+cl_int render_cpu_samples(const struct cpu_scene *scene, cl_float4 *accumulator, cl_float2 *luminance_moments, cl_float4 *albedo, cl_float4 *normal_depth, cl_ulong4 *exact_sums, const cl_float4 camera_quat, const cl_float z_distance, const cl_float3 camera_position, const cl_uint height, const cl_uint width, const cl_uint sample_offset, const cl_uint num_samples, const cl_float error_threshold, const cl_uint num_threads, cl_ulong *num_rays, cl_uint *num_active_pixels);
+cl_uint get_cpu_count(void);
+
+#endif
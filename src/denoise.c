@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "denoise.h"
+#include "vector.h"
+
+// the first-hit surface of a pixel, averaged over its samples, which guides the filter
+struct guide
+{
+    cl_float3 albedo;
+    cl_float3 normal;
+    float depth;
+};
+
+// the weights of the B3 spline, by the distance of the tap from the centre
+static const float spline_weights[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+static inline cl_float3 get_mean(const cl_float4 pixel)
+{
+    return pixel.w > 0 ? (cl_float3){pixel.x / pixel.w, pixel.y / pixel.w, pixel.z / pixel.w} : (cl_float3){0, 0, 0};
+}
+
+/**
+ * @brief Filters an image once, with taps spread step pixels apart.
+ *
+ * @param input the per-pixel sample sums, with the sample count in w.
+ * @param output the filtered sums, which keep the sample counts of the input.
+ * @param guides the guides.
+ * @param width the image width.
+ * @param height the image height.
+ * @param step the distance between taps.
+ * @param colour_sigma the colour difference at which taps are ignored.
+ */
+static void denoise_pass(const cl_float4 *input, cl_float4 *output, const struct guide *guides, const cl_uint width, const cl_uint height, const int step, const float colour_sigma)
+{
+    for (cl_uint y = 0; y < height; y++)
+    {
+        for (cl_uint x = 0; x < width; x++)
+        {
+            size_t i = x + (size_t) width * y;
+            if (input[i].w == 0)
+            {
+                output[i] = input[i];
+                continue;
+            }
+
+            cl_float3 colour = get_mean(input[i]);
+            const struct guide *guide = &guides[i];
+
+            cl_float3 sum = (cl_float3){0, 0, 0};
+            float weight_sum = 0;
+            for (int dy = -2; dy <= 2; dy++)
+            {
+                int qy = (int) y + dy * step;
+                if (qy < 0 || qy >= (int) height)
+                    continue;
+
+                for (int dx = -2; dx <= 2; dx++)
+                {
+                    int qx = (int) x + dx * step;
+                    if (qx < 0 || qx >= (int) width)
+                        continue;
+
+                    size_t j = qx + (size_t) width * qy;
+                    if (input[j].w == 0)
+                        continue;
+
+                    cl_float3 tap_colour = get_mean(input[j]);
+                    const struct guide *tap_guide = &guides[j];
+
+                    cl_float3 colour_difference = subtract_float3(tap_colour, colour);
+                    cl_float3 albedo_difference = subtract_float3(tap_guide->albedo, guide->albedo);
+                    cl_float3 normal_difference = subtract_float3(tap_guide->normal, guide->normal);
+                    float depth_difference = (tap_guide->depth - guide->depth) / (DENOISE_DEPTH_SIGMA * guide->depth + 1e-3f);
+
+                    float exponent = dot_float3(colour_difference, colour_difference) / (colour_sigma * colour_sigma)
+                        + dot_float3(albedo_difference, albedo_difference) / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA)
+                        + dot_float3(normal_difference, normal_difference) / (DENOISE_NORMAL_SIGMA * DENOISE_NORMAL_SIGMA)
+                        + depth_difference * depth_difference;
+                    float weight = spline_weights[abs(dx)] * spline_weights[abs(dy)] * expf(-exponent);
+
+                    sum = add_float3(sum, scale_float3(tap_colour, weight));
+                    weight_sum += weight;
+                }
+            }
+
+            // the centre tap always has a weight, so the sum is never empty
+            cl_float3 filtered = scale_float3(sum, input[i].w / weight_sum);
+            output[i] = (cl_float4){{filtered.x, filtered.y, filtered.z, input[i].w}};
+        }
+    }
+}
+
+/**
+ * @brief Denoises an accumulator, guided by the first-hit albedo, normal and depth of each pixel.
+ *
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @param albedo the per-pixel sums of the first-hit albedo, with the sample count in w.
+ * @param normal_depth the per-pixel sums of the first-hit normal, with the sum of the first-hit depth in w.
+ * @param width the image width.
+ * @param height the image height.
+ * @param image the denoised sample sums, which keep the sample counts of the accumulator, and must not be the
+ * accumulator.
+ * @return cl_int the return code.
+ */
+cl_int denoise_image(const cl_float4 *accumulator, const cl_float4 *albedo, const cl_float4 *normal_depth, const cl_uint width, const cl_uint height, cl_float4 *image)
+{
+    size_t num_pixels = (size_t) width * height;
+    struct guide *guides = malloc(num_pixels * sizeof(struct guide));
+    cl_float4 *buffers[2] = {malloc(num_pixels * sizeof(cl_float4)), image};
+    if (guides == NULL || buffers[0] == NULL)
+    {
+        free(buffers[0]);
+        free(guides);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        float scale = albedo[i].w > 0 ? 1.0f / albedo[i].w : 0;
+        guides[i].albedo = scale_float3((cl_float3){albedo[i].x, albedo[i].y, albedo[i].z}, scale);
+        guides[i].normal = scale_float3((cl_float3){normal_depth[i].x, normal_depth[i].y, normal_depth[i].z}, scale);
+        guides[i].depth = normal_depth[i].w * scale;
+    }
+
+    // the iterations alternate between the buffers, so that the last writes the image
+    const cl_float4 *input = accumulator;
+    float colour_sigma = DENOISE_COLOUR_SIGMA;
+    for (int iteration = 0; iteration < DENOISE_ITERATIONS; iteration++)
+    {
+        cl_float4 *output = buffers[(DENOISE_ITERATIONS - 1 - iteration) % 2 == 0];
+        denoise_pass(input, output, guides, width, height, 1 << iteration, colour_sigma);
+
+        input = output;
+        colour_sigma *= 0.5f;
+    }
+
+    free(buffers[0]);
+    free(guides);
+    return CL_SUCCESS;
+}
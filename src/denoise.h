@@ -0,0 +1,22 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "gpulib.h"
+
+/*
+ * An edge-avoiding à-trous wavelet filter, after Dammertz et al., which matches kernels/denoise.cl. Each iteration
+ * blurs with a 5x5 B3 spline whose taps are spread twice as far apart as the last, and weights each tap by how
+ * alike its colour and first-hit albedo, normal and depth are to those of the centre, so that edges are kept.
+ */
+
+#define DENOISE_ITERATIONS 5
+// the colour difference at which taps are ignored in the first iteration, which halves every iteration
+#define DENOISE_COLOUR_SIGMA 0.3f
+#define DENOISE_ALBEDO_SIGMA 0.1f
+#define DENOISE_NORMAL_SIGMA 0.3f
+// the depth difference at which taps are ignored, relative to the depth of the centre
+#define DENOISE_DEPTH_SIGMA 0.05f
+
+cl_int denoise_image(const cl_float4 *accumulator, const cl_float4 *albedo, const cl_float4 *normal_depth, const cl_uint width, const cl_uint height, cl_float4 *image);
+
+#endif
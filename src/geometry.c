@@ -112,3 +112,19 @@ cl_float4 rotate_quat(const cl_float4 rotation, const cl_float4 unrotated)
     cl_float4 conjugate = conjugate_quat(rotation);
     return multiply_quat(rotation, multiply_quat(unrotated, conjugate));
 }
+
+/**
+ * @brief Gets the rotation of a camera, and the distance of the screen from it, which gives the field of view.
+ * 
+ * @param camera the camera.
+ * @param height the image height.
+ * @param camera_quat a pointer to the camera rotation.
+ * @param z_distance a pointer to the screen distance.
+ */
+void get_camera_projection(const struct camera *camera, const cl_uint height, cl_float4 *camera_quat, cl_float *z_distance)
+{
+    // tangent of half the field of view gives the ratio of half the screen height to the screen distance
+    *z_distance = -(height / (2.0f * tan(camera->fov / 2.0f)));
+    // the camera rolls, then pitches, then yaws, which is the quaternion product in z, y, x order
+    *camera_quat = euler_to_quat(camera->rotation, "zyx");
+}
@@ -3,10 +3,20 @@
 
 #include "gpulib.h"
 
-static const cl_float4 SIGN_XYZ = {-1, 1, -1, 1};
+static const cl_float4 SIGN_XYZ = {1, -1, 1, -1};
 static const cl_float4 SIGN_XZY = {-1, -1, 1, 1};
 static const cl_float4 SIGN_YXZ = {1, -1, -1, 1};
 
+struct camera
+{
+    // world coordinates
+    cl_float3 position;
+    // Euler rotation in xyz order, where the origin of the screen is at the top left
+    cl_float3 rotation;
+    // vertical field of view in radians
+    cl_float fov;
+};
+
 cl_float4 multiply_quat(const cl_float4 lhs, const cl_float4 rhs);
 cl_float4 multiply_quat_components(const cl_float4 q, const float s);
 cl_float4 divide_quat_components(const cl_float4 q, const float s);
@@ -15,5 +25,6 @@ float quat_magnitude(const cl_float4 q);
 cl_float4 norm_quat(const cl_float4 q);
 cl_float4 euler_to_quat(const cl_float3 euler, const char *order);
 cl_float4 rotate_quat(const cl_float4 rotation, const cl_float4 unrotated);
+void get_camera_projection(const struct camera *camera, const cl_uint height, cl_float4 *camera_quat, cl_float *z_distance);
 
 #endif
@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 
 #include "gpulib.h"
+#include "cache.h"
 
 /**
  * @brief Reads an integer value from user input.
@@ -111,9 +113,9 @@ cl_int read_cl_source(const char *source_path, char **kernel_source, size_t *sou
     return CL_SUCCESS;
 }
 
-cl_int build_cl_program(const cl_program program, const cl_device_id device)
+cl_int build_cl_program(const cl_program program, const cl_device_id device, const char *options)
 {
-    cl_int ret = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+    cl_int ret = clBuildProgram(program, 1, &device, options, NULL, NULL);
     if (ret == CL_BUILD_PROGRAM_FAILURE)
     {
         size_t log_size;
@@ -130,7 +132,75 @@ cl_int build_cl_program(const cl_program program, const cl_device_id device)
     return ret;
 }
 
-cl_int setup_cl(cl_device_id *device, cl_context *context, cl_command_queue *command_queue)
+/**
+ * @brief Creates and builds a program from several source files, which are compiled as one in the given order.
+ * 
+ * Built programs are cached on disk, and are loaded from their binaries until the sources, build options, device, or
+ * driver change.
+ * 
+ * @param context the context.
+ * @param device the device to build for.
+ * @param source_paths the source paths.
+ * @param num_sources the number of sources.
+ * @param options the build options, or NULL.
+ * @param program a pointer to the program.
+ * @return cl_int the return code.
+ */
+cl_int create_cl_program(const cl_context context, const cl_device_id device, const char **source_paths, const cl_uint num_sources, const char *options, cl_program *program)
+{
+    cl_int ret = CL_SUCCESS;
+
+    char **sources = calloc(num_sources, sizeof(char *));
+    size_t *source_sizes = calloc(num_sources, sizeof(size_t));
+    if (sources == NULL || source_sizes == NULL)
+    {
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto cleanup_sources;
+    }
+
+    for (cl_uint i = 0; i < num_sources; i++)
+    {
+        ret = read_cl_source(source_paths[i], &sources[i], &source_sizes[i]);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to read kernel source '%s'.\n", source_paths[i]);
+            goto cleanup_sources;
+        }
+    }
+
+    cl_ulong key;
+    int has_key = get_program_key(device, (const char **)sources, source_sizes, num_sources, options, &key) == CL_SUCCESS;
+    if (has_key && load_cached_program(context, device, key, options, program) == CL_SUCCESS)
+        goto cleanup_sources;
+
+    *program = clCreateProgramWithSource(context, num_sources, (const char **)sources, source_sizes, &ret);
+    if (ret != CL_SUCCESS)
+        goto cleanup_sources;
+
+    ret = build_cl_program(*program, device, options);
+    if (ret != CL_SUCCESS)
+    {
+        clReleaseProgram(*program);
+        goto cleanup_sources;
+    }
+
+    // a failure to cache only costs the next run a build
+    if (has_key && save_cached_program(*program, key) != CL_SUCCESS)
+        fprintf(stderr, "Failed to cache the program binary.\n");
+
+cleanup_sources:
+    if (sources != NULL)
+    {
+        for (cl_uint i = 0; i < num_sources; i++)
+            free(sources[i]);
+    }
+
+    free(sources);
+    free(source_sizes);
+    return ret;
+}
+
+cl_int setup_cl(const cl_command_queue_properties queue_properties, cl_device_id *device, cl_context *context, cl_command_queue *command_queue)
 {
     cl_int ret;
 
@@ -216,7 +286,8 @@ cl_int setup_cl(cl_device_id *device, cl_context *context, cl_command_queue *com
     if (ret != CL_SUCCESS)
         goto cleanup_devices;
 
-    *command_queue = clCreateCommandQueueWithProperties(*context, *device, NULL, &ret);
+    cl_queue_properties queue_property_list[] = {CL_QUEUE_PROPERTIES, queue_properties, 0};
+    *command_queue = clCreateCommandQueueWithProperties(*context, *device, queue_property_list, &ret);
     if (ret != CL_SUCCESS)
         clReleaseContext(*context);
     
@@ -226,4 +297,148 @@ cleanup_platforms:
     free(platforms);
 out:
     return ret;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Opens a context and command queue on a device, if it is available and can compile programs.
+ * 
+ * @param platform the platform of the device.
+ * @param device the device.
+ * @param queue_properties the properties of the command queue, such as CL_QUEUE_PROFILING_ENABLE.
+ * @param opened a pointer to the opened device.
+ * @return cl_int the return code.
+ */
+static cl_int open_device(const cl_platform_id platform, const cl_device_id device, const cl_command_queue_properties queue_properties, struct device_queue *opened)
+{
+    cl_int ret;
+
+    cl_bool is_available;
+    cl_bool is_compiler_available;
+    ret = clGetDeviceInfo(device, CL_DEVICE_AVAILABLE, sizeof(cl_bool), &is_available, NULL);
+    ret |= clGetDeviceInfo(device, CL_DEVICE_COMPILER_AVAILABLE, sizeof(cl_bool), &is_compiler_available, NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    if (!is_available || !is_compiler_available)
+        return CL_DEVICE_NOT_AVAILABLE;
+
+    cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0};
+
+    opened->device = device;
+    opened->context = clCreateContext(properties, 1, &device, NULL, NULL, &ret);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    cl_queue_properties queue_property_list[] = {CL_QUEUE_PROPERTIES, queue_properties, 0};
+    opened->command_queue = clCreateCommandQueueWithProperties(opened->context, device, queue_property_list, &ret);
+    if (ret != CL_SUCCESS)
+        clReleaseContext(opened->context);
+
+    return ret;
+}
+
+/**
+ * @brief Opens a context and command queue on every usable device of every platform, without asking the user.
+ * 
+ * Devices which fail to open are reported and skipped.
+ * 
+ * @param queue_properties the properties of the command queues, such as CL_QUEUE_PROFILING_ENABLE.
+ * @param devices a pointer to the opened devices, which must be released with release_all_cl.
+ * @param num_devices a pointer to the number of opened devices.
+ * @return cl_int the return code, which is CL_DEVICE_NOT_FOUND if no device could be opened.
+ */
+cl_int setup_all_cl(const cl_command_queue_properties queue_properties, struct device_queue **devices, cl_uint *num_devices)
+{
+    cl_int ret;
+
+    cl_uint num_platforms;
+
+    *devices = NULL;
+    *num_devices = 0;
+
+    ret = clGetPlatformIDs(0, NULL, &num_platforms);
+    if (ret != CL_SUCCESS)
+        goto out;
+
+    cl_platform_id *platforms = malloc(num_platforms * sizeof(cl_platform_id));
+    if (platforms == NULL)
+    {
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto out;
+    }
+
+    ret = clGetPlatformIDs(num_platforms, platforms, NULL);
+    if (ret != CL_SUCCESS)
+        goto cleanup_platforms;
+
+    for (cl_uint i = 0; i < num_platforms; i++)
+    {
+        cl_uint num_platform_devices;
+        // a platform without devices is skipped
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &num_platform_devices) != CL_SUCCESS)
+            continue;
+
+        cl_device_id *platform_devices = malloc(num_platform_devices * sizeof(cl_device_id));
+        struct device_queue *resized_devices = realloc(*devices, (*num_devices + num_platform_devices) * sizeof(struct device_queue));
+        if (platform_devices == NULL || resized_devices == NULL)
+        {
+            free(platform_devices);
+            ret = CL_OUT_OF_HOST_MEMORY;
+            goto cleanup_devices;
+        }
+
+        *devices = resized_devices;
+
+        ret = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, num_platform_devices, platform_devices, NULL);
+        for (cl_uint j = 0; ret == CL_SUCCESS && j < num_platform_devices; j++)
+        {
+            // a device whose name cannot be read is still opened, and reported as unnamed
+            char *device_name = NULL;
+            get_device_name(platform_devices[j], &device_name);
+            const char *name = device_name != NULL ? device_name : "unnamed";
+
+            cl_int open_ret = open_device(platforms[i], platform_devices[j], queue_properties, &(*devices)[*num_devices]);
+            if (open_ret == CL_SUCCESS)
+            {
+                printf("Opened device %u: %s\n", *num_devices, name);
+                (*num_devices)++;
+            }
+            else
+            {
+                fprintf(stderr, "Skipping device '%s' with code '%d'.\n", name, open_ret);
+            }
+
+            free(device_name);
+        }
+
+        free(platform_devices);
+        if (ret != CL_SUCCESS)
+            goto cleanup_devices;
+    }
+
+    if (*num_devices == 0)
+        ret = CL_DEVICE_NOT_FOUND;
+
+cleanup_devices:
+    if (ret != CL_SUCCESS)
+    {
+        release_all_cl(*devices, *num_devices);
+        *devices = NULL;
+        *num_devices = 0;
+    }
+cleanup_platforms:
+    free(platforms);
+out:
+    return ret;
+}
+
+void release_all_cl(struct device_queue *devices, const cl_uint num_devices)
+{
+    for (cl_uint i = 0; i < num_devices; i++)
+    {
+        clReleaseCommandQueue(devices[i].command_queue);
+        clReleaseContext(devices[i].context);
+    }
+
+    free(devices);
+}
@@ -7,8 +7,19 @@
 #include <CL/cl.h>
 #endif
 
+// a device with its own context and command queue
+struct device_queue
+{
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue command_queue;
+};
+
 cl_int read_cl_source(const char *source_path, char **kernel_source, size_t *source_size);
-cl_int build_cl_program(const cl_program program, const cl_device_id device);
-cl_int setup_cl(cl_device_id *device, cl_context *context, cl_command_queue *command_queue);
+cl_int build_cl_program(const cl_program program, const cl_device_id device, const char *options);
+cl_int create_cl_program(const cl_context context, const cl_device_id device, const char **source_paths, const cl_uint num_sources, const char *options, cl_program *program);
+cl_int setup_cl(const cl_command_queue_properties queue_properties, cl_device_id *device, cl_context *context, cl_command_queue *command_queue);
+cl_int setup_all_cl(const cl_command_queue_properties queue_properties, struct device_queue **devices, cl_uint *num_devices);
+void release_all_cl(struct device_queue *devices, const cl_uint num_devices);
 
 #endif
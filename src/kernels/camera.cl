@@ -26,15 +26,10 @@ inline float4 reverse_rotate_quat(const float4 rotation, const float4 unrotated)
     return multiply_quat(conjugate, multiply_quat(unrotated, rotation));
 }
 
-kernel void get_directions(global float3 *camera_directions, const float4 camera_world_quat, const float z_distance, const uint height, const uint width)
+// the direction of a camera ray through a point on the screen, in pixels from the top left
+inline float3 get_camera_direction(const float4 camera_quat, const float z_distance, const float x, const float y, const uint height, const uint width)
 {
-    size_t i = get_global_id(0);
-    size_t x = i % width;
-    size_t y = i / width;
-
     float4 screen_coordinates = (float4){x - width / 2.0f, y - height / 2.0f, z_distance, 0};
     // tangent of half the field of view gives the ratio of the opposite and adjacent of the right angle triangle one half the height of the screen height
-    float3 direction = normalize(reverse_rotate_quat(camera_world_quat, screen_coordinates).xyz);
-
-    camera_directions[i] = direction;
-}
\ No newline at end of file
+    return normalize(reverse_rotate_quat(camera_quat, screen_coordinates).xyz);
+}
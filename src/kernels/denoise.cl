@@ -0,0 +1,82 @@
+// matches denoise.h
+#define DENOISE_ALBEDO_SIGMA 0.1f
+#define DENOISE_NORMAL_SIGMA 0.3f
+#define DENOISE_DEPTH_SIGMA 0.05f
+
+// the weights of the B3 spline, by the distance of the tap from the centre
+constant float SPLINE_WEIGHTS[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+inline float3 get_mean(const float4 pixel)
+{
+    return pixel.w > 0 ? pixel.xyz / pixel.w : (float3)(0, 0, 0);
+}
+
+// the guides of a checkpoint have no samples until it renders more, and are then all zero
+inline float get_guide_scale(const float4 albedo)
+{
+    return albedo.w > 0 ? 1.0f / albedo.w : 0;
+}
+
+// one iteration of the edge-avoiding à-trous filter, with taps spread step pixels apart, which keeps the sample counts
+kernel void denoise(global const float4 *input, global float4 *output, global const float4 *albedo, global const float4 *normal_depth, const uint width, const uint height, const int step, const float colour_sigma)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= width || y >= height)
+        return;
+
+    size_t i = x + width * y;
+    float4 pixel = input[i];
+    if (pixel.w == 0)
+    {
+        output[i] = pixel;
+        return;
+    }
+
+    float3 colour = get_mean(pixel);
+    float scale = get_guide_scale(albedo[i]);
+    float3 guide_albedo = albedo[i].xyz * scale;
+    float3 guide_normal = normal_depth[i].xyz * scale;
+    float guide_depth = normal_depth[i].w * scale;
+
+    float3 sum = (float3)(0, 0, 0);
+    float weight_sum = 0;
+    for (int dy = -2; dy <= 2; dy++)
+    {
+        int qy = y + dy * step;
+        if (qy < 0 || qy >= height)
+            continue;
+
+        for (int dx = -2; dx <= 2; dx++)
+        {
+            int qx = x + dx * step;
+            if (qx < 0 || qx >= width)
+                continue;
+
+            size_t j = qx + width * qy;
+            float4 tap = input[j];
+            if (tap.w == 0)
+                continue;
+
+            float3 tap_colour = get_mean(tap);
+            float tap_scale = get_guide_scale(albedo[j]);
+
+            float3 colour_difference = tap_colour - colour;
+            float3 albedo_difference = albedo[j].xyz * tap_scale - guide_albedo;
+            float3 normal_difference = normal_depth[j].xyz * tap_scale - guide_normal;
+            float depth_difference = (normal_depth[j].w * tap_scale - guide_depth) / (DENOISE_DEPTH_SIGMA * guide_depth + 1e-3f);
+
+            float exponent = dot(colour_difference, colour_difference) / (colour_sigma * colour_sigma)
+                + dot(albedo_difference, albedo_difference) / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA)
+                + dot(normal_difference, normal_difference) / (DENOISE_NORMAL_SIGMA * DENOISE_NORMAL_SIGMA)
+                + depth_difference * depth_difference;
+            float weight = SPLINE_WEIGHTS[abs(dx)] * SPLINE_WEIGHTS[abs(dy)] * exp(-exponent);
+
+            sum += tap_colour * weight;
+            weight_sum += weight;
+        }
+    }
+
+    // the centre tap always has a weight, so the sum is never empty
+    output[i] = (float4)(sum * (pixel.w / weight_sum), pixel.w);
+}
@@ -1,205 +1,352 @@
-#define EPSILON 1e-2f
+// matches profile.h
+#define PATH_STATS_PRIMARY 0
+#define PATH_STATS_BOUNCE 1
+#define PATH_STATS_SHADOW 2
+#define PATH_STATS_ROULETTE 3
 
-struct ray
-{
-    float3 origin;
-    float3 direction;
-};
-
-struct sphere
-{
-    float3 position;
-    float3 colour;
-    float3 emission;
-    float radius;
-} __attribute__((packed));
-
-inline bool intersect_sphere(const struct sphere s, const struct ray *r, float *t)
-{
-    float3 centre_ray = s.position - r->origin;
-
-    // solve the quadratic, where a = 1
-    float b = dot(centre_ray, r->direction);
-    float c = dot(centre_ray, centre_ray) - s.radius * s.radius;
-
-    float disc = b * b - c;
+// matches cpu.c, unless build options override them
+#ifndef MAX_BOUNCES
+#define MAX_BOUNCES 16
+#endif
+#ifndef ROULETTE_BOUNCE
+#define ROULETTE_BOUNCE 5
+#endif
 
-    if (disc < 0.0f)
-        return false;
+// matches partial.h
+#define EXACT_SUM_SCALE 16777216.0f
 
-    float disc_root = sqrt(disc);
-    if ((*t = b - disc_root) > EPSILON)
-        return true;
-
-    if ((*t = b + disc_root) > EPSILON)
-        return true;
+// matches adaptive.h
+#define ADAPTIVE_MIN_SAMPLES 64
+#define ADAPTIVE_MIN_LUMINANCE 0.01f
 
-    return false;
-}
+constant float3 LUMINANCE = (float3)(0.2126f, 0.7152f, 0.0722f);
 
-inline bool intersect_scene(constant struct sphere *scene_spheres, const size_t n, const struct ray *r, int *hit_index, float *t)
+// the standard error of the mean luminance of a pixel, relative to that mean, from the moments of its samples
+float get_pixel_error(const float4 pixel, const float2 moments)
 {
-    float min_distance = INFINITY;
-    
-    for (size_t i = 0; i < n; i++)
-    {
-        float hit_distance;
-        
-        if (intersect_sphere(scene_spheres[i], r, &hit_distance) && hit_distance < min_distance && *hit_index != i)
-        {
-            min_distance = hit_distance;
-            *hit_index = i;
-        }
-    }
+    if (moments.y < ADAPTIVE_MIN_SAMPLES)
+        return INFINITY;
 
-    *t = min_distance;
-
-    return min_distance < INFINITY;
-}
-
-inline uint rand(ulong *seed)
-{
-    // Java Random number algorithm
-    *seed = (*seed * 0x5DEECE66DL + 0xBL) & ((1L << 48) - 1);
-    return *seed >> 16;
+    float mean = dot(pixel.xyz, LUMINANCE) / pixel.w;
+    float variance = max(moments.x / moments.y - mean * mean, 0.0f) * moments.y / (moments.y - 1);
+    return sqrt(variance / pixel.w) / (mean + ADAPTIVE_MIN_LUMINANCE);
 }
 
-inline float randf(ulong *seed)
+// adds to a 64-bit counter kept as a low and a high word, where the add which wraps the low word carries into the
+// high one, so that the counts of a launch do not overflow without needing 64-bit atomics
+void add_count(volatile global uint *count, const uint value)
 {
-    return rand(seed) / (float) UINT_MAX;
+    if (atomic_add(count, value) > UINT_MAX - value)
+        atomic_inc(count + 1);
 }
 
-kernel void render(global float3 *output, constant struct sphere *scene_spheres, const uint num_spheres, constant float3 *camera_directions, const float3 camera_position, const uint height, const uint width, const uint num_samples)
+kernel void render(global float4 *accumulator, volatile global uint *ray_count, SCENE_PARAMETERS, const float4 camera_quat, const float z_distance, const float3 camera_position, const uint height_argument, const uint width_argument, const uint sample_offset, const uint num_samples, const uint2 tile_end, global float2 *luminance_moments, const float error_threshold, volatile global uint *active_count, global float4 *albedo, global float4 *normal_depth, volatile global uint *path_stats, global ulong4 *exact_sums, const uint4 frame)
 {
+    // a program specialized by session.c has the image size and scene counts as constants, and ignores the arguments,
+    // while the camera projects the frame, of which the image may only be one tile
+#ifdef SPECIALIZED_WIDTH
+    const uint width = SPECIALIZED_WIDTH;
+#else
+    const uint width = width_argument;
+#endif
     size_t x = get_global_id(0);
     size_t y = get_global_id(1);
     size_t i = x + width * y;
 
-    if (x >= width || y >= height)
+    // the work items past the end of the tile, which is within the image, are only there to round up the global size
+    if (x >= tile_end.x || y >= tile_end.y)
         return;
 
-    // not the best pseudo-random
-    ulong seed = i;
-    for (size_t t = 0; t < (size_t) (64 * randf(&seed)); t++) {
-        rand(&seed);
-    }
+    // adaptive sampling skips the pixels which have converged, so that the samples go to the noisy ones
+    float2 moments = luminance_moments[i];
+    if (error_threshold > 0 && get_pixel_error(accumulator[i], moments) < error_threshold)
+        return;
 
-    struct ray camera_ray;
-    camera_ray.origin = camera_position;
-    camera_ray.direction = camera_directions[i];
+    atomic_inc(active_count);
 
+    // the pixel's place in the frame, of which the session may only render a tile, picks its samples and camera ray
+    size_t frame_x = x + frame.x;
+    size_t frame_y = y + frame.y;
+
+    struct scene scene = SCENE_ARGUMENTS;
+    specialize_scene(&scene);
+
+    uint num_rays = 0;
+    float3 sample_sum = (float3){0, 0, 0};
+    float square_sum = 0;
+    float3 albedo_sum = (float3){0, 0, 0};
+    float3 normal_sum = (float3){0, 0, 0};
+    float depth_sum = 0;
+    uint num_bounce_rays = 0;
+    uint num_terminations = 0;
+    ulong3 exact_sum = (ulong3)(0, 0, 0);
     for (size_t s = 0; s < num_samples; s++)
     {
         float light_weight = 1;
         float3 accumulated_colour = (float3){0, 0, 0};
         float3 mask = (float3){1.0, 1.0, 1.0};
-        struct ray cast_ray = camera_ray;
+        // jitter each sample within the pixel, for anti-aliasing
+        // index the samples from those already taken, so that each chunk of samples continues the sequence
+        struct sampler sampler = create_sampler(frame_x + frame.z * frame_y, sample_offset + s);
+        float2 jitter = sample_2d(&sampler);
+        struct ray cast_ray;
+        cast_ray.origin = camera_position;
+        cast_ray.direction = get_camera_direction(camera_quat, z_distance, frame_x + jitter.x, frame_y + jitter.y, frame.w, frame.z);
         int hit_index = -1;
-        for (size_t bounce = 0; bounce < 16; bounce++)
+        for (size_t bounce = 0; bounce < MAX_BOUNCES; bounce++)
         {
             float t;
-            if (!intersect_scene(scene_spheres, num_spheres, &cast_ray, &hit_index, &t))
+            num_rays++;
+            num_bounce_rays += bounce > 0;
+            if (!intersect_scene(&scene, &cast_ray, &hit_index, &t))
                 break;
 
-            struct sphere hit_sphere = scene_spheres[hit_index];
+            float3 hit_point = cast_ray.origin + cast_ray.direction * t;
+            struct surface surface = get_surface(&scene, hit_index, hit_point);
 
-            accumulated_colour += mask * hit_sphere.emission * light_weight;
+            accumulated_colour += mask * surface.emission * light_weight;
 
             float p = max(mask.x, max(mask.y, mask.z));
-            if (bounce > 5) {
-                if (randf(&seed) > p) {
+            if (bounce > ROULETTE_BOUNCE) {
+                if (sample_1d(&sampler) > p) {
+                    num_terminations++;
                     break;
                 } else {
                     mask /= p;
                 }
             }
 
-            float3 hit_point = cast_ray.origin + cast_ray.direction * t;
-            // a ray from the centre of a sphere, to the point on the surface will have the direction of the normal
-            float3 normal = normalize(hit_point - hit_sphere.position);
             // normal flipping technique
-            float3 oriented_normal = dot(normal, cast_ray.direction) < 0.0f ? normal : normal * -1.0f;
-
-            // create axes about the normal
-            float3 w = oriented_normal;
-            // use the smallest component as the axis
-            float3 axis = fabs(w.x) < fabs(w.y) && fabs(w.x) < fabs(w.z) ? (float3){1.0, 0, 0} : fabs(w.y) < fabs(w.z) ? (float3){0, 1.0, 0} : (float3){0, 0, 1.0};
-            float3 u = normalize(cross(axis, w));
-            float3 v = cross(w, u);
-
-            // cosine hemisphere sampling
-            float random_angle =  2 * M_PI_F * randf(&seed);
-            float random_number = randf(&seed);
-            float random_distance = sqrt(random_number);
-            float3 bounce_direction = normalize(u * cos(random_angle) * random_distance + v * sin(random_angle) * random_distance + w * sqrt(1 - random_number));
+            float3 oriented_normal = dot(surface.normal, cast_ray.direction) < 0.0f ? surface.normal : surface.normal * -1.0f;
+
+            if (bounce == 0)
+            {
+                albedo_sum += surface.colour;
+                normal_sum += oriented_normal;
+                depth_sum += t;
+            }
+
+            float3 bounce_direction = sample_hemisphere(oriented_normal, &sampler);
             float3 bounce_start = hit_point + oriented_normal * EPSILON;
 
             cast_ray.origin = bounce_start;
             cast_ray.direction = bounce_direction;
 
-            // this snippet of code is translated from smallpt for now
-            // smallpt is by Kevin Beason, released under the MIT licence
-            // TODO make this code more clear
-            
-            /* LICENSE
-             *
-             * Copyright (c) 2006-2008 Kevin Beason (kevin.beason@gmail.com)
-             *
-             * Permission is hereby granted, free of charge, to any person obtaining
-             * a copy of this software and associated documentation files (the
-             * "Software"), to deal in the Software without restriction, including
-             * without limitation the rights to use, copy, modify, merge, publish,
-             * distribute, sublicense, and/or sell copies of the Software, and to
-             * permit persons to whom the Software is furnished to do so, subject to
-             * the following conditions:
-             * 
-             * The above copyright notice and this permission notice shall be included
-             * in all copies or substantial portions of the Software.
-             *
-             * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
-             * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
-             * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
-             * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
-             * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
-             * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
-             * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
-             */
-            float3 e = (float3){0, 0, 0};
-            for (size_t j = 0; j < num_spheres; j++) {
-                struct sphere sphere = scene_spheres[j];
-                if (length(sphere.emission) == 0)
-                    continue;
-                
-                float3 light_w = sphere.position - bounce_start;
-                float3 light_axis = fabs(light_w.x) < fabs(light_w.y) && fabs(light_w.x) < fabs(light_w.z) ? (float3){1.0, 0, 0} : fabs(light_w.y) < fabs(light_w.z) ? (float3){0, 1.0, 0} : (float3){0, 0, 1.0};
-                float3 light_u = normalize(cross(light_axis, light_w));
-                float3 light_v = cross(light_w, light_u);
-                float cos_a_max = sqrt(1 -  sphere.radius * sphere.radius / dot(bounce_start - sphere.position, bounce_start - sphere.position));
-                float eps1 = randf(&seed);
-                float eps2 = randf(&seed);
-                float cos_a = 1 - eps1 + eps1 * cos_a_max;
-                float sin_a = sqrt(1 - cos_a * cos_a);
-                float phi = 2 * M_PI_F * eps2;
-                float3 l = normalize(light_u * cos(phi) * sin_a + light_v * sin(phi) * sin_a + light_w * cos_a);
-                int hit_light = -1;
-                float t_light;
-                if (intersect_scene(scene_spheres, num_spheres, &(struct ray){bounce_start, l}, &hit_light, &t_light)) {
-                    if (hit_light == j && hit_light != hit_index) {
-                        float omega = 2 * M_PI_F * (1 - cos_a_max);
-                        e += hit_sphere.colour * (sphere.emission * dot(l, oriented_normal) * omega) * M_1_PI_F;
-                    }
+            accumulated_colour += mask * sample_lights(&scene, bounce_start, oriented_normal, surface.colour, hit_index, &sampler, &num_rays);
+            mask *= surface.colour;
+
+            light_weight = 0;
+        }
+
+        sample_sum += accumulated_colour;
+        exact_sum += convert_ulong3_sat_rte(accumulated_colour * EXACT_SUM_SCALE);
+        float luminance = dot(accumulated_colour, LUMINANCE);
+        square_sum += luminance * luminance;
+    }
+
+    // the accumulator holds the running sum of samples, with the sample count in w
+    accumulator[i] += (float4)(sample_sum, (float) num_samples);
+    luminance_moments[i] = moments + (float2)(square_sum, (float) num_samples);
+
+    // the first-hit albedo, normal and depth guide the denoiser, which passes NULL buffers when it is disabled
+    if (albedo != 0)
+    {
+        albedo[i] += (float4)(albedo_sum, (float) num_samples);
+        normal_depth[i] += (float4)(normal_sum, depth_sum);
+    }
+    // the fixed point sums are only kept for partial renders, which pass a NULL buffer otherwise
+    if (exact_sums != 0)
+        exact_sums[i] += (ulong4)(exact_sum, num_samples);
+
+    add_count(ray_count, num_rays);
+
+    // the path statistics are only counted when profiling, which passes a NULL buffer otherwise
+    if (path_stats != 0)
+    {
+        add_count(&path_stats[2 * PATH_STATS_PRIMARY], num_samples);
+        add_count(&path_stats[2 * PATH_STATS_BOUNCE], num_bounce_rays);
+        add_count(&path_stats[2 * PATH_STATS_SHADOW], num_rays - num_samples - num_bounce_rays);
+        add_count(&path_stats[2 * PATH_STATS_ROULETTE], num_terminations);
+    }
+}
+
+
+// the state of a path which a persistent work item traces one bounce at a time
+struct path
+{
+    struct ray ray;
+    struct sampler sampler;
+    float3 mask;
+    float3 colour;
+    float light_weight;
+    int hit_index;
+    uint bounce;
+};
+
+// the sums of the samples of the pixel which a persistent work item is rendering, which it adds to the buffers alone
+struct pixel_sums
+{
+    float3 sample_sum;
+    float square_sum;
+    float3 albedo_sum;
+    float3 normal_sum;
+    float depth_sum;
+    ulong3 exact_sum;
+};
+
+// claims the next pixel of the tile from the work queue, skipping those which have converged, until the queue is empty
+bool claim_pixel(volatile global uint *next_job, const uint2 tile_start, const uint2 tile_end, const uint width, global float4 *accumulator, global float2 *luminance_moments, const float error_threshold, volatile global uint *active_count, uint2 *pixel)
+{
+    const uint tile_width = tile_end.x - tile_start.x;
+    const uint num_jobs = tile_width * (tile_end.y - tile_start.y);
+    for (uint job = atomic_inc(next_job); job < num_jobs; job = atomic_inc(next_job))
+    {
+        uint2 claimed = tile_start + (uint2)(job % tile_width, job / tile_width);
+        size_t i = claimed.x + width * claimed.y;
+        if (error_threshold > 0 && get_pixel_error(accumulator[i], luminance_moments[i]) < error_threshold)
+            continue;
+
+        atomic_inc(active_count);
+        *pixel = claimed;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * The render kernel with persistent work items, which take the pixels of a tile from a work queue, rather than one
+ * work item rendering each pixel. Each work item traces one bounce per iteration, and starts the next sample as soon
+ * as a path ends, so that the lanes whose paths escape or are terminated early do not idle until the longest path of
+ * their group has ended. A pixel's samples are all taken by the work item which claimed it, in order, so the sums are
+ * added without atomics, and are the same as the render kernel's.
+ */
+kernel void render_persistent(global float4 *accumulator, volatile global uint *ray_count, SCENE_PARAMETERS, const float4 camera_quat, const float z_distance, const float3 camera_position, const uint height_argument, const uint width_argument, const uint sample_offset, const uint num_samples, const uint2 tile_end, global float2 *luminance_moments, const float error_threshold, volatile global uint *active_count, global float4 *albedo, global float4 *normal_depth, volatile global uint *path_stats, global ulong4 *exact_sums, const uint4 frame, const uint2 tile_start, volatile global uint *next_job)
+{
+#ifdef SPECIALIZED_WIDTH
+    const uint width = SPECIALIZED_WIDTH;
+#else
+    const uint width = width_argument;
+#endif
+
+    struct scene scene = SCENE_ARGUMENTS;
+    specialize_scene(&scene);
+
+    uint num_rays = 0;
+    uint num_primary_rays = 0;
+    uint num_bounce_rays = 0;
+    uint num_terminations = 0;
+
+    // the work item starts as if it had taken every sample of a pixel, so that it claims its first pixel
+    uint2 pixel = (uint2)(0, 0);
+    uint s = num_samples;
+    struct pixel_sums sums;
+    struct path path;
+    bool is_tracing = false;
+    while (true)
+    {
+        // an ended path is replaced by the next sample of its pixel, or the first sample of the next pixel
+        if (!is_tracing)
+        {
+            if (s == num_samples)
+            {
+                if (!claim_pixel(next_job, tile_start, tile_end, width, accumulator, luminance_moments, error_threshold, active_count, &pixel))
+                    break;
+
+                s = 0;
+                sums = (struct pixel_sums){(float3)(0, 0, 0), 0, (float3)(0, 0, 0), (float3)(0, 0, 0), 0, (ulong3)(0, 0, 0)};
+            }
+
+            uint2 frame_pixel = pixel + frame.xy;
+            path.sampler = create_sampler(frame_pixel.x + frame.z * frame_pixel.y, sample_offset + s);
+            float2 jitter = sample_2d(&path.sampler);
+            path.ray.origin = camera_position;
+            path.ray.direction = get_camera_direction(camera_quat, z_distance, frame_pixel.x + jitter.x, frame_pixel.y + jitter.y, frame.w, frame.z);
+            path.mask = (float3){1.0, 1.0, 1.0};
+            path.colour = (float3){0, 0, 0};
+            path.light_weight = 1;
+            path.hit_index = -1;
+            path.bounce = 0;
+            num_primary_rays++;
+            is_tracing = true;
+        }
+
+        float t;
+        num_rays++;
+        num_bounce_rays += path.bounce > 0;
+        is_tracing = intersect_scene(&scene, &path.ray, &path.hit_index, &t);
+        if (is_tracing)
+        {
+            float3 hit_point = path.ray.origin + path.ray.direction * t;
+            struct surface surface = get_surface(&scene, path.hit_index, hit_point);
+
+            path.colour += path.mask * surface.emission * path.light_weight;
+
+            float p = max(path.mask.x, max(path.mask.y, path.mask.z));
+            if (path.bounce > ROULETTE_BOUNCE && sample_1d(&path.sampler) > p)
+            {
+                num_terminations++;
+                is_tracing = false;
+            }
+            else
+            {
+                if (path.bounce > ROULETTE_BOUNCE)
+                    path.mask /= p;
+
+                float3 oriented_normal = dot(surface.normal, path.ray.direction) < 0.0f ? surface.normal : surface.normal * -1.0f;
+
+                if (path.bounce == 0)
+                {
+                    sums.albedo_sum += surface.colour;
+                    sums.normal_sum += oriented_normal;
+                    sums.depth_sum += t;
                 }
+
+                float3 bounce_direction = sample_hemisphere(oriented_normal, &path.sampler);
+                float3 bounce_start = hit_point + oriented_normal * EPSILON;
+
+                path.ray.origin = bounce_start;
+                path.ray.direction = bounce_direction;
+
+                path.colour += path.mask * sample_lights(&scene, bounce_start, oriented_normal, surface.colour, path.hit_index, &path.sampler, &num_rays);
+                path.mask *= surface.colour;
+                path.light_weight = 0;
+
+                is_tracing = ++path.bounce < MAX_BOUNCES;
             }
-            /*
-             * End of material from smallpt
-             */
+        }
 
-            accumulated_colour += mask * e;
-            mask *= hit_sphere.colour;
+        if (is_tracing)
+            continue;
 
-            light_weight = 0;
+        sums.sample_sum += path.colour;
+        sums.exact_sum += convert_ulong3_sat_rte(path.colour * EXACT_SUM_SCALE);
+        float luminance = dot(path.colour, LUMINANCE);
+        sums.square_sum += luminance * luminance;
+
+        // the work item owns the pixel until its last sample, so the buffers are written as the render kernel writes them
+        if (++s < num_samples)
+            continue;
+
+        size_t i = pixel.x + width * pixel.y;
+        accumulator[i] += (float4)(sums.sample_sum, (float) num_samples);
+        luminance_moments[i] += (float2)(sums.square_sum, (float) num_samples);
+        if (albedo != 0)
+        {
+            albedo[i] += (float4)(sums.albedo_sum, (float) num_samples);
+            normal_depth[i] += (float4)(sums.normal_sum, sums.depth_sum);
         }
+        if (exact_sums != 0)
+            exact_sums[i] += (ulong4)(sums.exact_sum, num_samples);
+    }
 
-        output[i] += accumulated_colour / (float) num_samples;
+    add_count(ray_count, num_rays);
+
+    if (path_stats != 0)
+    {
+        add_count(&path_stats[2 * PATH_STATS_PRIMARY], num_primary_rays);
+        add_count(&path_stats[2 * PATH_STATS_BOUNCE], num_bounce_rays);
+        add_count(&path_stats[2 * PATH_STATS_SHADOW], num_rays - num_primary_rays - num_bounce_rays);
+        add_count(&path_stats[2 * PATH_STATS_ROULETTE], num_terminations);
     }
 }
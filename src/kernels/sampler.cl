@@ -0,0 +1,93 @@
+// the state of one sample of one pixel, which matches struct sampler in sampler.h
+struct sampler
+{
+    uint seed;
+    // the sample index, with the bits reversed
+    uint index;
+    uint dimension;
+};
+
+inline uint reverse_bits(uint x)
+{
+    x = rotate(x, 16u);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+inline uint hash_uint(uint x)
+{
+    // lowbias32 by Chris Wellons
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint hash_combine(const uint seed, const uint value)
+{
+    return seed ^ (hash_uint(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+// a random permutation in which each bit only depends on the bits below it, from Brent Burley's hash-based Owen scrambling
+inline uint laine_karras_permutation(uint x, const uint seed)
+{
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return x;
+}
+
+// the second dimension of the Sobol sequence, with the bits reversed, which multiplies the bits of the index by the
+// Pascal matrix, since its generator matrix is the Pascal matrix modulo two. By Lucas's theorem, each bit is then the
+// parity of the bits of the index at the positions whose binary digits include those of its own
+inline uint sobol_second_dimension_reversed(uint index)
+{
+    index ^= (index >> 1) & 0x55555555;
+    index ^= (index >> 2) & 0x33333333;
+    index ^= (index >> 4) & 0x0f0f0f0f;
+    index ^= (index >> 8) & 0x00ff00ff;
+    index ^= (index >> 16) & 0x0000ffff;
+    return index;
+}
+
+inline float to_unit_float(const uint x)
+{
+    // the top 24 bits, so that the result rounds below one
+    return (x >> 8) * 0x1p-24f;
+}
+
+inline struct sampler create_sampler(const uint pixel, const uint sample_index)
+{
+    return (struct sampler){hash_uint(pixel), reverse_bits(sample_index), 0};
+}
+
+/*
+ * Each dimension, or pair of dimensions, draws from its own shuffled and Owen scrambled Sobol sequence. The samples
+ * of a pixel are then stratified in every dimension, and the pixels are decorrelated, without a table of direction
+ * numbers per dimension. Owen scrambling permutes each bit by the bits above it, which the Laine-Karras permutation
+ * does to a number with its bits reversed, so the points are permuted reversed, and only reversed back at the end.
+ */
+inline float sample_1d(struct sampler *sampler)
+{
+    uint seed = hash_combine(sampler->seed, sampler->dimension++);
+    // shuffle the samples, so that each dimension pairs them differently
+    uint index = reverse_bits(laine_karras_permutation(sampler->index, seed));
+    // the first dimension of the Sobol sequence is the reversed index
+    return to_unit_float(reverse_bits(laine_karras_permutation(index, hash_combine(seed, 0))));
+}
+
+inline float2 sample_2d(struct sampler *sampler)
+{
+    uint seed = hash_combine(sampler->seed, sampler->dimension++);
+    uint index = reverse_bits(laine_karras_permutation(sampler->index, seed));
+    uint x = reverse_bits(laine_karras_permutation(index, hash_combine(seed, 0)));
+    uint y = reverse_bits(laine_karras_permutation(sobol_second_dimension_reversed(index), hash_combine(seed, 1)));
+    return (float2){to_unit_float(x), to_unit_float(y)};
+}
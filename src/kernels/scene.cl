@@ -0,0 +1,372 @@
+#define EPSILON 1e-2f
+// the spheres intersected at once, by which each array of sphere components is padded, which matches scene.h
+#define SPHERE_LANES 8
+
+struct ray
+{
+    float3 origin;
+    float3 direction;
+};
+
+// matches struct sphere in scene.h
+struct sphere
+{
+    float3 position;
+    float3 colour;
+    float3 emission;
+    float radius;
+    float padding[3];
+};
+
+// a flattened bvh node in depth-first order, where a missed node continues at skip
+struct bvh_node
+{
+    float3 min;
+    float3 max;
+    uint offset;
+    uint count;
+    uint skip;
+    uint padding;
+};
+
+struct material
+{
+    float3 colour;
+    float3 emission;
+};
+
+struct triangle
+{
+    uint v0;
+    uint v1;
+    uint v2;
+    uint material;
+};
+
+// an entry of the light alias table, which matches struct light in scene.h
+struct light
+{
+    uint sphere;
+    uint alias;
+    float threshold;
+    float probability;
+};
+
+// the scene buffers, where triangles are indexed after the spheres
+struct scene
+{
+    global const struct sphere *spheres;
+    // the x, y, z and squared radius arrays of the spheres, at a stride of num_spheres + SPHERE_LANES
+    global const float *sphere_components;
+    uint num_spheres;
+    global const struct bvh_node *sphere_nodes;
+    uint num_sphere_nodes;
+    global const float *vertices;
+    global const struct triangle *triangles;
+    uint num_triangles;
+    global const struct bvh_node *triangle_nodes;
+    uint num_triangle_nodes;
+    global const struct material *materials;
+    global const struct light *lights;
+    uint num_lights;
+};
+
+// the scene kernel parameters, which set_scene_args in scene.c sets
+#define SCENE_PARAMETERS global const struct sphere *spheres, global const float *sphere_components, const uint num_spheres, global const struct bvh_node *sphere_nodes, const uint num_sphere_nodes, global const float *vertices, global const struct triangle *triangles, const uint num_triangles, global const struct bvh_node *triangle_nodes, const uint num_triangle_nodes, global const struct material *materials, global const struct light *lights, const uint num_lights
+#define SCENE_ARGUMENTS {spheres, sphere_components, num_spheres, sphere_nodes, num_sphere_nodes, vertices, triangles, num_triangles, triangle_nodes, num_triangle_nodes, materials, lights, num_lights}
+
+// replaces the counts of the scene with those the program was specialized for, if it was, which the compiler folds
+inline void specialize_scene(struct scene *scene)
+{
+#ifdef SPECIALIZED_NUM_SPHERES
+    scene->num_spheres = SPECIALIZED_NUM_SPHERES;
+    scene->num_sphere_nodes = SPECIALIZED_NUM_SPHERE_NODES;
+    scene->num_triangles = SPECIALIZED_NUM_TRIANGLES;
+    scene->num_triangle_nodes = SPECIALIZED_NUM_TRIANGLE_NODES;
+    scene->num_lights = SPECIALIZED_NUM_LIGHTS;
+#endif
+}
+
+// the shading data of a hit
+struct surface
+{
+    float3 normal;
+    float3 colour;
+    float3 emission;
+};
+
+// tests a ray against SPHERE_LANES spheres at a time, from their components, so that the shading data is only read for the closest hit
+inline void test_spheres(const struct scene *scene, const uint begin, const uint end, const struct ray *r, const int excluded_index, float *min_distance, int *hit_index)
+{
+    uint stride = scene->num_spheres + SPHERE_LANES;
+    global const float *xs = scene->sphere_components;
+    global const float *ys = xs + stride;
+    global const float *zs = ys + stride;
+    global const float *radii2 = zs + stride;
+
+    for (uint i = begin; i < end; i += SPHERE_LANES)
+    {
+        float8 centre_x = vload8(0, xs + i) - r->origin.x;
+        float8 centre_y = vload8(0, ys + i) - r->origin.y;
+        float8 centre_z = vload8(0, zs + i) - r->origin.z;
+
+        // solve the quadratic, where a = 1
+        float8 b = centre_x * r->direction.x + centre_y * r->direction.y + centre_z * r->direction.z;
+        float8 c = centre_x * centre_x + centre_y * centre_y + centre_z * centre_z - vload8(0, radii2 + i);
+
+        float8 disc = b * b - c;
+        float8 disc_root = sqrt(fmax(disc, 0.0f));
+
+        // the near root, unless it is behind the ray, in which case the far root
+        float8 near = b - disc_root;
+        float8 t = select(b + disc_root, near, near > EPSILON);
+
+        // the lanes past the end of the range are the padding, or the spheres of the next leaf
+        int8 index = (int8)(0, 1, 2, 3, 4, 5, 6, 7) + (int) i;
+        int8 hit = disc >= 0.0f && t > EPSILON && t < *min_distance && index < (int) end && index != excluded_index;
+        if (!any(hit))
+            continue;
+
+        // the closest of the lanes, and the first of them if several are as close
+        t = select((float8)(INFINITY), t, hit);
+        float4 t4 = fmin(t.lo, t.hi);
+        float2 t2 = fmin(t4.lo, t4.hi);
+        float closest = fmin(t2.x, t2.y);
+
+        int8 closest_index = select((int8)(INT_MAX), index, t == closest);
+        int4 index4 = min(closest_index.lo, closest_index.hi);
+        int2 index2 = min(index4.lo, index4.hi);
+
+        *min_distance = closest;
+        *hit_index = min(index2.x, index2.y);
+    }
+}
+
+inline bool intersect_aabb(const float3 box_min, const float3 box_max, const struct ray *r, const float3 inverse_direction, const float max_distance)
+{
+    float3 t0 = (box_min - r->origin) * inverse_direction;
+    float3 t1 = (box_max - r->origin) * inverse_direction;
+    float3 near = fmin(t0, t1);
+    float3 far = fmax(t0, t1);
+
+    float t_near = max(max(near.x, near.y), near.z);
+    float t_far = min(min(far.x, far.y), far.z);
+
+    return t_near <= t_far && t_far > 0 && t_near < max_distance;
+}
+
+inline bool intersect_triangle(const float3 v0, const float3 v1, const float3 v2, const struct ray *r, float *t)
+{
+    // Moller-Trumbore, which solves for the distance and barycentric coordinates with Cramer's rule
+    float3 edge1 = v1 - v0;
+    float3 edge2 = v2 - v0;
+
+    float3 p = cross(r->direction, edge2);
+    float determinant = dot(edge1, p);
+
+    // the ray is parallel to the triangle
+    if (determinant == 0.0f)
+        return false;
+
+    float inverse_determinant = 1.0f / determinant;
+
+    float3 s = r->origin - v0;
+    float u = dot(s, p) * inverse_determinant;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    float3 q = cross(s, edge1);
+    float v = dot(r->direction, q) * inverse_determinant;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    *t = dot(edge2, q) * inverse_determinant;
+
+    return *t > EPSILON;
+}
+
+inline void test_primitives(const struct scene *scene, const bool triangles, const uint begin, const uint end, const struct ray *r, const int excluded_index, float *min_distance, int *hit_index)
+{
+    if (!triangles)
+    {
+        test_spheres(scene, begin, end, r, excluded_index, min_distance, hit_index);
+        return;
+    }
+
+    for (uint i = begin; i < end; i++)
+    {
+        // triangles are indexed after the spheres
+        int index = scene->num_spheres + i;
+
+        float hit_distance;
+        struct triangle triangle = scene->triangles[i];
+        bool hit = intersect_triangle(vload3(triangle.v0, scene->vertices), vload3(triangle.v1, scene->vertices), vload3(triangle.v2, scene->vertices), r, &hit_distance);
+
+        if (hit && hit_distance < *min_distance && excluded_index != index)
+        {
+            *min_distance = hit_distance;
+            *hit_index = index;
+        }
+    }
+}
+
+inline void intersect_primitives(const struct scene *scene, const bool triangles, const struct ray *r, const int excluded_index, float *min_distance, int *hit_index)
+{
+    global const struct bvh_node *nodes = triangles ? scene->triangle_nodes : scene->sphere_nodes;
+    uint num_nodes = triangles ? scene->num_triangle_nodes : scene->num_sphere_nodes;
+
+    if (num_nodes == 0)
+    {
+        test_primitives(scene, triangles, 0, triangles ? scene->num_triangles : scene->num_spheres, r, excluded_index, min_distance, hit_index);
+        return;
+    }
+
+    float3 inverse_direction = 1.0f / r->direction;
+
+    // stackless traversal, as both the left child of a hit interior node and the node after a leaf come next
+    uint node_index = 0;
+    while (node_index < num_nodes)
+    {
+        struct bvh_node node = nodes[node_index];
+        if (!intersect_aabb(node.min, node.max, r, inverse_direction, *min_distance))
+        {
+            node_index = node.skip;
+            continue;
+        }
+
+        test_primitives(scene, triangles, node.offset, node.offset + node.count, r, excluded_index, min_distance, hit_index);
+        node_index++;
+    }
+}
+
+inline bool intersect_scene(const struct scene *scene, const struct ray *r, int *hit_index, float *t)
+{
+    float min_distance = INFINITY;
+    // ignore the primitive the ray starts from
+    int excluded_index = *hit_index;
+
+    intersect_primitives(scene, false, r, excluded_index, &min_distance, hit_index);
+    intersect_primitives(scene, true, r, excluded_index, &min_distance, hit_index);
+
+    *t = min_distance;
+
+    return min_distance < INFINITY;
+}
+
+inline struct surface get_surface(const struct scene *scene, const int hit_index, const float3 hit_point)
+{
+    struct surface result;
+
+    if (hit_index < scene->num_spheres)
+    {
+        struct sphere sphere = scene->spheres[hit_index];
+        // a ray from the centre of a sphere, to the point on the surface will have the direction of the normal
+        result.normal = normalize(hit_point - sphere.position);
+        result.colour = sphere.colour;
+        result.emission = sphere.emission;
+    }
+    else
+    {
+        struct triangle triangle = scene->triangles[hit_index - scene->num_spheres];
+        float3 v0 = vload3(triangle.v0, scene->vertices);
+        float3 v1 = vload3(triangle.v1, scene->vertices);
+        float3 v2 = vload3(triangle.v2, scene->vertices);
+        result.normal = normalize(cross(v1 - v0, v2 - v0));
+
+        struct material material = scene->materials[triangle.material];
+        result.colour = material.colour;
+        result.emission = material.emission;
+    }
+
+    return result;
+}
+
+// samples a cosine-weighted direction in the hemisphere about the oriented normal
+inline float3 sample_hemisphere(const float3 oriented_normal, struct sampler *sampler)
+{
+    // create axes about the normal
+    float3 w = oriented_normal;
+    // use the smallest component as the axis
+    float3 axis = fabs(w.x) < fabs(w.y) && fabs(w.x) < fabs(w.z) ? (float3){1.0, 0, 0} : fabs(w.y) < fabs(w.z) ? (float3){0, 1.0, 0} : (float3){0, 0, 1.0};
+    float3 u = normalize(cross(axis, w));
+    float3 v = cross(w, u);
+
+    // cosine hemisphere sampling
+    float2 random = sample_2d(sampler);
+    float random_angle =  2 * M_PI_F * random.x;
+    float random_number = random.y;
+    float random_distance = sqrt(random_number);
+    return normalize(u * cos(random_angle) * random_distance + v * sin(random_angle) * random_distance + w * sqrt(1 - random_number));
+}
+
+// picks an emitting sphere from the light alias table, traces a shadow ray towards it, and returns the direct light
+// reflected by a diffuse surface, divided by the probability of the pick
+inline float3 sample_lights(const struct scene *scene, const float3 bounce_start, const float3 oriented_normal, const float3 colour, const int hit_index, struct sampler *sampler, uint *num_rays)
+{
+    // this snippet of code is translated from smallpt for now
+    // smallpt is by Kevin Beason, released under the MIT licence
+    // TODO make this code more clear
+    
+    /* LICENSE
+     *
+     * Copyright (c) 2006-2008 Kevin Beason (kevin.beason@gmail.com)
+     *
+     * Permission is hereby granted, free of charge, to any person obtaining
+     * a copy of this software and associated documentation files (the
+     * "Software"), to deal in the Software without restriction, including
+     * without limitation the rights to use, copy, modify, merge, publish,
+     * distribute, sublicense, and/or sell copies of the Software, and to
+     * permit persons to whom the Software is furnished to do so, subject to
+     * the following conditions:
+     * 
+     * The above copyright notice and this permission notice shall be included
+     * in all copies or substantial portions of the Software.
+     *
+     * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+     * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+     * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+     * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+     * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+     * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+     * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+     */
+    float3 e = (float3){0, 0, 0};
+    if (scene->num_lights == 0)
+        return e;
+
+    // pick an entry uniformly, then its own sphere or its alias by the fraction left over
+    float pick = sample_1d(sampler) * scene->num_lights;
+    uint entry = min((uint) pick, scene->num_lights - 1);
+    struct light light = scene->lights[entry];
+    if (pick - entry >= light.threshold)
+        light = scene->lights[light.alias];
+
+    uint j = light.sphere;
+    struct sphere sphere = scene->spheres[j];
+    float3 light_w = sphere.position - bounce_start;
+    float3 light_axis = fabs(light_w.x) < fabs(light_w.y) && fabs(light_w.x) < fabs(light_w.z) ? (float3){1.0, 0, 0} : fabs(light_w.y) < fabs(light_w.z) ? (float3){0, 1.0, 0} : (float3){0, 0, 1.0};
+    float3 light_u = normalize(cross(light_axis, light_w));
+    float3 light_v = cross(light_w, light_u);
+    float cos_a_max = sqrt(1 -  sphere.radius * sphere.radius / dot(bounce_start - sphere.position, bounce_start - sphere.position));
+    float2 eps = sample_2d(sampler);
+    float eps1 = eps.x;
+    float eps2 = eps.y;
+    float cos_a = 1 - eps1 + eps1 * cos_a_max;
+    float sin_a = sqrt(1 - cos_a * cos_a);
+    float phi = 2 * M_PI_F * eps2;
+    float3 l = normalize(light_u * cos(phi) * sin_a + light_v * sin(phi) * sin_a + light_w * cos_a);
+    int hit_light = -1;
+    float t_light;
+    (*num_rays)++;
+    if (intersect_scene(scene, &(struct ray){bounce_start, l}, &hit_light, &t_light)) {
+        if (hit_light == (int) j && hit_light != hit_index) {
+            float omega = 2 * M_PI_F * (1 - cos_a_max);
+            e += colour * (sphere.emission * dot(l, oriented_normal) * omega) * M_1_PI_F / light.probability;
+        }
+    }
+    /*
+     * End of material from smallpt
+     */
+
+    return e;
+}
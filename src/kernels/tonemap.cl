@@ -0,0 +1,34 @@
+// matches enum tonemap_curve in tonemap.h
+#define TONEMAP_CLAMP 0
+#define TONEMAP_REINHARD 1
+#define TONEMAP_ACES 2
+
+inline float3 apply_curve(const float3 x, const int curve)
+{
+    if (curve == TONEMAP_REINHARD)
+        return x / (1 + x);
+
+    // Narkowicz's fit of the ACES filmic curve
+    float3 y = curve == TONEMAP_ACES ? x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f) : x;
+    return fmin(y, 1.0f);
+}
+
+inline float3 encode_srgb(const float3 x)
+{
+    return select(1.055f * pow(x, 1 / 2.4f) - 0.055f, 12.92f * x, x <= 0.0031308f);
+}
+
+// the display transform of tonemap.h, which scales the mean of each pixel by the exposure, and packs it as 8-bit sRGB
+kernel void tonemap(global const float4 *input, global uchar4 *output, const uint num_pixels, const int curve, const float exposure_scale)
+{
+    size_t i = get_global_id(0);
+    if (i >= num_pixels)
+        return;
+
+    float4 pixel = input[i];
+    float3 colour = pixel.w > 0 ? pixel.xyz * (exposure_scale / pixel.w) : (float3)(0, 0, 0);
+
+    // negative and NaN channels become zero
+    colour = encode_srgb(apply_curve(fmax(colour, 0.0f), curve));
+    output[i] = convert_uchar4_sat_rte((float4)(colour * 255, 255));
+}
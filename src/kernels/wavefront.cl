@@ -0,0 +1,148 @@
+#define MAX_BOUNCES 16
+// the bounce after which paths are terminated with Russian roulette
+#define ROULETTE_BOUNCE 5
+
+// indices into the queue counters
+#define HIT_COUNT 0
+#define SHADOW_COUNT 1
+#define EXTEND_COUNT 2
+#define SHADOW_RAY_COUNT 3
+
+// the state of a path between stages, which matches struct path in wavefront.h
+struct path
+{
+    struct ray ray;
+    float3 mask;
+    float3 colour;
+    // the shading point and weight of the last hit, from which the connect stage samples the lights
+    float3 shadow_origin;
+    float3 shadow_normal;
+    float3 shadow_weight;
+    struct sampler sampler;
+    float t;
+    int hit_index;
+    uint bounce;
+    float light_weight;
+};
+
+kernel void generate(global struct path *paths, global uint *ray_queue, const float4 camera_quat, const float z_distance, const float3 camera_position, const uint height, const uint width, const uint sample_index)
+{
+    size_t i = get_global_id(0);
+    if (i >= width * height)
+        return;
+
+    struct path path;
+
+    path.sampler = create_sampler(i, sample_index);
+
+    // jitter the sample within the pixel, for anti-aliasing
+    float2 jitter = sample_2d(&path.sampler);
+    path.ray.origin = camera_position;
+    path.ray.direction = get_camera_direction(camera_quat, z_distance, i % width + jitter.x, i / width + jitter.y, height, width);
+    path.mask = (float3){1.0, 1.0, 1.0};
+    path.colour = (float3){0, 0, 0};
+    path.hit_index = -1;
+    path.bounce = 0;
+    path.light_weight = 1;
+
+    paths[i] = path;
+    ray_queue[i] = i;
+}
+
+kernel void extend(global struct path *paths, global const uint *ray_queue, const uint num_rays, global uint *hit_queue, volatile global uint *counters, SCENE_PARAMETERS)
+{
+    size_t q = get_global_id(0);
+    if (q >= num_rays)
+        return;
+
+    struct scene scene = SCENE_ARGUMENTS;
+
+    uint p = ray_queue[q];
+    struct ray ray = paths[p].ray;
+    int hit_index = paths[p].hit_index;
+
+    float t;
+    if (!intersect_scene(&scene, &ray, &hit_index, &t))
+        return;
+
+    paths[p].t = t;
+    paths[p].hit_index = hit_index;
+    hit_queue[atomic_inc(&counters[HIT_COUNT])] = p;
+}
+
+kernel void shade(global struct path *paths, global const uint *hit_queue, global uint *shadow_queue, global uint *next_ray_queue, volatile global uint *counters, SCENE_PARAMETERS)
+{
+    size_t q = get_global_id(0);
+    if (q >= counters[HIT_COUNT])
+        return;
+
+    struct scene scene = SCENE_ARGUMENTS;
+
+    uint p = hit_queue[q];
+    struct path path = paths[p];
+
+    float3 hit_point = path.ray.origin + path.ray.direction * path.t;
+    struct surface surface = get_surface(&scene, path.hit_index, hit_point);
+
+    path.colour += path.mask * surface.emission * path.light_weight;
+
+    float probability = max(path.mask.x, max(path.mask.y, path.mask.z));
+    if (path.bounce > ROULETTE_BOUNCE) {
+        if (sample_1d(&path.sampler) > probability) {
+            paths[p] = path;
+            return;
+        } else {
+            path.mask /= probability;
+        }
+    }
+
+    // normal flipping technique
+    float3 oriented_normal = dot(surface.normal, path.ray.direction) < 0.0f ? surface.normal : surface.normal * -1.0f;
+
+    float3 bounce_direction = sample_hemisphere(oriented_normal, &path.sampler);
+    float3 bounce_start = hit_point + oriented_normal * EPSILON;
+
+    path.shadow_origin = bounce_start;
+    path.shadow_normal = oriented_normal;
+    path.shadow_weight = path.mask * surface.colour;
+    shadow_queue[atomic_inc(&counters[SHADOW_COUNT])] = p;
+
+    path.ray.origin = bounce_start;
+    path.ray.direction = bounce_direction;
+    path.mask *= surface.colour;
+    path.light_weight = 0;
+
+    if (++path.bounce < MAX_BOUNCES)
+        next_ray_queue[atomic_inc(&counters[EXTEND_COUNT])] = p;
+
+    paths[p] = path;
+}
+
+kernel void connect(global struct path *paths, global const uint *shadow_queue, volatile global uint *counters, SCENE_PARAMETERS)
+{
+    size_t q = get_global_id(0);
+    if (q >= counters[SHADOW_COUNT])
+        return;
+
+    struct scene scene = SCENE_ARGUMENTS;
+
+    uint p = shadow_queue[q];
+    struct path path = paths[p];
+
+    uint num_rays = 0;
+    // the shadow weight includes the mask, so the direct light adds to the path colour as is
+    paths[p].colour = path.colour + sample_lights(&scene, path.shadow_origin, path.shadow_normal, path.shadow_weight, path.hit_index, &path.sampler, &num_rays);
+    paths[p].sampler = path.sampler;
+
+    atomic_add(&counters[SHADOW_RAY_COUNT], num_rays);
+}
+
+kernel void accumulate(global float4 *accumulator, global const struct path *paths, const uint num_paths)
+{
+    size_t i = get_global_id(0);
+    if (i >= num_paths)
+        return;
+
+    // the accumulator holds the running sum of samples, with the sample count in w
+    accumulator[i] += (float4)(paths[i].colour, 1.0f);
+}
@@ -1,291 +1,1390 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "gpulib.h"
 #include "geometry.h"
+#include "checkpoint.h"
+#include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "scene-file.h"
+#include "session.h"
+#include "multi.h"
+#include "cpu.h"
+#include "denoise.h"
+#include "profile.h"
+#include "output.h"
+#include "tonemap.h"
+#include "preview.h"
+#include "partial.h"
 
-#define WIDTH 2560 
-#define HEIGHT 1440
+#define DEFAULT_WIDTH 2560
+#define DEFAULT_HEIGHT 1440
 #define NUM_SAMPLES 32
+// the default number of samples per kernel launch, which keeps each launch short enough for driver watchdogs
+#define CHUNK_SAMPLES 4
 
 static cl_device_id device;
 
 static cl_context context;
 static cl_command_queue command_queue;
+// every usable device, which are opened instead of asking for one
+static struct device_queue *devices = NULL;
+static cl_uint num_devices = 0;
 
-// vertical field of view in radians
-static cl_float fov = 1.25f;
-// world coordinates
-static cl_float3 camera_position = {160, 50, 52};
-// Euler camera rotation to point forward with origin at the top left
+// the camera points forward with origin at the top left, with a pitch yaw roll Euler rotation
 // TODO check YXZ XZY orders
-// pitch yaw roll
-static cl_float3 camera_rotation = {CL_M_PI_2, -CL_M_PI_2, 0};
+static struct camera camera = {{160, 50, 52}, {CL_M_PI_2, -CL_M_PI_2, 0}, 1.25f};
 
-struct sphere
+// the image size, which may be too large to render at once, unless it is split into tiles of at most tile_size
+static cl_uint image_width = DEFAULT_WIDTH;
+static cl_uint image_height = DEFAULT_HEIGHT;
+// the size of the tiles which the image is rendered in, one at a time, each streamed into the image file when it is
+// finished, or zero to render the whole image at once
+static cl_uint tile_size = 0;
+// samples per kernel launch
+static cl_uint chunk_samples = CHUNK_SAMPLES;
+// the number of samples of each pixel, which adaptive sampling stops short of once a pixel has converged
+static cl_uint max_samples = NUM_SAMPLES;
+// the relative error at which pixels stop taking samples, or zero to render every sample of every pixel
+static cl_float error_threshold = 0;
+// whether the final image is denoised, guided by the first-hit albedo, normal and depth, which checkpoints are not
+static int use_denoiser = 0;
+// the accumulator checkpoint, which is written every checkpoint_interval chunks and resumed from if it exists
+static const char *checkpoint_path = NULL;
+static cl_uint checkpoint_interval = 1;
+// an image written after every chunk, to observe a render while it progresses
+static const char *intermediate_path = NULL;
+
+enum bvh_mode
 {
-    cl_float3 position;
-    cl_float3 colour;
-    cl_float3 emission;
-    cl_float radius;
-} __attribute__((packed));
+    BVH_AUTO,
+    BVH_ON,
+    BVH_OFF,
+};
+
+// a scene file written by firefly-scene, which replaces the built-in scene, and is mapped while rendering
+static const char *scene_path = NULL;
+static struct scene_file scene_file;
+// whether intersections traverse a bvh, or test every sphere
+static enum bvh_mode bvh_mode = BVH_AUTO;
+// random spheres added to the scene, to stress scenes with many primitives
+static size_t num_random_spheres = 0;
+// an OBJ mesh added to the scene, which is scaled, then translated into place
+static const char *mesh_path = NULL;
+static cl_float mesh_scale = 1;
+static cl_float3 mesh_offset = {0, 0, 0};
+static struct material mesh_material = {{0.75f, 0.75f, 0.75f}, {0, 0, 0}};
+// whether to render with the wavefront stages, rather than the render megakernel
+static int use_wavefront = 0;
+// whether to build the render kernel with the image size and scene counts as constants
+static int use_specialized = 0;
+// whether to render with persistent work items, which take pixels from a queue, rather than one work item per pixel
+static int use_persistent = 0;
+// whether to split the tiles of each chunk between every usable device
+static int use_all_devices = 0;
+// whether to render on the CPU backend, which is also used when no OpenCL device is available
+static int use_cpu = 0;
+// the number of CPU backend threads, which defaults to the number of processors
+static cl_uint num_threads = 0;
+// the final image, which is written as binary PPM unless a format is chosen or the extension is .pfm
+static const char *output_path = "result.ppm";
+// the partial render of the samples from first_sample to --samples, which is written instead of the image, so that
+// firefly-merge can add it to the partial renders of the other samples
+static const char *partial_path = NULL;
+static cl_uint first_sample = 0;
+static struct partial_render partial = {0, 0, 0, 0, NULL};
+// the framebuffer of the preview, which renders until standard input closes, rather than rendering one image
+static const char *preview_path = NULL;
+// the Chrome trace of the profile, which also enables profiling, and prints a summary
+static const char *profile_path = NULL;
+static struct profile profile;
+static enum image_format image_format = IMAGE_PPM;
+static int has_image_format = 0;
+// the curve and exposure with which 8-bit images are displayed
+static struct tonemap tonemap = {TONEMAP_CLAMP, 0};
 
-const static inline unsigned int convert_pixel(float pixel)
+// the format of an image, which is the chosen format or else that of its extension
+static inline enum image_format get_output_format(const char *path)
 {
-    return (unsigned int)(255 * pixel);
+    return has_image_format ? image_format : get_image_format(path);
 }
 
-cl_int generate_directions(cl_mem *directions_buf)
+/**
+ * @brief Writes the mean of the accumulated samples as an image, where 8-bit images are tonemapped for display.
+ * 
+ * @param path the image path.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @return cl_int the return code.
+ */
+static cl_int save_image(const char *path, const cl_float4 *accumulator)
 {
     cl_int ret;
 
-    cl_program program;
-    cl_kernel kernel;
+    cl_ulong start = get_profile_time();
+    enum image_format format = get_output_format(path);
+    if (format == IMAGE_PPM)
+    {
+        cl_uchar4 *display = malloc((size_t) image_width * image_height * sizeof(cl_uchar4));
+        if (display == NULL)
+            return CL_OUT_OF_HOST_MEMORY;
 
-    size_t local[] = {1};
-    size_t global[] = {WIDTH * HEIGHT};
+        tonemap_image(accumulator, (size_t) image_width * image_height, &tonemap, display);
+        ret = write_display_image(path, display, image_width, image_height);
+        free(display);
+    }
+    else
+    {
+        ret = write_image(path, accumulator, image_width, image_height, format);
+    }
 
-    cl_uint width = WIDTH;
-    cl_uint height = HEIGHT;
+    if (profile_path != NULL)
+        add_profile_span(&profile, "encode image", start, get_profile_time());
 
-    cl_float z_distance = -(height / (2.0f * tan(fov / 2.0f)));
-    cl_float4 camera_quat = euler_to_quat(camera_rotation, "xyz");
+    return ret;
+}
 
-    size_t source_size;
-    char *kernel_source;
-    read_cl_source("kernels/camera-directions.cl", &kernel_source, &source_size);
+/**
+ * @brief Writes an image which was tonemapped on the device.
+ *
+ * @param path the image path, which must be an 8-bit image.
+ * @param display the 8-bit pixels.
+ * @return cl_int the return code.
+ */
+static cl_int save_display_image(const char *path, const cl_uchar4 *display)
+{
+    cl_ulong start = get_profile_time();
+    cl_int ret = write_display_image(path, display, image_width, image_height);
+    if (profile_path != NULL)
+        add_profile_span(&profile, "encode image", start, get_profile_time());
 
-    program = clCreateProgramWithSource(context, 1, (const char **)&kernel_source, &source_size, &ret);
-    free(kernel_source);
-    if (ret != CL_SUCCESS)
-        goto cleanup_buf;
+    return ret;
+}
 
-    ret = build_cl_program(program, device);
-    if (ret != CL_SUCCESS)
-        goto cleanup_program;
+// the profile, if profiling
+static inline struct profile *get_profile(void)
+{
+    return profile_path != NULL ? &profile : NULL;
+}
+
+// whether a chunk is followed by a checkpoint, which is also written after the last chunk, or once every pixel has converged
+static inline int is_checkpoint_chunk(const cl_uint num_chunks, const cl_uint sample_offset, const cl_uint num_samples, const int is_converged)
+{
+    return checkpoint_path != NULL && (num_chunks % checkpoint_interval == 0 || sample_offset == num_samples || is_converged);
+}
+
+static void print_chunk(const cl_uint sample_offset, const cl_uint num_samples, const cl_uint num_active_pixels)
+{
+    if (error_threshold > 0)
+        printf("Rendered %u/%u samples, on %u pixels.\n", sample_offset, num_samples, num_active_pixels);
+    else
+        printf("Rendered %u/%u samples.\n", sample_offset, num_samples);
+}
+
+/**
+ * @brief Writes the checkpoint and intermediate image of a chunk, which are reported rather than stopping the render.
+ * 
+ * @param image the accumulator.
+ * @param is_checkpoint whether to write a checkpoint.
+ * @param sample_offset the number of samples rendered.
+ */
+static void write_progress(const cl_float4 *image, const int is_checkpoint, const cl_uint sample_offset)
+{
+    cl_ulong start = get_profile_time();
+    if (is_checkpoint && write_checkpoint(checkpoint_path, image, image_width, image_height, sample_offset) != CL_SUCCESS)
+        fprintf(stderr, "Failed to write checkpoint '%s'.\n", checkpoint_path);
+
+    if (is_checkpoint && profile_path != NULL)
+        add_profile_span(&profile, "write checkpoint", start, get_profile_time());
 
-    kernel = clCreateKernel(program, "get_directions", &ret);
+    if (intermediate_path != NULL && save_image(intermediate_path, image) != CL_SUCCESS)
+        fprintf(stderr, "Failed to write intermediate image '%s'.\n", intermediate_path);
+}
+
+// the progress of a chunk, which a worker thread writes from a snapshot while the device renders the next chunk
+struct progress_job
+{
+    struct session_snapshot snapshot;
+    int is_checkpoint;
+    cl_uint sample_offset;
+    cl_int ret;
+};
+
+static void *write_snapshot_progress(void *arg)
+{
+    struct progress_job *job = arg;
+
+    job->ret = clWaitForEvents(1, &job->snapshot.event);
+    if (job->ret == CL_SUCCESS)
+        write_progress(job->snapshot.accumulator, job->is_checkpoint, job->sample_offset);
+
+    return NULL;
+}
+
+/**
+ * @brief Waits for the progress of a chunk to be written, and releases its snapshot.
+ *
+ * @param session the session.
+ * @param thread the worker thread.
+ * @param job the progress.
+ * @return cl_int the return code.
+ */
+static cl_int finish_progress(struct session *session, const pthread_t thread, struct progress_job *job)
+{
+    pthread_join(thread, NULL);
+
+    cl_int ret = release_session_snapshot(session, &job->snapshot);
+    return job->ret != CL_SUCCESS ? job->ret : ret;
+}
+
+/**
+ * @brief Creates a session on the device, with the camera and scene.
+ *
+ * @param width the session width, which is that of the image, or of its tiles.
+ * @param height the session height.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param bvh the sphere bvh.
+ * @param mesh the mesh.
+ * @param mesh_bvh the mesh bvh.
+ * @param session a pointer to the session, which must be released with release_session.
+ * @return cl_int the return code.
+ */
+static cl_int open_session(const cl_uint width, const cl_uint height, const struct sphere *spheres, const size_t num_spheres, const struct bvh *bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, struct session *session)
+{
+    cl_int ret;
+
+    ret = create_session(context, device, command_queue, width, height, use_wavefront, session);
     if (ret != CL_SUCCESS)
-        goto cleanup_program;
+        return ret;
 
-    *directions_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, HEIGHT * WIDTH * sizeof(cl_float3), NULL, &ret);
+    ret = set_session_profile(session, get_profile());
     if (ret != CL_SUCCESS)
-        goto cleanup_kernel;
+        goto cleanup;
 
-    ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), directions_buf);
-    ret |= clSetKernelArg(kernel, 1, sizeof(cl_float4), &camera_quat);
-    ret |= clSetKernelArg(kernel, 2, sizeof(cl_float), &z_distance);
-    ret |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &height);
-    ret |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &width);
+    ret = set_session_camera(session, &camera);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
+        goto cleanup;
 
-    // ret = clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &local, NULL);
-    // if (ret != CL_SUCCESS)
-    //     goto cleanup_buf;
+    if (scene_file.data != NULL)
+        ret = set_session_scene_file(session, &scene_file);
+    else
+        ret = set_session_scene(session, spheres, num_spheres, bvh, mesh, mesh_bvh, &mesh_material, 1);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
 
-    ret = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, global, local, 0, NULL, NULL);
+    // the kernel is specialized once the scene is set, so that it is only built for the scene which is rendered
+    ret = set_session_specialized(session, use_specialized);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
+        goto cleanup;
+
+    ret = set_session_persistent(session, use_persistent);
 
-    ret = clFinish(command_queue);
+cleanup:
     if (ret != CL_SUCCESS)
-    cleanup_buf:
-        clReleaseMemObject(*directions_buf);
+        release_session(session);
 
-cleanup_kernel:
-    clReleaseKernel(kernel);
-cleanup_program:
-    clReleaseProgram(program);
-out:
     return ret;
 }
 
-cl_int render(cl_float3 **image, cl_mem *directions_buf)
+/**
+ * @brief Renders the remaining samples with an OpenCL session, in chunks.
+ * 
+ * @param image the accumulator, which holds the samples already rendered.
+ * @param display the 8-bit pixels, which are tonemapped on the device rather than reading the accumulator, or NULL.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param bvh the sphere bvh.
+ * @param mesh the mesh.
+ * @param mesh_bvh the mesh bvh.
+ * @param sample_offset the number of samples already rendered.
+ * @param num_samples the total number of samples.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @return cl_int the return code.
+ */
+static cl_int render_cl(cl_float4 *image, cl_uchar4 *display, const struct sphere *spheres, const size_t num_spheres, const struct bvh *bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, cl_uint sample_offset, const cl_uint num_samples, cl_ulong *num_rays)
 {
     cl_int ret;
 
-    cl_program program;
-    cl_kernel kernel;
-
-    size_t local_size;
-    size_t global[] = {WIDTH, HEIGHT};
-
-    cl_uint width = WIDTH;
-    cl_uint height = HEIGHT;
-    cl_uint num_samples = NUM_SAMPLES;
-
-    // scene courtesy of smallpt
-    struct sphere s1;
-    s1.position = (cl_float3){81.6f, 1e4f + 1, 40.8f};
-    s1.colour = (cl_float3){0.75f, 0.25f, 0.25f};
-    s1.emission = (cl_float3){0, 0, 0};
-    s1.radius = 1e4f;
-
-    struct sphere s2;
-    s2.position = (cl_float3){81.6f, -1e4f + 99, 40.8f};
-    s2.colour = (cl_float3){0.25f, 0.25f, 0.75f};
-    s2.emission = (cl_float3){0, 0, 0};
-    s2.radius = 1e4f;
-
-    struct sphere s3;
-    s3.position = (cl_float3){1e4f, 50, 40.8f};
-    s3.colour = (cl_float3){0.75f, 0.75f, 0.75f};
-    s3.emission = (cl_float3){0, 0, 0};
-    s3.radius = 1e4f;
-
-    struct sphere s4;
-    s4.position = (cl_float3){-1e4 + 170, 50, 40.8f};
-    s4.colour = (cl_float3){0, 0, 0};
-    s4.emission = (cl_float3){0, 0, 0};
-    s4.radius = 1e4f;
-
-    struct sphere s5;
-    s5.position = (cl_float3){81.6f, 50, 1e4f};
-    s5.colour = (cl_float3){0.75f, 0.75f, 0.75f};
-    s5.emission = (cl_float3){0, 0, 0};
-    s5.radius = 1e4f;
-
-    struct sphere s6;
-    s6.position = (cl_float3){81.6f, 50, -1e4 + 81.6f};
-    s6.colour = (cl_float3){0.75f, 0.75f, 0.75f};
-    s6.emission = (cl_float3){0, 0, 0};
-    s6.radius = 1e4f;
-
-    struct sphere s7;
-    s7.position = (cl_float3){47, 27, 16.5f};
-    s7.colour = (cl_float3){1, 1, 1};
-    s7.emission = (cl_float3){0, 0, 0};
-    s7.radius = 16.5f;
-
-    struct sphere s8;
-    s8.position = (cl_float3){78, 73, 16.5f};
-    s8.colour = (cl_float3){1, 1, 1};
-    s8.emission = (cl_float3){0, 0, 0};
-    s8.radius = 16.5f;
-
-    struct sphere s9;
-    s9.position = (cl_float3){81.6f, 50, 55};
-    s9.colour = (cl_float3){0, 0, 0};
-    s9.emission = (cl_float3){14, 14, 14};
-    s9.radius = 6.5f;
-
-    struct sphere scene_spheres[] = {s1, s2, s3, s4, s5, s6, s7, s8, s9};
-    size_t num_spheres = sizeof(scene_spheres) / sizeof(struct sphere);
-
-    *image = calloc(HEIGHT * WIDTH, sizeof(cl_float3));
-
-    size_t source_size;
-    char *kernel_source;
-    read_cl_source("kernels/path-trace.cl", &kernel_source, &source_size);
-
-    program = clCreateProgramWithSource(context, 1, (const char **)&kernel_source, &source_size, &ret);
-    free(kernel_source);
-    if (ret != CL_SUCCESS)
-        goto cleanup_program;
+    // the progress of each chunk is copied into pinned memory behind its launches, and written by a worker thread
+    // while the device renders the next chunk, so that neither the transfer nor the encoding stalls the device
+    pthread_t progress_thread;
+    struct progress_job progress;
+    int is_writing = 0;
 
-    ret = build_cl_program(program, device);
+    struct session session;
+    ret = open_session(image_width, image_height, spheres, num_spheres, bvh, mesh, mesh_bvh, &session);
     if (ret != CL_SUCCESS)
-        goto cleanup_program;
+        goto out;
 
-    kernel = clCreateKernel(program, "render", &ret);
+    ret = set_session_error_threshold(&session, error_threshold);
     if (ret != CL_SUCCESS)
-        goto cleanup_program;
+        goto cleanup;
 
-    cl_mem image_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, HEIGHT * WIDTH * sizeof(cl_float3), NULL, &ret);
-    if (ret != CL_SUCCESS)
-        goto cleanup_kernel;
-    
-    cl_mem scene_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, num_spheres * sizeof(struct sphere), NULL, &ret);
+    ret = set_session_denoiser(&session, use_denoiser);
     if (ret != CL_SUCCESS)
-        goto cleanup_image;
-    
-    // ensure no undefined behaviour by copying the zeroed values
-    ret = clEnqueueWriteBuffer(command_queue, image_buf, CL_TRUE, 0, HEIGHT * WIDTH * sizeof(cl_float3), *image, 0, NULL, NULL);
+        goto cleanup;
+
+    ret = set_session_exact_sums(&session, partial.sums != NULL);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
+        goto cleanup;
+
+    if (sample_offset > 0)
+    {
+        ret = write_session_accumulator(&session, image, sample_offset);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+    }
+
+    // render the samples in chunks, so that no single launch runs for too long, and progress can be saved
+    int is_converged = 0;
+    for (cl_uint num_chunks = 1; sample_offset < num_samples && !is_converged; num_chunks++)
+    {
+        cl_uint samples = num_samples - sample_offset < chunk_samples ? num_samples - sample_offset : chunk_samples;
+
+        ret = render_session_samples(&session, samples, num_rays);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+
+        sample_offset += samples;
+        print_chunk(sample_offset, num_samples, session.num_active_pixels);
+
+        // the remaining samples are not taken once no pixel is left to take them
+        is_converged = session.num_active_pixels == 0;
+        int is_checkpoint = is_checkpoint_chunk(num_chunks, sample_offset, num_samples, is_converged);
+        if (!is_checkpoint && intermediate_path == NULL)
+            continue;
+
+        // the snapshot takes the other pinned buffer, so it is queued before the last progress is finished
+        struct session_snapshot snapshot;
+        ret = enqueue_session_snapshot(&session, &snapshot);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+
+        if (is_writing)
+        {
+            is_writing = 0;
+            ret = finish_progress(&session, progress_thread, &progress);
+            if (ret != CL_SUCCESS)
+            {
+                release_session_snapshot(&session, &snapshot);
+                goto cleanup;
+            }
+        }
+
+        progress = (struct progress_job){snapshot, is_checkpoint, sample_offset, CL_SUCCESS};
+        is_writing = pthread_create(&progress_thread, NULL, write_snapshot_progress, &progress) == 0;
+        if (is_writing)
+            continue;
+
+        // the progress is written on this thread if the worker could not start
+        write_snapshot_progress(&progress);
+        ret = release_session_snapshot(&session, &progress.snapshot);
+        ret = progress.ret != CL_SUCCESS ? progress.ret : ret;
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+    }
+
+    if (display != NULL)
+    {
+        ret = read_session_display(&session, &tonemap, display);
+
+        // the sample counts of adaptive sampling are only in the accumulator
+        if (ret == CL_SUCCESS && error_threshold > 0)
+            ret = read_session_accumulator(&session, image);
+    }
+    else if (use_denoiser)
+    {
+        ret = read_session_denoised(&session, image);
+    }
+    else
+    {
+        ret = read_session_accumulator(&session, image);
+    }
+
+    if (ret == CL_SUCCESS && partial.sums != NULL)
+        ret = read_session_exact_sums(&session, partial.sums);
+
+cleanup:
+    if (is_writing)
+    {
+        cl_int progress_ret = finish_progress(&session, progress_thread, &progress);
+        ret = ret != CL_SUCCESS ? ret : progress_ret;
+    }
+
+    release_session(&session);
+out:
+    return ret;
+}
+
+/**
+ * @brief Renders the image one tile at a time with an OpenCL session of the tile size, and streams each finished tile
+ * into the image file at its offset.
+ *
+ * Neither the device nor the host holds more than a tile, so the resolution is only bounded by the image file. Each
+ * tile takes every sample before the next starts, and its pixels draw the samples of their place in the image, so the
+ * image is the one rendered at once.
+ *
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param bvh the sphere bvh.
+ * @param mesh the mesh.
+ * @param mesh_bvh the mesh bvh.
+ * @param num_samples the number of samples of each pixel.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @return cl_int the return code.
+ */
+static cl_int render_tiled(const struct sphere *spheres, const size_t num_spheres, const struct bvh *bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const cl_uint num_samples, cl_ulong *num_rays)
+{
+    cl_int ret;
+
+    cl_uint session_width = tile_size < image_width ? tile_size : image_width;
+    cl_uint session_height = tile_size < image_height ? tile_size : image_height;
+    cl_uint num_tiles_x = (image_width + session_width - 1) / session_width;
+    cl_uint num_tiles = num_tiles_x * ((image_height + session_height - 1) / session_height);
 
-    ret = clEnqueueWriteBuffer(command_queue, scene_buf, CL_TRUE, 0, num_spheres * sizeof(struct sphere), scene_spheres, 0, NULL, NULL);
+    // an 8-bit image is tonemapped on the device, as when it is rendered at once
+    enum image_format format = get_output_format(output_path);
+    size_t num_pixels = (size_t) session_width * session_height;
+    cl_float4 *accumulator = NULL;
+    cl_uchar4 *display = NULL;
+    if (format == IMAGE_PPM)
+        display = malloc(num_pixels * sizeof(cl_uchar4));
+    else
+        accumulator = malloc(num_pixels * sizeof(cl_float4));
+    if (display == NULL && accumulator == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    struct image_stream stream;
+    ret = create_image_stream(output_path, image_width, image_height, format, &stream);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
-
-    ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), &image_buf);
-    ret |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &scene_buf);
-    ret |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &num_spheres);
-    ret |= clSetKernelArg(kernel, 3, sizeof(cl_mem), directions_buf);
-    ret |= clSetKernelArg(kernel, 4, sizeof(cl_float3), &camera_position);
-    ret |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &height);
-    ret |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &width);
-    ret |= clSetKernelArg(kernel, 7, sizeof(cl_uint), &num_samples);
+    {
+        fprintf(stderr, "Failed to create image '%s'.\n", output_path);
+        goto cleanup_buffers;
+    }
+
+    struct session session;
+    ret = open_session(session_width, session_height, spheres, num_spheres, bvh, mesh, mesh_bvh, &session);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
+        goto cleanup_stream;
 
-    ret = clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &local_size, NULL);
+    ret = set_session_error_threshold(&session, error_threshold);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
+        goto cleanup;
+
+    printf("Rendering %u tiles of %ux%u.\n", num_tiles, session_width, session_height);
+
+    for (cl_uint tile = 0; tile < num_tiles; tile++)
+    {
+        // the tiles at the right and bottom of the image are cut short
+        cl_uint x = tile % num_tiles_x * session_width;
+        cl_uint y = tile / num_tiles_x * session_height;
+        cl_uint width = image_width - x < session_width ? image_width - x : session_width;
+        cl_uint height = image_height - y < session_height ? image_height - y : session_height;
+
+        ret = set_session_frame(&session, image_width, image_height, x, y);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
 
-    local_size = (size_t) sqrt(local_size);
-    size_t local[] = {local_size, local_size};
+        for (cl_uint sample_offset = 0; sample_offset < num_samples;)
+        {
+            cl_uint samples = num_samples - sample_offset < chunk_samples ? num_samples - sample_offset : chunk_samples;
+            ret = render_session_tile(&session, 0, 0, width, height, sample_offset, samples, num_rays);
+            if (ret != CL_SUCCESS)
+                goto cleanup;
 
-    ret = clEnqueueNDRangeKernel(command_queue, kernel, 2, NULL, global, local, 0, NULL, NULL);
+            sample_offset += samples;
+
+            // the remaining samples are not taken once every pixel of the tile has converged
+            if (session.num_active_pixels == 0)
+                break;
+        }
+
+        cl_ulong start = get_profile_time();
+        if (display != NULL)
+        {
+            ret = read_session_display(&session, &tonemap, display);
+            if (ret == CL_SUCCESS)
+                ret = write_display_tile(&stream, display, session_width, x, y, width, height);
+        }
+        else
+        {
+            ret = read_session_accumulator(&session, accumulator);
+            if (ret == CL_SUCCESS)
+                ret = write_image_tile(&stream, accumulator, session_width, x, y, width, height);
+        }
+
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to write tile %u of image '%s'.\n", tile, output_path);
+            goto cleanup;
+        }
+
+        if (profile_path != NULL)
+            add_profile_span(&profile, "encode tile", start, get_profile_time());
+
+        printf("Rendered tile %u/%u.\n", tile + 1, num_tiles);
+    }
+
+cleanup:
+    release_session(&session);
+cleanup_stream:
+    if (close_image_stream(&stream) != CL_SUCCESS && ret == CL_SUCCESS)
+    {
+        fprintf(stderr, "Failed to write image '%s'.\n", output_path);
+        ret = 1;
+    }
+cleanup_buffers:
+    free(display);
+    free(accumulator);
+    return ret;
+}
+
+/**
+ * @brief Renders the remaining samples on every usable device, in chunks split by tiles.
+ * 
+ * @param image the accumulator, which holds the samples already rendered.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param bvh the sphere bvh.
+ * @param mesh the mesh.
+ * @param mesh_bvh the mesh bvh.
+ * @param sample_offset the number of samples already rendered.
+ * @param num_samples the total number of samples.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @return cl_int the return code.
+ */
+static cl_int render_multi_cl(cl_float4 *image, const struct sphere *spheres, const size_t num_spheres, const struct bvh *bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, cl_uint sample_offset, const cl_uint num_samples, cl_ulong *num_rays)
+{
+    cl_int ret;
+
+    struct multi_session multi;
+    ret = create_multi_session(devices, num_devices, image_width, image_height, &multi);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
+        goto out;
 
-    ret = clFinish(command_queue);
+    ret = set_multi_session_camera(&multi, &camera);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
+        goto cleanup;
 
-    ret = clEnqueueReadBuffer(command_queue, image_buf, CL_TRUE, 0, HEIGHT * WIDTH * sizeof(cl_float3), *image, 0, NULL, NULL);
+    if (scene_file.data != NULL)
+        ret = set_multi_session_scene_file(&multi, &scene_file);
+    else
+        ret = set_multi_session_scene(&multi, spheres, num_spheres, bvh, mesh, mesh_bvh, &mesh_material, 1);
     if (ret != CL_SUCCESS)
-        goto cleanup_buf;
-
-cleanup_buf:
-    clReleaseMemObject(scene_buf);
-cleanup_image:
-    clReleaseMemObject(image_buf);
-cleanup_kernel:
-    clReleaseKernel(kernel);
-cleanup_program:
-    clReleaseProgram(program);
+        goto cleanup;
+
+    if (sample_offset > 0)
+    {
+        ret = write_multi_session_accumulator(&multi, image, sample_offset);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+    }
+
+    printf("Rendering on %u devices.\n", multi.num_sessions);
+
+    for (cl_uint num_chunks = 1; sample_offset < num_samples; num_chunks++)
+    {
+        cl_uint samples = num_samples - sample_offset < chunk_samples ? num_samples - sample_offset : chunk_samples;
+
+        ret = render_multi_session_samples(&multi, samples, num_rays);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+
+        sample_offset += samples;
+        printf("Rendered %u/%u samples.\n", sample_offset, num_samples);
+
+        int is_checkpoint = is_checkpoint_chunk(num_chunks, sample_offset, num_samples, 0);
+        if (!is_checkpoint && intermediate_path == NULL)
+            continue;
+
+        ret = read_multi_session_accumulator(&multi, image);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+
+        write_progress(image, is_checkpoint, sample_offset);
+    }
+
+    for (cl_uint i = 0; i < multi.num_sessions; i++)
+        printf("Device %u rendered %.2f Mpixel samples/s.\n", i, multi.throughputs[i] * 1e-6);
+
+    ret = read_multi_session_accumulator(&multi, image);
+
+cleanup:
+    release_multi_session(&multi);
 out:
     return ret;
 }
 
-int main(void)
+/**
+ * @brief Renders the remaining samples on the CPU backend, in chunks.
+ * 
+ * @param image the accumulator, which holds the samples already rendered.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param bvh the sphere bvh.
+ * @param mesh the mesh.
+ * @param mesh_bvh the mesh bvh.
+ * @param sample_offset the number of samples already rendered.
+ * @param num_samples the total number of samples.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @return cl_int the return code.
+ */
+static cl_int render_cpu(cl_float4 *image, const struct sphere *spheres, const size_t num_spheres, const struct bvh *bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, cl_uint sample_offset, const cl_uint num_samples, cl_ulong *num_rays)
 {
     cl_int ret;
 
-    ret = setup_cl(&device, &context, &command_queue);
+    cl_float4 camera_quat;
+    cl_float z_distance;
+    get_camera_projection(&camera, image_height, &camera_quat, &z_distance);
+
+    struct cpu_scene scene;
+    ret = create_cpu_scene(spheres, num_spheres, bvh, mesh, mesh_bvh, scene_file.data != NULL ? scene_file.materials : &mesh_material, &scene);
     if (ret != CL_SUCCESS)
-        goto out;
+        return ret;
+
+    // the luminance moments start empty, even when resuming, as the checkpoint does not hold them
+    cl_float2 *luminance_moments = NULL;
+    if (error_threshold > 0)
+    {
+        luminance_moments = calloc((size_t) image_width * image_height, sizeof(cl_float2));
+        if (luminance_moments == NULL)
+        {
+            ret = CL_OUT_OF_HOST_MEMORY;
+            goto cleanup_scene;
+        }
+    }
+
+    // nor does it hold the guides of the denoiser
+    cl_float4 *albedo = NULL;
+    cl_float4 *normal_depth = NULL;
+    if (use_denoiser)
+    {
+        albedo = calloc((size_t) image_width * image_height, sizeof(cl_float4));
+        normal_depth = calloc((size_t) image_width * image_height, sizeof(cl_float4));
+        if (albedo == NULL || normal_depth == NULL)
+        {
+            ret = CL_OUT_OF_HOST_MEMORY;
+            goto cleanup_guides;
+        }
+    }
+
+    printf("Rendering on %u CPU threads.\n", num_threads);
+
+    int is_converged = 0;
+    for (cl_uint num_chunks = 1; sample_offset < num_samples && !is_converged; num_chunks++)
+    {
+        cl_uint samples = num_samples - sample_offset < chunk_samples ? num_samples - sample_offset : chunk_samples;
+
+        cl_uint num_active_pixels;
+        cl_ulong start = get_profile_time();
+        ret = render_cpu_samples(&scene, image, luminance_moments, albedo, normal_depth, partial.sums, camera_quat, z_distance, camera.position, image_height, image_width, sample_offset, samples, error_threshold, num_threads, num_rays, &num_active_pixels);
+        if (ret != CL_SUCCESS)
+            goto cleanup_guides;
+
+        if (profile_path != NULL)
+            add_profile_span(&profile, "render", start, get_profile_time());
+
+        sample_offset += samples;
+        print_chunk(sample_offset, num_samples, num_active_pixels);
+
+        is_converged = num_active_pixels == 0;
+        write_progress(image, is_checkpoint_chunk(num_chunks, sample_offset, num_samples, is_converged), sample_offset);
+    }
+
+    if (use_denoiser)
+    {
+        // the filter cannot work in place, so the noisy accumulator is kept until it is done
+        cl_ulong start = get_profile_time();
+        cl_float4 *denoised = malloc((size_t) image_width * image_height * sizeof(cl_float4));
+        ret = denoised != NULL ? denoise_image(image, albedo, normal_depth, image_width, image_height, denoised) : CL_OUT_OF_HOST_MEMORY;
+        if (ret == CL_SUCCESS)
+            memcpy(image, denoised, (size_t) image_width * image_height * sizeof(cl_float4));
+
+        free(denoised);
+        if (profile_path != NULL)
+            add_profile_span(&profile, "denoise", start, get_profile_time());
+    }
+
+cleanup_guides:
+    free(normal_depth);
+    free(albedo);
+    free(luminance_moments);
+cleanup_scene:
+    release_cpu_scene(&scene);
+    return ret;
+}
+
+/**
+ * @brief Previews a scene on the chosen backend, until standard input closes or sends quit.
+ *
+ * Each command which moves the camera restarts the accumulation. The first frame after a move has one sample, so that
+ * it is published as soon as it can be, and each frame after it doubles the samples, up to a chunk per frame, until
+ * every pixel has max_samples. The preview then waits for the next command.
+ *
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param bvh the sphere bvh.
+ * @param mesh the mesh.
+ * @param mesh_bvh the mesh bvh.
+ * @return cl_int the return code.
+ */
+static cl_int run_preview(const struct sphere *spheres, const size_t num_spheres, const struct bvh *bvh, const struct mesh *mesh, const struct bvh *mesh_bvh)
+{
+    cl_int ret;
 
-    cl_mem directions_buf;
-    ret = generate_directions(&directions_buf);
+    struct preview_framebuffer framebuffer;
+    ret = create_preview_framebuffer(preview_path, image_width, image_height, &framebuffer);
     if (ret != CL_SUCCESS)
-        goto cleanup_context;
+    {
+        fprintf(stderr, "Failed to create the preview framebuffer '%s'.\n", preview_path);
+        return ret;
+    }
+
+    // the CPU backend accumulates on the host, and an OpenCL session on the device
+    struct cpu_scene scene = {0};
+    cl_float4 *accumulator = NULL;
+    struct session session = {0};
+    if (use_cpu)
+    {
+        ret = create_cpu_scene(spheres, num_spheres, bvh, mesh, mesh_bvh, scene_file.data != NULL ? scene_file.materials : &mesh_material, &scene);
+        if (ret != CL_SUCCESS)
+            goto cleanup_framebuffer;
+
+        accumulator = malloc((size_t) image_width * image_height * sizeof(cl_float4));
+        if (accumulator == NULL)
+        {
+            ret = CL_OUT_OF_HOST_MEMORY;
+            goto cleanup;
+        }
+    }
+    else
+    {
+        ret = open_session(image_width, image_height, spheres, num_spheres, bvh, mesh, mesh_bvh, &session);
+        if (ret != CL_SUCCESS)
+            goto cleanup_framebuffer;
+    }
+
+    printf("Previewing into '%s', with position, rotation, fov and quit commands on standard input.\n", preview_path);
+
+    struct preview_input input = {STDIN_FILENO, {0}, 0};
+    cl_float4 camera_quat;
+    cl_float z_distance;
+    cl_uint sample_offset = 0;
+    cl_ulong moved_time = 0;
+    cl_ulong num_rays = 0;
+    int is_moved = 1;
+    int is_closed = 0;
+    while (1)
+    {
+        // commands are only waited for once every sample is rendered
+        ret = read_preview_input(&input, sample_offset < max_samples ? 0 : -1, &camera, &is_moved, &is_closed);
+        if (ret != CL_SUCCESS || is_closed)
+            break;
+
+        if (is_moved)
+        {
+            is_moved = 0;
+            sample_offset = 0;
+            moved_time = get_profile_time();
+
+            get_camera_projection(&camera, image_height, &camera_quat, &z_distance);
+            if (use_cpu)
+                memset(accumulator, 0, (size_t) image_width * image_height * sizeof(cl_float4));
+            else
+                ret = set_session_camera(&session, &camera);
+            if (ret != CL_SUCCESS)
+                break;
+        }
+
+        cl_uint samples = sample_offset > 0 ? sample_offset : 1;
+        samples = samples < chunk_samples ? samples : chunk_samples;
+        samples = samples < max_samples - sample_offset ? samples : max_samples - sample_offset;
+
+        // once every sample is rendered, input which does not move the camera leaves the frame as it is
+        if (samples == 0)
+            continue;
+
+        // the last frame stays readable while the next renders, and is only marked as being written after
+        if (use_cpu)
+        {
+            cl_uint num_active_pixels;
+            ret = render_cpu_samples(&scene, accumulator, NULL, NULL, NULL, NULL, camera_quat, z_distance, camera.position, image_height, image_width, sample_offset, samples, 0, num_threads, &num_rays, &num_active_pixels);
+            if (ret != CL_SUCCESS)
+                break;
+
+            begin_preview_frame(&framebuffer);
+            tonemap_image(accumulator, (size_t) image_width * image_height, &tonemap, framebuffer.pixels);
+        }
+        else
+        {
+            ret = render_session_samples(&session, samples, &num_rays);
+            if (ret != CL_SUCCESS)
+                break;
+
+            begin_preview_frame(&framebuffer);
+            ret = read_session_display(&session, &tonemap, framebuffer.pixels);
+            if (ret != CL_SUCCESS)
+                break;
+        }
+
+        sample_offset += samples;
+        end_preview_frame(&framebuffer, sample_offset);
+
+        if (sample_offset == samples)
+            printf("Published the first frame after the move in %.1f ms.\n", (get_profile_time() - moved_time) * 1e-6);
+    }
+
+    printf("Closed the preview.\n");
+
+cleanup:
+    free(accumulator);
+    release_cpu_scene(&scene);
+    release_session(&session);
+cleanup_framebuffer:
+    release_preview_framebuffer(&framebuffer);
+    return ret;
+}
+
+/**
+ * @brief Renders a scene on the chosen backend, resuming from the checkpoint if there is one.
+ *
+ * @param image a pointer to the accumulator, which is allocated, unless the image is streamed into its file in tiles.
+ * @param display a pointer to the 8-bit pixels, which are allocated if an 8-bit image is tonemapped on one device, or
+ * else NULL.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param bvh the sphere bvh.
+ * @param mesh the mesh.
+ * @param mesh_bvh the mesh bvh.
+ * @return cl_int the return code.
+ */
+static cl_int render_scene(cl_float4 **image, cl_uchar4 **display, const struct sphere *spheres, const size_t num_spheres, const struct bvh *bvh, const struct mesh *mesh, const struct bvh *mesh_bvh)
+{
+    cl_int ret;
+
+    cl_uint num_samples = max_samples;
+    cl_uint sample_offset = 0;
+
+    printf("Rendering %zu spheres with %u bvh nodes, and %zu triangles with %u bvh nodes.\n", num_spheres, bvh->num_nodes, mesh->num_triangles, mesh_bvh->num_nodes);
+
+    *image = NULL;
+    *display = NULL;
+    if (preview_path != NULL)
+        return run_preview(spheres, num_spheres, bvh, mesh, mesh_bvh);
+
+    // a tiled image is streamed into its file, so the image is never held in memory
+    if (tile_size > 0 && use_cpu)
+    {
+        fprintf(stderr, "The image is only rendered in tiles on an OpenCL device.\n");
+        return CL_INVALID_OPERATION;
+    }
+
+    if (tile_size == 0)
+    {
+        *image = calloc((size_t) image_width * image_height, sizeof(cl_float4));
+        if (*image == NULL)
+            return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // an 8-bit image is tonemapped on the device, so that only a quarter of the accumulator is read
+    if (!use_cpu && !use_all_devices && tile_size == 0 && partial_path == NULL && get_output_format(output_path) == IMAGE_PPM)
+        *display = malloc((size_t) image_width * image_height * sizeof(cl_uchar4));
+
+    // a partial render starts from its first sample, with an empty accumulator
+    if (partial_path != NULL)
+    {
+        sample_offset = first_sample;
+        partial = (struct partial_render){image_width, image_height, first_sample, num_samples - first_sample, calloc((size_t) image_width * image_height, sizeof(cl_ulong4))};
+        if (partial.sums == NULL)
+            return CL_OUT_OF_HOST_MEMORY;
+
+        printf("Rendering samples %u to %u of the frame.\n", first_sample, num_samples);
+    }
+
+    if (checkpoint_path != NULL)
+    {
+        ret = read_checkpoint(checkpoint_path, *image, image_width, image_height, &sample_offset);
+        if (ret == CL_SUCCESS)
+            printf("Resuming from '%s' at %u/%u samples.\n", checkpoint_path, sample_offset, num_samples);
+        else if (ret == CL_INVALID_VALUE)
+            return ret;
+    }
+
+    cl_ulong num_rays = 0;
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if (tile_size > 0)
+        ret = render_tiled(spheres, num_spheres, bvh, mesh, mesh_bvh, num_samples, &num_rays);
+    else if (use_cpu)
+        ret = render_cpu(*image, spheres, num_spheres, bvh, mesh, mesh_bvh, sample_offset, num_samples, &num_rays);
+    else if (use_all_devices)
+        ret = render_multi_cl(*image, spheres, num_spheres, bvh, mesh, mesh_bvh, sample_offset, num_samples, &num_rays);
+    else
+        ret = render_cl(*image, *display, spheres, num_spheres, bvh, mesh, mesh_bvh, sample_offset, num_samples, &num_rays);
 
-    cl_float3 *image;
-    ret = render(&image, &directions_buf);
     if (ret != CL_SUCCESS)
-        goto cleanup;
+        return ret;
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double elapsed = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+    printf("Rendered in %.3f s (%.2f Mrays/s).\n", elapsed, num_rays / elapsed * 1e-6);
+
+    if (error_threshold > 0 && *image != NULL)
+    {
+        double total_samples = 0;
+        for (size_t i = 0; i < (size_t) image_width * image_height; i++)
+            total_samples += (*image)[i].w;
+
+        printf("Rendered %.2f samples per pixel on average, of at most %u.\n", total_samples / ((size_t) image_width * image_height), num_samples);
+    }
+
+    return CL_SUCCESS;
+}
+
+cl_int render(cl_float4 **image, cl_uchar4 **display)
+{
+    cl_int ret;
+
+    if (scene_path != NULL)
+    {
+        ret = map_scene_file(scene_path, &scene_file);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to load scene '%s'.\n", scene_path);
+            return ret;
+        }
+
+        ret = render_scene(image, display, scene_file.spheres, scene_file.num_spheres, &scene_file.sphere_bvh, &scene_file.mesh, &scene_file.mesh_bvh);
+        unmap_scene_file(&scene_file);
+        return ret;
+    }
+
+    struct sphere *scene_spheres;
+    size_t num_spheres;
+    ret = create_cornell_box(&scene_spheres, &num_spheres);
+    if (ret != CL_SUCCESS)
+        goto out;
+
+    if (num_random_spheres > 0)
+    {
+        ret = add_random_spheres(&scene_spheres, &num_spheres, num_random_spheres, 1);
+        if (ret != CL_SUCCESS)
+            goto cleanup_scene;
+    }
+
+    // the bvh permutes the spheres into leaf order
+    struct bvh bvh = {NULL, 0, NULL};
+    if (bvh_mode == BVH_ON || (bvh_mode == BVH_AUTO && num_spheres >= BVH_MIN_PRIMITIVES))
+    {
+        ret = build_sphere_bvh(scene_spheres, num_spheres, &bvh);
+        if (ret != CL_SUCCESS)
+            goto cleanup_scene;
+    }
+
+    struct mesh mesh = {NULL, 0, NULL, 0};
+    struct bvh mesh_bvh = {NULL, 0, NULL};
+    if (mesh_path != NULL)
+    {
+        ret = load_obj(mesh_path, 0, &mesh);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to load mesh '%s'.\n", mesh_path);
+            goto cleanup_bvh;
+        }
+
+        transform_mesh(&mesh, mesh_scale, mesh_offset);
+
+        if (bvh_mode == BVH_ON || (bvh_mode == BVH_AUTO && mesh.num_triangles >= BVH_MIN_PRIMITIVES))
+        {
+            ret = build_mesh_bvh(&mesh, &mesh_bvh);
+            if (ret != CL_SUCCESS)
+                goto cleanup_mesh;
+        }
+    }
+
+    ret = render_scene(image, display, scene_spheres, num_spheres, &bvh, &mesh, &mesh_bvh);
+
+cleanup_mesh:
+    release_bvh(&mesh_bvh);
+    release_mesh(&mesh);
+cleanup_bvh:
+    release_bvh(&bvh);
+cleanup_scene:
+    free(scene_spheres);
+out:
+    return ret;
+}
+
+/**
+ * @brief Parses the command line options.
+ * 
+ * @param argc the argument count.
+ * @param argv the arguments.
+ * @return cl_int the return code.
+ */
+cl_int parse_options(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"samples", required_argument, NULL, 'N'},
+        {"resolution", required_argument, NULL, 'r'},
+        {"tile", required_argument, NULL, 'z'},
+        {"adaptive", required_argument, NULL, 'e'},
+        {"denoise", no_argument, NULL, 'd'},
+        {"profile", required_argument, NULL, 'p'},
+        {"chunk", required_argument, NULL, 'c'},
+        {"checkpoint", required_argument, NULL, 'k'},
+        {"checkpoint-interval", required_argument, NULL, 'n'},
+        {"intermediate", required_argument, NULL, 'i'},
+        {"bvh", required_argument, NULL, 'b'},
+        {"spheres", required_argument, NULL, 's'},
+        {"mesh", required_argument, NULL, 'm'},
+        {"mesh-scale", required_argument, NULL, 'S'},
+        {"mesh-offset", required_argument, NULL, 'O'},
+        {"scene", required_argument, NULL, 'l'},
+        {"wavefront", no_argument, NULL, 'w'},
+        {"specialize", no_argument, NULL, 'K'},
+        {"persistent", no_argument, NULL, 'W'},
+        {"all-devices", no_argument, NULL, 'a'},
+        {"cpu", no_argument, NULL, 'C'},
+        {"threads", required_argument, NULL, 't'},
+        {"output", required_argument, NULL, 'o'},
+        {"format", required_argument, NULL, 'f'},
+        {"tonemap", required_argument, NULL, 'T'},
+        {"exposure", required_argument, NULL, 'E'},
+        {"preview", required_argument, NULL, 'P'},
+        {"partial", required_argument, NULL, 'R'},
+        {"first-sample", required_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "N:r:z:e:dp:c:k:n:i:b:s:m:S:O:l:wKWaCt:o:f:T:E:P:R:F:", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'N':
+            max_samples = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%ux%u", &image_width, &image_height) != 2 || image_width == 0 || image_height == 0)
+            {
+                fprintf(stderr, "The resolution must be given as widthxheight, such as 2560x1440.\n");
+                return CL_INVALID_VALUE;
+            }
+            break;
+        case 'z':
+        {
+            char *end;
+            unsigned long size = strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || optarg[0] == '-' || size == 0 || size > CL_UINT_MAX)
+            {
+                fprintf(stderr, "The tile size must be a positive number of pixels.\n");
+                return CL_INVALID_VALUE;
+            }
+            tile_size = size;
+            break;
+        }
+        case 'e':
+            error_threshold = strtof(optarg, NULL);
+            break;
+        case 'd':
+            use_denoiser = 1;
+            break;
+        case 'p':
+            profile_path = optarg;
+            break;
+        case 'c':
+            chunk_samples = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            checkpoint_path = optarg;
+            break;
+        case 'R':
+            partial_path = optarg;
+            break;
+        case 'F':
+            first_sample = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            checkpoint_interval = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            intermediate_path = optarg;
+            break;
+        case 'b':
+            if (strcmp(optarg, "on") == 0)
+                bvh_mode = BVH_ON;
+            else if (strcmp(optarg, "off") == 0)
+                bvh_mode = BVH_OFF;
+            else
+                bvh_mode = BVH_AUTO;
+            break;
+        case 's':
+            num_random_spheres = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            mesh_path = optarg;
+            break;
+        case 'S':
+            mesh_scale = strtof(optarg, NULL);
+            break;
+        case 'l':
+            scene_path = optarg;
+            break;
+        case 'w':
+            use_wavefront = 1;
+            break;
+        case 'K':
+            use_specialized = 1;
+            break;
+        case 'W':
+            use_persistent = 1;
+            break;
+        case 'a':
+            use_all_devices = 1;
+            break;
+        case 'C':
+            use_cpu = 1;
+            break;
+        case 't':
+            num_threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'f':
+            if (parse_image_format(optarg, &image_format) != CL_SUCCESS)
+            {
+                fprintf(stderr, "The image format must be ppm, ppm16, or pfm.\n");
+                return CL_INVALID_VALUE;
+            }
+
+            has_image_format = 1;
+            break;
+        case 'T':
+            if (parse_tonemap_curve(optarg, &tonemap.curve) != CL_SUCCESS)
+            {
+                fprintf(stderr, "The tonemap curve must be clamp, reinhard, or aces.\n");
+                return CL_INVALID_VALUE;
+            }
+            break;
+        case 'E':
+            tonemap.exposure = strtof(optarg, NULL);
+            break;
+        case 'P':
+            preview_path = optarg;
+            break;
+        case 'O':
+            if (sscanf(optarg, "%f,%f,%f", &mesh_offset.x, &mesh_offset.y, &mesh_offset.z) != 3)
+            {
+                fprintf(stderr, "The mesh offset must be of the form x,y,z.\n");
+                return CL_INVALID_VALUE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--samples count] [--resolution widthxheight] [--tile size] [--adaptive error] [--denoise] [--profile path] [--chunk samples] [--checkpoint path] [--checkpoint-interval chunks] [--intermediate path] [--bvh auto|on|off] [--spheres count] [--mesh path] [--mesh-scale scale] [--mesh-offset x,y,z] [--scene path] [--wavefront] [--specialize] [--persistent] [--all-devices] [--cpu] [--threads count] [--output path] [--format ppm|ppm16|pfm] [--tonemap clamp|reinhard|aces] [--exposure stops] [--preview path] [--partial path] [--first-sample index]\n", argv[0]);
+            return CL_INVALID_VALUE;
+        }
+    }
+
+    if (max_samples == 0 || chunk_samples == 0 || checkpoint_interval == 0)
+    {
+        fprintf(stderr, "The number of samples, chunk size and checkpoint interval must be positive.\n");
+        return CL_INVALID_VALUE;
+    }
+
+    if (first_sample >= max_samples)
+    {
+        fprintf(stderr, "The first sample must be before the last.\n");
+        return CL_INVALID_VALUE;
+    }
+
+    if (first_sample > 0 && partial_path == NULL)
+    {
+        fprintf(stderr, "Only a partial render starts from a first sample.\n");
+        return CL_INVALID_VALUE;
+    }
+
+    if (!(error_threshold >= 0))
+    {
+        fprintf(stderr, "The adaptive sampling error must not be negative.\n");
+        return CL_INVALID_VALUE;
+    }
+
+    if (num_threads == 0)
+        num_threads = get_cpu_count();
 
-    FILE *image_file = fopen("result.pgm", "wb");
-    // write the magic number, dimensions, and max greyscale value
-    fprintf(image_file, "P3\n%d %d\n%d\n", WIDTH, HEIGHT, 255);
+    if (preview_path != NULL && use_all_devices)
+    {
+        fprintf(stderr, "The preview restarts often, which splitting tiles between devices does not pay for, so it renders on one device.\n");
+        use_all_devices = 0;
+    }
 
-    for (size_t i = 0; i < HEIGHT * WIDTH; i++)
+    if (use_all_devices && use_wavefront)
     {
-        fprintf(image_file, "%d %d %d ", convert_pixel(image[i].x), convert_pixel(image[i].y), convert_pixel(image[i].z));
+        fprintf(stderr, "The wavefront stages render whole frames, so tiles are split between devices with the render megakernel.\n");
+        use_wavefront = 0;
     }
 
-    fclose(image_file);
+    if (error_threshold > 0 && use_all_devices)
+    {
+        fprintf(stderr, "Each device only accumulates part of each pixel, so adaptive sampling is disabled with every device.\n");
+        error_threshold = 0;
+    }
+
+    if (error_threshold > 0 && use_wavefront)
+    {
+        fprintf(stderr, "The wavefront stages render every pixel, so pixels are sampled adaptively with the render megakernel.\n");
+        use_wavefront = 0;
+    }
+
+    if (use_denoiser && use_all_devices)
+    {
+        fprintf(stderr, "Each device only accumulates part of each pixel, so the denoiser is disabled with every device.\n");
+        use_denoiser = 0;
+    }
+
+    if (profile_path != NULL && use_all_devices)
+    {
+        fprintf(stderr, "The devices render on threads of their own, so profiling is disabled with every device.\n");
+        profile_path = NULL;
+    }
+
+    if (use_denoiser && use_wavefront)
+    {
+        fprintf(stderr, "The wavefront stages do not output the first hits, so the denoiser renders with the render megakernel.\n");
+        use_wavefront = 0;
+    }
+
+    if (partial_path != NULL && (preview_path != NULL || checkpoint_path != NULL))
+    {
+        fprintf(stderr, "A partial render is a fixed range of samples, so it neither previews nor resumes from a checkpoint.\n");
+        return CL_INVALID_VALUE;
+    }
+
+    // every pixel must take every sample of its range, which must be summed the same way however the frame is split
+    if (partial_path != NULL && (use_all_devices || use_wavefront || error_threshold > 0 || use_denoiser))
+    {
+        fprintf(stderr, "A partial render sums every sample exactly, on one device with the render megakernel, without adaptive sampling or the denoiser.\n");
+        use_all_devices = 0;
+        use_wavefront = 0;
+        error_threshold = 0;
+        use_denoiser = 0;
+    }
+
+    if (use_specialized && use_all_devices)
+    {
+        fprintf(stderr, "The devices render with the generic render kernel, so specialization is disabled with every device.\n");
+        use_specialized = 0;
+    }
+
+    if (use_specialized && use_wavefront)
+    {
+        fprintf(stderr, "The wavefront stages are not specialized, so the specialized kernel renders with the render megakernel.\n");
+        use_wavefront = 0;
+    }
+
+    if (tile_size > 0 && (preview_path != NULL || checkpoint_path != NULL || intermediate_path != NULL || partial_path != NULL))
+    {
+        fprintf(stderr, "A tiled image only exists in its file, so it neither previews, checkpoints, writes intermediate images, nor renders partially.\n");
+        return CL_INVALID_VALUE;
+    }
+
+    // each tile is rendered on one device with the render megakernel, and the denoiser would leave seams between tiles
+    if (tile_size > 0 && (use_all_devices || use_wavefront || use_denoiser))
+    {
+        fprintf(stderr, "A tiled image renders on one device with the render megakernel, without the denoiser.\n");
+        use_all_devices = 0;
+        use_wavefront = 0;
+        use_denoiser = 0;
+    }
+
+    if (use_persistent && use_all_devices)
+    {
+        fprintf(stderr, "The devices render with the generic render kernel, so persistent work items are disabled with every device.\n");
+        use_persistent = 0;
+    }
+
+    if (use_persistent && use_wavefront)
+    {
+        fprintf(stderr, "The wavefront stages already drop ended paths from their queues, so persistent work items render with the render megakernel.\n");
+        use_wavefront = 0;
+    }
+
+    return CL_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    cl_int ret;
+
+    ret = parse_options(argc, argv);
+    if (ret != CL_SUCCESS)
+        goto out;
+
+    if (!use_cpu && use_all_devices)
+    {
+        ret = setup_all_cl(0, &devices, &num_devices);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to open any OpenCL device with code '%d', so rendering on the CPU backend.\n", ret);
+            use_cpu = 1;
+        }
+    }
+    else if (!use_cpu)
+    {
+        ret = setup_cl(profile_path != NULL ? CL_QUEUE_PROFILING_ENABLE : 0, &device, &context, &command_queue);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to set up OpenCL with code '%d', so rendering on the CPU backend.\n", ret);
+            use_cpu = 1;
+        }
+    }
+
+    cl_float4 *image = NULL;
+    cl_uchar4 *display = NULL;
+    ret = render(&image, &display);
+    if (ret != CL_SUCCESS || preview_path != NULL)
+        goto cleanup;
+
+    if (partial_path != NULL)
+        ret = write_partial_render(partial_path, &partial);
+    else if (display != NULL)
+        ret = save_display_image(output_path, display);
+    else if (image != NULL)
+        ret = save_image(output_path, image);
+    if (ret != CL_SUCCESS || profile_path == NULL)
+        goto cleanup;
+
+    // the events are read before the command queue is released
+    print_profile_summary(&profile, stdout);
+    if (write_chrome_trace(&profile, profile_path) != CL_SUCCESS)
+        fprintf(stderr, "Failed to write profile '%s'.\n", profile_path);
 
 cleanup:
-    clReleaseMemObject(directions_buf);
+    release_profile(&profile);
+    release_partial_render(&partial);
+    free(display);
     free(image);
-cleanup_context:
-    clReleaseCommandQueue(command_queue);
-    clReleaseContext(context);
+    if (!use_cpu && use_all_devices)
+    {
+        release_all_cl(devices, num_devices);
+    }
+    else if (!use_cpu)
+    {
+        clReleaseCommandQueue(command_queue);
+        clReleaseContext(context);
+    }
 out:
     if (ret != CL_SUCCESS)
         fprintf(stderr, "Program exited with non-zero exit code: '%d'.\n", ret);
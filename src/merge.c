@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "gpulib.h"
+#include "partial.h"
+#include "output.h"
+#include "tonemap.h"
+
+/**
+ * @brief Writes the merged samples as an image, where 8-bit images are tonemapped for display, as firefly writes them.
+ *
+ * @param path the image path.
+ * @param format the image format.
+ * @param tonemap the display transform of 8-bit images.
+ * @param merged the merged partial render.
+ * @return cl_int the return code.
+ */
+static cl_int write_merged_image(const char *path, const enum image_format format, const struct tonemap *tonemap, const struct partial_render *merged)
+{
+    cl_int ret;
+
+    size_t num_pixels = (size_t) merged->width * merged->height;
+    cl_float4 *accumulator = malloc(num_pixels * sizeof(cl_float4));
+    if (accumulator == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    get_partial_accumulator(merged, accumulator);
+    if (format == IMAGE_PPM)
+    {
+        cl_uchar4 *display = malloc(num_pixels * sizeof(cl_uchar4));
+        if (display == NULL)
+        {
+            free(accumulator);
+            return CL_OUT_OF_HOST_MEMORY;
+        }
+
+        tonemap_image(accumulator, num_pixels, tonemap, display);
+        ret = write_display_image(path, display, merged->width, merged->height);
+        free(display);
+    }
+    else
+    {
+        ret = write_image(path, accumulator, merged->width, merged->height, format);
+    }
+
+    free(accumulator);
+    return ret;
+}
+
+/**
+ * Merges the partial renders of ranges of the samples of a frame, written by firefly --partial, into one image. The
+ * ranges may be given in any order, but must follow on from each other without overlapping. The merged samples may
+ * also be written as a partial render, so that the partial renders of a large farm can be merged in stages.
+ */
+int main(int argc, char **argv)
+{
+    cl_int ret = 1;
+
+    static const struct option long_options[] = {
+        {"output", required_argument, NULL, 'o'},
+        {"format", required_argument, NULL, 'f'},
+        {"tonemap", required_argument, NULL, 'T'},
+        {"exposure", required_argument, NULL, 'E'},
+        {"partial", required_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0},
+    };
+
+    const char *output_path = "result.ppm";
+    const char *partial_path = NULL;
+    enum image_format image_format = IMAGE_PPM;
+    int has_image_format = 0;
+    struct tonemap tonemap = {TONEMAP_CLAMP, 0};
+
+    int option;
+    while ((option = getopt_long(argc, argv, "o:f:T:E:R:", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'f':
+            if (parse_image_format(optarg, &image_format) != CL_SUCCESS)
+            {
+                fprintf(stderr, "The image format must be ppm, ppm16, or pfm.\n");
+                return ret;
+            }
+
+            has_image_format = 1;
+            break;
+        case 'T':
+            if (parse_tonemap_curve(optarg, &tonemap.curve) != CL_SUCCESS)
+            {
+                fprintf(stderr, "The tonemap curve must be clamp, reinhard, or aces.\n");
+                return ret;
+            }
+            break;
+        case 'E':
+            tonemap.exposure = strtof(optarg, NULL);
+            break;
+        case 'R':
+            partial_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--output path] [--format ppm|ppm16|pfm] [--tonemap clamp|reinhard|aces] [--exposure stops] [--partial path] partial...\n", argv[0]);
+            return ret;
+        }
+    }
+
+    int num_partials = argc - optind;
+    if (num_partials == 0)
+    {
+        fprintf(stderr, "There are no partial renders to merge.\n");
+        return ret;
+    }
+
+    struct sample_range *ranges = malloc(num_partials * sizeof(struct sample_range));
+    if (ranges == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    // the partial renders are read one at a time, so that only two are in memory however many there are
+    struct partial_render merged = {0, 0, 0, 0, NULL};
+    for (int i = 0; i < num_partials; i++)
+    {
+        const char *path = argv[optind + i];
+        struct partial_render partial;
+        ret = read_partial_render(path, &partial);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to read partial render '%s'.\n", path);
+            goto cleanup;
+        }
+
+        ranges[i] = (struct sample_range){partial.first_sample, partial.first_sample + partial.num_samples, path};
+        if (i == 0)
+        {
+            merged = partial;
+            continue;
+        }
+
+        ret = merge_partial_render(&merged, &partial);
+        release_partial_render(&partial);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Partial render '%s' is not the size of '%s', or there are more samples than a range holds.\n", path, ranges[0].path);
+            goto cleanup;
+        }
+    }
+
+    size_t i = find_sample_range_break(ranges, num_partials);
+    if (i > 0)
+    {
+        fprintf(stderr, "Partial render '%s' %s '%s', at sample %u.\n", ranges[i].path, ranges[i].first < ranges[i - 1].end ? "overlaps" : "leaves a gap after", ranges[i - 1].path, ranges[i - 1].end);
+        ret = CL_INVALID_VALUE;
+        goto cleanup;
+    }
+
+    printf("Merged %d partial renders, of samples %u to %u.\n", num_partials, merged.first_sample, merged.first_sample + merged.num_samples);
+
+    if (partial_path != NULL)
+    {
+        ret = write_partial_render(partial_path, &merged);
+        if (ret != CL_SUCCESS)
+        {
+            fprintf(stderr, "Failed to write partial render '%s'.\n", partial_path);
+            goto cleanup;
+        }
+    }
+
+    ret = write_merged_image(output_path, has_image_format ? image_format : get_image_format(output_path), &tonemap, &merged);
+    if (ret != CL_SUCCESS)
+        fprintf(stderr, "Failed to write image '%s'.\n", output_path);
+
+cleanup:
+    release_partial_render(&merged);
+    free(ranges);
+    return ret;
+}
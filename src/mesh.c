@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mesh.h"
+#include "vector.h"
+
+// the initial capacity of the vertex and triangle arrays, which double as they fill
+#define INITIAL_CAPACITY 1024
+
+static inline int is_space(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *skip_spaces(const char *p, const char *end)
+{
+    while (p < end && is_space(*p))
+        p++;
+
+    return p;
+}
+
+static inline const char *skip_line(const char *p, const char *end)
+{
+    while (p < end && *p != '\n')
+        p++;
+
+    return p < end ? p + 1 : end;
+}
+
+/**
+ * @brief Parses a decimal float in place, as the mapped file is not null-terminated for strtof.
+ * 
+ * @param p a pointer to the position in the file, which is advanced past the number.
+ * @param end the end of the file.
+ * @param value a pointer to the parsed value.
+ * @return int whether a number was parsed.
+ */
+static int parse_float(const char **p, const char *end, float *value)
+{
+    const char *c = skip_spaces(*p, end);
+
+    double sign = 1;
+    if (c < end && (*c == '-' || *c == '+'))
+        sign = *c++ == '-' ? -1 : 1;
+
+    const char *digits = c;
+    double result = 0;
+    while (c < end && *c >= '0' && *c <= '9')
+        result = 10 * result + (*c++ - '0');
+
+    if (c < end && *c == '.')
+    {
+        double place = 0.1;
+        for (c++; c < end && *c >= '0' && *c <= '9'; c++, place *= 0.1)
+            result += (*c - '0') * place;
+    }
+
+    if (c == digits)
+        return 0;
+
+    if (c < end && (*c == 'e' || *c == 'E'))
+    {
+        c++;
+        int exponent_sign = 1;
+        if (c < end && (*c == '-' || *c == '+'))
+            exponent_sign = *c++ == '-' ? -1 : 1;
+
+        int exponent = 0;
+        while (c < end && *c >= '0' && *c <= '9')
+            exponent = 10 * exponent + (*c++ - '0');
+
+        double power = 1;
+        for (double base = exponent_sign > 0 ? 10 : 0.1; exponent > 0; exponent >>= 1, base *= base)
+        {
+            if (exponent & 1)
+                power *= base;
+        }
+
+        result *= power;
+    }
+
+    *value = sign * result;
+    *p = c;
+
+    return 1;
+}
+
+/**
+ * @brief Parses a face vertex of the form v, v/vt, v//vn or v/vt/vn, and resolves it to a zero-based index.
+ * 
+ * @param p a pointer to the position in the file, which is advanced past the face vertex.
+ * @param end the end of the file.
+ * @param num_vertices the number of vertices read so far, for negative relative indices.
+ * @param index a pointer to the vertex index.
+ * @return int 1 if a valid index was parsed, 0 at the end of the face, or -1 if the index is malformed or out of range.
+ */
+static int parse_face_vertex(const char **p, const char *end, const size_t num_vertices, cl_uint *index)
+{
+    const char *c = skip_spaces(*p, end);
+    if (c == end || *c == '\n' || *c == '#')
+        return 0;
+
+    int negative = *c == '-';
+    if (negative)
+        c++;
+
+    const char *digits = c;
+    long value = 0;
+    while (c < end && *c >= '0' && *c <= '9' && value <= (long) num_vertices)
+        value = 10 * value + (*c++ - '0');
+
+    if (c == digits || (c < end && *c >= '0' && *c <= '9'))
+        return -1;
+
+    // skip the texture and normal indices
+    while (c < end && !is_space(*c) && *c != '\n')
+        c++;
+
+    *p = c;
+
+    long resolved = negative ? (long)num_vertices - value : value - 1;
+    if (resolved < 0 || resolved >= (long)num_vertices)
+        return -1;
+
+    *index = resolved;
+
+    return 1;
+}
+
+static int reserve(void **array, size_t *capacity, const size_t count, const size_t element_size)
+{
+    if (count < *capacity)
+        return 1;
+
+    size_t resized_capacity = *capacity == 0 ? INITIAL_CAPACITY : 2 * *capacity;
+    void *resized = realloc(*array, resized_capacity * element_size);
+    if (resized == NULL)
+        return 0;
+
+    *array = resized;
+    *capacity = resized_capacity;
+
+    return 1;
+}
+
+/**
+ * @brief Loads the vertices and faces of an OBJ file, triangulating polygons as fans.
+ * 
+ * The file is memory-mapped and parsed in place, without copying lines. Any statements other than vertices and
+ * faces are ignored.
+ * 
+ * @param path the OBJ path.
+ * @param material the material index of every triangle.
+ * @param mesh a pointer to the mesh, which must be released with release_mesh.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the file cannot be read, is malformed, or has no faces.
+ */
+cl_int load_obj(const char *path, const cl_uint material, struct mesh *mesh)
+{
+    // a file which cannot be read, or is not a mesh, is an invalid value
+    cl_int ret = CL_INVALID_VALUE;
+
+    mesh->vertices = NULL;
+    mesh->num_vertices = 0;
+    mesh->triangles = NULL;
+    mesh->num_triangles = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return ret;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size == 0)
+        goto cleanup_file;
+
+    const char *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        goto cleanup_file;
+
+    madvise((void *)data, file_stat.st_size, MADV_SEQUENTIAL);
+
+    size_t vertex_capacity = 0;
+    size_t triangle_capacity = 0;
+
+    const char *end = data + file_stat.st_size;
+    const char *p = data;
+    while (p < end)
+    {
+        p = skip_spaces(p, end);
+        if (end - p < 2 || !is_space(p[1]))
+        {
+            p = skip_line(p, end);
+            continue;
+        }
+
+        if (*p == 'v')
+        {
+            p++;
+            if (!reserve((void **)&mesh->vertices, &vertex_capacity, 3 * mesh->num_vertices + 2, sizeof(cl_float)))
+            {
+                ret = CL_OUT_OF_HOST_MEMORY;
+                goto cleanup_mesh;
+            }
+
+            cl_float *vertex = mesh->vertices + 3 * mesh->num_vertices;
+            if (!parse_float(&p, end, vertex) || !parse_float(&p, end, vertex + 1) || !parse_float(&p, end, vertex + 2))
+            {
+                ret = CL_INVALID_VALUE;
+                goto cleanup_mesh;
+            }
+
+            mesh->num_vertices++;
+        }
+        else if (*p == 'f')
+        {
+            p++;
+
+            cl_uint first;
+            cl_uint previous;
+            cl_uint current;
+            if (parse_face_vertex(&p, end, mesh->num_vertices, &first) != 1 || parse_face_vertex(&p, end, mesh->num_vertices, &previous) != 1)
+            {
+                ret = CL_INVALID_VALUE;
+                goto cleanup_mesh;
+            }
+
+            // a bad index anywhere in the face rejects the file, rather than ending the face early
+            int parsed;
+            while ((parsed = parse_face_vertex(&p, end, mesh->num_vertices, &current)) == 1)
+            {
+                if (!reserve((void **)&mesh->triangles, &triangle_capacity, mesh->num_triangles, sizeof(struct triangle)))
+                {
+                    ret = CL_OUT_OF_HOST_MEMORY;
+                    goto cleanup_mesh;
+                }
+
+                mesh->triangles[mesh->num_triangles++] = (struct triangle){first, previous, current, material};
+                previous = current;
+            }
+
+            if (parsed < 0)
+            {
+                ret = CL_INVALID_VALUE;
+                goto cleanup_mesh;
+            }
+        }
+
+        p = skip_line(p, end);
+    }
+
+    // a mesh without faces would build an empty bvh
+    if (mesh->num_triangles == 0)
+        goto cleanup_mesh;
+
+    ret = CL_SUCCESS;
+
+cleanup_mesh:
+    if (ret != CL_SUCCESS)
+        release_mesh(mesh);
+
+    munmap((void *)data, file_stat.st_size);
+cleanup_file:
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Scales, then translates the vertices of a mesh.
+ * 
+ * @param mesh the mesh.
+ * @param scale the uniform scale.
+ * @param offset the translation.
+ */
+void transform_mesh(struct mesh *mesh, const cl_float scale, const cl_float3 offset)
+{
+    for (size_t i = 0; i < mesh->num_vertices; i++)
+    {
+        cl_float *vertex = mesh->vertices + 3 * i;
+        vertex[0] = vertex[0] * scale + offset.x;
+        vertex[1] = vertex[1] * scale + offset.y;
+        vertex[2] = vertex[2] * scale + offset.z;
+    }
+}
+
+/**
+ * @brief Builds a bvh over the triangles of a mesh, and permutes the triangles into leaf order.
+ * 
+ * @param mesh the mesh, whose triangles are permuted.
+ * @param bvh a pointer to the bvh, which must be released with release_bvh.
+ * @return cl_int the return code.
+ */
+cl_int build_mesh_bvh(struct mesh *mesh, struct bvh *bvh)
+{
+    cl_int ret = CL_OUT_OF_HOST_MEMORY;
+
+    struct aabb *bounds = malloc(mesh->num_triangles * sizeof(struct aabb));
+    struct triangle *permuted = malloc(mesh->num_triangles * sizeof(struct triangle));
+    if (bounds == NULL || permuted == NULL)
+        goto cleanup;
+
+    for (size_t i = 0; i < mesh->num_triangles; i++)
+    {
+        const cl_float *v0 = mesh->vertices + 3 * mesh->triangles[i].v0;
+        const cl_float *v1 = mesh->vertices + 3 * mesh->triangles[i].v1;
+        const cl_float *v2 = mesh->vertices + 3 * mesh->triangles[i].v2;
+
+        cl_float3 p0 = (cl_float3){v0[0], v0[1], v0[2]};
+        cl_float3 p1 = (cl_float3){v1[0], v1[1], v1[2]};
+        cl_float3 p2 = (cl_float3){v2[0], v2[1], v2[2]};
+
+        bounds[i].min = min_float3(p0, min_float3(p1, p2));
+        bounds[i].max = max_float3(p0, max_float3(p1, p2));
+    }
+
+    ret = build_bvh(bounds, mesh->num_triangles, bvh);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    for (size_t i = 0; i < mesh->num_triangles; i++)
+        permuted[i] = mesh->triangles[bvh->indices[i]];
+
+    free(mesh->triangles);
+    mesh->triangles = permuted;
+    permuted = NULL;
+
+cleanup:
+    free(permuted);
+    free(bounds);
+    return ret;
+}
+
+void release_mesh(struct mesh *mesh)
+{
+    free(mesh->vertices);
+    free(mesh->triangles);
+
+    mesh->vertices = NULL;
+    mesh->num_vertices = 0;
+    mesh->triangles = NULL;
+    mesh->num_triangles = 0;
+}
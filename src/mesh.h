@@ -0,0 +1,40 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "gpulib.h"
+#include "bvh.h"
+
+struct material
+{
+    cl_float3 colour;
+    cl_float3 emission;
+};
+
+_Static_assert(sizeof(struct material) == 32, "struct material must match the kernel");
+
+// a triangle indexing three vertices, with the index of its material
+struct triangle
+{
+    cl_uint v0;
+    cl_uint v1;
+    cl_uint v2;
+    cl_uint material;
+};
+
+_Static_assert(sizeof(struct triangle) == 16, "struct triangle must match the kernel");
+
+struct mesh
+{
+    // tightly packed xyz positions, which the kernel reads with vload3
+    cl_float *vertices;
+    size_t num_vertices;
+    struct triangle *triangles;
+    size_t num_triangles;
+};
+
+cl_int load_obj(const char *path, const cl_uint material, struct mesh *mesh);
+void transform_mesh(struct mesh *mesh, const cl_float scale, const cl_float3 offset);
+cl_int build_mesh_bvh(struct mesh *mesh, struct bvh *bvh);
+void release_mesh(struct mesh *mesh);
+
+#endif
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "multi.h"
+
+struct multi_job
+{
+    struct multi_session *multi;
+    cl_uint sample_offset;
+    cl_uint num_samples;
+    cl_uint num_tiles_x;
+    cl_uint num_tiles;
+    // whether every device was measured in the last chunk, so that the batches may be sized by throughput
+    int is_measured;
+    double total_throughput;
+    atomic_uint next_tile;
+};
+
+struct multi_worker
+{
+    struct multi_job *job;
+    cl_uint index;
+    double throughput;
+    cl_ulong num_rays;
+    cl_int ret;
+};
+
+static inline double get_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Creates a session on each device, which are skipped if their session fails.
+ *
+ * @param devices the devices.
+ * @param num_devices the number of devices.
+ * @param width the image width.
+ * @param height the image height.
+ * @param multi a pointer to the multi-device session, which must be released with release_multi_session.
+ * @return cl_int the return code, which is that of the last failure if no session could be created.
+ */
+cl_int create_multi_session(const struct device_queue *devices, const cl_uint num_devices, const cl_uint width, const cl_uint height, struct multi_session *multi)
+{
+    cl_int ret = CL_DEVICE_NOT_FOUND;
+
+    memset(multi, 0, sizeof(struct multi_session));
+    multi->width = width;
+    multi->height = height;
+
+    multi->sessions = malloc(num_devices * sizeof(struct session));
+    multi->throughputs = calloc(num_devices, sizeof(double));
+    if (multi->sessions == NULL || multi->throughputs == NULL)
+    {
+        release_multi_session(multi);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for (cl_uint i = 0; i < num_devices; i++)
+    {
+        // tiles are only rendered by the megakernel
+        ret = create_session(devices[i].context, devices[i].device, devices[i].command_queue, width, height, 0, &multi->sessions[multi->num_sessions]);
+        if (ret == CL_SUCCESS)
+            multi->num_sessions++;
+        else
+            fprintf(stderr, "Skipping device %u, which failed to create a session with code '%d'.\n", i, ret);
+    }
+
+    if (multi->num_sessions == 0)
+    {
+        release_multi_session(multi);
+        return ret;
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Moves the camera of every device, and restarts the accumulation.
+ *
+ * @param multi the multi-device session.
+ * @param camera the camera.
+ * @return cl_int the return code.
+ */
+cl_int set_multi_session_camera(struct multi_session *multi, const struct camera *camera)
+{
+    cl_int ret;
+
+    multi->num_samples = 0;
+    for (cl_uint i = 0; i < multi->num_sessions; i++)
+    {
+        ret = set_session_camera(&multi->sessions[i], camera);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Replaces the scene of every device, and restarts the accumulation.
+ *
+ * @param multi the multi-device session.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param sphere_bvh the sphere bvh, which is empty to test every sphere.
+ * @param mesh the mesh, which may have no triangles.
+ * @param mesh_bvh the mesh bvh, which is empty to test every triangle.
+ * @param materials the materials of the triangles.
+ * @param num_materials the number of materials.
+ * @return cl_int the return code.
+ */
+cl_int set_multi_session_scene(struct multi_session *multi, const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const struct material *materials, const size_t num_materials)
+{
+    cl_int ret;
+
+    multi->num_samples = 0;
+    for (cl_uint i = 0; i < multi->num_sessions; i++)
+    {
+        ret = set_session_scene(&multi->sessions[i], spheres, num_spheres, sphere_bvh, mesh, mesh_bvh, materials, num_materials);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Replaces the scene of every device with a mapped scene file, which must stay mapped until the session is
+ * released or given another scene, and restarts the accumulation.
+ *
+ * @param multi the multi-device session.
+ * @param file the scene file.
+ * @return cl_int the return code.
+ */
+cl_int set_multi_session_scene_file(struct multi_session *multi, const struct scene_file *file)
+{
+    cl_int ret;
+
+    multi->num_samples = 0;
+    for (cl_uint i = 0; i < multi->num_sessions; i++)
+    {
+        ret = set_session_scene_file(&multi->sessions[i], file);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Replaces the accumulator, such as with a checkpoint to resume from, which the first device holds.
+ *
+ * @param multi the multi-device session.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @param num_samples the number of samples in the accumulator.
+ * @return cl_int the return code.
+ */
+cl_int write_multi_session_accumulator(struct multi_session *multi, const cl_float4 *accumulator, const cl_uint num_samples)
+{
+    cl_int ret;
+
+    ret = write_session_accumulator(&multi->sessions[0], accumulator, num_samples);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    for (cl_uint i = 1; i < multi->num_sessions; i++)
+    {
+        ret = reset_session(&multi->sessions[i]);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    multi->num_samples = num_samples;
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Reads the accumulator, which composites the tiles of every device by summing their accumulators.
+ *
+ * @param multi the multi-device session.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @return cl_int the return code.
+ */
+cl_int read_multi_session_accumulator(struct multi_session *multi, cl_float4 *accumulator)
+{
+    cl_int ret;
+
+    ret = read_session_accumulator(&multi->sessions[0], accumulator);
+    if (ret != CL_SUCCESS || multi->num_sessions == 1)
+        return ret;
+
+    size_t num_pixels = (size_t) multi->width * multi->height;
+    cl_float4 *device_accumulator = malloc(num_pixels * sizeof(cl_float4));
+    if (device_accumulator == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    for (cl_uint i = 1; i < multi->num_sessions; i++)
+    {
+        ret = read_session_accumulator(&multi->sessions[i], device_accumulator);
+        if (ret != CL_SUCCESS)
+            break;
+
+        // each pixel holds the samples of whichever device rendered its tile in each chunk, and its sample count
+        for (size_t j = 0; j < num_pixels; j++)
+        {
+            for (int k = 0; k < 4; k++)
+                accumulator[j].s[k] += device_accumulator[j].s[k];
+        }
+    }
+
+    free(device_accumulator);
+    return ret;
+}
+
+/**
+ * @brief Takes a batch of tiles from the queue of a chunk.
+ *
+ * This is guided scheduling weighted by throughput, where each device takes its share of half the remaining tiles.
+ * The batches shrink as the queue empties, so that the last batches finish together on devices of any speed.
+ *
+ * @param job the job.
+ * @param throughput the throughput of the device.
+ * @param first a pointer to the first tile of the batch.
+ * @return cl_uint the number of tiles in the batch, which is zero once the queue is empty.
+ */
+static cl_uint take_tiles(struct multi_job *job, const double throughput, cl_uint *first)
+{
+    cl_uint next = atomic_load(&job->next_tile);
+    cl_uint count;
+    do
+    {
+        if (next >= job->num_tiles)
+            return 0;
+
+        // until every device is measured, each takes one tile at a time
+        count = 1;
+        if (job->is_measured)
+        {
+            double share = throughput / job->total_throughput;
+            cl_uint guided_count = (job->num_tiles - next) * share / 2;
+            count = guided_count > 1 ? guided_count : 1;
+        }
+    } while (!atomic_compare_exchange_weak(&job->next_tile, &next, next + count));
+
+    *first = next;
+    return count;
+}
+
+/**
+ * @brief Renders batches of tiles on the session of one device until the queue is empty, and measures its throughput.
+ *
+ * @param arg the worker.
+ * @return void* NULL.
+ */
+static void *render_device_tiles(void *arg)
+{
+    struct multi_worker *worker = arg;
+    struct multi_job *job = worker->job;
+    struct session *session = &job->multi->sessions[worker->index];
+
+    cl_uint first;
+    cl_uint count;
+    while ((count = take_tiles(job, worker->throughput, &first)) > 0)
+    {
+        double start = get_time();
+        double pixel_samples = 0;
+        for (cl_uint tile = first; tile < first + count; tile++)
+        {
+            cl_uint x = tile % job->num_tiles_x * MULTI_TILE_SIZE;
+            cl_uint y = tile / job->num_tiles_x * MULTI_TILE_SIZE;
+            cl_uint width = job->multi->width - x < MULTI_TILE_SIZE ? job->multi->width - x : MULTI_TILE_SIZE;
+            cl_uint height = job->multi->height - y < MULTI_TILE_SIZE ? job->multi->height - y : MULTI_TILE_SIZE;
+
+            worker->ret = render_session_tile(session, x, y, width, height, job->sample_offset, job->num_samples, &worker->num_rays);
+            if (worker->ret != CL_SUCCESS)
+                return NULL;
+
+            pixel_samples += (double) width * height * job->num_samples;
+        }
+
+        // average with the last measurement, so that a single slow batch does not swing the share of a device
+        double measured = pixel_samples / (get_time() - start);
+        worker->throughput = worker->throughput == 0 ? measured : (worker->throughput + measured) / 2;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Renders samples on every device, and adds them to the accumulators.
+ *
+ * Each device renders on its own thread, taking batches of tiles from a shared queue. The throughput measured in
+ * each chunk sizes the batches of the next.
+ *
+ * @param multi the multi-device session.
+ * @param num_samples the number of samples.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @return cl_int the return code.
+ */
+cl_int render_multi_session_samples(struct multi_session *multi, const cl_uint num_samples, cl_ulong *num_rays)
+{
+    cl_int ret = CL_SUCCESS;
+
+    pthread_t *threads = malloc(multi->num_sessions * sizeof(pthread_t));
+    struct multi_worker *workers = malloc(multi->num_sessions * sizeof(struct multi_worker));
+    if (threads == NULL || workers == NULL)
+    {
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto cleanup;
+    }
+
+    cl_uint num_tiles_x = (multi->width + MULTI_TILE_SIZE - 1) / MULTI_TILE_SIZE;
+    cl_uint num_tiles = num_tiles_x * ((multi->height + MULTI_TILE_SIZE - 1) / MULTI_TILE_SIZE);
+
+    struct multi_job job = {multi, multi->num_samples, num_samples, num_tiles_x, num_tiles, 1, 0};
+    atomic_init(&job.next_tile, 0);
+
+    for (cl_uint i = 0; i < multi->num_sessions; i++)
+    {
+        job.is_measured &= multi->throughputs[i] > 0;
+        job.total_throughput += multi->throughputs[i];
+        workers[i] = (struct multi_worker){&job, i, multi->throughputs[i], 0, CL_SUCCESS};
+    }
+
+    // the calling thread renders on the first device
+    cl_uint num_started = 1;
+    for (; num_started < multi->num_sessions; num_started++)
+    {
+        if (pthread_create(&threads[num_started], NULL, render_device_tiles, &workers[num_started]) != 0)
+            break;
+    }
+
+    // devices whose threads failed to start leave their tiles to the others
+    render_device_tiles(&workers[0]);
+
+    for (cl_uint i = 1; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (cl_uint i = 0; i < num_started; i++)
+    {
+        *num_rays += workers[i].num_rays;
+        multi->throughputs[i] = workers[i].throughput;
+        if (workers[i].ret != CL_SUCCESS)
+            ret = workers[i].ret;
+    }
+
+    // a device which did not run has no measurement for this chunk, so the next chunk measures every device again
+    for (cl_uint i = num_started; i < multi->num_sessions; i++)
+        multi->throughputs[i] = 0;
+
+    if (ret == CL_SUCCESS)
+        multi->num_samples += num_samples;
+
+cleanup:
+    free(workers);
+    free(threads);
+    return ret;
+}
+
+void release_multi_session(struct multi_session *multi)
+{
+    for (cl_uint i = 0; i < multi->num_sessions; i++)
+        release_session(&multi->sessions[i]);
+
+    free(multi->sessions);
+    free(multi->throughputs);
+
+    memset(multi, 0, sizeof(struct multi_session));
+}
@@ -0,0 +1,38 @@
+#ifndef MULTI_H
+#define MULTI_H
+
+#include "gpulib.h"
+#include "session.h"
+
+// the side of the square tiles which the devices take, which is large enough to fill a device with one launch
+#define MULTI_TILE_SIZE 256
+
+/*
+ * A render session on several devices, which split each chunk of samples by tiles. The tiles are taken from a
+ * shared queue in batches sized by the measured throughput of each device, so that a slow device only holds the
+ * last few tiles of a chunk. Each device accumulates the tiles it rendered, and the accumulators are summed.
+ */
+struct multi_session
+{
+    struct session *sessions;
+    cl_uint num_sessions;
+    cl_uint width;
+    cl_uint height;
+
+    // the throughput of each device in the last chunk, in pixel samples per second, or zero until it is measured
+    double *throughputs;
+
+    // the number of samples in the accumulators together
+    cl_uint num_samples;
+};
+
+cl_int create_multi_session(const struct device_queue *devices, const cl_uint num_devices, const cl_uint width, const cl_uint height, struct multi_session *multi);
+cl_int set_multi_session_camera(struct multi_session *multi, const struct camera *camera);
+cl_int set_multi_session_scene(struct multi_session *multi, const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const struct material *materials, const size_t num_materials);
+cl_int set_multi_session_scene_file(struct multi_session *multi, const struct scene_file *file);
+cl_int write_multi_session_accumulator(struct multi_session *multi, const cl_float4 *accumulator, const cl_uint num_samples);
+cl_int read_multi_session_accumulator(struct multi_session *multi, cl_float4 *accumulator);
+cl_int render_multi_session_samples(struct multi_session *multi, const cl_uint num_samples, cl_ulong *num_rays);
+void release_multi_session(struct multi_session *multi);
+
+#endif
@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "output.h"
+
+/**
+ * @brief Parses the name of an image format.
+ * 
+ * @param name the name, which is one of ppm, ppm16, or pfm.
+ * @param format a pointer to the format.
+ * @return cl_int the return code.
+ */
+cl_int parse_image_format(const char *name, enum image_format *format)
+{
+    if (strcmp(name, "ppm") == 0)
+        *format = IMAGE_PPM;
+    else if (strcmp(name, "ppm16") == 0)
+        *format = IMAGE_PPM16;
+    else if (strcmp(name, "pfm") == 0)
+        *format = IMAGE_PFM;
+    else
+        return CL_INVALID_VALUE;
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Gets the image format of a path from its extension, where paths other than .pfm are 8-bit PPM.
+ * 
+ * @param path the image path.
+ * @return enum image_format the format.
+ */
+enum image_format get_image_format(const char *path)
+{
+    const char *extension = strrchr(path, '.');
+    if (extension != NULL && strcmp(extension, ".pfm") == 0)
+        return IMAGE_PFM;
+
+    return IMAGE_PPM;
+}
+
+/**
+ * @brief Converts the mean of the samples of a pixel to integer channels, which are clamped to the max value.
+ * 
+ * @param pixel the sample sums, with the sample count in w.
+ * @param max_value the max channel value.
+ * @param channels the red, green, and blue channels, followed by an unused channel.
+ */
+static inline void convert_pixel(const cl_float4 *pixel, const float max_value, int32_t *channels)
+{
+    float scale = pixel->w > 0 ? max_value / pixel->w : 0;
+
+#ifdef __SSE2__
+    // the second operand of max is returned for NaN, so NaN channels become zero
+    __m128 value = _mm_mul_ps(_mm_loadu_ps((const float *) pixel), _mm_set1_ps(scale));
+    value = _mm_min_ps(_mm_max_ps(value, _mm_setzero_ps()), _mm_set1_ps(max_value));
+    _mm_storeu_si128((__m128i *) channels, _mm_cvttps_epi32(value));
+#else
+    const float values[] = {pixel->x * scale, pixel->y * scale, pixel->z * scale};
+    for (size_t i = 0; i < 3; i++)
+        channels[i] = values[i] > 0 ? (values[i] < max_value ? values[i] : max_value) : 0;
+#endif
+}
+
+// the size of a pixel of an image file, which has three channels
+static inline size_t get_pixel_size(const enum image_format format)
+{
+    return 3 * (format == IMAGE_PPM ? 1 : format == IMAGE_PPM16 ? 2 : sizeof(float));
+}
+
+/**
+ * @brief Formats the header of an image file.
+ *
+ * @param header the header.
+ * @param size the size of the header.
+ * @param width the image width.
+ * @param height the image height.
+ * @param format the image format.
+ * @return int the length of the header.
+ */
+static int format_image_header(char *header, const size_t size, const cl_uint width, const cl_uint height, const enum image_format format)
+{
+    if (format == IMAGE_PFM)
+    {
+        // a negative scale marks little-endian floats
+        uint16_t byte_order = 1;
+        return snprintf(header, size, "PF\n%u %u\n%s\n", width, height, *(unsigned char *) &byte_order ? "-1.0" : "1.0");
+    }
+
+    // write the magic number, dimensions, and max value
+    return snprintf(header, size, "P6\n%u %u\n%u\n", width, height, format == IMAGE_PPM ? 255 : 65535);
+}
+
+/**
+ * @brief Converts the mean of the samples of consecutive pixels into the channels of an image file.
+ *
+ * @param pixels the per-pixel sample sums, with the sample count in w.
+ * @param num_pixels the number of pixels.
+ * @param format the image format.
+ * @param data the channels, of get_pixel_size bytes per pixel.
+ */
+static void convert_pixels(const cl_float4 *pixels, const size_t num_pixels, const enum image_format format, unsigned char *data)
+{
+    int32_t channels[4];
+    if (format == IMAGE_PFM)
+    {
+        float *values = (float *) data;
+        for (size_t i = 0; i < num_pixels; i++)
+        {
+            float scale = pixels[i].w > 0 ? 1.0f / pixels[i].w : 0;
+            *values++ = pixels[i].x * scale;
+            *values++ = pixels[i].y * scale;
+            *values++ = pixels[i].z * scale;
+        }
+    }
+    else if (format == IMAGE_PPM)
+    {
+        for (size_t i = 0; i < num_pixels; i++)
+        {
+            convert_pixel(&pixels[i], 255, channels);
+            data[3 * i] = channels[0];
+            data[3 * i + 1] = channels[1];
+            data[3 * i + 2] = channels[2];
+        }
+    }
+    else
+    {
+        // 16-bit channels are big-endian
+        for (size_t i = 0; i < num_pixels; i++)
+        {
+            convert_pixel(&pixels[i], 65535, channels);
+            for (size_t c = 0; c < 3; c++)
+            {
+                data[6 * i + 2 * c] = channels[c] >> 8;
+                data[6 * i + 2 * c + 1] = channels[c] & 0xff;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Writes the mean of the accumulated samples as a binary image, which is converted into memory and written at once.
+ * 
+ * @param path the image path.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @param width the image width.
+ * @param height the image height.
+ * @param format the image format.
+ * @return cl_int the return code.
+ */
+cl_int write_image(const char *path, const cl_float4 *accumulator, const cl_uint width, const cl_uint height, const enum image_format format)
+{
+    cl_int ret = CL_SUCCESS;
+
+    size_t num_pixels = (size_t) width * height;
+    size_t row_size = width * get_pixel_size(format);
+    size_t data_size = height * row_size;
+
+    unsigned char *data = malloc(data_size);
+    if (data == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    char header[64];
+    int header_size = format_image_header(header, sizeof(header), width, height, format);
+    if (format == IMAGE_PFM)
+    {
+        // rows are stored from the bottom of the image
+        for (size_t y = 0; y < height; y++)
+            convert_pixels(&accumulator[(height - 1 - y) * (size_t) width], width, format, &data[y * row_size]);
+    }
+    else
+    {
+        convert_pixels(accumulator, num_pixels, format, data);
+    }
+
+    FILE *image_file = fopen(path, "wb");
+    if (image_file == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    int failed = fwrite(header, 1, header_size, image_file) != (size_t) header_size;
+    failed |= fwrite(data, 1, data_size, image_file) != data_size;
+    failed |= fclose(image_file) != 0;
+    if (failed)
+        ret = 1;
+
+cleanup:
+    free(data);
+    return ret;
+}
+
+/**
+ * @brief Writes pixels which are already in display form, such as those of tonemap_image, as a binary 8-bit PPM.
+ *
+ * @param path the image path.
+ * @param image the 8-bit pixels, whose alpha is dropped.
+ * @param width the image width.
+ * @param height the image height.
+ * @return cl_int the return code.
+ */
+cl_int write_display_image(const char *path, const cl_uchar4 *image, const cl_uint width, const cl_uint height)
+{
+    cl_int ret = CL_SUCCESS;
+
+    size_t num_pixels = (size_t) width * height;
+    unsigned char *data = malloc(3 * num_pixels);
+    if (data == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    for (size_t i = 0; i < num_pixels; i++)
+        memcpy(&data[3 * i], &image[i], 3);
+
+    FILE *image_file = fopen(path, "wb");
+    if (image_file == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    int failed = fprintf(image_file, "P6\n%u %u\n255\n", width, height) < 0;
+    failed |= fwrite(data, 1, 3 * num_pixels, image_file) != 3 * num_pixels;
+    failed |= fclose(image_file) != 0;
+    if (failed)
+        ret = 1;
+
+cleanup:
+    free(data);
+    return ret;
+}
+
+/**
+ * @brief Creates an image file, into which the tiles of the image are then written at their offsets, so that the
+ * whole image is never held in memory.
+ *
+ * @param path the image path.
+ * @param width the image width.
+ * @param height the image height.
+ * @param format the image format.
+ * @param stream a pointer to the stream, which must be closed with close_image_stream.
+ * @return cl_int the return code.
+ */
+cl_int create_image_stream(const char *path, const cl_uint width, const cl_uint height, const enum image_format format, struct image_stream *stream)
+{
+    char header[64];
+    int header_size = format_image_header(header, sizeof(header), width, height, format);
+
+    *stream = (struct image_stream){fopen(path, "wb"), width, height, format, header_size, NULL, 0};
+    if (stream->file == NULL)
+        return 1;
+
+    if (fwrite(header, 1, header_size, stream->file) != (size_t) header_size)
+    {
+        close_image_stream(stream);
+        return 1;
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Writes the rows of a tile, which have been converted into the channels of the file, at their offsets.
+ *
+ * @param stream the stream.
+ * @param x the left of the tile.
+ * @param y the top of the tile.
+ * @param width the tile width.
+ * @param height the tile height.
+ * @return cl_int the return code.
+ */
+static cl_int write_stream_rows(struct image_stream *stream, const cl_uint x, const cl_uint y, const cl_uint width, const cl_uint height)
+{
+    size_t pixel_size = get_pixel_size(stream->format);
+    for (cl_uint row = 0; row < height; row++)
+    {
+        // rows of a PFM are stored from the bottom of the image
+        cl_uint image_row = stream->format == IMAGE_PFM ? stream->height - 1 - (y + row) : y + row;
+        off_t offset = stream->data_offset + ((off_t) image_row * stream->width + x) * pixel_size;
+        if (fseeko(stream->file, offset, SEEK_SET) != 0)
+            return 1;
+
+        if (fwrite(&stream->data[(size_t) row * width * pixel_size], pixel_size, width, stream->file) != width)
+            return 1;
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Grows the buffer into which the tiles of a stream are converted, to fit a tile.
+ *
+ * @param stream the stream.
+ * @param size the size of the tile in the file.
+ * @return cl_int the return code.
+ */
+static cl_int reserve_stream_data(struct image_stream *stream, const size_t size)
+{
+    if (size <= stream->data_size)
+        return CL_SUCCESS;
+
+    unsigned char *data = realloc(stream->data, size);
+    if (data == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    stream->data = data;
+    stream->data_size = size;
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Writes the mean of the accumulated samples of a tile into an image file, at the tile's offset.
+ *
+ * @param stream the stream.
+ * @param accumulator the per-pixel sample sums of the tile, with the sample count in w.
+ * @param stride the number of pixels between the rows of the accumulator.
+ * @param x the left of the tile.
+ * @param y the top of the tile.
+ * @param width the tile width.
+ * @param height the tile height.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the tile is not within the image.
+ */
+cl_int write_image_tile(struct image_stream *stream, const cl_float4 *accumulator, const size_t stride, const cl_uint x, const cl_uint y, const cl_uint width, const cl_uint height)
+{
+    cl_int ret;
+
+    if (x > stream->width || width > stream->width - x || y > stream->height || height > stream->height - y)
+        return CL_INVALID_VALUE;
+
+    size_t row_size = width * get_pixel_size(stream->format);
+    ret = reserve_stream_data(stream, height * row_size);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    for (cl_uint row = 0; row < height; row++)
+        convert_pixels(&accumulator[row * stride], width, stream->format, &stream->data[row * row_size]);
+
+    return write_stream_rows(stream, x, y, width, height);
+}
+
+/**
+ * @brief Writes the pixels of a tile which are already in display form into an 8-bit image file, at the tile's offset.
+ *
+ * @param stream the stream, which must be an 8-bit PPM.
+ * @param image the 8-bit pixels of the tile, whose alpha is dropped.
+ * @param stride the number of pixels between the rows of the image.
+ * @param x the left of the tile.
+ * @param y the top of the tile.
+ * @param width the tile width.
+ * @param height the tile height.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the tile is not within the image.
+ */
+cl_int write_display_tile(struct image_stream *stream, const cl_uchar4 *image, const size_t stride, const cl_uint x, const cl_uint y, const cl_uint width, const cl_uint height)
+{
+    cl_int ret;
+
+    if (stream->format != IMAGE_PPM || x > stream->width || width > stream->width - x || y > stream->height || height > stream->height - y)
+        return CL_INVALID_VALUE;
+
+    ret = reserve_stream_data(stream, 3 * (size_t) width * height);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    for (cl_uint row = 0; row < height; row++)
+    {
+        for (cl_uint column = 0; column < width; column++)
+            memcpy(&stream->data[3 * ((size_t) row * width + column)], &image[row * stride + column], 3);
+    }
+
+    return write_stream_rows(stream, x, y, width, height);
+}
+
+/**
+ * @brief Closes an image file, once every tile has been written.
+ *
+ * @param stream the stream.
+ * @return cl_int the return code, which reports a failure to flush the file.
+ */
+cl_int close_image_stream(struct image_stream *stream)
+{
+    cl_int ret = CL_SUCCESS;
+    if (stream->file != NULL && fclose(stream->file) != 0)
+        ret = 1;
+
+    free(stream->data);
+    memset(stream, 0, sizeof(struct image_stream));
+    return ret;
+}
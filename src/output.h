@@ -0,0 +1,42 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "gpulib.h"
+
+enum image_format
+{
+    // binary 8-bit PPM (P6)
+    IMAGE_PPM,
+    // binary 16-bit PPM (P6 with a max value of 65535)
+    IMAGE_PPM16,
+    // the unclamped mean of the samples, as a float PFM
+    IMAGE_PFM,
+};
+
+// an image file which is written a tile at a time, each at its offset, so that the whole image is never in memory
+struct image_stream
+{
+    FILE *file;
+    cl_uint width;
+    cl_uint height;
+    enum image_format format;
+    // the offset of the first pixel, after the header
+    off_t data_offset;
+    // the channels of the last tile, which is converted before it is written
+    unsigned char *data;
+    size_t data_size;
+};
+
+cl_int parse_image_format(const char *name, enum image_format *format);
+enum image_format get_image_format(const char *path);
+cl_int write_image(const char *path, const cl_float4 *accumulator, const cl_uint width, const cl_uint height, const enum image_format format);
+cl_int write_display_image(const char *path, const cl_uchar4 *image, const cl_uint width, const cl_uint height);
+cl_int create_image_stream(const char *path, const cl_uint width, const cl_uint height, const enum image_format format, struct image_stream *stream);
+cl_int write_image_tile(struct image_stream *stream, const cl_float4 *accumulator, const size_t stride, const cl_uint x, const cl_uint y, const cl_uint width, const cl_uint height);
+cl_int write_display_tile(struct image_stream *stream, const cl_uchar4 *image, const size_t stride, const cl_uint x, const cl_uint y, const cl_uint width, const cl_uint height);
+cl_int close_image_stream(struct image_stream *stream);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "partial.h"
+
+#define PARTIAL_MAGIC "FFPR"
+#define PARTIAL_VERSION 1
+
+struct partial_header
+{
+    char magic[4];
+    cl_uint version;
+    cl_uint width;
+    cl_uint height;
+    cl_uint first_sample;
+    cl_uint num_samples;
+    cl_uint reserved[2];
+};
+
+/**
+ * @brief Writes a partial render to disk, through a temporary file as checkpoints are written.
+ *
+ * @param path the partial render path.
+ * @param partial the partial render.
+ * @return cl_int the return code.
+ */
+cl_int write_partial_render(const char *path, const struct partial_render *partial)
+{
+    cl_int ret = 1;
+
+    size_t path_length = strlen(path);
+    char *temporary_path = malloc((path_length + sizeof(".tmp")) * sizeof(char));
+    if (temporary_path == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    memcpy(temporary_path, path, path_length);
+    memcpy(temporary_path + path_length, ".tmp", sizeof(".tmp"));
+
+    FILE *fp = fopen(temporary_path, "wb");
+    if (fp == NULL)
+        goto cleanup_path;
+
+    struct partial_header header = {PARTIAL_MAGIC, PARTIAL_VERSION, partial->width, partial->height, partial->first_sample, partial->num_samples, {0}};
+    size_t num_pixels = (size_t) partial->width * partial->height;
+
+    int failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+    failed |= fwrite(partial->sums, sizeof(cl_ulong4), num_pixels, fp) != num_pixels;
+    failed |= fclose(fp) != 0;
+
+    if (failed)
+    {
+        remove(temporary_path);
+        goto cleanup_path;
+    }
+
+    if (rename(temporary_path, path) == 0)
+        ret = CL_SUCCESS;
+
+cleanup_path:
+    free(temporary_path);
+    return ret;
+}
+
+/**
+ * @brief Reads a partial render written by write_partial_render.
+ *
+ * @param path the partial render path.
+ * @param partial a pointer to the partial render, which must be released with release_partial_render.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the file is not a partial render, or its range of samples
+ * overflows.
+ */
+cl_int read_partial_render(const char *path, struct partial_render *partial)
+{
+    cl_int ret = 1;
+
+    memset(partial, 0, sizeof(struct partial_render));
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return ret;
+
+    struct partial_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1)
+        goto cleanup_file;
+
+    // the range must end within the sample indices, so that merged ranges are compared without wrapping
+    if (memcmp(header.magic, PARTIAL_MAGIC, sizeof(header.magic)) != 0 || header.version != PARTIAL_VERSION || header.num_samples > CL_UINT_MAX - header.first_sample)
+    {
+        ret = CL_INVALID_VALUE;
+        goto cleanup_file;
+    }
+
+    size_t num_pixels = (size_t) header.width * header.height;
+    partial->sums = malloc(num_pixels * sizeof(cl_ulong4));
+    if (partial->sums == NULL)
+    {
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto cleanup_file;
+    }
+
+    if (fread(partial->sums, sizeof(cl_ulong4), num_pixels, fp) != num_pixels)
+    {
+        release_partial_render(partial);
+        goto cleanup_file;
+    }
+
+    partial->width = header.width;
+    partial->height = header.height;
+    partial->first_sample = header.first_sample;
+    partial->num_samples = header.num_samples;
+    ret = CL_SUCCESS;
+
+cleanup_file:
+    fclose(fp);
+    return ret;
+}
+
+/**
+ * @brief Adds a partial render to another.
+ *
+ * The sums are integers, so they are the same whatever order the partial renders are merged in. The merged render
+ * starts at the first of their first samples, and holds the samples of both, which only follow on from each other if
+ * the ranges neither overlap nor leave a gap, which the caller checks.
+ *
+ * @param merged the partial render which the other is added to.
+ * @param partial the partial render to add.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the images differ in size, or the samples of both do not
+ * fit in a range.
+ */
+cl_int merge_partial_render(struct partial_render *merged, const struct partial_render *partial)
+{
+    if (partial->width != merged->width || partial->height != merged->height || partial->num_samples > CL_UINT_MAX - merged->num_samples)
+        return CL_INVALID_VALUE;
+
+    merged->first_sample = partial->first_sample < merged->first_sample ? partial->first_sample : merged->first_sample;
+    merged->num_samples += partial->num_samples;
+
+    size_t num_pixels = (size_t) merged->width * merged->height;
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        for (int j = 0; j < 4; j++)
+            merged->sums[i].s[j] += partial->sums[i].s[j];
+    }
+
+    return CL_SUCCESS;
+}
+
+static int compare_ranges(const void *lhs, const void *rhs)
+{
+    const struct sample_range *a = lhs;
+    const struct sample_range *b = rhs;
+    return (a->first > b->first) - (a->first < b->first);
+}
+
+/**
+ * @brief Sorts the sample ranges of partial renders, and finds the first which does not follow on from the one before.
+ *
+ * @param ranges the ranges, which are sorted by their first sample.
+ * @param num_ranges the number of ranges.
+ * @return size_t the index of the first range which overlaps the one before it, or leaves a gap after it, or 0 if
+ * every range follows on from the one before.
+ */
+size_t find_sample_range_break(struct sample_range *ranges, const size_t num_ranges)
+{
+    qsort(ranges, num_ranges, sizeof(struct sample_range), compare_ranges);
+    for (size_t i = 1; i < num_ranges; i++)
+    {
+        if (ranges[i].first != ranges[i - 1].end)
+            return i;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Converts the exact sums of a partial render into an accumulator, from which images are written.
+ *
+ * @param partial the partial render.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ */
+void get_partial_accumulator(const struct partial_render *partial, cl_float4 *accumulator)
+{
+    size_t num_pixels = (size_t) partial->width * partial->height;
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        const cl_ulong4 *sum = &partial->sums[i];
+        accumulator[i] = (cl_float4){{(cl_float) (sum->x / (double) EXACT_SUM_SCALE), (cl_float) (sum->y / (double) EXACT_SUM_SCALE), (cl_float) (sum->z / (double) EXACT_SUM_SCALE), (cl_float) sum->w}};
+    }
+}
+
+void release_partial_render(struct partial_render *partial)
+{
+    free(partial->sums);
+    memset(partial, 0, sizeof(struct partial_render));
+}
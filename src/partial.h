@@ -0,0 +1,51 @@
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include <math.h>
+
+#include "gpulib.h"
+
+/*
+ * A partial render, of a range of the samples of a frame, which firefly-merge adds to the partial renders of the
+ * other ranges. Each sample is indexed by its pixel and its index in the frame, so it is the same whichever process
+ * renders it, and the samples are summed in fixed point, so that the sums do not depend on the order in which they
+ * are added. The merged image is then the same, bit for bit, however the frame was split.
+ */
+
+// the fixed point scale of the exact sums, which matches kernels/path-trace.cl
+#define EXACT_SUM_SCALE 16777216.0f
+
+struct partial_render
+{
+    cl_uint width;
+    cl_uint height;
+    // the samples of the frame which the sums hold, from first_sample
+    cl_uint first_sample;
+    cl_uint num_samples;
+    // the fixed point sums of the samples of each pixel, with the sample count in w
+    cl_ulong4 *sums;
+};
+
+// the samples of a partial render, by which merged ranges are checked to follow on from each other
+struct sample_range
+{
+    cl_uint first;
+    cl_uint end;
+    const char *path;
+};
+
+// a sample in fixed point, rounded to nearest even as convert_ulong_sat_rte rounds it on the device
+static inline cl_ulong get_exact_sample(const float value)
+{
+    float scaled = value * EXACT_SUM_SCALE;
+    return scaled > 0 ? (cl_ulong) nearbyintf(scaled) : 0;
+}
+
+cl_int write_partial_render(const char *path, const struct partial_render *partial);
+cl_int read_partial_render(const char *path, struct partial_render *partial);
+cl_int merge_partial_render(struct partial_render *merged, const struct partial_render *partial);
+size_t find_sample_range_break(struct sample_range *ranges, const size_t num_ranges);
+void get_partial_accumulator(const struct partial_render *partial, cl_float4 *accumulator);
+void release_partial_render(struct partial_render *partial);
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "preview.h"
+
+/**
+ * @brief Creates a framebuffer file of a black frame, and maps it.
+ *
+ * @param path the framebuffer path, such as a file in /dev/shm.
+ * @param width the image width.
+ * @param height the image height.
+ * @param framebuffer a pointer to the framebuffer, which must be released with release_preview_framebuffer.
+ * @return cl_int the return code.
+ */
+cl_int create_preview_framebuffer(const char *path, const cl_uint width, const cl_uint height, struct preview_framebuffer *framebuffer)
+{
+    size_t size = PREVIEW_PIXEL_OFFSET + (size_t) width * height * sizeof(cl_uchar4);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return CL_INVALID_VALUE;
+
+    // the file is extended with zeros, which are black and transparent until the first frame
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return CL_OUT_OF_RESOURCES;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return CL_OUT_OF_RESOURCES;
+
+    framebuffer->data = data;
+    framebuffer->size = size;
+    framebuffer->header = data;
+    framebuffer->pixels = (cl_uchar4 *) ((char *) data + PREVIEW_PIXEL_OFFSET);
+
+    memcpy(framebuffer->header->magic, PREVIEW_MAGIC, sizeof(PREVIEW_MAGIC));
+    framebuffer->header->width = width;
+    framebuffer->header->height = height;
+    framebuffer->header->num_samples = 0;
+    atomic_init(&framebuffer->header->frame, 0);
+
+    return CL_SUCCESS;
+}
+
+// marks the frame as being written, before its pixels are
+void begin_preview_frame(struct preview_framebuffer *framebuffer)
+{
+    atomic_fetch_add_explicit(&framebuffer->header->frame, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+// marks the frame as complete, once its pixels are written
+void end_preview_frame(struct preview_framebuffer *framebuffer, const cl_uint num_samples)
+{
+    framebuffer->header->num_samples = num_samples;
+    atomic_fetch_add_explicit(&framebuffer->header->frame, 1, memory_order_release);
+}
+
+void release_preview_framebuffer(struct preview_framebuffer *framebuffer)
+{
+    if (framebuffer->data != NULL)
+        munmap(framebuffer->data, framebuffer->size);
+
+    memset(framebuffer, 0, sizeof(struct preview_framebuffer));
+}
+
+/**
+ * @brief Parses a preview command, which is one of:
+ *
+ * position x y z: moves the camera to a point in world coordinates.
+ * rotation x y z: rotates the camera, by the Euler angles of struct camera in radians.
+ * fov angle: sets the vertical field of view in radians.
+ * quit: closes the preview.
+ *
+ * @param line the command, without its newline.
+ * @param camera the camera, which is changed by the command.
+ * @param is_closed a pointer to whether the command closes the preview.
+ * @return cl_int the return code, which is CL_INVALID_VALUE for a malformed command, which changes nothing.
+ */
+cl_int parse_preview_command(const char *line, struct camera *camera, int *is_closed)
+{
+    char name[16];
+    int length;
+    if (sscanf(line, "%15s%n", name, &length) != 1)
+        return CL_INVALID_VALUE;
+
+    const char *arguments = line + length;
+    cl_float3 vector;
+    cl_float value;
+    if (strcmp(name, "position") == 0 && sscanf(arguments, "%f %f %f", &vector.x, &vector.y, &vector.z) == 3)
+        camera->position = vector;
+    else if (strcmp(name, "rotation") == 0 && sscanf(arguments, "%f %f %f", &vector.x, &vector.y, &vector.z) == 3)
+        camera->rotation = vector;
+    else if (strcmp(name, "fov") == 0 && sscanf(arguments, "%f", &value) == 1 && value > 0)
+        camera->fov = value;
+    else if (strcmp(name, "quit") == 0)
+        *is_closed = 1;
+    else
+        return CL_INVALID_VALUE;
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Reads and applies every complete command on the input, waiting for the first if there is none yet.
+ *
+ * Only whole lines are applied, so a command written in parts waits for the rest. Malformed commands are reported,
+ * and ignored. The end of the input closes the preview.
+ *
+ * @param input the input.
+ * @param timeout the milliseconds to wait for a command, or -1 to wait until there is one.
+ * @param camera the camera, which is changed by the commands.
+ * @param is_moved a pointer to whether a command changed the camera, which is set rather than cleared.
+ * @param is_closed a pointer to whether the preview was closed.
+ * @return cl_int the return code.
+ */
+cl_int read_preview_input(struct preview_input *input, const int timeout, struct camera *camera, int *is_moved, int *is_closed)
+{
+    struct pollfd poll_fd = {input->fd, POLLIN, 0};
+    int wait = timeout;
+    while (!*is_closed && poll(&poll_fd, 1, wait) > 0)
+    {
+        // once there is input, the rest of the commands are only read if they are already there
+        wait = 0;
+
+        ssize_t count = read(input->fd, input->line + input->length, sizeof(input->line) - 1 - input->length);
+        if (count <= 0)
+        {
+            *is_closed = 1;
+            break;
+        }
+
+        input->length += count;
+        input->line[input->length] = '\0';
+
+        char *start = input->line;
+        char *end;
+        while ((end = strchr(start, '\n')) != NULL)
+        {
+            *end = '\0';
+            if (parse_preview_command(start, camera, is_closed) == CL_SUCCESS)
+                *is_moved |= !*is_closed;
+            else if (start[strspn(start, " \t\r")] != '\0')
+                fprintf(stderr, "Ignoring the preview command '%s'.\n", start);
+
+            start = end + 1;
+        }
+
+        // keep the incomplete line, or drop a line too long to be a command
+        input->length = input->line + input->length - start;
+        memmove(input->line, start, input->length);
+        if (input->length == sizeof(input->line) - 1)
+            input->length = 0;
+    }
+
+    return CL_SUCCESS;
+}
@@ -0,0 +1,57 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <stdatomic.h>
+
+#include "gpulib.h"
+#include "geometry.h"
+
+/*
+ * A preview renders until it is closed, restarting the accumulation whenever a command on its input moves the camera,
+ * and publishes each refinement of the frame to a framebuffer file, which a viewer maps. On Linux, a file in /dev/shm
+ * is shared memory, so frames are never written to disk.
+ */
+
+#define PREVIEW_MAGIC "FFPREVW"
+// the offset of the pixels in the framebuffer, which is a page, so that the pixels are page aligned
+#define PREVIEW_PIXEL_OFFSET 4096
+
+/*
+ * The header of a framebuffer, which is followed by the pixels at PREVIEW_PIXEL_OFFSET, as 8-bit sRGB RGBA. The frame
+ * is odd while the pixels are written, and even once they are complete, so that a viewer copies the pixels between
+ * two reads of the same even frame.
+ */
+struct preview_header
+{
+    char magic[8];
+    cl_uint width;
+    cl_uint height;
+    // the samples of each pixel in the frame, which is 1 for the first frame after each move
+    cl_uint num_samples;
+    atomic_uint frame;
+};
+
+struct preview_framebuffer
+{
+    void *data;
+    size_t size;
+    struct preview_header *header;
+    cl_uchar4 *pixels;
+};
+
+// the lines read from the input, which are buffered until they are complete
+struct preview_input
+{
+    int fd;
+    char line[256];
+    size_t length;
+};
+
+cl_int create_preview_framebuffer(const char *path, const cl_uint width, const cl_uint height, struct preview_framebuffer *framebuffer);
+void begin_preview_frame(struct preview_framebuffer *framebuffer);
+void end_preview_frame(struct preview_framebuffer *framebuffer, const cl_uint num_samples);
+void release_preview_framebuffer(struct preview_framebuffer *framebuffer);
+cl_int parse_preview_command(const char *line, struct camera *camera, int *is_closed);
+cl_int read_preview_input(struct preview_input *input, const int timeout, struct camera *camera, int *is_moved, int *is_closed);
+
+#endif
@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "profile.h"
+
+// the totals of a stage, over every span of that name
+struct profile_stage
+{
+    const char *name;
+    int is_device;
+    size_t count;
+    cl_ulong total;
+};
+
+/**
+ * @brief Gets the host time, in nanoseconds, on the clock of the host spans.
+ *
+ * @return cl_ulong the time.
+ */
+cl_ulong get_profile_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (cl_ulong) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// spans may be recorded from the threads which encode images, as well as from the thread which renders
+static pthread_mutex_t span_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static cl_int append_span(struct profile *profile, const struct profile_span *span)
+{
+    cl_int ret = CL_SUCCESS;
+
+    pthread_mutex_lock(&span_mutex);
+    if (profile->num_spans == profile->capacity)
+    {
+        size_t capacity = profile->capacity == 0 ? 256 : 2 * profile->capacity;
+        struct profile_span *spans = realloc(profile->spans, capacity * sizeof(struct profile_span));
+        if (spans == NULL)
+        {
+            ret = CL_OUT_OF_HOST_MEMORY;
+            goto unlock;
+        }
+
+        profile->spans = spans;
+        profile->capacity = capacity;
+    }
+
+    profile->spans[profile->num_spans++] = *span;
+
+unlock:
+    pthread_mutex_unlock(&span_mutex);
+    return ret;
+}
+
+/**
+ * @brief Records the device span of an event, which is read once the profile is written.
+ *
+ * The profile takes the reference to the event, which is released even if it cannot be recorded.
+ *
+ * @param profile the profile.
+ * @param name the stage, which must outlive the profile.
+ * @param event the event, from a command queue created with CL_QUEUE_PROFILING_ENABLE.
+ * @return cl_int the return code.
+ */
+cl_int add_profile_event(struct profile *profile, const char *name, const cl_event event)
+{
+    struct profile_span span = {name, 1, event, 0, 0, get_profile_time()};
+
+    cl_int ret = append_span(profile, &span);
+    if (ret != CL_SUCCESS)
+        clReleaseEvent(event);
+
+    return ret;
+}
+
+/**
+ * @brief Records a host span.
+ *
+ * @param profile the profile.
+ * @param name the stage, which must outlive the profile.
+ * @param start the start, from get_profile_time.
+ * @param end the end, from get_profile_time.
+ * @return cl_int the return code.
+ */
+cl_int add_profile_span(struct profile *profile, const char *name, const cl_ulong start, const cl_ulong end)
+{
+    struct profile_span span = {name, 0, NULL, start, end, end};
+    return append_span(profile, &span);
+}
+
+/**
+ * @brief Reads the device spans which have not been read, and moves them to the host clock.
+ *
+ * Each event is aligned by the host time at which it was recorded, which is taken as the time at which it was queued,
+ * so device spans are placed among the host spans to within the time of an enqueue call.
+ *
+ * @param profile the profile.
+ * @return cl_int the return code.
+ */
+static cl_int resolve_profile(struct profile *profile)
+{
+    cl_int ret = CL_SUCCESS;
+
+    for (size_t i = 0; i < profile->num_spans; i++)
+    {
+        struct profile_span *span = &profile->spans[i];
+        if (span->event == NULL)
+            continue;
+
+        cl_ulong queued, start, end;
+        ret = clWaitForEvents(1, &span->event);
+        ret |= clGetEventProfilingInfo(span->event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+        ret |= clGetEventProfilingInfo(span->event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        ret |= clGetEventProfilingInfo(span->event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        clReleaseEvent(span->event);
+        span->event = NULL;
+        span->start = span->recorded + (start - queued);
+        span->end = span->recorded + (end - queued);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Sums the time of every span of a stage.
+ *
+ * @param profile the profile.
+ * @param name the stage.
+ * @param total a pointer to the total, in nanoseconds.
+ * @return cl_int the return code.
+ */
+cl_int get_profile_stage_time(struct profile *profile, const char *name, cl_ulong *total)
+{
+    cl_int ret;
+
+    ret = resolve_profile(profile);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    *total = 0;
+    for (size_t i = 0; i < profile->num_spans; i++)
+    {
+        if (strcmp(profile->spans[i].name, name) == 0)
+            *total += profile->spans[i].end - profile->spans[i].start;
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Writes the spans as a Chrome trace, which chrome://tracing and Perfetto open.
+ *
+ * The host spans are on one track, and the device spans on another, in microseconds from the first span.
+ *
+ * @param profile the profile.
+ * @param path the trace path.
+ * @return cl_int the return code.
+ */
+cl_int write_chrome_trace(struct profile *profile, const char *path)
+{
+    cl_int ret;
+
+    ret = resolve_profile(profile);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        return 1;
+
+    cl_ulong origin = profile->num_spans > 0 ? profile->spans[0].start : 0;
+    for (size_t i = 0; i < profile->num_spans; i++)
+        origin = profile->spans[i].start < origin ? profile->spans[i].start : origin;
+
+    fprintf(fp, "{\"traceEvents\": [\n");
+    fprintf(fp, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, \"args\": {\"name\": \"host\"}},\n");
+    fprintf(fp, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 1, \"args\": {\"name\": \"device\"}}");
+    for (size_t i = 0; i < profile->num_spans; i++)
+    {
+        const struct profile_span *span = &profile->spans[i];
+        fprintf(fp, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", span->name, span->is_device, (span->start - origin) * 1e-3, (span->end - span->start) * 1e-3);
+    }
+
+    fprintf(fp, "\n],\n\"otherData\": {\"primary_rays\": %llu, \"bounce_rays\": %llu, \"shadow_rays\": %llu, \"roulette_terminations\": %llu}}\n",
+            (unsigned long long) profile->path_stats[PATH_STATS_PRIMARY], (unsigned long long) profile->path_stats[PATH_STATS_BOUNCE],
+            (unsigned long long) profile->path_stats[PATH_STATS_SHADOW], (unsigned long long) profile->path_stats[PATH_STATS_ROULETTE]);
+
+    return fclose(fp) == 0 ? CL_SUCCESS : 1;
+}
+
+/**
+ * @brief Prints the total time of each stage, and the path statistics, as a table.
+ *
+ * @param profile the profile.
+ * @param fp the file.
+ * @return cl_int the return code.
+ */
+cl_int print_profile_summary(struct profile *profile, FILE *fp)
+{
+    cl_int ret;
+
+    ret = resolve_profile(profile);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    struct profile_stage *stages = calloc(profile->num_spans + 1, sizeof(struct profile_stage));
+    if (stages == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    // the stages are few, so they are found by name in the order they first appear
+    size_t num_stages = 0;
+    cl_ulong device_total = 0;
+    cl_ulong host_total = 0;
+    for (size_t i = 0; i < profile->num_spans; i++)
+    {
+        const struct profile_span *span = &profile->spans[i];
+        size_t j = 0;
+        while (j < num_stages && (strcmp(stages[j].name, span->name) != 0 || stages[j].is_device != span->is_device))
+            j++;
+
+        if (j == num_stages)
+            stages[num_stages++] = (struct profile_stage){span->name, span->is_device, 0, 0};
+
+        stages[j].count++;
+        stages[j].total += span->end - span->start;
+        if (span->is_device)
+            device_total += span->end - span->start;
+        else
+            host_total += span->end - span->start;
+    }
+
+    fprintf(fp, "%-24s %-7s %8s %12s %12s %8s\n", "stage", "on", "calls", "total ms", "mean ms", "share");
+    for (size_t i = 0; i < num_stages; i++)
+    {
+        const struct profile_stage *stage = &stages[i];
+        cl_ulong total = stage->is_device ? device_total : host_total;
+        fprintf(fp, "%-24s %-7s %8zu %12.3f %12.3f %7.1f%%\n", stage->name, stage->is_device ? "device" : "host", stage->count, stage->total * 1e-6,
+                stage->total * 1e-6 / stage->count, total > 0 ? 100.0 * stage->total / total : 0);
+    }
+
+    const cl_ulong *stats = profile->path_stats;
+    if (stats[PATH_STATS_PRIMARY] > 0)
+    {
+        fprintf(fp, "Primary rays: %llu, bounce rays: %llu (%.2f per path), shadow rays: %llu, russian roulette terminations: %llu.\n",
+                (unsigned long long) stats[PATH_STATS_PRIMARY], (unsigned long long) stats[PATH_STATS_BOUNCE], (double) stats[PATH_STATS_BOUNCE] / stats[PATH_STATS_PRIMARY],
+                (unsigned long long) stats[PATH_STATS_SHADOW], (unsigned long long) stats[PATH_STATS_ROULETTE]);
+    }
+
+    free(stages);
+    return CL_SUCCESS;
+}
+
+void release_profile(struct profile *profile)
+{
+    for (size_t i = 0; i < profile->num_spans; i++)
+    {
+        if (profile->spans[i].event != NULL)
+            clReleaseEvent(profile->spans[i].event);
+    }
+
+    free(profile->spans);
+    memset(profile, 0, sizeof(struct profile));
+}
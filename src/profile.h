@@ -0,0 +1,65 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+
+#include "gpulib.h"
+
+/*
+ * A profile of a render, which records the device time of each launch and transfer from profiling events, the host
+ * time of spans such as encoding the image, and the path statistics counted by the render kernel. The command queues
+ * must be created with CL_QUEUE_PROFILING_ENABLE. The events are only read once the profile is written, so recording
+ * them does not wait for the device. Spans may be recorded from any thread, but the profile is only read once they stop.
+ */
+
+// the indices of the path statistics, which match kernels/path-trace.cl
+#define PATH_STATS_PRIMARY 0
+#define PATH_STATS_BOUNCE 1
+#define PATH_STATS_SHADOW 2
+#define PATH_STATS_ROULETTE 3
+#define NUM_PATH_STATS 4
+
+struct profile_span
+{
+    // the stage, which must outlive the profile, such as a string literal
+    const char *name;
+    int is_device;
+    // the event of a device span until it is read
+    cl_event event;
+    // the span in nanoseconds, on the host clock once the span is resolved
+    cl_ulong start;
+    cl_ulong end;
+    // the host time at which a device span was recorded, by which the device clock is aligned with the host clock
+    cl_ulong recorded;
+};
+
+struct profile
+{
+    struct profile_span *spans;
+    size_t num_spans;
+    size_t capacity;
+    // the primary rays, bounce rays, shadow rays and russian roulette terminations of the render kernel
+    cl_ulong path_stats[NUM_PATH_STATS];
+};
+
+cl_ulong get_profile_time(void);
+cl_int add_profile_event(struct profile *profile, const char *name, const cl_event event);
+cl_int add_profile_span(struct profile *profile, const char *name, const cl_ulong start, const cl_ulong end);
+cl_int get_profile_stage_time(struct profile *profile, const char *name, cl_ulong *total);
+cl_int write_chrome_trace(struct profile *profile, const char *path);
+cl_int print_profile_summary(struct profile *profile, FILE *fp);
+void release_profile(struct profile *profile);
+
+// the event argument of an enqueue call, which is only asked for when profiling
+static inline cl_event *get_profile_event(const struct profile *profile, cl_event *event)
+{
+    return profile != NULL ? event : NULL;
+}
+
+// records the event of an enqueue call, if there is a profile
+static inline cl_int record_profile_event(struct profile *profile, const char *name, const cl_event event)
+{
+    return profile != NULL ? add_profile_event(profile, name, event) : CL_SUCCESS;
+}
+
+#endif
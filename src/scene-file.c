@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scene-file.h"
+
+_Static_assert(sizeof(struct scene_file_header) == 136, "the scene file header must not depend on the compiler");
+
+static inline cl_ulong align_offset(const cl_ulong offset)
+{
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+/**
+ * @brief Writes a section at its offset, after zeros from the end of the previous section.
+ *
+ * @param fp the file.
+ * @param position a pointer to the end of the previous section, which is moved to the end of this one.
+ * @param section the section.
+ * @param data the array.
+ * @param element_size the size of each element of the array.
+ * @return int whether the section was written.
+ */
+static int write_section(FILE *fp, cl_ulong *position, const struct scene_file_section *section, const void *data, const size_t element_size)
+{
+    static const char zeros[SCENE_FILE_ALIGNMENT] = {0};
+
+    if (section->count == 0)
+        return 1;
+
+    size_t padding = section->offset - *position;
+    if (fwrite(zeros, 1, padding, fp) != padding || fwrite(data, element_size, section->count, fp) != section->count)
+        return 0;
+
+    *position = section->offset + section->count * element_size;
+    return 1;
+}
+
+/**
+ * @brief Writes a scene, with its bvhs, in the layout that the kernels read, so that it can be mapped and uploaded
+ * without parsing.
+ *
+ * The file is first written to a temporary file, which is then renamed over the destination.
+ *
+ * @param path the scene file path.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param sphere_bvh the sphere bvh, which is empty to test every sphere.
+ * @param mesh the mesh, which may have no triangles.
+ * @param mesh_bvh the mesh bvh, which is empty to test every triangle.
+ * @param materials the materials of the triangles.
+ * @param num_materials the number of materials.
+ * @return cl_int the return code.
+ */
+cl_int write_scene_file(const char *path, const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const struct material *materials, const size_t num_materials)
+{
+    cl_int ret = 1;
+
+    struct scene_file_header header = {SCENE_FILE_MAGIC, SCENE_FILE_VERSION, sizeof(struct sphere), sizeof(struct bvh_node), sizeof(struct triangle), sizeof(struct material), {0}};
+    header.spheres.count = num_spheres;
+    header.sphere_nodes.count = sphere_bvh->num_nodes;
+    header.vertices.count = mesh->num_vertices;
+    header.triangles.count = mesh->num_triangles;
+    header.triangle_nodes.count = mesh_bvh->num_nodes;
+    header.materials.count = num_materials;
+
+    struct
+    {
+        struct scene_file_section *section;
+        const void *data;
+        size_t element_size;
+    } sections[] = {
+        {&header.spheres, spheres, sizeof(struct sphere)},
+        {&header.sphere_nodes, sphere_bvh->nodes, sizeof(struct bvh_node)},
+        {&header.vertices, mesh->vertices, 3 * sizeof(cl_float)},
+        {&header.triangles, mesh->triangles, sizeof(struct triangle)},
+        {&header.triangle_nodes, mesh_bvh->nodes, sizeof(struct bvh_node)},
+        {&header.materials, materials, sizeof(struct material)},
+    };
+    size_t num_sections = sizeof(sections) / sizeof(sections[0]);
+
+    // each section starts on its own page
+    cl_ulong offset = sizeof(header);
+    for (size_t i = 0; i < num_sections; i++)
+    {
+        sections[i].section->offset = align_offset(offset);
+        offset = sections[i].section->offset + sections[i].section->count * sections[i].element_size;
+    }
+
+    size_t path_length = strlen(path);
+    char *temporary_path = malloc((path_length + sizeof(".tmp")) * sizeof(char));
+    if (temporary_path == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    memcpy(temporary_path, path, path_length);
+    memcpy(temporary_path + path_length, ".tmp", sizeof(".tmp"));
+
+    FILE *fp = fopen(temporary_path, "wb");
+    if (fp == NULL)
+        goto cleanup_path;
+
+    cl_ulong position = sizeof(header);
+    int failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+    for (size_t i = 0; i < num_sections; i++)
+        failed |= !write_section(fp, &position, sections[i].section, sections[i].data, sections[i].element_size);
+
+    failed |= fclose(fp) != 0;
+
+    if (failed)
+    {
+        remove(temporary_path);
+        goto cleanup_path;
+    }
+
+    if (rename(temporary_path, path) == 0)
+        ret = CL_SUCCESS;
+
+cleanup_path:
+    free(temporary_path);
+    return ret;
+}
+
+// whether a section is aligned, and lies within the file
+static inline int is_section_valid(const struct scene_file_section *section, const size_t element_size, const size_t file_size)
+{
+    if (section->count == 0)
+        return 1;
+
+    return section->offset % SCENE_FILE_ALIGNMENT == 0 && section->offset <= file_size && section->count <= (file_size - section->offset) / element_size;
+}
+
+// whether the nodes of a bvh only index nodes and primitives within the scene, which the kernels do not check
+static int is_bvh_valid(const struct bvh *bvh, const size_t num_primitives)
+{
+    for (cl_uint i = 0; i < bvh->num_nodes; i++)
+    {
+        const struct bvh_node *node = &bvh->nodes[i];
+        if (node->skip > bvh->num_nodes || node->offset > num_primitives || node->count > num_primitives - node->offset)
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Maps a scene file written by write_scene_file, whose arrays are then used in place.
+ *
+ * The header is checked against the struct layouts of this build, and the indices of the bvhs and triangles are
+ * checked against the arrays, so that a corrupt file cannot make the kernels read out of bounds.
+ *
+ * @param path the scene file path.
+ * @param file a pointer to the mapped scene, which must be released with unmap_scene_file.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the file is not a valid scene file.
+ */
+cl_int map_scene_file(const char *path, struct scene_file *file)
+{
+    cl_int ret = 1;
+
+    memset(file, 0, sizeof(struct scene_file));
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return ret;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1)
+        goto cleanup_file;
+
+    ret = CL_INVALID_VALUE;
+    if ((size_t) file_stat.st_size < sizeof(struct scene_file_header))
+        goto cleanup_file;
+
+    // the mapping is private and writable, so that spheres may be updated in place without changing the file
+    void *data = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        ret = 1;
+        goto cleanup_file;
+    }
+
+    file->data = data;
+    file->size = file_stat.st_size;
+
+    const struct scene_file_header *header = data;
+    if (memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != SCENE_FILE_VERSION)
+        goto cleanup_mapping;
+
+    if (header->sphere_size != sizeof(struct sphere) || header->node_size != sizeof(struct bvh_node) || header->triangle_size != sizeof(struct triangle) || header->material_size != sizeof(struct material))
+        goto cleanup_mapping;
+
+    if (!is_section_valid(&header->spheres, sizeof(struct sphere), file->size) || !is_section_valid(&header->sphere_nodes, sizeof(struct bvh_node), file->size)
+        || !is_section_valid(&header->vertices, 3 * sizeof(cl_float), file->size) || !is_section_valid(&header->triangles, sizeof(struct triangle), file->size)
+        || !is_section_valid(&header->triangle_nodes, sizeof(struct bvh_node), file->size) || !is_section_valid(&header->materials, sizeof(struct material), file->size))
+        goto cleanup_mapping;
+
+    // the kernels index nodes and primitives as uint
+    if (header->sphere_nodes.count > UINT32_MAX || header->triangle_nodes.count > UINT32_MAX || header->spheres.count + header->triangles.count > INT32_MAX)
+        goto cleanup_mapping;
+
+    char *bytes = data;
+    file->spheres = (struct sphere *)(bytes + header->spheres.offset);
+    file->num_spheres = header->spheres.count;
+    file->sphere_bvh = (struct bvh){(struct bvh_node *)(bytes + header->sphere_nodes.offset), header->sphere_nodes.count, NULL};
+    file->mesh = (struct mesh){(cl_float *)(bytes + header->vertices.offset), header->vertices.count, (struct triangle *)(bytes + header->triangles.offset), header->triangles.count};
+    file->mesh_bvh = (struct bvh){(struct bvh_node *)(bytes + header->triangle_nodes.offset), header->triangle_nodes.count, NULL};
+    file->materials = (struct material *)(bytes + header->materials.offset);
+    file->num_materials = header->materials.count;
+
+    if (!is_bvh_valid(&file->sphere_bvh, file->num_spheres) || !is_bvh_valid(&file->mesh_bvh, file->mesh.num_triangles))
+        goto cleanup_mapping;
+
+    for (size_t i = 0; i < file->mesh.num_triangles; i++)
+    {
+        const struct triangle *triangle = &file->mesh.triangles[i];
+        if (triangle->v0 >= file->mesh.num_vertices || triangle->v1 >= file->mesh.num_vertices || triangle->v2 >= file->mesh.num_vertices || triangle->material >= file->num_materials)
+            goto cleanup_mapping;
+    }
+
+    ret = CL_SUCCESS;
+
+cleanup_mapping:
+    if (ret != CL_SUCCESS)
+        unmap_scene_file(file);
+cleanup_file:
+    close(fd);
+    return ret;
+}
+
+void unmap_scene_file(struct scene_file *file)
+{
+    if (file->data != NULL)
+        munmap(file->data, file->size);
+
+    memset(file, 0, sizeof(struct scene_file));
+}
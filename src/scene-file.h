@@ -0,0 +1,66 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "gpulib.h"
+#include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
+
+#define SCENE_FILE_MAGIC "FFSCENE"
+#define SCENE_FILE_VERSION 1
+// the alignment of each section, which is a page, so that sections may be used in place by CL_MEM_USE_HOST_PTR and
+// as sub-buffers on any device
+#define SCENE_FILE_ALIGNMENT 4096
+
+// an array in a scene file, at an offset from the start of the file
+struct scene_file_section
+{
+    cl_ulong offset;
+    cl_ulong count;
+};
+
+/*
+ * The header of a scene file, which is followed by its sections in the host byte order. The struct sizes are
+ * recorded, so that a file written with a different layout is rejected rather than misread.
+ */
+struct scene_file_header
+{
+    char magic[8];
+    cl_uint version;
+    cl_uint sphere_size;
+    cl_uint node_size;
+    cl_uint triangle_size;
+    cl_uint material_size;
+    cl_uint reserved[3];
+    struct scene_file_section spheres;
+    struct scene_file_section sphere_nodes;
+    // the count is the number of vertices, each of three floats
+    struct scene_file_section vertices;
+    struct scene_file_section triangles;
+    struct scene_file_section triangle_nodes;
+    struct scene_file_section materials;
+};
+
+/*
+ * A scene file mapped into memory, whose arrays point into the mapping. The mapping is private, so the arrays may be
+ * modified without changing the file, and it must outlive any buffers which use it in place.
+ */
+struct scene_file
+{
+    void *data;
+    size_t size;
+
+    struct sphere *spheres;
+    size_t num_spheres;
+    struct bvh sphere_bvh;
+    struct mesh mesh;
+    struct bvh mesh_bvh;
+    struct material *materials;
+    size_t num_materials;
+};
+
+cl_int write_scene_file(const char *path, const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const struct material *materials, const size_t num_materials);
+cl_int map_scene_file(const char *path, struct scene_file *file);
+void unmap_scene_file(struct scene_file *file);
+
+#endif
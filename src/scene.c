@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+#include "adaptive.h"
+
+/**
+ * @brief Creates the smallpt Cornell box scene.
+ * 
+ * @param spheres a pointer to the allocated spheres.
+ * @param num_spheres a pointer to the number of spheres.
+ * @return cl_int the return code.
+ */
+cl_int create_cornell_box(struct sphere **spheres, size_t *num_spheres)
+{
+    // scene courtesy of smallpt
+    struct sphere s1;
+    s1.position = (cl_float3){81.6f, 1e4f + 1, 40.8f};
+    s1.colour = (cl_float3){0.75f, 0.25f, 0.25f};
+    s1.emission = (cl_float3){0, 0, 0};
+    s1.radius = 1e4f;
+
+    struct sphere s2;
+    s2.position = (cl_float3){81.6f, -1e4f + 99, 40.8f};
+    s2.colour = (cl_float3){0.25f, 0.25f, 0.75f};
+    s2.emission = (cl_float3){0, 0, 0};
+    s2.radius = 1e4f;
+
+    struct sphere s3;
+    s3.position = (cl_float3){1e4f, 50, 40.8f};
+    s3.colour = (cl_float3){0.75f, 0.75f, 0.75f};
+    s3.emission = (cl_float3){0, 0, 0};
+    s3.radius = 1e4f;
+
+    struct sphere s4;
+    s4.position = (cl_float3){-1e4 + 170, 50, 40.8f};
+    s4.colour = (cl_float3){0, 0, 0};
+    s4.emission = (cl_float3){0, 0, 0};
+    s4.radius = 1e4f;
+
+    struct sphere s5;
+    s5.position = (cl_float3){81.6f, 50, 1e4f};
+    s5.colour = (cl_float3){0.75f, 0.75f, 0.75f};
+    s5.emission = (cl_float3){0, 0, 0};
+    s5.radius = 1e4f;
+
+    struct sphere s6;
+    s6.position = (cl_float3){81.6f, 50, -1e4 + 81.6f};
+    s6.colour = (cl_float3){0.75f, 0.75f, 0.75f};
+    s6.emission = (cl_float3){0, 0, 0};
+    s6.radius = 1e4f;
+
+    struct sphere s7;
+    s7.position = (cl_float3){47, 27, 16.5f};
+    s7.colour = (cl_float3){1, 1, 1};
+    s7.emission = (cl_float3){0, 0, 0};
+    s7.radius = 16.5f;
+
+    struct sphere s8;
+    s8.position = (cl_float3){78, 73, 16.5f};
+    s8.colour = (cl_float3){1, 1, 1};
+    s8.emission = (cl_float3){0, 0, 0};
+    s8.radius = 16.5f;
+
+    struct sphere s9;
+    s9.position = (cl_float3){81.6f, 50, 55};
+    s9.colour = (cl_float3){0, 0, 0};
+    s9.emission = (cl_float3){14, 14, 14};
+    s9.radius = 6.5f;
+
+    struct sphere scene_spheres[] = {s1, s2, s3, s4, s5, s6, s7, s8, s9};
+    *num_spheres = sizeof(scene_spheres) / sizeof(struct sphere);
+
+    *spheres = malloc(sizeof(scene_spheres));
+    if (*spheres == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    memcpy(*spheres, scene_spheres, sizeof(scene_spheres));
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Generates a uniform random number in [0, 1) with xorshift, so that generated scenes are reproducible.
+ * 
+ * @param state the generator state, which must be non-zero.
+ * @return float the random number.
+ */
+static inline float random_float(cl_uint *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+
+    return (*state >> 8) / 16777216.0f;
+}
+
+/**
+ * @brief Appends small diffuse spheres at random positions inside the Cornell box, to stress scenes with many primitives.
+ * 
+ * @param spheres a pointer to the spheres, which is reallocated.
+ * @param num_spheres a pointer to the number of spheres.
+ * @param count the number of spheres to add.
+ * @param seed the seed for the sphere positions.
+ * @return cl_int the return code.
+ */
+cl_int add_random_spheres(struct sphere **spheres, size_t *num_spheres, const size_t count, const cl_uint seed)
+{
+    struct sphere *resized = realloc(*spheres, (*num_spheres + count) * sizeof(struct sphere));
+    if (resized == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    *spheres = resized;
+
+    cl_uint state = seed == 0 ? 1 : seed;
+    for (size_t i = 0; i < count; i++)
+    {
+        struct sphere s;
+        s.position = (cl_float3){10 + 150 * random_float(&state), 5 + 90 * random_float(&state), 5 + 70 * random_float(&state)};
+        s.colour = (cl_float3){0.25f + 0.75f * random_float(&state), 0.25f + 0.75f * random_float(&state), 0.25f + 0.75f * random_float(&state)};
+        s.emission = (cl_float3){0, 0, 0};
+        s.radius = 0.25f + 1.75f * random_float(&state);
+
+        (*spheres)[(*num_spheres)++] = s;
+    }
+
+    return CL_SUCCESS;
+}
+
+// the power of an emitting sphere, up to a constant factor
+static inline float get_sphere_power(const struct sphere *sphere)
+{
+    return get_luminance(sphere->emission.x, sphere->emission.y, sphere->emission.z) * sphere->radius * sphere->radius;
+}
+
+/**
+ * @brief Builds the alias table of the emitting spheres, which picks each in proportion to its power.
+ *
+ * The power of a sphere is taken as the luminance of its emission times its surface area. This is the same from
+ * every point, so the table is built once per scene, and the solid angle of the picked sphere is left to the cone
+ * which its shadow ray samples. The table is built with Vose's method, which pairs each entry below the mean with one
+ * above it, so that every entry holds at most two spheres.
+ *
+ * @param spheres the spheres.
+ * @param num_spheres the number of spheres.
+ * @param lights a pointer to the allocated entries, which is NULL if no sphere emits.
+ * @param num_lights a pointer to the number of entries.
+ * @return cl_int the return code.
+ */
+cl_int build_light_table(const struct sphere *spheres, const size_t num_spheres, struct light **lights, size_t *num_lights)
+{
+    cl_int ret = CL_SUCCESS;
+
+    *lights = NULL;
+    *num_lights = 0;
+
+    double total_power = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < num_spheres; i++)
+    {
+        float power = get_sphere_power(&spheres[i]);
+        if (power > 0)
+        {
+            total_power += power;
+            count++;
+        }
+    }
+
+    if (count == 0)
+        return CL_SUCCESS;
+
+    struct light *table = malloc(count * sizeof(struct light));
+    // the probabilities scaled by the number of entries, and the entries below and above one
+    double *scaled = malloc(count * sizeof(double));
+    size_t *small = malloc(count * sizeof(size_t));
+    size_t *large = malloc(count * sizeof(size_t));
+    if (table == NULL || scaled == NULL || small == NULL || large == NULL)
+    {
+        free(table);
+        ret = CL_OUT_OF_HOST_MEMORY;
+        goto cleanup;
+    }
+
+    size_t num_small = 0;
+    size_t num_large = 0;
+    for (size_t i = 0, j = 0; i < num_spheres; i++)
+    {
+        float power = get_sphere_power(&spheres[i]);
+        if (power <= 0)
+            continue;
+
+        table[j] = (struct light){i, j, 1, power / total_power};
+        scaled[j] = power / total_power * count;
+        if (scaled[j] < 1)
+            small[num_small++] = j;
+        else
+            large[num_large++] = j;
+
+        j++;
+    }
+
+    // each entry below one is filled up to one by an entry above it, which may then fall below one itself
+    while (num_small > 0 && num_large > 0)
+    {
+        size_t s = small[--num_small];
+        size_t l = large[--num_large];
+
+        table[s].threshold = scaled[s];
+        table[s].alias = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1)
+            small[num_small++] = l;
+        else
+            large[num_large++] = l;
+    }
+
+    // the entries left over are within rounding of one, and keep their own sphere
+    *lights = table;
+    *num_lights = count;
+
+cleanup:
+    free(scaled);
+    free(small);
+    free(large);
+
+    return ret;
+}
+
+/**
+ * @brief Copies the centres and squared radii of the spheres into padded arrays, from which SPHERE_LANES spheres are
+ * intersected at once.
+ *
+ * @param spheres the spheres.
+ * @param num_spheres the number of spheres.
+ * @param components a pointer to the allocated x, y, z and squared radius arrays, each num_spheres + SPHERE_LANES long.
+ * @param size a pointer to the size of the arrays in bytes.
+ * @return cl_int the return code.
+ */
+cl_int build_sphere_components(const struct sphere *spheres, const size_t num_spheres, float **components, size_t *size)
+{
+    size_t stride = num_spheres + SPHERE_LANES;
+    float *x = calloc(4 * stride, sizeof(float));
+    if (x == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    float *y = x + stride;
+    float *z = y + stride;
+    float *radius2 = z + stride;
+    for (size_t i = 0; i < num_spheres; i++)
+    {
+        x[i] = spheres[i].position.x;
+        y[i] = spheres[i].position.y;
+        z[i] = spheres[i].position.z;
+        radius2[i] = spheres[i].radius * spheres[i].radius;
+    }
+
+    *components = x;
+    *size = 4 * stride * sizeof(float);
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Sets the scene arguments of a kernel, which are declared with SCENE_PARAMETERS.
+ * 
+ * @param kernel the kernel.
+ * @param first_index the index of the first scene argument.
+ * @param scene the scene buffers.
+ * @return cl_int the return code.
+ */
+cl_int set_scene_args(const cl_kernel kernel, const cl_uint first_index, const struct scene_buffers *scene)
+{
+    cl_int ret;
+
+    ret = clSetKernelArg(kernel, first_index, sizeof(cl_mem), &scene->spheres);
+    ret |= clSetKernelArg(kernel, first_index + 1, sizeof(cl_mem), &scene->sphere_components);
+    ret |= clSetKernelArg(kernel, first_index + 2, sizeof(cl_uint), &scene->num_spheres);
+    ret |= clSetKernelArg(kernel, first_index + 3, sizeof(cl_mem), &scene->sphere_nodes);
+    ret |= clSetKernelArg(kernel, first_index + 4, sizeof(cl_uint), &scene->num_sphere_nodes);
+    ret |= clSetKernelArg(kernel, first_index + 5, sizeof(cl_mem), &scene->vertices);
+    ret |= clSetKernelArg(kernel, first_index + 6, sizeof(cl_mem), &scene->triangles);
+    ret |= clSetKernelArg(kernel, first_index + 7, sizeof(cl_uint), &scene->num_triangles);
+    ret |= clSetKernelArg(kernel, first_index + 8, sizeof(cl_mem), &scene->triangle_nodes);
+    ret |= clSetKernelArg(kernel, first_index + 9, sizeof(cl_uint), &scene->num_triangle_nodes);
+    ret |= clSetKernelArg(kernel, first_index + 10, sizeof(cl_mem), &scene->materials);
+    ret |= clSetKernelArg(kernel, first_index + 11, sizeof(cl_mem), &scene->lights);
+    ret |= clSetKernelArg(kernel, first_index + 12, sizeof(cl_uint), &scene->num_lights);
+
+    return ret;
+}
@@ -0,0 +1,71 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stddef.h>
+
+#include "gpulib.h"
+
+/*
+ * A sphere, whose layout matches struct sphere in kernels/scene.cl and scene files. The cl_float3 are 16 byte aligned
+ * on both sides, and the radius is padded to the same alignment, so that arrays of spheres have no holes.
+ */
+struct sphere
+{
+    cl_float3 position;
+    cl_float3 colour;
+    cl_float3 emission;
+    cl_float radius;
+    cl_float padding[3];
+};
+
+_Static_assert(sizeof(struct sphere) == 64, "struct sphere must match the kernel");
+_Static_assert(offsetof(struct sphere, radius) == 48, "struct sphere must match the kernel");
+
+/*
+ * An entry of the light alias table, whose layout matches struct light in kernels/scene.cl. Each emitting sphere has
+ * an entry, picked uniformly, which keeps its own sphere below the threshold and gives way to its alias above it, so
+ * that one lookup picks a sphere in proportion to its power, however many emit.
+ */
+struct light
+{
+    cl_uint sphere;
+    cl_uint alias;
+    cl_float threshold;
+    // the probability with which the sphere of this entry is picked
+    cl_float probability;
+};
+
+_Static_assert(sizeof(struct light) == 16, "struct light must match the kernel");
+
+/*
+ * The spheres are also intersected from arrays of their centre x, y and z and their squared radius, which the kernels
+ * and the CPU backend load SPHERE_LANES at a time. Each array is padded by SPHERE_LANES, so that the last spheres load
+ * together with the lanes after them, and the arrays follow each other at a stride of num_spheres + SPHERE_LANES.
+ */
+#define SPHERE_LANES 8
+
+// the device buffers of a scene, in the order of SCENE_PARAMETERS in kernels/scene.cl
+struct scene_buffers
+{
+    cl_mem spheres;
+    cl_mem sphere_components;
+    cl_uint num_spheres;
+    cl_mem sphere_nodes;
+    cl_uint num_sphere_nodes;
+    cl_mem vertices;
+    cl_mem triangles;
+    cl_uint num_triangles;
+    cl_mem triangle_nodes;
+    cl_uint num_triangle_nodes;
+    cl_mem materials;
+    cl_mem lights;
+    cl_uint num_lights;
+};
+
+cl_int create_cornell_box(struct sphere **spheres, size_t *num_spheres);
+cl_int add_random_spheres(struct sphere **spheres, size_t *num_spheres, const size_t count, const cl_uint seed);
+cl_int build_light_table(const struct sphere *spheres, const size_t num_spheres, struct light **lights, size_t *num_lights);
+cl_int build_sphere_components(const struct sphere *spheres, const size_t num_spheres, float **components, size_t *size);
+cl_int set_scene_args(const cl_kernel kernel, const cl_uint first_index, const struct scene_buffers *scene);
+
+#endif
@@ -0,0 +1,1513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "session.h"
+#include "denoise.h"
+
+/**
+ * @brief Writes data to a scene buffer, which is only reallocated when the data outgrows it.
+ *
+ * @param session the session.
+ * @param buffer a pointer to the buffer, which is NULL until data is first written.
+ * @param capacity a pointer to the size of the buffer.
+ * @param data the data.
+ * @param size the size of the data.
+ * @return cl_int the return code.
+ */
+static cl_int write_scene_buffer(struct session *session, cl_mem *buffer, size_t *capacity, const void *data, const size_t size)
+{
+    cl_int ret = CL_SUCCESS;
+
+    if (size > *capacity)
+    {
+        if (*buffer != NULL)
+            clReleaseMemObject(*buffer);
+
+        *buffer = clCreateBuffer(session->context, CL_MEM_READ_ONLY, size, NULL, &ret);
+        if (ret != CL_SUCCESS)
+        {
+            *buffer = NULL;
+            *capacity = 0;
+            return ret;
+        }
+
+        *capacity = size;
+    }
+
+    if (size == 0)
+        return CL_SUCCESS;
+
+    cl_event event;
+    ret = clEnqueueWriteBuffer(session->command_queue, *buffer, CL_TRUE, 0, size, data, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return record_profile_event(session->profile, "upload scene", event);
+}
+
+static void release_mem_object(cl_mem buffer)
+{
+    if (buffer != NULL)
+        clReleaseMemObject(buffer);
+}
+
+/**
+ * @brief Releases the scene buffers, so that the next scene allocates its own.
+ *
+ * @param session the session.
+ */
+static void release_scene_buffers(struct session *session)
+{
+    release_mem_object(session->scene.spheres);
+    release_mem_object(session->scene.sphere_components);
+    release_mem_object(session->scene.sphere_nodes);
+    release_mem_object(session->scene.vertices);
+    release_mem_object(session->scene.triangles);
+    release_mem_object(session->scene.triangle_nodes);
+    release_mem_object(session->scene.materials);
+    release_mem_object(session->scene.lights);
+    release_mem_object(session->scene_file_buf);
+
+    memset(&session->scene, 0, sizeof(struct scene_buffers));
+    session->scene_file_buf = NULL;
+    session->sphere_capacity = 0;
+    session->sphere_component_capacity = 0;
+    session->sphere_node_capacity = 0;
+    session->vertex_capacity = 0;
+    session->triangle_capacity = 0;
+    session->triangle_node_capacity = 0;
+    session->material_capacity = 0;
+    session->light_capacity = 0;
+}
+
+/**
+ * @brief Copies the spheres and their bvh nodes to the host copies, which update_session_spheres modifies.
+ *
+ * @param session the session.
+ * @param spheres the spheres.
+ * @param num_spheres the number of spheres.
+ * @param sphere_bvh the sphere bvh.
+ * @return cl_int the return code.
+ */
+static cl_int copy_host_spheres(struct session *session, const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh)
+{
+    size_t sphere_size = num_spheres * sizeof(struct sphere);
+    size_t sphere_node_size = sphere_bvh->num_nodes * sizeof(struct bvh_node);
+
+    // keep the old copies until the new ones are allocated, so that a failure leaves the session as it was
+    struct sphere *resized_spheres = realloc(session->spheres, sphere_size + sizeof(struct sphere));
+    if (resized_spheres == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    session->spheres = resized_spheres;
+
+    struct bvh_node *resized_nodes = realloc(session->sphere_bvh.nodes, sphere_node_size + sizeof(struct bvh_node));
+    if (resized_nodes == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    session->sphere_bvh.nodes = resized_nodes;
+
+    memcpy(session->spheres, spheres, sphere_size);
+    memcpy(session->sphere_bvh.nodes, sphere_bvh->nodes, sphere_node_size);
+    session->sphere_bvh.num_nodes = sphere_bvh->num_nodes;
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Copies the centres and squared radii of the host copies of the spheres into padded arrays, and uploads them.
+ *
+ * The sphere components buffer may be reallocated, so the render arguments must be set after.
+ *
+ * @param session the session.
+ * @return cl_int the return code.
+ */
+static cl_int write_sphere_components(struct session *session)
+{
+    cl_int ret;
+
+    float *components;
+    size_t size;
+    ret = build_sphere_components(session->spheres, session->scene.num_spheres, &components, &size);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_scene_buffer(session, &session->scene.sphere_components, &session->sphere_component_capacity, components, size);
+
+    free(components);
+    return ret;
+}
+
+/**
+ * @brief Builds the light alias table from the host copies of the spheres, and uploads it.
+ *
+ * The lights buffer may be reallocated, so the render arguments must be set after.
+ *
+ * @param session the session.
+ * @return cl_int the return code.
+ */
+static cl_int write_light_table(struct session *session)
+{
+    cl_int ret;
+
+    struct light *lights;
+    size_t num_lights;
+    ret = build_light_table(session->spheres, session->scene.num_spheres, &lights, &num_lights);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_scene_buffer(session, &session->scene.lights, &session->light_capacity, lights, num_lights * sizeof(struct light));
+    if (ret == CL_SUCCESS)
+        session->scene.num_lights = num_lights;
+
+    free(lights);
+    return ret;
+}
+
+// the sources of the programs, of which the render megakernel may also be built specialized
+static const char *path_trace_sources[] = {"kernels/sampler.cl", "kernels/scene.cl", "kernels/camera.cl", "kernels/path-trace.cl", "kernels/denoise.cl", "kernels/tonemap.cl"};
+static const char *wavefront_sources[] = {"kernels/sampler.cl", "kernels/scene.cl", "kernels/camera.cl", "kernels/wavefront.cl", "kernels/tonemap.cl"};
+
+// the work groups of the persistent render kernel per compute unit, enough to hide latency on current GPUs, beyond
+// which the extra groups only find the queue empty
+#define PERSISTENT_GROUPS_PER_UNIT 8
+
+/**
+ * @brief Formats the build options which specialize the render kernel for the image size and scene counts of a session.
+ *
+ * @param session the session.
+ * @param options the options.
+ * @param size the size of the options, including the terminator.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the options do not fit.
+ */
+cl_int get_session_specialization(const struct session *session, char *options, const size_t size)
+{
+    const struct scene_buffers *scene = &session->scene;
+    int length = snprintf(options, size, "-D SPECIALIZED_WIDTH=%u -D SPECIALIZED_HEIGHT=%u -D SPECIALIZED_NUM_SPHERES=%u -D SPECIALIZED_NUM_SPHERE_NODES=%u "
+                                         "-D SPECIALIZED_NUM_TRIANGLES=%u -D SPECIALIZED_NUM_TRIANGLE_NODES=%u -D SPECIALIZED_NUM_LIGHTS=%u",
+                          session->width, session->height, scene->num_spheres, scene->num_sphere_nodes, scene->num_triangles, scene->num_triangle_nodes, scene->num_lights);
+
+    return length >= 0 && (size_t) length < size ? CL_SUCCESS : CL_INVALID_VALUE;
+}
+
+/**
+ * @brief Replaces the render kernel with one from the generic program, or from a program built with options.
+ *
+ * Programs are cached by their options, so each specialization is only compiled the first time it is used. The kernel
+ * is the persistent one if the session uses it.
+ *
+ * @param session the session.
+ * @param options the build options, or NULL for the generic program.
+ * @return cl_int the return code.
+ */
+static cl_int create_render_kernel(struct session *session, const char *options)
+{
+    cl_int ret;
+
+    cl_kernel kernel = NULL;
+    cl_program program = session->program;
+    cl_ulong start = get_profile_time();
+    if (options != NULL)
+    {
+        ret = create_cl_program(session->context, session->device, path_trace_sources, 6, options, &program);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    kernel = clCreateKernel(program, session->use_persistent ? "render_persistent" : "render", &ret);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    size_t local_size;
+    ret = clGetKernelWorkGroupInfo(kernel, session->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &local_size, NULL);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    if (session->kernel != NULL)
+        clReleaseKernel(session->kernel);
+
+    if (session->specialized_program != NULL)
+        clReleaseProgram(session->specialized_program);
+
+    session->kernel = kernel;
+    session->specialized_program = options != NULL ? program : NULL;
+    session->local_size = (size_t) sqrt(local_size);
+    session->persistent_local_size = local_size;
+
+    if (options != NULL && session->profile != NULL)
+        return add_profile_span(session->profile, "specialize render kernel", start, get_profile_time());
+
+    return CL_SUCCESS;
+
+cleanup:
+    if (kernel != NULL)
+        clReleaseKernel(kernel);
+
+    if (program != session->program)
+        clReleaseProgram(program);
+
+    return ret;
+}
+
+/**
+ * @brief Rebuilds the render kernel if it is specialized for a different image or scene from the session's.
+ *
+ * @param session the session.
+ * @return cl_int the return code.
+ */
+static cl_int update_specialization(struct session *session)
+{
+    cl_int ret;
+
+    char options[sizeof(session->specialization)] = "";
+    if (session->is_specialized)
+    {
+        ret = get_session_specialization(session, options, sizeof(options));
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    if (strcmp(options, session->specialization) == 0)
+        return CL_SUCCESS;
+
+    ret = create_render_kernel(session, session->is_specialized ? options : NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    strcpy(session->specialization, options);
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Sets the arguments of the render kernel or wavefront stages, which change with the camera or scene buffers.
+ *
+ * A specialized render kernel is first rebuilt if the scene counts have changed, so that every argument is set on the
+ * kernel which will be launched.
+ *
+ * @param session the session.
+ * @return cl_int the return code.
+ */
+static cl_int set_render_args(struct session *session)
+{
+    cl_int ret;
+
+    if (session->use_wavefront)
+        return set_wavefront_args(&session->wavefront, session->accumulator_buf, session->camera_quat, session->z_distance, session->camera.position, session->width, session->height, &session->scene);
+
+    ret = update_specialization(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = clSetKernelArg(session->kernel, 0, sizeof(cl_mem), &session->accumulator_buf);
+    ret |= clSetKernelArg(session->kernel, 1, sizeof(cl_mem), &session->ray_count_buf);
+    ret |= set_scene_args(session->kernel, 2, &session->scene);
+    ret |= clSetKernelArg(session->kernel, 15, sizeof(cl_float4), &session->camera_quat);
+    ret |= clSetKernelArg(session->kernel, 16, sizeof(cl_float), &session->z_distance);
+    ret |= clSetKernelArg(session->kernel, 17, sizeof(cl_float3), &session->camera.position);
+    ret |= clSetKernelArg(session->kernel, 18, sizeof(cl_uint), &session->height);
+    ret |= clSetKernelArg(session->kernel, 19, sizeof(cl_uint), &session->width);
+    ret |= clSetKernelArg(session->kernel, 23, sizeof(cl_mem), &session->moments_buf);
+    ret |= clSetKernelArg(session->kernel, 24, sizeof(cl_float), &session->error_threshold);
+    ret |= clSetKernelArg(session->kernel, 25, sizeof(cl_mem), &session->active_count_buf);
+    ret |= clSetKernelArg(session->kernel, 26, sizeof(cl_mem), &session->albedo_buf);
+    ret |= clSetKernelArg(session->kernel, 27, sizeof(cl_mem), &session->normal_depth_buf);
+    ret |= clSetKernelArg(session->kernel, 28, sizeof(cl_mem), &session->path_stats_buf);
+    ret |= clSetKernelArg(session->kernel, 29, sizeof(cl_mem), &session->exact_sums_buf);
+    ret |= clSetKernelArg(session->kernel, 30, sizeof(cl_uint4), &session->frame);
+    if (session->use_persistent)
+        ret |= clSetKernelArg(session->kernel, 32, sizeof(cl_mem), &session->next_job_buf);
+
+    return ret;
+}
+
+/**
+ * @brief Creates a session, which builds the programs, and allocates the accumulator.
+ *
+ * The session starts with an empty scene, and a camera at the origin.
+ *
+ * @param context the context.
+ * @param device the device.
+ * @param command_queue the command queue.
+ * @param width the image width.
+ * @param height the image height.
+ * @param use_wavefront whether to render with the wavefront stages, rather than the render megakernel.
+ * @param session a pointer to the session, which must be released with release_session.
+ * @return cl_int the return code.
+ */
+cl_int create_session(const cl_context context, const cl_device_id device, const cl_command_queue command_queue, const cl_uint width, const cl_uint height, const int use_wavefront, struct session *session)
+{
+    cl_int ret;
+
+    memset(session, 0, sizeof(struct session));
+    session->context = context;
+    session->device = device;
+    session->command_queue = command_queue;
+    session->width = width;
+    session->height = height;
+    session->use_wavefront = use_wavefront;
+    session->frame = (cl_uint4){{0, 0, width, height}};
+    session->camera.fov = 1.25f;
+    session->local_size = 1;
+
+    ret = create_cl_program(context, device, use_wavefront ? wavefront_sources : path_trace_sources, use_wavefront ? 5 : 6, NULL, &session->program);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    session->tonemap_kernel = clCreateKernel(session->program, "tonemap", &ret);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    size_t num_pixels = (size_t) width * height;
+    session->accumulator_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, num_pixels * sizeof(cl_float4), NULL, &ret);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    if (use_wavefront)
+    {
+        ret = create_wavefront(context, session->program, num_pixels, &session->wavefront);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+    }
+    else
+    {
+        ret = create_render_kernel(session, NULL);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+
+        session->ray_count_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint), NULL, &ret);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+
+        session->moments_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, num_pixels * sizeof(cl_float2), NULL, &ret);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+
+        session->active_count_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &ret);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+
+        session->denoise_kernel = clCreateKernel(session->program, "denoise", &ret);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+    }
+
+    ret = set_session_camera(session, &session->camera);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+cleanup:
+    if (ret != CL_SUCCESS)
+        release_session(session);
+
+    return ret;
+}
+
+/**
+ * @brief Moves the camera, and restarts the accumulation.
+ *
+ * @param session the session.
+ * @param camera the camera.
+ * @return cl_int the return code.
+ */
+cl_int set_session_camera(struct session *session, const struct camera *camera)
+{
+    cl_int ret;
+
+    session->camera = *camera;
+
+    get_camera_projection(camera, session->frame.w, &session->camera_quat, &session->z_distance);
+
+    ret = set_render_args(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return reset_session(session);
+}
+
+/**
+ * @brief Places the session's pixels within a larger frame, so that it renders one tile of the frame at a time, with
+ * buffers of only the tile's size, and restarts the accumulation.
+ *
+ * The camera projects the whole frame, and each pixel draws the samples of its place in the frame, so the tiles are
+ * those of the frame rendered at once. Tiles at the right and bottom of the frame may be rendered smaller than the
+ * session with render_session_tile.
+ *
+ * @param session the session.
+ * @param frame_width the frame width.
+ * @param frame_height the frame height.
+ * @param x the left of the session's pixels in the frame.
+ * @param y the top of the session's pixels in the frame.
+ * @return cl_int the return code, which is CL_INVALID_VALUE if the offset is outside the frame, and
+ * CL_INVALID_OPERATION to place the wavefront stages in a larger frame.
+ */
+cl_int set_session_frame(struct session *session, const cl_uint frame_width, const cl_uint frame_height, const cl_uint x, const cl_uint y)
+{
+    if (x >= frame_width || y >= frame_height)
+        return CL_INVALID_VALUE;
+
+    // the wavefront stages index their paths by the pixels of the whole image
+    if (session->use_wavefront && (x > 0 || y > 0 || frame_width != session->width || frame_height != session->height))
+        return CL_INVALID_OPERATION;
+
+    session->frame = (cl_uint4){{x, y, frame_width, frame_height}};
+    return set_session_camera(session, &session->camera);
+}
+
+/**
+ * @brief Replaces the scene, which is uploaded into the existing buffers where it fits, and restarts the accumulation.
+ *
+ * The spheres and their bvh are copied, so that they may be updated with update_session_spheres. The mesh and
+ * materials are only read during the call.
+ *
+ * @param session the session.
+ * @param spheres the spheres, in leaf order if there is a bvh.
+ * @param num_spheres the number of spheres.
+ * @param sphere_bvh the sphere bvh, which is empty to test every sphere.
+ * @param mesh the mesh, which may have no triangles.
+ * @param mesh_bvh the mesh bvh, which is empty to test every triangle.
+ * @param materials the materials of the triangles.
+ * @param num_materials the number of materials.
+ * @return cl_int the return code.
+ */
+cl_int set_session_scene(struct session *session, const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const struct material *materials, const size_t num_materials)
+{
+    cl_int ret;
+
+    size_t sphere_size = num_spheres * sizeof(struct sphere);
+    size_t sphere_node_size = sphere_bvh->num_nodes * sizeof(struct bvh_node);
+
+    ret = copy_host_spheres(session, spheres, num_spheres, sphere_bvh);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    // the sub-buffers of a scene file cannot grow
+    if (session->scene_file_buf != NULL)
+        release_scene_buffers(session);
+
+    struct scene_buffers *scene = &session->scene;
+    scene->num_spheres = num_spheres;
+    scene->num_sphere_nodes = sphere_bvh->num_nodes;
+    scene->num_triangles = mesh->num_triangles;
+    scene->num_triangle_nodes = mesh_bvh->num_nodes;
+
+    ret = write_scene_buffer(session, &scene->spheres, &session->sphere_capacity, spheres, sphere_size);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_scene_buffer(session, &scene->sphere_nodes, &session->sphere_node_capacity, sphere_bvh->nodes, sphere_node_size);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_scene_buffer(session, &scene->vertices, &session->vertex_capacity, mesh->vertices, 3 * mesh->num_vertices * sizeof(cl_float));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_scene_buffer(session, &scene->triangles, &session->triangle_capacity, mesh->triangles, mesh->num_triangles * sizeof(struct triangle));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_scene_buffer(session, &scene->triangle_nodes, &session->triangle_node_capacity, mesh_bvh->nodes, mesh_bvh->num_nodes * sizeof(struct bvh_node));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_scene_buffer(session, &scene->materials, &session->material_capacity, materials, num_materials * sizeof(struct material));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_sphere_components(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = write_light_table(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    // the buffers may have been reallocated
+    ret = set_render_args(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return reset_session(session);
+}
+
+/**
+ * @brief Creates a sub-buffer of a section of a scene file on the device.
+ *
+ * @param session the session.
+ * @param section the section.
+ * @param element_size the size of each element of the section.
+ * @param buffer a pointer to the sub-buffer, which is NULL for an empty section.
+ * @return cl_int the return code.
+ */
+static cl_int create_section_buffer(struct session *session, const struct scene_file_section *section, const size_t element_size, cl_mem *buffer)
+{
+    cl_int ret = CL_SUCCESS;
+
+    *buffer = NULL;
+    if (section->count == 0)
+        return CL_SUCCESS;
+
+    cl_buffer_region region = {section->offset, section->count * element_size};
+    *buffer = clCreateSubBuffer(session->scene_file_buf, CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &region, &ret);
+    if (ret != CL_SUCCESS)
+        *buffer = NULL;
+
+    return ret;
+}
+
+/**
+ * @brief Replaces the scene with a mapped scene file, and restarts the accumulation.
+ *
+ * The whole file becomes one buffer, of which each section is a sub-buffer. CPU devices, and devices which share
+ * host memory, use the mapping in place with CL_MEM_USE_HOST_PTR. Other devices copy it with one non-blocking
+ * write. Either way, the file must stay mapped until the session is released or given another scene.
+ *
+ * @param session the session.
+ * @param file the scene file.
+ * @return cl_int the return code.
+ */
+cl_int set_session_scene_file(struct session *session, const struct scene_file *file)
+{
+    cl_int ret;
+
+    ret = copy_host_spheres(session, file->spheres, file->num_spheres, &file->sphere_bvh);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    release_scene_buffers(session);
+
+    cl_device_type device_type;
+    cl_bool is_host_unified_memory;
+    ret = clGetDeviceInfo(session->device, CL_DEVICE_TYPE, sizeof(cl_device_type), &device_type, NULL);
+    ret |= clGetDeviceInfo(session->device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &is_host_unified_memory, NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    if ((device_type & CL_DEVICE_TYPE_CPU) || is_host_unified_memory)
+    {
+        session->scene_file_buf = clCreateBuffer(session->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, file->size, file->data, &ret);
+    }
+    else
+    {
+        session->scene_file_buf = clCreateBuffer(session->context, CL_MEM_READ_ONLY, file->size, NULL, &ret);
+        if (ret == CL_SUCCESS)
+        {
+            cl_event event;
+            ret = clEnqueueWriteBuffer(session->command_queue, session->scene_file_buf, CL_FALSE, 0, file->size, file->data, 0, NULL, get_profile_event(session->profile, &event));
+            if (ret == CL_SUCCESS)
+                ret = record_profile_event(session->profile, "upload scene", event);
+        }
+    }
+
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    const struct scene_file_header *header = file->data;
+    struct scene_buffers *scene = &session->scene;
+    ret = create_section_buffer(session, &header->spheres, sizeof(struct sphere), &scene->spheres);
+    ret |= create_section_buffer(session, &header->sphere_nodes, sizeof(struct bvh_node), &scene->sphere_nodes);
+    ret |= create_section_buffer(session, &header->vertices, 3 * sizeof(cl_float), &scene->vertices);
+    ret |= create_section_buffer(session, &header->triangles, sizeof(struct triangle), &scene->triangles);
+    ret |= create_section_buffer(session, &header->triangle_nodes, sizeof(struct bvh_node), &scene->triangle_nodes);
+    ret |= create_section_buffer(session, &header->materials, sizeof(struct material), &scene->materials);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    scene->num_spheres = file->num_spheres;
+    scene->num_sphere_nodes = file->sphere_bvh.num_nodes;
+    scene->num_triangles = file->mesh.num_triangles;
+    scene->num_triangle_nodes = file->mesh_bvh.num_nodes;
+
+    // the sphere components and light table are not part of the file, so they have buffers of their own
+    ret = write_sphere_components(session);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    ret = write_light_table(session);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    ret = set_render_args(session);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    return reset_session(session);
+
+cleanup:
+    release_scene_buffers(session);
+    return ret;
+}
+
+/**
+ * @brief Sets the error at which pixels stop taking samples, which only the render megakernel supports.
+ *
+ * Each pixel estimates the standard error of its mean luminance, relative to that mean, from its samples. Once it
+ * falls below the threshold, the pixel is skipped, so the samples of later renders go to the pixels still noisy.
+ * The threshold compares pixels with each other, so the sessions of several devices, whose accumulators each hold
+ * part of a pixel, must not use it.
+ *
+ * @param session the session.
+ * @param error_threshold the relative error, or zero to render every sample of every pixel.
+ * @return cl_int the return code.
+ */
+cl_int set_session_error_threshold(struct session *session, const cl_float error_threshold)
+{
+    if (session->use_wavefront)
+        return error_threshold > 0 ? CL_INVALID_OPERATION : CL_SUCCESS;
+
+    session->error_threshold = error_threshold;
+
+    return clSetKernelArg(session->kernel, 24, sizeof(cl_float), &session->error_threshold);
+}
+
+/**
+ * @brief Clears the luminance moments, so that the error of each pixel is estimated from the samples which follow.
+ *
+ * @param session the session.
+ * @return cl_int the return code.
+ */
+static cl_int clear_luminance_moments(struct session *session)
+{
+    static const cl_float2 zero = {{0, 0}};
+
+    if (session->moments_buf == NULL)
+        return CL_SUCCESS;
+
+    return clEnqueueFillBuffer(session->command_queue, session->moments_buf, &zero, sizeof(cl_float2), 0, (size_t) session->width * session->height * sizeof(cl_float2), 0, NULL, NULL);
+}
+
+/**
+ * @brief Clears the guides of the denoiser, so that they average the first hits of the samples which follow.
+ *
+ * @param session the session.
+ * @return cl_int the return code.
+ */
+static cl_int clear_denoiser_guides(struct session *session)
+{
+    cl_int ret;
+
+    static const cl_float4 zero = {0, 0, 0, 0};
+
+    if (session->albedo_buf == NULL)
+        return CL_SUCCESS;
+
+    size_t size = (size_t) session->width * session->height * sizeof(cl_float4);
+    ret = clEnqueueFillBuffer(session->command_queue, session->albedo_buf, &zero, sizeof(cl_float4), 0, size, 0, NULL, NULL);
+    ret |= clEnqueueFillBuffer(session->command_queue, session->normal_depth_buf, &zero, sizeof(cl_float4), 0, size, 0, NULL, NULL);
+
+    return ret;
+}
+
+/**
+ * @brief Clears the exact sums, so that they only hold the samples which follow.
+ *
+ * @param session the session.
+ * @return cl_int the return code.
+ */
+static cl_int clear_exact_sums(struct session *session)
+{
+    static const cl_ulong4 zero = {{0, 0, 0, 0}};
+
+    if (session->exact_sums_buf == NULL)
+        return CL_SUCCESS;
+
+    return clEnqueueFillBuffer(session->command_queue, session->exact_sums_buf, &zero, sizeof(cl_ulong4), 0, (size_t) session->width * session->height * sizeof(cl_ulong4), 0, NULL, NULL);
+}
+
+/**
+ * @brief Releases the buffers of the denoiser, after which the render kernel skips its guides.
+ *
+ * @param session the session.
+ */
+static void release_denoiser_buffers(struct session *session)
+{
+    release_mem_object(session->albedo_buf);
+    release_mem_object(session->normal_depth_buf);
+    release_mem_object(session->denoise_bufs[0]);
+    release_mem_object(session->denoise_bufs[1]);
+
+    session->albedo_buf = NULL;
+    session->normal_depth_buf = NULL;
+    session->denoise_bufs[0] = NULL;
+    session->denoise_bufs[1] = NULL;
+}
+
+/**
+ * @brief Enables or disables the denoiser, which only the render megakernel supports, and restarts the accumulation.
+ *
+ * While enabled, the render kernel also sums the albedo, normal and depth of the first hit of every sample, which
+ * read_session_denoised uses to keep the edges of the image. The guides take another two float4 per pixel, and the
+ * denoiser two more.
+ *
+ * @param session the session.
+ * @param use_denoiser whether to enable the denoiser.
+ * @return cl_int the return code.
+ */
+cl_int set_session_denoiser(struct session *session, const int use_denoiser)
+{
+    cl_int ret = CL_SUCCESS;
+
+    if (session->use_wavefront)
+        return use_denoiser ? CL_INVALID_OPERATION : CL_SUCCESS;
+
+    release_denoiser_buffers(session);
+
+    if (use_denoiser)
+    {
+        size_t size = (size_t) session->width * session->height * sizeof(cl_float4);
+        cl_mem *buffers[] = {&session->albedo_buf, &session->normal_depth_buf, &session->denoise_bufs[0], &session->denoise_bufs[1]};
+        for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]) && ret == CL_SUCCESS; i++)
+        {
+            *buffers[i] = clCreateBuffer(session->context, CL_MEM_READ_WRITE, size, NULL, &ret);
+            if (ret != CL_SUCCESS)
+                *buffers[i] = NULL;
+        }
+
+        if (ret != CL_SUCCESS)
+        {
+            release_denoiser_buffers(session);
+            set_render_args(session);
+            return ret;
+        }
+    }
+
+    ret = set_render_args(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return reset_session(session);
+}
+
+/**
+ * @brief Enables or disables the specialization of the render kernel, which then has the image size and scene counts
+ * compiled in as constants, so that the compiler may fold them and unroll the loops over small scenes.
+ *
+ * A specialized kernel is rebuilt whenever the scene counts change, so it suits a fixed scene rendered for many
+ * samples, rather than one whose spheres are added and removed. Each specialization is cached like any program. The
+ * accumulation is kept, since the kernel renders the same image either way.
+ *
+ * @param session the session.
+ * @param is_specialized whether to specialize the render kernel.
+ * @return cl_int the return code, which is CL_INVALID_OPERATION to specialize the wavefront stages.
+ */
+cl_int set_session_specialized(struct session *session, const int is_specialized)
+{
+    if (session->use_wavefront)
+        return is_specialized ? CL_INVALID_OPERATION : CL_SUCCESS;
+
+    session->is_specialized = is_specialized;
+    return set_render_args(session);
+}
+
+/**
+ * @brief Switches between the render kernel, with one work item per pixel, and the persistent render kernel, whose
+ * work items take pixels from a queue and start a new path as soon as one ends.
+ *
+ * The persistent kernel keeps every lane busy however much the lengths of paths vary, such as in scenes where many
+ * paths escape or are terminated early. It renders the same samples, so the accumulation is kept.
+ *
+ * @param session the session.
+ * @param use_persistent whether to render with the persistent render kernel.
+ * @return cl_int the return code, which is CL_INVALID_OPERATION to use it with the wavefront stages.
+ */
+cl_int set_session_persistent(struct session *session, const int use_persistent)
+{
+    cl_int ret;
+
+    if (session->use_wavefront)
+        return use_persistent ? CL_INVALID_OPERATION : CL_SUCCESS;
+
+    if (use_persistent == session->use_persistent)
+        return CL_SUCCESS;
+
+    release_mem_object(session->next_job_buf);
+    session->next_job_buf = NULL;
+
+    if (use_persistent)
+    {
+        ret = clGetDeviceInfo(session->device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &session->num_compute_units, NULL);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        session->next_job_buf = clCreateBuffer(session->context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &ret);
+        if (ret != CL_SUCCESS)
+        {
+            session->next_job_buf = NULL;
+            return ret;
+        }
+    }
+
+    // the kernel is recreated from the program which the current one was built from
+    session->use_persistent = use_persistent;
+    ret = create_render_kernel(session, session->specialization[0] != '\0' ? session->specialization : NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return set_render_args(session);
+}
+
+/**
+ * @brief Gets the global size of a launch of the persistent render kernel, which fills every compute unit, unless
+ * there are fewer jobs than that.
+ *
+ * @param session the session.
+ * @param num_jobs the number of pixels in the queue.
+ * @return size_t the global size, which is a multiple of the local size.
+ */
+size_t get_session_persistent_size(const struct session *session, const size_t num_jobs)
+{
+    size_t local_size = session->persistent_local_size;
+    size_t device_size = (size_t) session->num_compute_units * PERSISTENT_GROUPS_PER_UNIT * local_size;
+    size_t job_size = (num_jobs + local_size - 1) / local_size * local_size;
+    return device_size < job_size ? device_size : job_size;
+}
+
+/**
+ * @brief Enables or disables the exact sums, which the render kernel adds each sample to in fixed point, so that
+ * partial renders of ranges of samples merge into the same image however the frame was split.
+ *
+ * The sums start empty, and are cleared with the accumulator, so they only hold the samples rendered after.
+ *
+ * @param session the session.
+ * @param use_exact_sums whether to keep the exact sums.
+ * @return cl_int the return code, which is CL_INVALID_OPERATION to enable them with the wavefront stages.
+ */
+cl_int set_session_exact_sums(struct session *session, const int use_exact_sums)
+{
+    cl_int ret = CL_SUCCESS;
+
+    if (session->use_wavefront)
+        return use_exact_sums ? CL_INVALID_OPERATION : CL_SUCCESS;
+
+    release_mem_object(session->exact_sums_buf);
+    session->exact_sums_buf = NULL;
+
+    if (use_exact_sums)
+    {
+        session->exact_sums_buf = clCreateBuffer(session->context, CL_MEM_READ_WRITE, (size_t) session->width * session->height * sizeof(cl_ulong4), NULL, &ret);
+        if (ret != CL_SUCCESS)
+            session->exact_sums_buf = NULL;
+        else
+            ret = clear_exact_sums(session);
+    }
+
+    cl_int args_ret = set_render_args(session);
+    return ret != CL_SUCCESS ? ret : args_ret;
+}
+
+/**
+ * @brief Reads the exact sums, which must have been enabled with set_session_exact_sums.
+ *
+ * @param session the session.
+ * @param sums the per-pixel fixed point sums of the samples, with the sample count in w.
+ * @return cl_int the return code.
+ */
+cl_int read_session_exact_sums(struct session *session, cl_ulong4 *sums)
+{
+    cl_int ret;
+
+    if (session->exact_sums_buf == NULL)
+        return CL_INVALID_OPERATION;
+
+    cl_event event;
+    ret = clEnqueueReadBuffer(session->command_queue, session->exact_sums_buf, CL_TRUE, 0, (size_t) session->width * session->height * sizeof(cl_ulong4), sums, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return record_profile_event(session->profile, "read exact sums", event);
+}
+
+/**
+ * @brief Sets the profile, which records every launch and transfer of the session from then on.
+ *
+ * The command queue must have been created with CL_QUEUE_PROFILING_ENABLE. With the render megakernel, the profile
+ * also sums the path statistics of every launch, which are counted with atomics on the device.
+ *
+ * @param session the session.
+ * @param profile the profile, which must outlive the session, or NULL to stop profiling.
+ * @return cl_int the return code.
+ */
+cl_int set_session_profile(struct session *session, struct profile *profile)
+{
+    cl_int ret = CL_SUCCESS;
+
+    session->profile = profile;
+    if (session->use_wavefront)
+        return CL_SUCCESS;
+
+    if (profile != NULL && session->path_stats_buf == NULL)
+    {
+        session->path_stats_buf = clCreateBuffer(session->context, CL_MEM_READ_WRITE, 2 * NUM_PATH_STATS * sizeof(cl_uint), NULL, &ret);
+        if (ret != CL_SUCCESS)
+            session->path_stats_buf = NULL;
+    }
+    else if (profile == NULL)
+    {
+        release_mem_object(session->path_stats_buf);
+        session->path_stats_buf = NULL;
+    }
+
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return clSetKernelArg(session->kernel, 28, sizeof(cl_mem), &session->path_stats_buf);
+}
+
+/**
+ * @brief Updates a range of spheres in place, and restarts the accumulation.
+ *
+ * Only the range, the bvh nodes if there is a bvh, and the light table are uploaded. The bvh is refit rather than rebuilt, so it
+ * degrades as spheres move far from where it was built, after which the scene should be set again.
+ *
+ * @param session the session.
+ * @param first the index of the first sphere, in the order of the spheres given to set_session_scene.
+ * @param count the number of spheres.
+ * @param spheres the new spheres.
+ * @return cl_int the return code.
+ */
+cl_int update_session_spheres(struct session *session, const cl_uint first, const cl_uint count, const struct sphere *spheres)
+{
+    cl_int ret;
+
+    if (first > session->scene.num_spheres || count > session->scene.num_spheres - first)
+        return CL_INVALID_VALUE;
+
+    if (count == 0)
+        return CL_SUCCESS;
+
+    memcpy(&session->spheres[first], spheres, count * sizeof(struct sphere));
+
+    ret = clEnqueueWriteBuffer(session->command_queue, session->scene.spheres, CL_TRUE, first * sizeof(struct sphere), count * sizeof(struct sphere), spheres, 0, NULL, NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    if (session->sphere_bvh.num_nodes > 0)
+    {
+        refit_sphere_bvh(&session->sphere_bvh, session->spheres);
+
+        ret = clEnqueueWriteBuffer(session->command_queue, session->scene.sphere_nodes, CL_TRUE, 0, session->sphere_bvh.num_nodes * sizeof(struct bvh_node), session->sphere_bvh.nodes, 0, NULL, NULL);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    ret = write_sphere_components(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    // the spheres may have started or stopped emitting, and the lights buffer may be reallocated
+    ret = write_light_table(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = set_render_args(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return reset_session(session);
+}
+
+/**
+ * @brief Clears the accumulator, so that the next samples start a new frame.
+ *
+ * @param session the session.
+ * @return cl_int the return code.
+ */
+cl_int reset_session(struct session *session)
+{
+    cl_int ret;
+
+    static const cl_float4 zero = {0, 0, 0, 0};
+
+    session->num_samples = 0;
+
+    ret = clEnqueueFillBuffer(session->command_queue, session->accumulator_buf, &zero, sizeof(cl_float4), 0, (size_t) session->width * session->height * sizeof(cl_float4), 0, NULL, NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = clear_denoiser_guides(session);
+    ret |= clear_exact_sums(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return clear_luminance_moments(session);
+}
+
+/**
+ * @brief Replaces the accumulator, such as with a checkpoint to resume from.
+ *
+ * The accumulator does not hold the luminance moments, so with adaptive sampling, every pixel takes samples until it
+ * has enough to estimate its error again. Nor does it hold the guides of the denoiser, which only average the samples
+ * rendered after it, or the exact sums, which only hold them. An empty accumulator with a number of samples starts a
+ * partial render at that sample.
+ *
+ * @param session the session.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @param num_samples the number of samples in the accumulator.
+ * @return cl_int the return code.
+ */
+cl_int write_session_accumulator(struct session *session, const cl_float4 *accumulator, const cl_uint num_samples)
+{
+    cl_int ret;
+
+    session->num_samples = num_samples;
+
+    ret = clear_luminance_moments(session);
+    ret |= clear_denoiser_guides(session);
+    ret |= clear_exact_sums(session);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    cl_event event;
+    ret = clEnqueueWriteBuffer(session->command_queue, session->accumulator_buf, CL_TRUE, 0, (size_t) session->width * session->height * sizeof(cl_float4), accumulator, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return record_profile_event(session->profile, "write accumulator", event);
+}
+
+/**
+ * @brief Reads the accumulator.
+ *
+ * @param session the session.
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @return cl_int the return code.
+ */
+cl_int read_session_accumulator(struct session *session, cl_float4 *accumulator)
+{
+    cl_int ret;
+
+    cl_event event;
+    ret = clEnqueueReadBuffer(session->command_queue, session->accumulator_buf, CL_TRUE, 0, (size_t) session->width * session->height * sizeof(cl_float4), accumulator, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return record_profile_event(session->profile, "read accumulator", event);
+}
+
+/**
+ * @brief Copies the accumulator into pinned host memory, without waiting for the device.
+ *
+ * The copy is queued after the launches before it, and the launches after it may be queued before it completes, so
+ * that the host reads and encodes the snapshot of one chunk while the device renders the next. Snapshots alternate
+ * between two pinned buffers, so at most two may be held at once.
+ *
+ * @param session the session.
+ * @param snapshot a pointer to the snapshot, whose accumulator may be read once its event has completed, and which
+ * must be released with release_session_snapshot.
+ * @return cl_int the return code.
+ */
+cl_int enqueue_session_snapshot(struct session *session, struct session_snapshot *snapshot)
+{
+    cl_int ret;
+
+    size_t size = (size_t) session->width * session->height * sizeof(cl_float4);
+    cl_mem *buffer = &session->snapshot_bufs[session->next_snapshot];
+    if (*buffer == NULL)
+    {
+        // host memory allocated by the runtime is pinned, so the device copies into it without staging
+        *buffer = clCreateBuffer(session->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &ret);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    cl_event event;
+    ret = clEnqueueCopyBuffer(session->command_queue, session->accumulator_buf, *buffer, 0, 0, size, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = record_profile_event(session->profile, "snapshot accumulator", event);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    snapshot->buffer = *buffer;
+    snapshot->accumulator = clEnqueueMapBuffer(session->command_queue, *buffer, CL_FALSE, CL_MAP_READ, 0, size, 0, NULL, &snapshot->event, &ret);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    session->next_snapshot = (session->next_snapshot + 1) % 2;
+
+    // the copy starts behind the launches already queued, rather than when the queue is next waited on
+    return clFlush(session->command_queue);
+}
+
+/**
+ * @brief Unmaps a snapshot, once it has been read, so that its buffer may take another.
+ *
+ * @param session the session.
+ * @param snapshot the snapshot.
+ * @return cl_int the return code.
+ */
+cl_int release_session_snapshot(struct session *session, struct session_snapshot *snapshot)
+{
+    cl_int ret;
+
+    ret = clEnqueueUnmapMemObject(session->command_queue, snapshot->buffer, (void *) snapshot->accumulator, 0, NULL, NULL);
+    clReleaseEvent(snapshot->event);
+
+    memset(snapshot, 0, sizeof(struct session_snapshot));
+    return ret;
+}
+
+/**
+ * @brief Denoises the accumulator on the device, which leaves the accumulator as it was.
+ *
+ * This runs the iterations of the edge-avoiding à-trous filter of denoise.h, the first from the accumulator and each
+ * of the others from the last.
+ *
+ * @param session the session, whose denoiser must be enabled.
+ * @param denoised a pointer to the denoiser buffer which holds the denoised sample sums.
+ * @return cl_int the return code.
+ */
+static cl_int enqueue_denoise(struct session *session, cl_mem *denoised)
+{
+    cl_int ret;
+
+    size_t local[] = {session->local_size, session->local_size};
+    size_t global[] = {
+        (session->width + local[0] - 1) / local[0] * local[0],
+        (session->height + local[1] - 1) / local[1] * local[1],
+    };
+
+    ret = clSetKernelArg(session->denoise_kernel, 2, sizeof(cl_mem), &session->albedo_buf);
+    ret |= clSetKernelArg(session->denoise_kernel, 3, sizeof(cl_mem), &session->normal_depth_buf);
+    ret |= clSetKernelArg(session->denoise_kernel, 4, sizeof(cl_uint), &session->width);
+    ret |= clSetKernelArg(session->denoise_kernel, 5, sizeof(cl_uint), &session->height);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    cl_mem input = session->accumulator_buf;
+    cl_float colour_sigma = DENOISE_COLOUR_SIGMA;
+    for (cl_int iteration = 0; iteration < DENOISE_ITERATIONS; iteration++)
+    {
+        cl_mem output = session->denoise_bufs[iteration % 2];
+        cl_int step = 1 << iteration;
+
+        ret = clSetKernelArg(session->denoise_kernel, 0, sizeof(cl_mem), &input);
+        ret |= clSetKernelArg(session->denoise_kernel, 1, sizeof(cl_mem), &output);
+        ret |= clSetKernelArg(session->denoise_kernel, 6, sizeof(cl_int), &step);
+        ret |= clSetKernelArg(session->denoise_kernel, 7, sizeof(cl_float), &colour_sigma);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        cl_event event;
+        ret = clEnqueueNDRangeKernel(session->command_queue, session->denoise_kernel, 2, NULL, global, local, 0, NULL, get_profile_event(session->profile, &event));
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        ret = record_profile_event(session->profile, "denoise", event);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        input = output;
+        colour_sigma *= 0.5f;
+    }
+
+    *denoised = input;
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Denoises the accumulator on the device, and reads only the result.
+ *
+ * @param session the session, whose denoiser must be enabled.
+ * @param image the denoised sample sums, which keep the sample counts of the accumulator.
+ * @return cl_int the return code.
+ */
+cl_int read_session_denoised(struct session *session, cl_float4 *image)
+{
+    cl_int ret;
+
+    if (session->albedo_buf == NULL)
+        return CL_INVALID_OPERATION;
+
+    cl_mem input;
+    ret = enqueue_denoise(session, &input);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    cl_event event;
+    ret = clEnqueueReadBuffer(session->command_queue, input, CL_TRUE, 0, (size_t) session->width * session->height * sizeof(cl_float4), image, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return record_profile_event(session->profile, "read denoised", event);
+}
+
+/**
+ * @brief Applies the display transform of tonemap.h on the device, and reads the 8-bit pixels.
+ *
+ * The transform runs on the denoised image if the denoiser is enabled, and on the accumulator otherwise, which stays
+ * on the device as it was, so that only a quarter of its size is read.
+ *
+ * @param session the session.
+ * @param tonemap the curve and exposure.
+ * @param image the 8-bit sRGB pixels, with an opaque alpha.
+ * @return cl_int the return code.
+ */
+cl_int read_session_display(struct session *session, const struct tonemap *tonemap, cl_uchar4 *image)
+{
+    cl_int ret;
+
+    // the tonemap kernel takes the number of pixels as a uint, which a large enough image would wrap
+    size_t num_pixels = (size_t) session->width * session->height;
+    if (num_pixels > CL_UINT_MAX)
+        return CL_INVALID_VALUE;
+
+    cl_uint kernel_num_pixels = num_pixels;
+    if (session->display_buf == NULL)
+    {
+        session->display_buf = clCreateBuffer(session->context, CL_MEM_WRITE_ONLY, num_pixels * sizeof(cl_uchar4), NULL, &ret);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    cl_mem input = session->accumulator_buf;
+    if (session->albedo_buf != NULL)
+    {
+        ret = enqueue_denoise(session, &input);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    cl_int curve = tonemap->curve;
+    cl_float exposure_scale = exp2f(tonemap->exposure);
+    ret = clSetKernelArg(session->tonemap_kernel, 0, sizeof(cl_mem), &input);
+    ret |= clSetKernelArg(session->tonemap_kernel, 1, sizeof(cl_mem), &session->display_buf);
+    ret |= clSetKernelArg(session->tonemap_kernel, 2, sizeof(cl_uint), &kernel_num_pixels);
+    ret |= clSetKernelArg(session->tonemap_kernel, 3, sizeof(cl_int), &curve);
+    ret |= clSetKernelArg(session->tonemap_kernel, 4, sizeof(cl_float), &exposure_scale);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    cl_event event;
+    size_t global = num_pixels;
+    ret = clEnqueueNDRangeKernel(session->command_queue, session->tonemap_kernel, 1, NULL, &global, NULL, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = record_profile_event(session->profile, "tonemap", event);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = clEnqueueReadBuffer(session->command_queue, session->display_buf, CL_TRUE, 0, num_pixels * sizeof(cl_uchar4), image, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return record_profile_event(session->profile, "read display image", event);
+}
+
+/**
+ * @brief Gets a count which the render kernels keep as a low and a high word.
+ *
+ * @param count the low and high words.
+ * @return cl_ulong the count.
+ */
+static cl_ulong get_count(const cl_uint *count)
+{
+    return count[0] + ((cl_ulong) count[1] << 32);
+}
+
+/**
+ * @brief Renders samples of a tile with the render megakernel, or the persistent one, and adds them to the accumulator.
+ *
+ * @param session the session.
+ * @param x the left of the tile.
+ * @param y the top of the tile.
+ * @param width the tile width.
+ * @param height the tile height.
+ * @param sample_offset the index of the first sample.
+ * @param num_samples the number of samples.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @param num_active_pixels a pointer to the number of pixels which took samples, which is incremented.
+ * @return cl_int the return code.
+ */
+static cl_int enqueue_render_tile(struct session *session, const cl_uint x, const cl_uint y, const cl_uint width, const cl_uint height, const cl_uint sample_offset, const cl_uint num_samples, cl_ulong *num_rays, cl_uint *num_active_pixels)
+{
+    cl_int ret;
+
+    static const cl_uint zero = 0;
+    static const cl_uint zeros[2 * NUM_PATH_STATS] = {0};
+    cl_uint ray_count[2];
+    cl_uint active_count;
+    cl_uint path_stats[2 * NUM_PATH_STATS];
+    cl_event event;
+
+    // the global size is rounded up to a multiple of the local size, and the kernel skips the pixels outside the tile
+    size_t local[] = {session->local_size, session->local_size};
+    size_t offset[] = {x, y};
+    size_t global[] = {
+        (width + local[0] - 1) / local[0] * local[0],
+        (height + local[1] - 1) / local[1] * local[1],
+    };
+    cl_uint2 tile_end = {{x + width, y + height}};
+
+    // the ray and path counts are 64-bit, as low and high words, since a launch of many samples of a large tile traces
+    // more than 2^32 rays, and they are reset every launch and added to the totals on the host
+    ret = clEnqueueWriteBuffer(session->command_queue, session->ray_count_buf, CL_FALSE, 0, sizeof(ray_count), zeros, 0, NULL, NULL);
+    ret |= clEnqueueWriteBuffer(session->command_queue, session->active_count_buf, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, NULL, NULL);
+    ret |= clSetKernelArg(session->kernel, 20, sizeof(cl_uint), &sample_offset);
+    ret |= clSetKernelArg(session->kernel, 21, sizeof(cl_uint), &num_samples);
+    ret |= clSetKernelArg(session->kernel, 22, sizeof(cl_uint2), &tile_end);
+    if (session->path_stats_buf != NULL)
+        ret |= clEnqueueWriteBuffer(session->command_queue, session->path_stats_buf, CL_FALSE, 0, sizeof(zeros), zeros, 0, NULL, NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    if (session->use_persistent)
+    {
+        // the persistent work items take the pixels of the tile from the queue, until it is empty
+        cl_uint2 tile_start = {{x, y}};
+        size_t persistent_local = session->persistent_local_size;
+        size_t persistent_global = get_session_persistent_size(session, (size_t) width * height);
+        ret = clEnqueueWriteBuffer(session->command_queue, session->next_job_buf, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, NULL, NULL);
+        ret |= clSetKernelArg(session->kernel, 31, sizeof(cl_uint2), &tile_start);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        ret = clEnqueueNDRangeKernel(session->command_queue, session->kernel, 1, NULL, &persistent_global, &persistent_local, 0, NULL, get_profile_event(session->profile, &event));
+    }
+    else
+    {
+        ret = clEnqueueNDRangeKernel(session->command_queue, session->kernel, 2, offset, global, local, 0, NULL, get_profile_event(session->profile, &event));
+    }
+
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = record_profile_event(session->profile, "render", event);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = clEnqueueReadBuffer(session->command_queue, session->active_count_buf, CL_FALSE, 0, sizeof(cl_uint), &active_count, 0, NULL, NULL);
+    if (session->path_stats_buf != NULL)
+        ret |= clEnqueueReadBuffer(session->command_queue, session->path_stats_buf, CL_FALSE, 0, sizeof(path_stats), path_stats, 0, NULL, NULL);
+    ret |= clEnqueueReadBuffer(session->command_queue, session->ray_count_buf, CL_TRUE, 0, sizeof(ray_count), ray_count, 0, NULL, get_profile_event(session->profile, &event));
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = record_profile_event(session->profile, "read counters", event);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    *num_rays += get_count(ray_count);
+    *num_active_pixels += active_count;
+    if (session->path_stats_buf != NULL)
+    {
+        for (int i = 0; i < NUM_PATH_STATS; i++)
+            session->profile->path_stats[i] += get_count(&path_stats[2 * i]);
+    }
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Renders samples, and adds them to the accumulator.
+ *
+ * With an error threshold, the pixels which have converged are skipped, and num_active_pixels counts the others.
+ *
+ * @param session the session.
+ * @param num_samples the number of samples, which must not be zero.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @return cl_int the return code.
+ */
+cl_int render_session_samples(struct session *session, const cl_uint num_samples, cl_ulong *num_rays)
+{
+    cl_int ret;
+
+    // the persistent kernel would trace a sample of each pixel which it then weighs as none
+    if (num_samples == 0)
+        return CL_INVALID_VALUE;
+
+    // the wavefront stages render every pixel
+    session->num_active_pixels = session->use_wavefront ? session->width * session->height : 0;
+    if (session->use_wavefront)
+        ret = enqueue_wavefront_samples(session->command_queue, &session->wavefront, session->num_samples, num_samples, num_rays, session->profile);
+    else
+        ret = enqueue_render_tile(session, 0, 0, session->width, session->height, session->num_samples, num_samples, num_rays, &session->num_active_pixels);
+
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    ret = clFinish(session->command_queue);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    session->num_samples += num_samples;
+
+    return CL_SUCCESS;
+}
+
+/**
+ * @brief Renders samples of a tile with the render megakernel, and adds them to the accumulator.
+ *
+ * The samples are indexed from sample_offset, rather than the number of samples in the accumulator, so that the tiles
+ * of a frame may be split between sessions on several devices, whose accumulators are then summed. The number of
+ * samples in the accumulator is left to the caller.
+ *
+ * @param session the session, which must not use the wavefront stages.
+ * @param x the left of the tile.
+ * @param y the top of the tile.
+ * @param width the tile width.
+ * @param height the tile height.
+ * @param sample_offset the index of the first sample.
+ * @param num_samples the number of samples, which must not be zero.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @return cl_int the return code.
+ */
+cl_int render_session_tile(struct session *session, const cl_uint x, const cl_uint y, const cl_uint width, const cl_uint height, const cl_uint sample_offset, const cl_uint num_samples, cl_ulong *num_rays)
+{
+    cl_int ret;
+
+    if (session->use_wavefront)
+        return CL_INVALID_OPERATION;
+
+    if (x > session->width || width > session->width - x || y > session->height || height > session->height - y || num_samples == 0)
+        return CL_INVALID_VALUE;
+
+    session->num_active_pixels = 0;
+    ret = enqueue_render_tile(session, x, y, width, height, sample_offset, num_samples, num_rays, &session->num_active_pixels);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    return clFinish(session->command_queue);
+}
+
+void release_session(struct session *session)
+{
+    release_wavefront(&session->wavefront);
+
+    if (session->kernel != NULL)
+        clReleaseKernel(session->kernel);
+
+    if (session->denoise_kernel != NULL)
+        clReleaseKernel(session->denoise_kernel);
+
+    if (session->tonemap_kernel != NULL)
+        clReleaseKernel(session->tonemap_kernel);
+
+    if (session->specialized_program != NULL)
+        clReleaseProgram(session->specialized_program);
+
+    if (session->program != NULL)
+        clReleaseProgram(session->program);
+
+    release_mem_object(session->accumulator_buf);
+    release_mem_object(session->ray_count_buf);
+    release_mem_object(session->moments_buf);
+    release_mem_object(session->active_count_buf);
+    release_mem_object(session->path_stats_buf);
+    release_mem_object(session->exact_sums_buf);
+    release_mem_object(session->next_job_buf);
+    release_mem_object(session->snapshot_bufs[0]);
+    release_mem_object(session->snapshot_bufs[1]);
+    release_mem_object(session->display_buf);
+    release_denoiser_buffers(session);
+    release_scene_buffers(session);
+
+    free(session->spheres);
+    free(session->sphere_bvh.nodes);
+
+    memset(session, 0, sizeof(struct session));
+}
@@ -0,0 +1,133 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "gpulib.h"
+#include "geometry.h"
+#include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "wavefront.h"
+#include "scene-file.h"
+#include "profile.h"
+#include "tonemap.h"
+
+/*
+ * A render session on one device, which builds its programs once and keeps its buffers between frames. Changes to
+ * the camera or scene only upload what changed, and restart the accumulation, so that a process may render many
+ * frames without rebuilding anything.
+ */
+struct session
+{
+    cl_context context;
+    cl_device_id device;
+    cl_command_queue command_queue;
+    cl_uint width;
+    cl_uint height;
+    // the offset of the session's pixels in the frame which it renders part of, in x and y, and the frame size in z
+    // and w, which is the session's own size unless the frame is too large to render at once
+    cl_uint4 frame;
+    int use_wavefront;
+
+    cl_program program;
+    // the render megakernel, or NULL with the wavefront stages
+    cl_kernel kernel;
+    // whether the render kernel is specialized, and the program and build options of the one it was last built with
+    int is_specialized;
+    cl_program specialized_program;
+    char specialization[512];
+    // whether the render kernel is the persistent one, whose work items take the pixels of each tile from a queue
+    int use_persistent;
+    cl_mem next_job_buf;
+    size_t persistent_local_size;
+    cl_uint num_compute_units;
+    struct wavefront wavefront;
+    size_t local_size;
+
+    struct camera camera;
+    // the projection of the camera, from which the kernels generate the primary rays
+    cl_float4 camera_quat;
+    cl_float z_distance;
+
+    // host copies of the spheres and their bvh nodes, which update_session_spheres modifies
+    struct sphere *spheres;
+    struct bvh sphere_bvh;
+
+    cl_mem accumulator_buf;
+    cl_mem ray_count_buf;
+    // the luminance moments of each pixel, and the number of pixels rendered by the last launch, for adaptive sampling
+    cl_mem moments_buf;
+    cl_mem active_count_buf;
+    // the first-hit albedo and normal and depth sums which guide the denoiser, or NULL while it is disabled
+    cl_mem albedo_buf;
+    cl_mem normal_depth_buf;
+    // the denoiser kernel, and the buffers between which its iterations alternate
+    cl_kernel denoise_kernel;
+    cl_mem denoise_bufs[2];
+    // the profile, which records every launch and transfer, and the path statistics of the render kernel, or NULL
+    struct profile *profile;
+    cl_mem path_stats_buf;
+    // the fixed point sums of the samples of each pixel, for partial renders, or NULL
+    cl_mem exact_sums_buf;
+    // the display transform, and the 8-bit pixels which it writes, which are allocated when first read
+    cl_kernel tonemap_kernel;
+    cl_mem display_buf;
+    // the pinned buffers into which snapshots of the accumulator are copied, and the one the next snapshot takes
+    cl_mem snapshot_bufs[2];
+    cl_uint next_snapshot;
+    struct scene_buffers scene;
+    // a mapped scene file on the device, of which the scene buffers are sub-buffers, or NULL
+    cl_mem scene_file_buf;
+    // the sizes of the scene buffers, which are only reallocated to grow
+    size_t sphere_capacity;
+    size_t sphere_component_capacity;
+    size_t sphere_node_capacity;
+    size_t vertex_capacity;
+    size_t triangle_capacity;
+    size_t triangle_node_capacity;
+    size_t material_capacity;
+    size_t light_capacity;
+
+    // the number of samples in the accumulator, which pixels stopped by adaptive sampling have fewer of
+    cl_uint num_samples;
+
+    // the relative error at which pixels stop taking samples, or zero to render every sample of every pixel
+    cl_float error_threshold;
+    // the number of pixels which took samples in the last render, which is zero once every pixel has converged
+    cl_uint num_active_pixels;
+};
+
+// a copy of the accumulator in pinned host memory, which may be read once its event has completed
+struct session_snapshot
+{
+    cl_mem buffer;
+    const cl_float4 *accumulator;
+    cl_event event;
+};
+
+cl_int create_session(const cl_context context, const cl_device_id device, const cl_command_queue command_queue, const cl_uint width, const cl_uint height, const int use_wavefront, struct session *session);
+cl_int set_session_camera(struct session *session, const struct camera *camera);
+cl_int set_session_frame(struct session *session, const cl_uint frame_width, const cl_uint frame_height, const cl_uint x, const cl_uint y);
+cl_int set_session_scene(struct session *session, const struct sphere *spheres, const size_t num_spheres, const struct bvh *sphere_bvh, const struct mesh *mesh, const struct bvh *mesh_bvh, const struct material *materials, const size_t num_materials);
+cl_int set_session_scene_file(struct session *session, const struct scene_file *file);
+cl_int set_session_error_threshold(struct session *session, const cl_float error_threshold);
+cl_int set_session_denoiser(struct session *session, const int use_denoiser);
+cl_int set_session_specialized(struct session *session, const int is_specialized);
+cl_int get_session_specialization(const struct session *session, char *options, const size_t size);
+cl_int set_session_persistent(struct session *session, const int use_persistent);
+size_t get_session_persistent_size(const struct session *session, const size_t num_jobs);
+cl_int set_session_exact_sums(struct session *session, const int use_exact_sums);
+cl_int read_session_exact_sums(struct session *session, cl_ulong4 *sums);
+cl_int set_session_profile(struct session *session, struct profile *profile);
+cl_int update_session_spheres(struct session *session, const cl_uint first, const cl_uint count, const struct sphere *spheres);
+cl_int reset_session(struct session *session);
+cl_int write_session_accumulator(struct session *session, const cl_float4 *accumulator, const cl_uint num_samples);
+cl_int read_session_accumulator(struct session *session, cl_float4 *accumulator);
+cl_int enqueue_session_snapshot(struct session *session, struct session_snapshot *snapshot);
+cl_int release_session_snapshot(struct session *session, struct session_snapshot *snapshot);
+cl_int render_session_samples(struct session *session, const cl_uint num_samples, cl_ulong *num_rays);
+cl_int render_session_tile(struct session *session, const cl_uint x, const cl_uint y, const cl_uint width, const cl_uint height, const cl_uint sample_offset, const cl_uint num_samples, cl_ulong *num_rays);
+cl_int read_session_denoised(struct session *session, cl_float4 *image);
+cl_int read_session_display(struct session *session, const struct tonemap *tonemap, cl_uchar4 *image);
+void release_session(struct session *session);
+
+#endif
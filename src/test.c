@@ -1,9 +1,28 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <unistd.h>
 
 #include "gpulib.h"
 #include "geometry.h"
+#include "checkpoint.h"
+#include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "scene-file.h"
+#include "cpu.h"
+#include "output.h"
+#include "sampler.h"
+#include "adaptive.h"
+#include "denoise.h"
+#include "tonemap.h"
+#include "preview.h"
+#include "session.h"
+#include "partial.h"
+#include "profile.h"
+#include "cache.h"
 
 #define EPSILON 1E-5
 
@@ -83,16 +102,931 @@ void test_rotate_quat(void)
     assert(approximatelty_equal(transformed.w, target.w));
 }
 
-int main(void)
+void test_checkpoint_round_trip(void)
 {
-    /*
-     * Test geometry functions
-     */
-    test_euler_to_quaternion_xyz();
-    test_euler_to_quaternion_zyx();
-    test_euler_to_quaternion_rand();
+    const char *path = "test_checkpoint.bin";
+    cl_float4 accumulator[6];
+    for (int i = 0; i < 6; i++)
+        accumulator[i] = (cl_float4){i, 2 * i, 3 * i, 4};
 
-    test_multiply_quat();
+    assert(write_checkpoint(path, accumulator, 3, 2, 4) == CL_SUCCESS);
 
-    test_rotate_quat();
+    cl_float4 resumed[6];
+    cl_uint num_samples;
+    assert(read_checkpoint(path, resumed, 3, 2, &num_samples) == CL_SUCCESS);
+    assert(num_samples == 4);
+    for (int i = 0; i < 6; i++)
+    {
+        assert(approximatelty_equal(resumed[i].y, accumulator[i].y));
+        assert(approximatelty_equal(resumed[i].w, accumulator[i].w));
+    }
+
+    // a checkpoint for a different resolution must not be resumed
+    assert(read_checkpoint(path, resumed, 2, 3, &num_samples) == CL_INVALID_VALUE);
+
+    remove(path);
+}
+
+void test_refit_bvh(void)
+{
+    struct sphere *spheres = NULL;
+    size_t num_spheres = 0;
+    assert(add_random_spheres(&spheres, &num_spheres, 200, 5) == CL_SUCCESS);
+
+    struct bvh bvh;
+    assert(build_sphere_bvh(spheres, num_spheres, &bvh) == CL_SUCCESS);
+
+    // move every other sphere, so that the leaves no longer bound them
+    for (size_t i = 0; i < num_spheres; i += 2)
+        spheres[i].position.y += 20;
+
+    refit_sphere_bvh(&bvh, spheres);
+
+    for (size_t i = 0; i < num_spheres; i++)
+    {
+        assert(spheres[i].position.y + spheres[i].radius <= bvh.nodes[0].max.y);
+        assert(spheres[i].position.y - spheres[i].radius >= bvh.nodes[0].min.y);
+    }
+
+    cl_float3 origin = (cl_float3){0, 50, 40};
+    for (int i = 0; i < 100; i++)
+    {
+        cl_float3 direction = (cl_float3){1, (i - 50) * 0.01f, (i % 10 - 5) * 0.02f};
+        float length = sqrt(direction.x * direction.x + direction.y * direction.y + direction.z * direction.z);
+        direction = (cl_float3){direction.x / length, direction.y / length, direction.z / length};
+
+        int linear_index = -1;
+        int bvh_index = -1;
+        float linear_t;
+        float bvh_t;
+        assert(intersect_spheres(spheres, num_spheres, origin, direction, &linear_index, &linear_t) == intersect_sphere_bvh(&bvh, spheres, origin, direction, &bvh_index, &bvh_t));
+        assert(linear_index == bvh_index);
+    }
+
+    release_bvh(&bvh);
+    free(spheres);
+}
+
+void test_write_image(void)
+{
+    const char *path = "test_image";
+    // the mean of two samples, where the channels outside [0, 1] are clamped
+    cl_float4 accumulator[2] = {{1, 0.5f, -1, 2}, {4, 2, 0, 2}};
+    unsigned char data[64];
+
+    assert(write_image(path, accumulator, 2, 1, IMAGE_PPM) == CL_SUCCESS);
+    FILE *fp = fopen(path, "rb");
+    size_t size = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
+
+    const char ppm_header[] = "P6\n2 1\n255\n";
+    assert(size == sizeof(ppm_header) - 1 + 6);
+    assert(memcmp(data, ppm_header, sizeof(ppm_header) - 1) == 0);
+    unsigned char *pixels = data + sizeof(ppm_header) - 1;
+    assert(pixels[0] == 127 && pixels[1] == 63 && pixels[2] == 0);
+    assert(pixels[3] == 255 && pixels[4] == 255 && pixels[5] == 0);
+
+    assert(write_image(path, accumulator, 2, 1, IMAGE_PPM16) == CL_SUCCESS);
+    fp = fopen(path, "rb");
+    size = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
+
+    const char ppm16_header[] = "P6\n2 1\n65535\n";
+    assert(size == sizeof(ppm16_header) - 1 + 12);
+    pixels = data + sizeof(ppm16_header) - 1;
+    assert(pixels[0] == 0x7f && pixels[1] == 0xff);
+    assert(pixels[6] == 0xff && pixels[7] == 0xff);
+
+    // float images hold the unclamped mean
+    assert(write_image(path, accumulator, 2, 1, IMAGE_PFM) == CL_SUCCESS);
+    fp = fopen(path, "rb");
+    size = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
+
+    const char pfm_header[] = "PF\n2 1\n-1.0\n";
+    assert(size == sizeof(pfm_header) - 1 + 6 * sizeof(float));
+    float values[6];
+    memcpy(values, data + sizeof(pfm_header) - 1, sizeof(values));
+    assert(approximatelty_equal(values[2], -0.5f));
+    assert(approximatelty_equal(values[3], 2));
+
+    assert(get_image_format("result.pfm") == IMAGE_PFM);
+    assert(get_image_format("result.ppm") == IMAGE_PPM);
+
+    remove(path);
+}
+
+// reads a whole file, which the caller frees
+static unsigned char *read_file(const char *path, size_t *size)
+{
+    FILE *fp = fopen(path, "rb");
+    assert(fp != NULL);
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char *data = malloc(*size);
+    assert(fread(data, 1, *size, fp) == *size);
+    fclose(fp);
+    return data;
+}
+
+void test_tiled_image(void)
+{
+    const cl_uint width = 5;
+    const cl_uint height = 3;
+    const cl_uint tile_size = 2;
+    cl_float4 accumulator[15];
+    cl_uchar4 display[15];
+    for (int i = 0; i < 15; i++)
+    {
+        accumulator[i] = (cl_float4){{0.1f * i, 1.5f - 0.1f * i, i % 3, 2}};
+        display[i] = (cl_uchar4){{i, 2 * i, 3 * i, 255}};
+    }
+
+    // the tiles are written in any order, each from a buffer of the tile size, which edge tiles only fill in part
+    const enum image_format formats[] = {IMAGE_PPM, IMAGE_PPM16, IMAGE_PFM};
+    for (int f = 0; f < 4; f++)
+    {
+        int is_display = f == 3;
+        enum image_format format = is_display ? IMAGE_PPM : formats[f];
+        if (is_display)
+            assert(write_display_image("test_whole", display, width, height) == CL_SUCCESS);
+        else
+            assert(write_image("test_whole", accumulator, width, height, format) == CL_SUCCESS);
+
+        struct image_stream stream;
+        assert(create_image_stream("test_tiled", width, height, format, &stream) == CL_SUCCESS);
+        for (int tile = 5; tile >= 0; tile--)
+        {
+            cl_uint x = tile % 3 * tile_size;
+            cl_uint y = tile / 3 * tile_size;
+            cl_uint tile_width = width - x < tile_size ? width - x : tile_size;
+            cl_uint tile_height = height - y < tile_size ? height - y : tile_size;
+
+            cl_float4 tile_accumulator[4] = {{{0}}};
+            cl_uchar4 tile_display[4] = {{{0}}};
+            for (cl_uint j = 0; j < tile_height; j++)
+            {
+                for (cl_uint i = 0; i < tile_width; i++)
+                {
+                    tile_accumulator[i + tile_size * j] = accumulator[x + i + width * (y + j)];
+                    tile_display[i + tile_size * j] = display[x + i + width * (y + j)];
+                }
+            }
+
+            if (is_display)
+                assert(write_display_tile(&stream, tile_display, tile_size, x, y, tile_width, tile_height) == CL_SUCCESS);
+            else
+                assert(write_image_tile(&stream, tile_accumulator, tile_size, x, y, tile_width, tile_height) == CL_SUCCESS);
+        }
+
+        // a tile must be within the image
+        assert(write_image_tile(&stream, accumulator, tile_size, 4, 0, 2, 2) == CL_INVALID_VALUE);
+        // even where the end of the tile would wrap
+        assert(write_image_tile(&stream, accumulator, tile_size, 4, 0, CL_UINT_MAX - 2, 2) == CL_INVALID_VALUE);
+        assert(write_display_tile(&stream, display, tile_size, 0, CL_UINT_MAX, 2, 2) == CL_INVALID_VALUE);
+        assert(close_image_stream(&stream) == CL_SUCCESS);
+
+        size_t whole_size;
+        size_t tiled_size;
+        unsigned char *whole = read_file("test_whole", &whole_size);
+        unsigned char *tiled = read_file("test_tiled", &tiled_size);
+        assert(whole_size == tiled_size && memcmp(whole, tiled, whole_size) == 0);
+        free(whole);
+        free(tiled);
+    }
+
+    // a session renders its tile of the frame, which must start within the frame
+    struct session session;
+    memset(&session, 0, sizeof(struct session));
+    session.width = tile_size;
+    session.height = tile_size;
+    assert(set_session_frame(&session, width, height, width, 0) == CL_INVALID_VALUE);
+    session.use_wavefront = 1;
+    assert(set_session_frame(&session, width, height, 2, 0) == CL_INVALID_OPERATION);
+
+    remove("test_whole");
+    remove("test_tiled");
+}
+
+void test_program_cache(void)
+{
+    const char *sources[] = {"kernel void a() {}", "kernel void b() {}"};
+    size_t source_sizes[] = {strlen(sources[0]), strlen(sources[1])};
+    cl_ulong key = hash_program_sources(sources, source_sizes, 2, "-DA");
+    assert(hash_program_sources(sources, source_sizes, 2, "-DA") == key);
+
+    // a change to a source, to where the sources split, or to the build options changes the key
+    const char *changed_sources[] = {"kernel void a() {}", "kernel void c() {}"};
+    const char *moved_sources[] = {"kernel void a() {}kernel", " void b() {}"};
+    size_t moved_sizes[] = {strlen(moved_sources[0]), strlen(moved_sources[1])};
+    cl_ulong changed_key = hash_program_sources(sources, source_sizes, 2, "-DB");
+    assert(hash_program_sources(changed_sources, source_sizes, 2, "-DA") != key);
+    assert(hash_program_sources(moved_sources, moved_sizes, 2, "-DA") != key);
+    assert(changed_key != key);
+    assert(hash_program_sources(sources, source_sizes, 2, NULL) != key);
+
+    // a binary reads back as it was written, under its key only
+    setenv("FIREFLY_CACHE_DIR", "test_cache/programs", 1);
+    const unsigned char binary[] = {0x7f, 'E', 'L', 'F', 0, 1, 2};
+    assert(write_cached_binary(key, binary, sizeof(binary)) == CL_SUCCESS);
+
+    unsigned char *cached;
+    size_t cached_size;
+    assert(read_cached_binary(key, &cached, &cached_size) == CL_SUCCESS);
+    assert(cached_size == sizeof(binary) && memcmp(cached, binary, sizeof(binary)) == 0);
+    free(cached);
+    assert(read_cached_binary(changed_key, &cached, &cached_size) != CL_SUCCESS);
+
+    // an empty directory disables the cache
+    setenv("FIREFLY_CACHE_DIR", "", 1);
+    assert(read_cached_binary(key, &cached, &cached_size) != CL_SUCCESS);
+    assert(write_cached_binary(key, binary, sizeof(binary)) != CL_SUCCESS);
+    unsetenv("FIREFLY_CACHE_DIR");
+
+    char path[64];
+    sprintf(path, "test_cache/programs/%016lx.bin", (unsigned long) key);
+    assert(remove(path) == 0);
+    rmdir("test_cache/programs");
+    rmdir("test_cache");
+}
+
+void test_tonemap(void)
+{
+    // the means 1, 0.5, 0.25 and NaN, and a pixel with no samples
+    cl_float4 accumulator[4] = {{2, 1, 0.5f, 2}, {NAN, -1, 8, 1}, {0, 0, 0, 0}, {0.5f, 0.5f, 0.5f, 1}};
+    cl_uchar4 image[4];
+
+    // the sRGB encoding of 0.5 is 0.7354
+    struct tonemap tonemap = {TONEMAP_CLAMP, 0};
+    tonemap_image(accumulator, 4, &tonemap, image);
+    assert(image[0].s[0] == 255 && image[0].s[1] == 188 && image[0].s[2] == 137 && image[0].s[3] == 255);
+    assert(image[1].s[0] == 0 && image[1].s[1] == 0 && image[1].s[2] == 255);
+    assert(image[2].s[0] == 0 && image[2].s[3] == 255);
+
+    // reinhard maps 1 to 0.5, and a stop of exposure doubles the mean
+    tonemap = (struct tonemap){TONEMAP_REINHARD, 1};
+    tonemap_image(accumulator, 4, &tonemap, image);
+    assert(image[0].s[1] == 188 && image[3].s[0] == 188);
+
+    // aces rolls bright colours off to white, and keeps black
+    tonemap = (struct tonemap){TONEMAP_ACES, 0};
+    tonemap_image(accumulator, 4, &tonemap, image);
+    assert(image[1].s[2] == 255 && image[2].s[0] == 0 && image[0].s[0] < 255);
+
+    assert(write_display_image("test_display", image, 2, 2) == CL_SUCCESS);
+    remove("test_display");
+}
+
+void test_profile(void)
+{
+    // the spans are recorded out of order, as the threads which encode images record them
+    struct profile profile = {NULL, 0, 0, {4, 6, 9, 1}};
+    assert(add_profile_span(&profile, "encode", 3000, 5000) == CL_SUCCESS);
+    assert(add_profile_span(&profile, "render", 1000, 2000) == CL_SUCCESS);
+    assert(add_profile_span(&profile, "encode", 6000, 7000) == CL_SUCCESS);
+
+    cl_ulong total;
+    assert(get_profile_stage_time(&profile, "encode", &total) == CL_SUCCESS && total == 3000);
+    assert(get_profile_stage_time(&profile, "upload", &total) == CL_SUCCESS && total == 0);
+
+    // the trace keeps the recorded order, in microseconds from the earliest span
+    const char *trace = "{\"traceEvents\": [\n"
+                        "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, \"args\": {\"name\": \"host\"}},\n"
+                        "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 1, \"args\": {\"name\": \"device\"}},\n"
+                        "  {\"name\": \"encode\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": 2.000, \"dur\": 2.000},\n"
+                        "  {\"name\": \"render\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": 0.000, \"dur\": 1.000},\n"
+                        "  {\"name\": \"encode\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": 5.000, \"dur\": 1.000}\n"
+                        "],\n"
+                        "\"otherData\": {\"primary_rays\": 4, \"bounce_rays\": 6, \"shadow_rays\": 9, \"roulette_terminations\": 1}}\n";
+    size_t size;
+    assert(write_chrome_trace(&profile, "test_trace.json") == CL_SUCCESS);
+    unsigned char *written = read_file("test_trace.json", &size);
+    assert(size == strlen(trace) && memcmp(written, trace, size) == 0);
+    free(written);
+    remove("test_trace.json");
+
+    // the summary has a row per stage, in the order the stages first appear, with their share of the host time
+    FILE *fp = fopen("test_summary.txt", "w");
+    assert(print_profile_summary(&profile, fp) == CL_SUCCESS);
+    fclose(fp);
+
+    char line[256];
+    fp = fopen("test_summary.txt", "r");
+    assert(fgets(line, sizeof(line), fp) != NULL && strncmp(line, "stage", 5) == 0);
+    assert(fgets(line, sizeof(line), fp) != NULL);
+    assert(strcmp(line, "encode                   host           2        0.003        0.002    75.0%\n") == 0);
+    assert(fgets(line, sizeof(line), fp) != NULL);
+    assert(strcmp(line, "render                   host           1        0.001        0.001    25.0%\n") == 0);
+    assert(fgets(line, sizeof(line), fp) != NULL && strncmp(line, "Primary rays: 4, bounce rays: 6 (1.50 per path)", 47) == 0);
+    assert(fgets(line, sizeof(line), fp) == NULL);
+    fclose(fp);
+    remove("test_summary.txt");
+
+    release_profile(&profile);
+    assert(profile.spans == NULL && profile.num_spans == 0);
+}
+
+void test_bvh_matches_linear(void)
+{
+    struct sphere *spheres;
+    size_t num_spheres;
+    assert(create_cornell_box(&spheres, &num_spheres) == CL_SUCCESS);
+    assert(add_random_spheres(&spheres, &num_spheres, 500, 3) == CL_SUCCESS);
+
+    struct bvh bvh;
+    assert(build_sphere_bvh(spheres, num_spheres, &bvh) == CL_SUCCESS);
+    assert(bvh.num_nodes > 0 && bvh.nodes[0].skip == bvh.num_nodes);
+
+    cl_float3 origin = (cl_float3){160, 50, 52};
+    for (int i = 0; i < 100; i++)
+    {
+        float angle = i * 0.0628f;
+        cl_float3 direction = (cl_float3){-cos(angle), sin(angle) * 0.5f, 0.2f - sin(angle) * 0.3f};
+        float length = sqrt(direction.x * direction.x + direction.y * direction.y + direction.z * direction.z);
+        direction = (cl_float3){direction.x / length, direction.y / length, direction.z / length};
+
+        int linear_index = -1;
+        int bvh_index = -1;
+        float linear_t;
+        float bvh_t;
+        assert(intersect_spheres(spheres, num_spheres, origin, direction, &linear_index, &linear_t) == intersect_sphere_bvh(&bvh, spheres, origin, direction, &bvh_index, &bvh_t));
+        assert(linear_index == bvh_index);
+    }
+
+    release_bvh(&bvh);
+    free(spheres);
+}
+
+void test_load_obj(void)
+{
+    const char *path = "test_mesh.obj";
+    FILE *fp = fopen(path, "w");
+    fprintf(fp, "# a quad and a triangle\nv 0 0 0\nv 1 0 0\nv 1 1.5e1 0\nv -0 1 -.5\nvt 0 0\nvn 0 0 1\nf 1/1/1 2/1/1 3/1/1 4/1/1\nf -1 -2 -3");
+    fclose(fp);
+
+    struct mesh mesh;
+    assert(load_obj(path, 2, &mesh) == CL_SUCCESS);
+    assert(mesh.num_vertices == 4);
+    assert(approximatelty_equal(mesh.vertices[7], 15));
+    assert(approximatelty_equal(mesh.vertices[11], -0.5f));
+
+    // the quad is triangulated as a fan
+    assert(mesh.num_triangles == 3);
+    assert(mesh.triangles[1].v0 == 0 && mesh.triangles[1].v1 == 2 && mesh.triangles[1].v2 == 3);
+    assert(mesh.triangles[2].v0 == 3 && mesh.triangles[2].v1 == 2 && mesh.triangles[2].v2 == 1);
+    assert(mesh.triangles[2].material == 2);
+
+    release_mesh(&mesh);
+
+    // an index out of range, or malformed, rejects the file wherever it is in the face
+    const char *bad_faces[] = {"f 1 2 3 999", "f 1 2 3 0", "f 1 2 3 -9", "f 1 2 3 x", "f 1 9 3", "f 1 2 3 99999999999999999999"};
+    for (size_t i = 0; i < sizeof(bad_faces) / sizeof(bad_faces[0]); i++)
+    {
+        fp = fopen(path, "w");
+        fprintf(fp, "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n%s\n", bad_faces[i]);
+        fclose(fp);
+        assert(load_obj(path, 0, &mesh) == CL_INVALID_VALUE);
+    }
+
+    // so does a file without faces, or one which cannot be read
+    fp = fopen(path, "w");
+    fprintf(fp, "v 0 0 0\nv 1 0 0\nv 1 1 0\n");
+    fclose(fp);
+    assert(load_obj(path, 0, &mesh) == CL_INVALID_VALUE);
+    remove(path);
+    assert(load_obj(path, 0, &mesh) == CL_INVALID_VALUE);
+}
+
+void test_scene_file_round_trip(void)
+{
+    const char *path = "test_scene.ffs";
+
+    struct sphere *spheres;
+    size_t num_spheres;
+    assert(create_cornell_box(&spheres, &num_spheres) == CL_SUCCESS);
+    assert(add_random_spheres(&spheres, &num_spheres, 100, 5) == CL_SUCCESS);
+
+    struct bvh bvh;
+    assert(build_sphere_bvh(spheres, num_spheres, &bvh) == CL_SUCCESS);
+
+    cl_float vertices[] = {0, 0, 0, 1, 0, 0, 0, 1, 0};
+    struct triangle triangles[] = {{0, 1, 2, 1}};
+    struct mesh mesh = {vertices, 3, triangles, 1};
+    struct bvh mesh_bvh = {NULL, 0, NULL};
+    struct material materials[] = {{{0.5f, 0.5f, 0.5f}, {0, 0, 0}}, {{0.25f, 0, 0}, {1, 2, 3}}};
+
+    assert(write_scene_file(path, spheres, num_spheres, &bvh, &mesh, &mesh_bvh, materials, 2) == CL_SUCCESS);
+
+    struct scene_file file;
+    assert(map_scene_file(path, &file) == CL_SUCCESS);
+    assert(file.num_spheres == num_spheres && memcmp(file.spheres, spheres, num_spheres * sizeof(struct sphere)) == 0);
+    assert(file.sphere_bvh.num_nodes == bvh.num_nodes && memcmp(file.sphere_bvh.nodes, bvh.nodes, bvh.num_nodes * sizeof(struct bvh_node)) == 0);
+    assert(file.mesh.num_vertices == 3 && file.mesh.num_triangles == 1 && file.mesh.triangles[0].material == 1);
+    assert(file.mesh_bvh.num_nodes == 0);
+    assert(file.num_materials == 2 && approximatelty_equal(file.materials[1].emission.z, 3));
+
+    // each section is page aligned, so that devices may use it in place
+    assert((size_t)((char *)file.spheres - (char *)file.data) % SCENE_FILE_ALIGNMENT == 0);
+    assert((size_t)((char *)file.materials - (char *)file.data) % SCENE_FILE_ALIGNMENT == 0);
+    unmap_scene_file(&file);
+
+    // a triangle indexing a missing material is rejected
+    triangles[0].material = 2;
+    assert(write_scene_file(path, spheres, num_spheres, &bvh, &mesh, &mesh_bvh, materials, 2) == CL_SUCCESS);
+    assert(map_scene_file(path, &file) == CL_INVALID_VALUE);
+    assert(file.data == NULL);
+
+    FILE *fp = fopen(path, "wb");
+    fprintf(fp, "not a scene file, but long enough to hold the header of one, which is checked before the sections.....");
+    fprintf(fp, "...............................................................................................");
+    fclose(fp);
+    assert(map_scene_file(path, &file) == CL_INVALID_VALUE);
+
+    release_bvh(&bvh);
+    free(spheres);
+    remove(path);
+}
+
+void test_light_table(void)
+{
+    struct sphere *spheres;
+    size_t num_spheres;
+    assert(create_cornell_box(&spheres, &num_spheres) == CL_SUCCESS);
+    assert(add_random_spheres(&spheres, &num_spheres, 200, 3) == CL_SUCCESS);
+
+    // make every fourth random sphere a light, of uneven power
+    for (size_t i = 9; i < num_spheres; i += 4)
+        spheres[i].emission = (cl_float3){(float) (i % 7), 1, (float) (i % 3)};
+
+    struct light *lights;
+    size_t num_lights;
+    assert(build_light_table(spheres, num_spheres, &lights, &num_lights) == CL_SUCCESS);
+    assert(num_lights == 51);
+
+    // the probability of picking each sphere through the table, which should be that of its entry
+    double *picked = calloc(num_spheres, sizeof(double));
+    double total = 0;
+    for (size_t i = 0; i < num_lights; i++)
+    {
+        assert(lights[i].threshold >= 0 && lights[i].threshold <= 1 && lights[i].alias < num_lights);
+        picked[lights[i].sphere] += lights[i].threshold / num_lights;
+        picked[lights[lights[i].alias].sphere] += (1 - lights[i].threshold) / num_lights;
+        total += lights[i].probability;
+    }
+
+    assert(fabs(total - 1) < 1e-4);
+    for (size_t i = 0; i < num_lights; i++)
+        assert(fabs(picked[lights[i].sphere] - lights[i].probability) < 1e-5);
+
+    free(picked);
+    free(lights);
+
+    // a scene without lights has no table
+    for (size_t i = 0; i < num_spheres; i++)
+        spheres[i].emission = (cl_float3){0, 0, 0};
+
+    assert(build_light_table(spheres, num_spheres, &lights, &num_lights) == CL_SUCCESS);
+    assert(lights == NULL && num_lights == 0);
+    free(spheres);
+}
+
+void test_sampler_stratified(void)
+{
+    // the first 16 samples of every dimension of a pixel fall in each of 16 strata, and in a 4x4 grid for pairs
+    for (cl_uint pixel = 0; pixel < 8; pixel++)
+    {
+        int strata_1d[3][16] = {0};
+        int strata_2d[3][16] = {0};
+        for (cl_uint s = 0; s < 16; s++)
+        {
+            struct sampler sampler = create_sampler(pixel, s);
+            for (int d = 0; d < 3; d++)
+            {
+                float u = sample_1d(&sampler);
+                assert(u >= 0 && u < 1);
+                strata_1d[d][(int) (u * 16)]++;
+
+                float x, y;
+                sample_2d(&sampler, &x, &y);
+                assert(x >= 0 && x < 1 && y >= 0 && y < 1);
+                strata_2d[d][(int) (x * 4) + 4 * (int) (y * 4)]++;
+            }
+        }
+
+        for (int d = 0; d < 3; d++)
+        {
+            for (int i = 0; i < 16; i++)
+                assert(strata_1d[d][i] == 1 && strata_2d[d][i] == 1);
+        }
+    }
+
+    // pixels draw different sequences
+    struct sampler first = create_sampler(0, 0);
+    struct sampler second = create_sampler(1, 0);
+    assert(sample_1d(&first) != sample_1d(&second));
+}
+
+// the distance of the screen from the camera, which is short enough for the small images of the tests to see the box
+#define TEST_Z_DISTANCE -20
+
+// the Cornell box on the CPU backend, seen from firefly's default camera, which the CPU tests render
+struct test_cpu_scene
+{
+    struct sphere *spheres;
+    size_t num_spheres;
+    struct bvh bvh;
+    struct mesh mesh;
+    struct bvh mesh_bvh;
+    struct material material;
+    struct cpu_scene scene;
+    cl_float4 camera_quat;
+    cl_float3 camera_position;
+};
+
+// creates the scene in place, since the CPU scene points at the bvhs, mesh and material beside it
+static void create_test_cpu_scene(struct test_cpu_scene *test)
+{
+    assert(create_cornell_box(&test->spheres, &test->num_spheres) == CL_SUCCESS);
+
+    test->bvh = (struct bvh){NULL, 0, NULL};
+    test->mesh = (struct mesh){NULL, 0, NULL, 0};
+    test->mesh_bvh = (struct bvh){NULL, 0, NULL};
+    test->material = (struct material){{0.75f, 0.75f, 0.75f}, {0, 0, 0}};
+    assert(create_cpu_scene(test->spheres, test->num_spheres, &test->bvh, &test->mesh, &test->mesh_bvh, &test->material, &test->scene) == CL_SUCCESS);
+
+    test->camera_quat = euler_to_quat((cl_float3){M_PI_2, -M_PI_2, 0}, "zyx");
+    test->camera_position = (cl_float3){160, 50, 52};
+}
+
+static void release_test_cpu_scene(struct test_cpu_scene *test)
+{
+    release_cpu_scene(&test->scene);
+    free(test->spheres);
+}
+
+void test_cpu_render_threads(void)
+{
+    const cl_uint width = 40;
+    const cl_uint height = 24;
+
+    struct test_cpu_scene test;
+    create_test_cpu_scene(&test);
+
+    cl_float4 *single = calloc(width * height, sizeof(cl_float4));
+    cl_float4 *multiple = calloc(width * height, sizeof(cl_float4));
+    cl_ulong single_rays = 0;
+    cl_ulong multiple_rays = 0;
+    cl_uint num_active_pixels;
+
+    // every pixel draws its own random sequence, so the tiles may be taken by any thread
+    assert(render_cpu_samples(&test.scene, single, NULL, NULL, NULL, NULL, test.camera_quat, TEST_Z_DISTANCE, test.camera_position, height, width, 0, 2, 0, 1, &single_rays, &num_active_pixels) == CL_SUCCESS);
+    assert(render_cpu_samples(&test.scene, multiple, NULL, NULL, NULL, NULL, test.camera_quat, TEST_Z_DISTANCE, test.camera_position, height, width, 0, 2, 0, 3, &multiple_rays, &num_active_pixels) == CL_SUCCESS);
+
+    assert(single_rays > 2 * width * height);
+    assert(single_rays == multiple_rays);
+    assert(num_active_pixels == width * height);
+    assert(memcmp(single, multiple, width * height * sizeof(cl_float4)) == 0);
+
+    for (size_t i = 0; i < width * height; i++)
+        assert(single[i].w == 2 && isfinite(single[i].x));
+
+    free(multiple);
+    free(single);
+    release_test_cpu_scene(&test);
+}
+
+void test_cpu_adaptive_sampling(void)
+{
+    const cl_uint width = 40;
+    const cl_uint height = 24;
+    const cl_uint max_samples = 256;
+    const cl_float error_threshold = 0.1f;
+
+    struct test_cpu_scene test;
+    create_test_cpu_scene(&test);
+
+    cl_float4 *accumulator = calloc(width * height, sizeof(cl_float4));
+    cl_float2 *moments = calloc(width * height, sizeof(cl_float2));
+    cl_ulong num_rays = 0;
+    cl_uint num_active_pixels = width * height;
+    for (cl_uint sample_offset = 0; sample_offset < max_samples && num_active_pixels > 0; sample_offset += 8)
+    {
+        assert(render_cpu_samples(&test.scene, accumulator, moments, NULL, NULL, NULL, test.camera_quat, TEST_Z_DISTANCE, test.camera_position, height, width, sample_offset, 8, error_threshold, 2, &num_rays, &num_active_pixels) == CL_SUCCESS);
+
+        // no pixel stops before its error can be estimated
+        if (sample_offset + 8 < ADAPTIVE_MIN_SAMPLES)
+            assert(num_active_pixels == width * height);
+    }
+
+    // the pixels which stopped early have converged, and the flat ones stop well before the noisy ones
+    double total_samples = 0;
+    cl_uint num_stopped = 0;
+    for (size_t i = 0; i < width * height; i++)
+    {
+        assert(accumulator[i].w >= ADAPTIVE_MIN_SAMPLES && accumulator[i].w <= max_samples);
+        assert(moments[i].y == accumulator[i].w);
+        if (accumulator[i].w < max_samples)
+        {
+            assert(get_pixel_error(accumulator[i], moments[i]) < error_threshold);
+            num_stopped++;
+        }
+
+        total_samples += accumulator[i].w;
+    }
+
+    assert(num_stopped > 0);
+    assert(total_samples < 0.75 * max_samples * width * height);
+
+    free(moments);
+    free(accumulator);
+    release_test_cpu_scene(&test);
+}
+
+void test_cpu_denoise(void)
+{
+    const cl_uint width = 40;
+    const cl_uint height = 24;
+    const size_t num_pixels = width * height;
+
+    struct test_cpu_scene test;
+    create_test_cpu_scene(&test);
+
+    cl_float4 *reference = calloc(num_pixels, sizeof(cl_float4));
+    cl_float4 *noisy = calloc(num_pixels, sizeof(cl_float4));
+    cl_float4 *albedo = calloc(num_pixels, sizeof(cl_float4));
+    cl_float4 *normal_depth = calloc(num_pixels, sizeof(cl_float4));
+    cl_float4 *denoised = calloc(num_pixels, sizeof(cl_float4));
+    cl_ulong num_rays = 0;
+    cl_uint num_active_pixels;
+    assert(render_cpu_samples(&test.scene, reference, NULL, NULL, NULL, NULL, test.camera_quat, TEST_Z_DISTANCE, test.camera_position, height, width, 0, 256, 0, 2, &num_rays, &num_active_pixels) == CL_SUCCESS);
+    assert(render_cpu_samples(&test.scene, noisy, NULL, albedo, normal_depth, NULL, test.camera_quat, TEST_Z_DISTANCE, test.camera_position, height, width, 0, 8, 0, 2, &num_rays, &num_active_pixels) == CL_SUCCESS);
+    assert(denoise_image(noisy, albedo, normal_depth, width, height, denoised) == CL_SUCCESS);
+
+    // the denoised image keeps the sample counts, and is well closer to the converged image than the noisy one
+    double noisy_error = 0;
+    double denoised_error = 0;
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        assert(albedo[i].w == 8 && denoised[i].w == 8);
+
+        // compare the displayed luminance, so that the few pixels of the light do not swamp the error
+        float reference_luminance = fminf(get_luminance(reference[i].x, reference[i].y, reference[i].z) / reference[i].w, 1);
+        float noisy_difference = fminf(get_luminance(noisy[i].x, noisy[i].y, noisy[i].z) / 8, 1) - reference_luminance;
+        float denoised_difference = fminf(get_luminance(denoised[i].x, denoised[i].y, denoised[i].z) / 8, 1) - reference_luminance;
+        noisy_error += noisy_difference * noisy_difference;
+        denoised_error += denoised_difference * denoised_difference;
+    }
+
+    assert(denoised_error < 0.6 * noisy_error);
+
+    free(denoised);
+    free(normal_depth);
+    free(albedo);
+    free(noisy);
+    free(reference);
+    release_test_cpu_scene(&test);
+}
+
+void test_preview(void)
+{
+    const char *path = "test_preview";
+
+    struct preview_framebuffer framebuffer;
+    assert(create_preview_framebuffer(path, 4, 2, &framebuffer) == CL_SUCCESS);
+    assert(memcmp(framebuffer.header->magic, PREVIEW_MAGIC, sizeof(PREVIEW_MAGIC)) == 0 && framebuffer.header->width == 4);
+    assert((char *) framebuffer.pixels - (char *) framebuffer.header == PREVIEW_PIXEL_OFFSET);
+
+    // the frame is odd while it is written
+    begin_preview_frame(&framebuffer);
+    assert(atomic_load(&framebuffer.header->frame) == 1);
+    framebuffer.pixels[7] = (cl_uchar4){{1, 2, 3, 255}};
+    end_preview_frame(&framebuffer, 4);
+    assert(atomic_load(&framebuffer.header->frame) == 2 && framebuffer.header->num_samples == 4);
+    release_preview_framebuffer(&framebuffer);
+
+    // the frame is in the file, where a viewer finds it
+    FILE *fp = fopen(path, "rb");
+    fseek(fp, PREVIEW_PIXEL_OFFSET + 7 * sizeof(cl_uchar4), SEEK_SET);
+    unsigned char pixel[4];
+    assert(fread(pixel, 1, 4, fp) == 4 && pixel[2] == 3);
+    fclose(fp);
+    remove(path);
+
+    struct camera camera = {{0, 0, 0}, {0, 0, 0}, 1};
+    int is_closed = 0;
+    assert(parse_preview_command("position 1 2.5 -3", &camera, &is_closed) == CL_SUCCESS);
+    assert(approximatelty_equal(camera.position.y, 2.5f) && approximatelty_equal(camera.position.z, -3));
+    assert(parse_preview_command("rotation 0.5 0 0", &camera, &is_closed) == CL_SUCCESS && approximatelty_equal(camera.rotation.x, 0.5f));
+    assert(parse_preview_command("fov 0", &camera, &is_closed) == CL_INVALID_VALUE && approximatelty_equal(camera.fov, 1));
+    assert(parse_preview_command("position 1 2", &camera, &is_closed) == CL_INVALID_VALUE && approximatelty_equal(camera.position.x, 1));
+    assert(!is_closed);
+
+    // commands are applied once their line is complete, and the end of the input closes the preview
+    int fds[2];
+    assert(pipe(fds) == 0);
+    struct preview_input input = {fds[0], {0}, 0};
+    int is_moved = 0;
+    assert(write(fds[1], "fov 0.75\nposition 4 5", 21) == 21);
+    assert(read_preview_input(&input, 0, &camera, &is_moved, &is_closed) == CL_SUCCESS);
+    assert(is_moved && approximatelty_equal(camera.fov, 0.75f) && approximatelty_equal(camera.position.x, 1));
+    assert(write(fds[1], " 6\n", 3) == 3);
+    assert(read_preview_input(&input, 0, &camera, &is_moved, &is_closed) == CL_SUCCESS);
+    assert(approximatelty_equal(camera.position.z, 6) && !is_closed);
+    close(fds[1]);
+    assert(read_preview_input(&input, 0, &camera, &is_moved, &is_closed) == CL_SUCCESS && is_closed);
+    close(fds[0]);
+}
+
+void test_sphere_components(void)
+{
+    struct sphere *spheres;
+    size_t num_spheres;
+    assert(create_cornell_box(&spheres, &num_spheres) == CL_SUCCESS);
+
+    float *components;
+    size_t size;
+    assert(build_sphere_components(spheres, num_spheres, &components, &size) == CL_SUCCESS);
+
+    // each array is padded by a whole vector of lanes, and the arrays follow each other
+    size_t stride = num_spheres + SPHERE_LANES;
+    assert(size == 4 * stride * sizeof(float));
+    for (size_t i = 0; i < num_spheres; i++)
+    {
+        assert(components[i] == spheres[i].position.x && components[stride + i] == spheres[i].position.y && components[2 * stride + i] == spheres[i].position.z);
+        assert(approximatelty_equal(components[3 * stride + i], spheres[i].radius * spheres[i].radius));
+    }
+
+    for (size_t i = num_spheres; i < stride; i++)
+        assert(components[i] == 0 && components[3 * stride + i] == 0);
+
+    free(components);
+    free(spheres);
+}
+
+void test_kernel_specialization(void)
+{
+    struct session session;
+    memset(&session, 0, sizeof(struct session));
+    session.width = 640;
+    session.height = 360;
+    session.scene.num_spheres = 9;
+    session.scene.num_lights = 1;
+
+    // the options define every constant which the kernel folds, so that each scene and size has its own cached program
+    char options[sizeof(session.specialization)];
+    assert(get_session_specialization(&session, options, sizeof(options)) == CL_SUCCESS);
+    assert(strstr(options, "-D SPECIALIZED_WIDTH=640 -D SPECIALIZED_HEIGHT=360 ") == options);
+    assert(strstr(options, "-D SPECIALIZED_NUM_SPHERES=9 -D SPECIALIZED_NUM_SPHERE_NODES=0 ") != NULL);
+    assert(strstr(options, "-D SPECIALIZED_NUM_TRIANGLES=0 -D SPECIALIZED_NUM_TRIANGLE_NODES=0 -D SPECIALIZED_NUM_LIGHTS=1") != NULL);
+
+    char other[sizeof(options)];
+    session.scene.num_spheres = 10;
+    assert(get_session_specialization(&session, other, sizeof(other)) == CL_SUCCESS && strcmp(options, other) != 0);
+    assert(get_session_specialization(&session, other, 16) == CL_INVALID_VALUE);
+}
+
+void test_persistent_launch_size(void)
+{
+    struct session session;
+    memset(&session, 0, sizeof(struct session));
+    session.num_compute_units = 4;
+    session.persistent_local_size = 64;
+
+    // the persistent work items fill every compute unit, however many pixels there are
+    assert(get_session_persistent_size(&session, 1280 * 720) == 4 * 64 * 8);
+    // but there is no more than one work item per pixel, rounded up to a whole group
+    assert(get_session_persistent_size(&session, 100) == 128);
+    assert(get_session_persistent_size(&session, 64) == 64);
+
+    // the wavefront stages have no render kernel to replace
+    session.use_wavefront = 1;
+    assert(set_session_persistent(&session, 1) == CL_INVALID_OPERATION);
+    assert(set_session_persistent(&session, 0) == CL_SUCCESS);
+}
+
+void test_partial_render(void)
+{
+    const cl_uint width = 16;
+    const cl_uint height = 12;
+    const size_t num_pixels = width * height;
+
+    struct test_cpu_scene test;
+    create_test_cpu_scene(&test);
+
+    cl_float4 *accumulator = calloc(num_pixels, sizeof(cl_float4));
+    struct partial_render whole = {width, height, 0, 3, calloc(num_pixels, sizeof(cl_ulong4))};
+    struct partial_render first = {width, height, 0, 1, calloc(num_pixels, sizeof(cl_ulong4))};
+    struct partial_render second = {width, height, 1, 2, calloc(num_pixels, sizeof(cl_ulong4))};
+    cl_ulong num_rays = 0;
+    cl_uint num_active_pixels;
+
+    assert(render_cpu_samples(&test.scene, accumulator, NULL, NULL, NULL, whole.sums, test.camera_quat, TEST_Z_DISTANCE, test.camera_position, height, width, 0, 3, 0, 1, &num_rays, &num_active_pixels) == CL_SUCCESS);
+    assert(render_cpu_samples(&test.scene, accumulator, NULL, NULL, NULL, second.sums, test.camera_quat, TEST_Z_DISTANCE, test.camera_position, height, width, 1, 2, 0, 3, &num_rays, &num_active_pixels) == CL_SUCCESS);
+    assert(render_cpu_samples(&test.scene, accumulator, NULL, NULL, NULL, first.sums, test.camera_quat, TEST_Z_DISTANCE, test.camera_position, height, width, 0, 1, 0, 2, &num_rays, &num_active_pixels) == CL_SUCCESS);
+
+    // the samples of a range are the same whichever process renders them, and their sums the same in any order
+    const char *path = "test_partial.bin";
+    assert(write_partial_render(path, &second) == CL_SUCCESS);
+    release_partial_render(&second);
+    assert(read_partial_render(path, &second) == CL_SUCCESS);
+    assert(second.width == width && second.first_sample == 1 && second.num_samples == 2);
+
+    assert(merge_partial_render(&second, &first) == CL_SUCCESS);
+    assert(second.first_sample == 0 && second.num_samples == 3);
+    assert(memcmp(second.sums, whole.sums, num_pixels * sizeof(cl_ulong4)) == 0);
+
+    get_partial_accumulator(&second, accumulator);
+    for (size_t i = 0; i < num_pixels; i++)
+        assert(accumulator[i].w == 3 && isfinite(accumulator[i].x));
+
+    // partial renders of different sizes must not be merged, nor may their samples overflow a range
+    struct partial_render other = {height, width, 3, 1, first.sums};
+    assert(merge_partial_render(&second, &other) == CL_INVALID_VALUE);
+    other = (struct partial_render){width, height, 3, CL_UINT_MAX - 2, first.sums};
+    assert(merge_partial_render(&second, &other) == CL_INVALID_VALUE && second.num_samples == 3);
+
+    // a partial render whose range ends past the last sample index is not read
+    other.first_sample = 4;
+    assert(write_partial_render(path, &other) == CL_SUCCESS);
+    assert(read_partial_render(path, &other) == CL_INVALID_VALUE);
+
+    // the ranges are sorted, and the first which overlaps the one before, or leaves a gap after it, is found
+    struct sample_range ranges[] = {{4, 8, "b"}, {8, 12, "c"}, {0, 4, "a"}};
+    assert(find_sample_range_break(ranges, 3) == 0);
+    assert(ranges[0].first == 0 && ranges[1].first == 4 && ranges[2].first == 8);
+    ranges[2] = (struct sample_range){6, 12, "c"};
+    size_t i = find_sample_range_break(ranges, 3);
+    assert(i == 2 && ranges[i].first < ranges[i - 1].end);
+    ranges[2] = (struct sample_range){10, 12, "c"};
+    i = find_sample_range_break(ranges, 3);
+    assert(i == 2 && ranges[i].first > ranges[i - 1].end);
+    ranges[0] = (struct sample_range){0, 8, "a"};
+    assert(find_sample_range_break(ranges, 2) == 1);
+
+    remove(path);
+    release_partial_render(&first);
+    release_partial_render(&second);
+    release_partial_render(&whole);
+    free(accumulator);
+    release_test_cpu_scene(&test);
+}
+
+// the tests, by the names with which CTest runs each of them alone
+static const struct
+{
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    // geometry functions
+    {"euler_to_quaternion_xyz", test_euler_to_quaternion_xyz},
+    {"euler_to_quaternion_zyx", test_euler_to_quaternion_zyx},
+    {"euler_to_quaternion_rand", test_euler_to_quaternion_rand},
+    {"multiply_quat", test_multiply_quat},
+    {"rotate_quat", test_rotate_quat},
+    // render state
+    {"checkpoint_round_trip", test_checkpoint_round_trip},
+    {"write_image", test_write_image},
+    {"tiled_image", test_tiled_image},
+    {"program_cache", test_program_cache},
+    {"tonemap", test_tonemap},
+    {"profile", test_profile},
+    {"bvh_matches_linear", test_bvh_matches_linear},
+    {"refit_bvh", test_refit_bvh},
+    {"load_obj", test_load_obj},
+    {"scene_file_round_trip", test_scene_file_round_trip},
+    {"light_table", test_light_table},
+    {"sphere_components", test_sphere_components},
+    {"kernel_specialization", test_kernel_specialization},
+    {"persistent_launch_size", test_persistent_launch_size},
+    {"partial_render", test_partial_render},
+    {"sampler_stratified", test_sampler_stratified},
+    {"cpu_render_threads", test_cpu_render_threads},
+    {"cpu_adaptive_sampling", test_cpu_adaptive_sampling},
+    {"cpu_denoise", test_cpu_denoise},
+    {"preview", test_preview},
+};
+
+int main(int argc, char **argv)
+{
+    // with no arguments, every test runs
+    size_t num_tests = sizeof(tests) / sizeof(tests[0]);
+    int has_run = 0;
+    for (size_t i = 0; i < num_tests; i++)
+    {
+        if (argc > 1 && strcmp(argv[1], tests[i].name) != 0)
+            continue;
+
+        tests[i].run();
+        has_run = 1;
+    }
+
+    if (!has_run)
+    {
+        fprintf(stderr, "There is no test named '%s'.\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
 }
@@ -0,0 +1,67 @@
+#include <string.h>
+#include <math.h>
+
+#include "tonemap.h"
+
+/**
+ * @brief Parses the name of a tonemap curve.
+ *
+ * @param name the name, which is one of clamp, reinhard, or aces.
+ * @param curve a pointer to the curve.
+ * @return cl_int the return code.
+ */
+cl_int parse_tonemap_curve(const char *name, enum tonemap_curve *curve)
+{
+    if (strcmp(name, "clamp") == 0)
+        *curve = TONEMAP_CLAMP;
+    else if (strcmp(name, "reinhard") == 0)
+        *curve = TONEMAP_REINHARD;
+    else if (strcmp(name, "aces") == 0)
+        *curve = TONEMAP_ACES;
+    else
+        return CL_INVALID_VALUE;
+
+    return CL_SUCCESS;
+}
+
+static inline float apply_curve(const float x, const enum tonemap_curve curve)
+{
+    if (curve == TONEMAP_REINHARD)
+        return x / (1 + x);
+
+    float y = curve == TONEMAP_ACES ? x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f) : x;
+    return y < 1 ? y : 1;
+}
+
+static inline float encode_srgb(const float x)
+{
+    return x <= 0.0031308f ? 12.92f * x : 1.055f * powf(x, 1 / 2.4f) - 0.055f;
+}
+
+/**
+ * @brief Applies the display transform to the mean of every pixel, as the tonemap kernel of kernels/tonemap.cl does.
+ *
+ * @param accumulator the per-pixel sample sums, with the sample count in w.
+ * @param num_pixels the number of pixels.
+ * @param tonemap the curve and exposure.
+ * @param image the 8-bit sRGB pixels, with an opaque alpha.
+ */
+void tonemap_image(const cl_float4 *accumulator, const size_t num_pixels, const struct tonemap *tonemap, cl_uchar4 *image)
+{
+    float exposure_scale = exp2f(tonemap->exposure);
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        const cl_float4 *pixel = &accumulator[i];
+        float scale = pixel->w > 0 ? exposure_scale / pixel->w : 0;
+        const float values[] = {pixel->x * scale, pixel->y * scale, pixel->z * scale};
+
+        for (size_t c = 0; c < 3; c++)
+        {
+            // negative and NaN channels become zero
+            float value = values[c] > 0 ? values[c] : 0;
+            image[i].s[c] = (cl_uchar) lrintf(encode_srgb(apply_curve(value, tonemap->curve)) * 255);
+        }
+
+        image[i].s[3] = 255;
+    }
+}
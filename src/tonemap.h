@@ -0,0 +1,34 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include <stddef.h>
+
+#include "gpulib.h"
+
+/*
+ * The display transform of 8-bit images, which matches kernels/tonemap.cl. The mean of the samples of each pixel is
+ * scaled by the exposure, compressed into [0, 1] by the tonemap curve, encoded with the sRGB transfer function, and
+ * rounded to 8 bits, with an opaque alpha so that pixels are packed in four bytes.
+ */
+
+enum tonemap_curve
+{
+    // clamps to [0, 1], which keeps the colours below 1 as they are
+    TONEMAP_CLAMP,
+    // x / (1 + x), which compresses every colour, and never reaches white
+    TONEMAP_REINHARD,
+    // Narkowicz's fit of the ACES filmic curve, which rolls bright colours off to white
+    TONEMAP_ACES,
+};
+
+struct tonemap
+{
+    enum tonemap_curve curve;
+    // the exposure in stops, where each doubles the brightness
+    cl_float exposure;
+};
+
+cl_int parse_tonemap_curve(const char *name, enum tonemap_curve *curve);
+void tonemap_image(const cl_float4 *accumulator, const size_t num_pixels, const struct tonemap *tonemap, cl_uchar4 *image);
+
+#endif
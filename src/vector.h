@@ -0,0 +1,64 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <math.h>
+
+#include "gpulib.h"
+
+static inline cl_float3 add_float3(const cl_float3 lhs, const cl_float3 rhs)
+{
+    return (cl_float3){lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z};
+}
+
+static inline cl_float3 subtract_float3(const cl_float3 lhs, const cl_float3 rhs)
+{
+    return (cl_float3){lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z};
+}
+
+static inline cl_float3 multiply_float3(const cl_float3 lhs, const cl_float3 rhs)
+{
+    return (cl_float3){lhs.x * rhs.x, lhs.y * rhs.y, lhs.z * rhs.z};
+}
+
+static inline cl_float3 scale_float3(const cl_float3 v, const float s)
+{
+    return (cl_float3){v.x * s, v.y * s, v.z * s};
+}
+
+static inline float dot_float3(const cl_float3 lhs, const cl_float3 rhs)
+{
+    return lhs.x * rhs.x + lhs.y * rhs.y + lhs.z * rhs.z;
+}
+
+static inline cl_float3 cross_float3(const cl_float3 lhs, const cl_float3 rhs)
+{
+    return (cl_float3){lhs.y * rhs.z - lhs.z * rhs.y, lhs.z * rhs.x - lhs.x * rhs.z, lhs.x * rhs.y - lhs.y * rhs.x};
+}
+
+static inline cl_float3 normalize_float3(const cl_float3 v)
+{
+    return scale_float3(v, 1.0f / sqrtf(dot_float3(v, v)));
+}
+
+// comparisons rather than fminf and fmaxf, which are library calls unless NaN handling is relaxed
+static inline float min_float(const float lhs, const float rhs)
+{
+    return lhs < rhs ? lhs : rhs;
+}
+
+static inline float max_float(const float lhs, const float rhs)
+{
+    return lhs > rhs ? lhs : rhs;
+}
+
+static inline cl_float3 min_float3(const cl_float3 lhs, const cl_float3 rhs)
+{
+    return (cl_float3){min_float(lhs.x, rhs.x), min_float(lhs.y, rhs.y), min_float(lhs.z, rhs.z)};
+}
+
+static inline cl_float3 max_float3(const cl_float3 lhs, const cl_float3 rhs)
+{
+    return (cl_float3){max_float(lhs.x, rhs.x), max_float(lhs.y, rhs.y), max_float(lhs.z, rhs.z)};
+}
+
+#endif
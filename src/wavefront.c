@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "wavefront.h"
+
+#define MAX_BOUNCES 16
+
+// indices into the queue counters, which match kernels/wavefront.cl
+#define HIT_COUNT 0
+#define SHADOW_COUNT 1
+#define EXTEND_COUNT 2
+#define SHADOW_RAY_COUNT 3
+#define NUM_COUNTERS 4
+
+/**
+ * @brief Creates the stage kernels and the path state and queue buffers, for one path per pixel.
+ * 
+ * @param context the context.
+ * @param program the program built from kernels/sampler.cl, kernels/scene.cl, kernels/camera.cl and kernels/wavefront.cl.
+ * @param num_paths the number of paths per wave.
+ * @param wavefront a pointer to the wavefront, which must be released with release_wavefront.
+ * @return cl_int the return code.
+ */
+cl_int create_wavefront(const cl_context context, const cl_program program, const cl_uint num_paths, struct wavefront *wavefront)
+{
+    cl_int ret = CL_SUCCESS;
+
+    memset(wavefront, 0, sizeof(struct wavefront));
+    wavefront->num_paths = num_paths;
+
+    const char *kernel_names[] = {"generate", "extend", "shade", "connect", "accumulate"};
+    cl_kernel *kernels[] = {&wavefront->generate_kernel, &wavefront->extend_kernel, &wavefront->shade_kernel, &wavefront->connect_kernel, &wavefront->accumulate_kernel};
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(cl_kernel *); i++)
+    {
+        *kernels[i] = clCreateKernel(program, kernel_names[i], &ret);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+    }
+
+    wavefront->path_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, num_paths * sizeof(struct path), NULL, &ret);
+    if (ret != CL_SUCCESS)
+        goto cleanup;
+
+    cl_mem *queues[] = {&wavefront->ray_queue_bufs[0], &wavefront->ray_queue_bufs[1], &wavefront->hit_queue_buf, &wavefront->shadow_queue_buf};
+    for (size_t i = 0; i < sizeof(queues) / sizeof(cl_mem *); i++)
+    {
+        *queues[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, num_paths * sizeof(cl_uint), NULL, &ret);
+        if (ret != CL_SUCCESS)
+            goto cleanup;
+    }
+
+    wavefront->counter_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, NUM_COUNTERS * sizeof(cl_uint), NULL, &ret);
+
+cleanup:
+    if (ret != CL_SUCCESS)
+        release_wavefront(wavefront);
+
+    return ret;
+}
+
+/**
+ * @brief Sets the kernel arguments which stay the same for every wave.
+ * 
+ * @param wavefront the wavefront.
+ * @param accumulator_buf the accumulator, with room for one pixel per path.
+ * @param camera_quat the camera rotation.
+ * @param z_distance the distance of the screen from the camera, in pixels.
+ * @param camera_position the camera position.
+ * @param width the image width.
+ * @param height the image height.
+ * @param scene the scene buffers.
+ * @return cl_int the return code.
+ */
+cl_int set_wavefront_args(struct wavefront *wavefront, const cl_mem accumulator_buf, const cl_float4 camera_quat, const cl_float z_distance, const cl_float3 camera_position, const cl_uint width, const cl_uint height, const struct scene_buffers *scene)
+{
+    cl_int ret;
+
+    ret = clSetKernelArg(wavefront->generate_kernel, 0, sizeof(cl_mem), &wavefront->path_buf);
+    ret |= clSetKernelArg(wavefront->generate_kernel, 1, sizeof(cl_mem), &wavefront->ray_queue_bufs[0]);
+    ret |= clSetKernelArg(wavefront->generate_kernel, 2, sizeof(cl_float4), &camera_quat);
+    ret |= clSetKernelArg(wavefront->generate_kernel, 3, sizeof(cl_float), &z_distance);
+    ret |= clSetKernelArg(wavefront->generate_kernel, 4, sizeof(cl_float3), &camera_position);
+    ret |= clSetKernelArg(wavefront->generate_kernel, 5, sizeof(cl_uint), &height);
+    ret |= clSetKernelArg(wavefront->generate_kernel, 6, sizeof(cl_uint), &width);
+
+    ret |= clSetKernelArg(wavefront->extend_kernel, 0, sizeof(cl_mem), &wavefront->path_buf);
+    ret |= clSetKernelArg(wavefront->extend_kernel, 3, sizeof(cl_mem), &wavefront->hit_queue_buf);
+    ret |= clSetKernelArg(wavefront->extend_kernel, 4, sizeof(cl_mem), &wavefront->counter_buf);
+    ret |= set_scene_args(wavefront->extend_kernel, 5, scene);
+
+    ret |= clSetKernelArg(wavefront->shade_kernel, 0, sizeof(cl_mem), &wavefront->path_buf);
+    ret |= clSetKernelArg(wavefront->shade_kernel, 1, sizeof(cl_mem), &wavefront->hit_queue_buf);
+    ret |= clSetKernelArg(wavefront->shade_kernel, 2, sizeof(cl_mem), &wavefront->shadow_queue_buf);
+    ret |= clSetKernelArg(wavefront->shade_kernel, 4, sizeof(cl_mem), &wavefront->counter_buf);
+    ret |= set_scene_args(wavefront->shade_kernel, 5, scene);
+
+    ret |= clSetKernelArg(wavefront->connect_kernel, 0, sizeof(cl_mem), &wavefront->path_buf);
+    ret |= clSetKernelArg(wavefront->connect_kernel, 1, sizeof(cl_mem), &wavefront->shadow_queue_buf);
+    ret |= clSetKernelArg(wavefront->connect_kernel, 2, sizeof(cl_mem), &wavefront->counter_buf);
+    ret |= set_scene_args(wavefront->connect_kernel, 3, scene);
+
+    ret |= clSetKernelArg(wavefront->accumulate_kernel, 0, sizeof(cl_mem), &accumulator_buf);
+    ret |= clSetKernelArg(wavefront->accumulate_kernel, 1, sizeof(cl_mem), &wavefront->path_buf);
+    ret |= clSetKernelArg(wavefront->accumulate_kernel, 2, sizeof(cl_uint), &wavefront->num_paths);
+
+    return ret;
+}
+
+/**
+ * @brief Renders samples as waves of one path per pixel, and adds them to the accumulator.
+ * 
+ * The hit and shadow stages size their launches by the number of rays of the bounce, and read their exact counts
+ * from the device, so the only synchronisation is one read of the queue counters per bounce.
+ * 
+ * @param command_queue the command queue.
+ * @param wavefront the wavefront.
+ * @param sample_offset the index of the first sample.
+ * @param num_samples the number of samples.
+ * @param num_rays a pointer to the number of rays traced, which is incremented.
+ * @param profile the profile, which records every stage, or NULL.
+ * @return cl_int the return code.
+ */
+cl_int enqueue_wavefront_samples(const cl_command_queue command_queue, struct wavefront *wavefront, const cl_uint sample_offset, const cl_uint num_samples, cl_ulong *num_rays, struct profile *profile)
+{
+    cl_int ret = CL_SUCCESS;
+
+    cl_event event;
+    cl_event stage_events[3];
+
+    const cl_uint zeroes[NUM_COUNTERS] = {0};
+    cl_uint counters[NUM_COUNTERS];
+
+    for (cl_uint s = 0; s < num_samples; s++)
+    {
+        cl_uint sample_index = sample_offset + s;
+        size_t global = wavefront->num_paths;
+
+        ret = clSetKernelArg(wavefront->generate_kernel, 7, sizeof(cl_uint), &sample_index);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        ret = clEnqueueNDRangeKernel(command_queue, wavefront->generate_kernel, 1, NULL, &global, NULL, 0, NULL, get_profile_event(profile, &event));
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        ret = record_profile_event(profile, "generate", event);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        cl_uint num_queued = wavefront->num_paths;
+        for (cl_uint bounce = 0; bounce < MAX_BOUNCES && num_queued > 0; bounce++)
+        {
+            cl_mem ray_queue_buf = wavefront->ray_queue_bufs[bounce % 2];
+            cl_mem next_ray_queue_buf = wavefront->ray_queue_bufs[(bounce + 1) % 2];
+            global = num_queued;
+
+            ret = clEnqueueWriteBuffer(command_queue, wavefront->counter_buf, CL_FALSE, 0, sizeof(zeroes), zeroes, 0, NULL, NULL);
+            ret |= clSetKernelArg(wavefront->extend_kernel, 1, sizeof(cl_mem), &ray_queue_buf);
+            ret |= clSetKernelArg(wavefront->extend_kernel, 2, sizeof(cl_uint), &num_queued);
+            ret |= clSetKernelArg(wavefront->shade_kernel, 3, sizeof(cl_mem), &next_ray_queue_buf);
+            if (ret != CL_SUCCESS)
+                return ret;
+
+            // there are at most as many hits and shadow rays as rays, so every stage is sized by the ray count
+            ret = clEnqueueNDRangeKernel(command_queue, wavefront->extend_kernel, 1, NULL, &global, NULL, 0, NULL, get_profile_event(profile, &stage_events[0]));
+            ret |= clEnqueueNDRangeKernel(command_queue, wavefront->shade_kernel, 1, NULL, &global, NULL, 0, NULL, get_profile_event(profile, &stage_events[1]));
+            ret |= clEnqueueNDRangeKernel(command_queue, wavefront->connect_kernel, 1, NULL, &global, NULL, 0, NULL, get_profile_event(profile, &stage_events[2]));
+            if (ret != CL_SUCCESS)
+                return ret;
+
+            ret = record_profile_event(profile, "extend", stage_events[0]);
+            ret |= record_profile_event(profile, "shade", stage_events[1]);
+            ret |= record_profile_event(profile, "connect", stage_events[2]);
+            if (ret != CL_SUCCESS)
+                return ret;
+
+            ret = clEnqueueReadBuffer(command_queue, wavefront->counter_buf, CL_TRUE, 0, sizeof(counters), counters, 0, NULL, get_profile_event(profile, &event));
+            if (ret != CL_SUCCESS)
+                return ret;
+
+            ret = record_profile_event(profile, "read counters", event);
+            if (ret != CL_SUCCESS)
+                return ret;
+
+            *num_rays += num_queued + counters[SHADOW_RAY_COUNT];
+            num_queued = counters[EXTEND_COUNT];
+        }
+
+        global = wavefront->num_paths;
+        ret = clEnqueueNDRangeKernel(command_queue, wavefront->accumulate_kernel, 1, NULL, &global, NULL, 0, NULL, get_profile_event(profile, &event));
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        ret = record_profile_event(profile, "accumulate", event);
+        if (ret != CL_SUCCESS)
+            return ret;
+    }
+
+    return ret;
+}
+
+void release_wavefront(struct wavefront *wavefront)
+{
+    cl_kernel kernels[] = {wavefront->generate_kernel, wavefront->extend_kernel, wavefront->shade_kernel, wavefront->connect_kernel, wavefront->accumulate_kernel};
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(cl_kernel); i++)
+    {
+        if (kernels[i] != NULL)
+            clReleaseKernel(kernels[i]);
+    }
+
+    cl_mem buffers[] = {wavefront->path_buf, wavefront->ray_queue_bufs[0], wavefront->ray_queue_bufs[1], wavefront->hit_queue_buf, wavefront->shadow_queue_buf, wavefront->counter_buf};
+    for (size_t i = 0; i < sizeof(buffers) / sizeof(cl_mem); i++)
+    {
+        if (buffers[i] != NULL)
+            clReleaseMemObject(buffers[i]);
+    }
+
+    memset(wavefront, 0, sizeof(struct wavefront));
+}
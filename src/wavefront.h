@@ -0,0 +1,54 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "gpulib.h"
+#include "scene.h"
+#include "sampler.h"
+#include "profile.h"
+
+// the path state, which matches struct path in kernels/wavefront.cl
+struct path
+{
+    cl_float3 origin;
+    cl_float3 direction;
+    cl_float3 mask;
+    cl_float3 colour;
+    cl_float3 shadow_origin;
+    cl_float3 shadow_normal;
+    cl_float3 shadow_weight;
+    struct sampler sampler;
+    cl_float t;
+    cl_int hit_index;
+    cl_uint bounce;
+    cl_float light_weight;
+};
+
+/*
+ * A path tracer split into stages, which communicate through queues of path indices. Each bounce, the extend stage
+ * intersects the queued rays, the shade stage samples the bounce of each hit, and the connect stage traces the
+ * shadow rays of each hit. Terminated paths drop out of the queues, so each stage only runs on live paths.
+ */
+struct wavefront
+{
+    cl_kernel generate_kernel;
+    cl_kernel extend_kernel;
+    cl_kernel shade_kernel;
+    cl_kernel connect_kernel;
+    cl_kernel accumulate_kernel;
+
+    cl_mem path_buf;
+    // the rays of the current and next bounce
+    cl_mem ray_queue_bufs[2];
+    cl_mem hit_queue_buf;
+    cl_mem shadow_queue_buf;
+    cl_mem counter_buf;
+
+    cl_uint num_paths;
+};
+
+cl_int create_wavefront(const cl_context context, const cl_program program, const cl_uint num_paths, struct wavefront *wavefront);
+cl_int set_wavefront_args(struct wavefront *wavefront, const cl_mem accumulator_buf, const cl_float4 camera_quat, const cl_float z_distance, const cl_float3 camera_position, const cl_uint width, const cl_uint height, const struct scene_buffers *scene);
+cl_int enqueue_wavefront_samples(const cl_command_queue command_queue, struct wavefront *wavefront, const cl_uint sample_offset, const cl_uint num_samples, cl_ulong *num_rays, struct profile *profile);
+void release_wavefront(struct wavefront *wavefront);
+
+#endif